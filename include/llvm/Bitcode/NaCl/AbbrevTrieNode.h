@@ -24,9 +24,11 @@
 #ifndef LLVM_BITCODE_NACL_ABBREV_TRIE_NODE_H
 #define LLVM_BITCODE_NACL_ABBREV_TRIE_NODE_H
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeParser.h"
 #include <map>
 #include <set>
+#include <vector>
 
 namespace llvm {
 
@@ -130,6 +132,66 @@ void NaClBuildAbbrevLookupMap(AbbrevLookupSizeMap &LookupMap,
                               const SmallVectorImpl<NaClBitCodeAbbrev*> &Abbrevs,
                               size_t InitialIndex = 0);
 
+// An immutable copy of the tries of an AbbrevLookupSizeMap, built once
+// all abbreviations have been added. The nodes, edges, and abbreviations
+// of all tries are stored in flat arrays, with the edges of each node
+// sorted, so that matching a record doesn't allocate, and touches little
+// memory. Since it is never modified, it can be used by several threads
+// at once.
+class AbbrevLookupTable {
+public:
+  AbbrevLookupTable() {}
+
+  // Builds the table from the tries in LookupMap, replacing its
+  // contents.
+  void Build(const AbbrevLookupSizeMap &LookupMap);
+
+  // Returns the abbreviations that may apply to the given record, in
+  // the same order as AbbrevTrieNode::MatchRecord followed by
+  // AbbrevTrieNode::GetAbbreviations. Returns an empty list if no trie
+  // applies to records of that size.
+  ArrayRef<AbbrevIndexPair>
+  MatchRecord(const NaClBitcodeRecordData &Record) const;
+
+private:
+  // Denotes that no trie applies to records of a given size.
+  static const uint32_t NoNode = ~0u;
+
+  // The edges of a node, for a given record index, are in
+  // Edges[FirstEdge, FirstEdge+NumEdges), sorted by value.
+  struct EdgeGroup {
+    size_t Index;
+    uint32_t FirstEdge;
+    uint32_t NumEdges;
+  };
+
+  struct Edge {
+    uint64_t Value;
+    uint32_t Node;
+  };
+
+  // The edge groups of a node are in Groups[FirstGroup, FirstGroup +
+  // NumGroups), sorted by index. Its abbreviations are in
+  // Abbreviations[FirstAbbrev, FirstAbbrev + NumAbbrevs).
+  struct Node {
+    uint32_t FirstGroup;
+    uint32_t NumGroups;
+    uint32_t FirstAbbrev;
+    uint32_t NumAbbrevs;
+  };
+
+  // Adds the trie rooted at TrieNode, and returns the index of its
+  // root.
+  uint32_t AddNode(const AbbrevTrieNode *TrieNode);
+
+  std::vector<Node> Nodes;
+  std::vector<EdgeGroup> Groups;
+  std::vector<Edge> Edges;
+  std::vector<AbbrevIndexPair> Abbreviations;
+  // The root of the trie for each record size (see AbbrevLookupSizeMap).
+  std::vector<uint32_t> Roots;
+};
+
 }
 
 #endif
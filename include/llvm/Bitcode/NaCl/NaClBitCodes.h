@@ -251,10 +251,24 @@ static inline bool operator>(const NaClBitCodeAbbrevOp &Op1,
 /// specialized format instead of the fully-general, fully-vbr, format.
 class NaClBitCodeAbbrev {
   SmallVector<NaClBitCodeAbbrevOp, 8> OperandList;
+  // The shape of the abbreviation, as needed to decode records with it.
+  // Maintained by Add(), so that it is computed once per abbreviation
+  // rather than once per record.
+  //
+  // The number of operands before the array operand, or of all operands if
+  // there is no array.
+  unsigned NumScalarOps;
+  // The total width of those operands if they are all literals, fixed width
+  // fields, or char6 fields, and VariableWidth otherwise.
+  unsigned ScalarWidth;
+  bool HasArrayOp;
   unsigned char RefCount; // Number of things using this.
   ~NaClBitCodeAbbrev() {}
 public:
-  NaClBitCodeAbbrev() : RefCount(1) {}
+  static const unsigned VariableWidth = ~0U;
+
+  NaClBitCodeAbbrev()
+      : NumScalarOps(0), ScalarWidth(0), HasArrayOp(false), RefCount(1) {}
 
   void addRef() { ++RefCount; }
   void dropRef() { if (--RefCount == 0) delete this; }
@@ -268,6 +282,46 @@ public:
 
   void Add(const NaClBitCodeAbbrevOp &OpInfo) {
     OperandList.push_back(OpInfo);
+    if (HasArrayOp)
+      return;
+    if (OpInfo.isArrayOp()) {
+      HasArrayOp = true;
+      return;
+    }
+    ++NumScalarOps;
+    if (ScalarWidth == VariableWidth)
+      return;
+    switch (OpInfo.getEncoding()) {
+    case NaClBitCodeAbbrevOp::Literal:
+      break;
+    case NaClBitCodeAbbrevOp::Fixed:
+      ScalarWidth += OpInfo.getValue();
+      break;
+    case NaClBitCodeAbbrevOp::Char6:
+      ScalarWidth += 6;
+      break;
+    default:
+      ScalarWidth = VariableWidth;
+      break;
+    }
+  }
+
+  /// Returns the number of operands before the array operand, or the
+  /// number of operands if there is no array. The first of these operands
+  /// is the record code, unless there are none, in which case the code is
+  /// the first element of the array.
+  unsigned getNumScalarOperands() const { return NumScalarOps; }
+
+  /// Returns the number of bits taken by the operands before the array
+  /// operand, or VariableWidth if any of them is a VBR field.
+  unsigned getScalarWidth() const { return ScalarWidth; }
+
+  /// Returns the encoding of the array elements, or nullptr if the
+  /// abbreviation has no array.
+  const NaClBitCodeAbbrevOp *getArrayElementOp() const {
+    if (!HasArrayOp || OperandList.size() < NumScalarOps + 2)
+      return nullptr;
+    return &OperandList[NumScalarOps + 1];
   }
 
   // Returns a simplified version of the abbreviation. Used
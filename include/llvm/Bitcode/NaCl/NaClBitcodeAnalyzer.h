@@ -31,7 +31,8 @@ class raw_ostream;
 // for a description.
 struct AnalysisDumpOptions {
   AnalysisDumpOptions()
-      : DumpRecords(false), DumpDetails(false), OpsPerLine(0)
+      : DumpRecords(false), DumpDetails(false), OpsPerLine(0),
+        OrderBlocksByID(false), Streaming(false)
   {}
 
   // When true, dump the records. When false, print out distribution
@@ -49,6 +50,10 @@ struct AnalysisDumpOptions {
   // size. When false, prints block statistics base on percentage of
   // file.
   bool OrderBlocksByID;
+
+  // When true, AnalyzeBitcodeInFile reads the file as a stream, only
+  // keeping the most recently read part of it in memory.
+  bool Streaming;
 };
 
 /// Run analysis on the given file. Output goes to OS.
@@ -48,9 +48,11 @@ public:
   // Note: No AddBlock method override because abbrevations only
   // apply to records.
 
+  virtual void Merge(const NaClBitcodeDistElement &Element);
+
   // Returns the number of times an abbreviation was used to represent
   // the value.
-  unsigned GetNumAbbrevs() const {
+  uint64_t GetNumAbbrevs() const {
     return NumAbbrevs;
   }
 
@@ -61,7 +63,7 @@ public:
 
 private:
   // Number of times an abbreviation is used for the value.
-  unsigned NumAbbrevs;
+  uint64_t NumAbbrevs;
 };
 
 }
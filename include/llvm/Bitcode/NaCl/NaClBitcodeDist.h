@@ -293,7 +293,7 @@ public:
 
   /// Returns the total number of instances held in the distribution
   /// map.
-  unsigned GetTotal() const {
+  uint64_t GetTotal() const {
     return Total;
   }
 
@@ -309,6 +309,11 @@ public:
   /// Note: Requires that GetStorageKind() == BlockStorage.
   virtual void AddBlock(const NaClBitcodeBlock &Block);
 
+  /// Adds the contents of the given distribution map, which must have
+  /// the same kind of elements, to this distribution map. Used to
+  /// combine distribution maps built in parallel.
+  void Merge(const NaClBitcodeDist &Dist);
+
   /// Builds the distribution associated with the distribution map.
   /// Warning: The distribution is cached, and hence, only valid while
   /// it's contents is not changed.
@@ -349,7 +354,7 @@ private:
   // Pointer to the cached distribution.
   mutable Distribution *CachedDistribution;
   // The total number of instances in the map.
-  unsigned Total;
+  uint64_t Total;
 };
 
 /// Defines the element type of a PNaCl bitcode distribution map.
@@ -419,8 +424,13 @@ public:
   // Adds an instance of the given block to this element.
   virtual void AddBlock(const NaClBitcodeBlock &Block);
 
+  // Adds the instances of the given element, which must be of the
+  // same kind, to this element. Default merges the number of
+  // instances and the nested distributions.
+  virtual void Merge(const NaClBitcodeDistElement &Element);
+
   // Returns the number of instances associated with this element.
-  unsigned GetNumInstances() const {
+  uint64_t GetNumInstances() const {
     return NumInstances;
   }
 
@@ -491,7 +501,7 @@ public:
 
 private:
   // The number of instances associated with this element.
-  unsigned NumInstances;
+  uint64_t NumInstances;
 };
 
 inline NaClBitcodeDistElement *NaClBitcodeDist::
@@ -581,6 +581,17 @@ public:
     return Record.GetCursor().SkipBlock();
   }
 
+  /// Skips the current block, like SkipBlock, but counts its bits as
+  /// the bits of a nested block (see NaClBitcodeBlock::GetLocalNumBits),
+  /// as if it had been parsed. Used when the block is parsed elsewhere.
+  bool SkipNestedBlock() {
+    uint64_t StartBit = Record.GetStartBit();
+    if (SkipBlock())
+      return true;
+    Block.LocalStartBit += Record.GetCursor().GetCurrentBitNo() - StartBit;
+    return false;
+  }
+
 protected:
   // The containing parser.
   NaClBitcodeParser *EnclosingParser;
@@ -20,6 +20,7 @@
 #include "llvm/Bitcode/NaCl/NaClBitcodeHeader.h"
 #include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
 #include "llvm/Support/Endian.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/StreamingMemoryObject.h"
 #include <climits>
 #include <vector>
@@ -73,6 +74,13 @@ private:
 
   // True if filler should be added to byte align records.
   bool AlignBitcodeRecords = false;
+
+  /// If non-null, the bytes of BitcodeBytes are contiguous in memory, and
+  /// cursors read them through this pointer instead of calling readBytes.
+  const unsigned char *DirectBytes = nullptr;
+  /// The number of bytes at DirectBytes.
+  size_t DirectSize = 0;
+
   NaClBitstreamReader(const NaClBitstreamReader&) = delete;
   void operator=(const NaClBitstreamReader&) = delete;
 
@@ -82,12 +90,20 @@ private:
     AlignBitcodeRecords = Header.getAlignBitcodeRecords();
   }
 
+  // Reads the bytes in place if BitcodeBytes keeps all of them in memory.
+  void initDirectBytes() {
+    DirectBytes = BitcodeBytes->getStablePointer();
+    if (DirectBytes)
+      DirectSize = BitcodeBytes->getExtent();
+  }
+
 public:
   /// Read stream from sequence of bytes [Start .. End) after parsing
   /// the given bitcode header.
   NaClBitstreamReader(const unsigned char *Start, const unsigned char *End,
                       NaClBitcodeHeader &Header)
-      : BitcodeBytes(getNonStreamedMemoryObject(Start, End)) {
+      : BitcodeBytes(getNonStreamedMemoryObject(Start, End)),
+        DirectBytes(Start), DirectSize(End - Start) {
     initFromHeader(Header);
   }
 
@@ -95,12 +111,17 @@ public:
   NaClBitstreamReader(MemoryObject *Bytes, NaClBitcodeHeader &Header)
       : BitcodeBytes(Bytes) {
     initFromHeader(Header);
+    initDirectBytes();
   }
 
   /// Read stream from bytes, starting at the given initial address.
-  /// Provides simple API for unit testing.
-  NaClBitstreamReader(MemoryObject *Bytes, size_t InitialAddress)
-      : BitcodeBytes(Bytes), InitialAddress(InitialAddress) {
+  /// Provides simple API for unit testing, and for re-reading a stream whose
+  /// header has already been parsed.
+  NaClBitstreamReader(MemoryObject *Bytes, size_t InitialAddress,
+                      bool AlignBitcodeRecords = false)
+      : BitcodeBytes(Bytes), InitialAddress(InitialAddress),
+        AlignBitcodeRecords(AlignBitcodeRecords) {
+    initDirectBytes();
   }
 
   // Returns the memory object that is being read.
@@ -132,6 +153,11 @@ public:
   /// it.
   bool hasBlockInfoRecords() const { return !BlockInfoRecords.empty(); }
 
+  /// Returns the abbreviations of all blocks defined by the blockinfo block.
+  const std::vector<BlockInfo> &getBlockInfoRecords() const {
+    return BlockInfoRecords;
+  }
+
   /// If there is block info for the specified ID, return it, otherwise return
   /// null.
   const BlockInfo *getBlockInfo(unsigned BlockID) const {
@@ -294,6 +320,10 @@ private:
   /// This tracks the codesize of parent blocks.
   SmallVector<Block, 8> BlockScope;
 
+  /// Empty abbreviation lists of exited blocks, whose storage is reused
+  /// for the next blocks entered.
+  std::vector<std::vector<NaClBitCodeAbbrev*>> SpareAbbrevLists;
+
   NaClBitstreamCursor(const NaClBitstreamCursor &) = delete;
   NaClBitstreamCursor &operator=(const NaClBitstreamCursor &) = delete;
 
@@ -328,6 +358,8 @@ public:
 
   bool canSkipToPos(size_t pos) const {
     // pos can be skipped to if it is a valid address or one byte past the end.
+    if (BitStream->DirectBytes && pos <= BitStream->DirectSize)
+      return true;
     return pos == 0 || BitStream->getBitcodeBytes().isValidAddress(
         static_cast<uint64_t>(pos - 1));
   }
@@ -433,6 +465,18 @@ public:
   void fillCurWord() {
     assert(Size == 0 || NextChar < (unsigned)Size);
 
+    // Read whole words straight from contiguous bytes.
+    if (const unsigned char *Bytes = BitStream->DirectBytes) {
+      if (NextChar + sizeof(word_t) <= BitStream->DirectSize) {
+        CurWord =
+            support::endian::read<word_t, support::little, support::unaligned>(
+                Bytes + NextChar);
+        NextChar += sizeof(word_t);
+        BitsInCurWord = sizeof(word_t) * CHAR_BIT;
+        return;
+      }
+    }
+
     // Read the next word from the stream.
     uint8_t Array[sizeof(word_t)] = {0};
 
@@ -496,18 +540,7 @@ public:
     uint32_t Piece = Read(NumBits);
     if ((Piece & (1U << (NumBits-1))) == 0)
       return Piece;
-
-    uint32_t Result = 0;
-    unsigned NextBit = 0;
-    while (1) {
-      Result |= (Piece & ((1U << (NumBits-1))-1)) << NextBit;
-
-      if ((Piece & (1U << (NumBits-1))) == 0)
-        return Result;
-
-      NextBit += NumBits-1;
-      Piece = Read(NumBits);
-    }
+    return static_cast<uint32_t>(ReadVBRContinuation(Piece, NumBits));
   }
 
   // Read a VBR that may have a value up to 64-bits in size. The chunk size of
@@ -516,21 +549,53 @@ public:
     uint32_t Piece = Read(NumBits);
     if ((Piece & (1U << (NumBits-1))) == 0)
       return uint64_t(Piece);
+    return ReadVBRContinuation(Piece, NumBits);
+  }
+
+private:
+  /// For each chunk size NumBits, the continuation bits of the chunks of a
+  /// VBR that starts at bit 0 of a 64-bit word.
+  static const uint64_t VBRContinuationMasks[33];
+
+  /// Reads the rest of a VBR whose first chunk, Piece, has its continuation
+  /// bit set.
+  uint64_t ReadVBRContinuation(uint32_t Piece, unsigned NumBits) {
+    const uint32_t DataMask = (1U << (NumBits-1)) - 1;
+    uint64_t Result = Piece & DataMask;
+    unsigned NextBit = NumBits-1;
+
+    // If the last chunk is in CurWord, find it from the continuation bits,
+    // and decode all chunks without reading them one at a time.
+    if (sizeof(word_t) == sizeof(uint64_t) && BitsInCurWord >= NumBits) {
+      uint64_t Word = CurWord;
+      uint64_t Stops = ~Word & VBRContinuationMasks[NumBits];
+      if (BitsInCurWord < 64)
+        Stops &= (uint64_t(1) << BitsInCurWord) - 1;
+      if (Stops) {
+        unsigned BitsUsed = countTrailingZeros(Stops) + 1;
+        uint64_t Data = 0;
+        for (unsigned Bit = 0, DataBit = 0; Bit < BitsUsed;
+             Bit += NumBits, DataBit += NumBits-1)
+          Data |= ((Word >> Bit) & DataMask) << DataBit;
+        Result |= Data << NextBit;
+        // Use a mask to avoid undefined behavior.
+        CurWord = BitsUsed < 64 ? Word >> BitsUsed : 0;
+        BitsInCurWord -= BitsUsed;
+        return Result;
+      }
+    }
 
-    uint64_t Result = 0;
-    unsigned NextBit = 0;
     while (1) {
-      Result |= uint64_t(Piece & ((1U << (NumBits-1))-1)) << NextBit;
+      Piece = Read(NumBits);
+      Result |= uint64_t(Piece & DataMask) << NextBit;
 
       if ((Piece & (1U << (NumBits-1))) == 0)
         return Result;
 
       NextBit += NumBits-1;
-      Piece = Read(NumBits);
     }
   }
 
-private:
   void SkipToByteBoundary() {
     unsigned BitsToSkip = BitsInCurWord % CHAR_BIT;
     if (BitsToSkip) {
@@ -617,6 +682,10 @@ private:
       CurAbbrevs[i]->dropRef();
 
     BlockScope.back().PrevAbbrevs.swap(CurAbbrevs);
+    std::vector<NaClBitCodeAbbrev*> &Spare = BlockScope.back().PrevAbbrevs;
+    Spare.clear();
+    SpareAbbrevLists.push_back(std::vector<NaClBitCodeAbbrev*>());
+    SpareAbbrevLists.back().swap(Spare);
     BlockScope.pop_back();
   }
 
@@ -646,6 +715,29 @@ private:
                               unsigned NumArrayElements,
                               SmallVectorImpl<uint64_t> &Vals);
 
+  // Reads NumArrayElements fields of NumBits bits each, decoding them as
+  // char6 values if IsChar6, and puts them in Vals. Fields are read as
+  // many at a time as fit in a word.
+  template <bool IsChar6>
+  inline void readFixedArray(unsigned NumBits, unsigned NumArrayElements,
+                             SmallVectorImpl<uint64_t> &Vals);
+
+  // Reads the operands of Abbv that precede its array, if any. The first of
+  // them is returned, and the others are put in Vals.
+  inline unsigned readScalarAbbrevFields(const NaClBitCodeAbbrev *Abbv,
+                                         SmallVectorImpl<uint64_t> &Vals);
+
+  // Skips over the next NumBits bits.
+  void skipBits(uint64_t NumBits) {
+    if (NumBits <= BitsInCurWord) {
+      // Use a mask to avoid undefined behavior.
+      CurWord = NumBits < sizeof(word_t) * 8 ? CurWord >> NumBits : 0;
+      BitsInCurWord -= NumBits;
+      return;
+    }
+    JumpToBit(GetCurrentBitNo() + NumBits);
+  }
+
   // Reports that that abbreviation Index is not valid.
   void reportInvalidAbbrevNumber(unsigned Index) const;
 
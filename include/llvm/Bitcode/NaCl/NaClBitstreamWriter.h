@@ -15,17 +15,43 @@
 #ifndef LLVM_BITCODE_NACL_NACLBITSTREAMWRITER_H
 #define LLVM_BITCODE_NACL_NACLBITSTREAMWRITER_H
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Bitcode/NaCl/NaClBitCodes.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeHeader.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <map>
 #include <vector>
 
 namespace llvm {
 
 class NaClBitstreamWriter {
+  /// Out - The output not yet written to OutStream (all of it, if there is
+  /// no OutStream).
   SmallVectorImpl<char> &Out;
 
+  /// OutStream - If non-null, the output is written to this stream each
+  /// time a top-level block (one nested in at most one other block) is
+  /// exited, so that Out only holds the output of the current top-level
+  /// block.
+  raw_pwrite_stream *OutStream = nullptr;
+
+  /// StreamStart - The offset in OutStream of the start of the output.
+  uint64_t StreamStart = 0;
+
+  /// FlushedBytes - The number of bytes of output written to OutStream.
+  uint64_t FlushedBytes = 0;
+
+  /// KeptBytes - The values of the bytes written to OutStream that may be
+  /// backpatched by BackpatchBits (see KeepBitsForBackpatch), by byte number.
+  std::map<uint64_t, unsigned char> KeptBytes;
+
+  /// PendingPatches - Backpatched bytes, by byte number, that have been
+  /// written to OutStream with their old values.
+  std::map<uint64_t, unsigned char> PendingPatches;
+
   /// CurBit - Always between 0 and 31 inclusive, specifies the next bit to use.
   unsigned CurBit;
 
@@ -68,6 +94,10 @@ class NaClBitstreamWriter {
   // True if filler should be added to byte align records.
   bool AlignBitcodeRecords = false;
 
+  /// BlockHeaderBits - The number of bits in the header of the last
+  /// top-level block entered, before the alignment of the block size word.
+  unsigned BlockHeaderBits = 0;
+
   /// AbbrevValues - Wrapper class that allows the bitstream writer to
   /// prefix a code to the set of values, associated with a record to
   /// emit, without having to destructively change the contents of
@@ -91,14 +121,108 @@ class NaClBitstreamWriter {
     const SmallVectorImpl<uintty> &Values;
   };
 
+  // Returns byte ByteNo of the output. If it has been written to OutStream,
+  // it must have been kept by KeepBitsForBackpatch.
+  unsigned char GetByte(uint64_t ByteNo) const {
+    if (ByteNo >= FlushedBytes)
+      return Out[ByteNo - FlushedBytes];
+    std::map<uint64_t, unsigned char>::const_iterator Pos =
+        KeptBytes.find(ByteNo);
+    assert(Pos != KeptBytes.end() && "Backpatched bits were not kept!");
+    return Pos->second;
+  }
+
+  // Sets byte ByteNo of the output. If it has been written to OutStream, the
+  // new value is written by FlushToStream.
+  void SetByte(uint64_t ByteNo, unsigned char Value) {
+    if (ByteNo >= FlushedBytes) {
+      Out[ByteNo - FlushedBytes] = Value;
+      return;
+    }
+    std::map<uint64_t, unsigned char>::iterator Pos = KeptBytes.find(ByteNo);
+    if (Pos != KeptBytes.end())
+      Pos->second = Value;
+    PendingPatches[ByteNo] = Value;
+  }
+
+  // Writes Out to OutStream, remembering the values of the kept bytes.
+  void FlushBuffer() {
+    uint64_t End = FlushedBytes + Out.size();
+    for (std::map<uint64_t, unsigned char>::iterator
+             Pos = KeptBytes.lower_bound(FlushedBytes),
+             PosEnd = KeptBytes.lower_bound(End); Pos != PosEnd; ++Pos)
+      Pos->second = Out[Pos->first - FlushedBytes];
+    OutStream->write(Out.data(), Out.size());
+    FlushedBytes = End;
+    Out.clear();
+  }
+
 public:
   // BackpatchWord - Backpatch a 32-bit word in the output with the specified
   // value.
-  void BackpatchWord(unsigned ByteNo, unsigned NewWord) {
-    Out[ByteNo++] = (unsigned char)(NewWord >>  0);
-    Out[ByteNo++] = (unsigned char)(NewWord >>  8);
-    Out[ByteNo++] = (unsigned char)(NewWord >> 16);
-    Out[ByteNo  ] = (unsigned char)(NewWord >> 24);
+  void BackpatchWord(uint64_t ByteNo, unsigned NewWord) {
+    SetByte(ByteNo++, (unsigned char)(NewWord >>  0));
+    SetByte(ByteNo++, (unsigned char)(NewWord >>  8));
+    SetByte(ByteNo++, (unsigned char)(NewWord >> 16));
+    SetByte(ByteNo  , (unsigned char)(NewWord >> 24));
+  }
+
+  // BackpatchBits - Backpatch the NumBits bits starting at bit BitNo of the
+  // output with the specified value. The bits must already have been flushed
+  // to the output.
+  void BackpatchBits(uint64_t BitNo, uint32_t NewBits, unsigned NumBits) {
+    assert(NumBits <= 32 && "Too many bits to backpatch!");
+    assert(BitNo + NumBits <= GetBufferOffset() * CHAR_BIT &&
+           "Bits not flushed to the output!");
+    while (NumBits) {
+      uint64_t ByteNo = BitNo / CHAR_BIT;
+      unsigned Shift = BitNo % CHAR_BIT;
+      unsigned Count = std::min<unsigned>(NumBits, CHAR_BIT - Shift);
+      unsigned char Mask = ((1U << Count) - 1) << Shift;
+      SetByte(ByteNo, (GetByte(ByteNo) & ~Mask) | ((NewBits << Shift) & Mask));
+      NewBits >>= Count;
+      BitNo += Count;
+      NumBits -= Count;
+    }
+  }
+
+  // KeepBitsForBackpatch - Declares that the NumBits bits starting at bit
+  // BitNo, which must not have been written to OutStream yet, will be
+  // backpatched by BackpatchBits after they are.
+  void KeepBitsForBackpatch(uint64_t BitNo, unsigned NumBits) {
+    if (!OutStream)
+      return;
+    assert(BitNo / CHAR_BIT >= FlushedBytes && "Bits already written!");
+    for (uint64_t ByteNo = BitNo / CHAR_BIT,
+             ByteEnd = (BitNo + NumBits + CHAR_BIT - 1) / CHAR_BIT;
+         ByteNo != ByteEnd; ++ByteNo)
+      KeptBytes.insert(std::make_pair(ByteNo, 0));
+  }
+
+  // FlushToStream - Writes the output not written yet to OutStream, and
+  // updates the backpatched bytes already written. The output must end on
+  // a word boundary.
+  void FlushToStream() {
+    assert(OutStream && "No stream to flush to!");
+    assert(CurBit == 0 && "Output not flushed to a word boundary!");
+    FlushBuffer();
+    // Write runs of consecutive patched bytes with one pwrite each.
+    SmallVector<char, 64> Run;
+    uint64_t RunStart = 0;
+    for (std::map<uint64_t, unsigned char>::iterator
+             Pos = PendingPatches.begin(), PosEnd = PendingPatches.end();
+         Pos != PosEnd; ++Pos) {
+      if (!Run.empty() && Pos->first != RunStart + Run.size()) {
+        OutStream->pwrite(Run.data(), Run.size(), StreamStart + RunStart);
+        Run.clear();
+      }
+      if (Run.empty())
+        RunStart = Pos->first;
+      Run.push_back(Pos->second);
+    }
+    if (!Run.empty())
+      OutStream->pwrite(Run.data(), Run.size(), StreamStart + RunStart);
+    PendingPatches.clear();
   }
 
 private:
@@ -115,12 +239,12 @@ private:
     Out.append(&Bytes[0], &Bytes[4]);
   }
 
-  unsigned GetBufferOffset() const {
-    return Out.size();
+  uint64_t GetBufferOffset() const {
+    return FlushedBytes + Out.size();
   }
 
   unsigned GetWordIndex() const {
-    unsigned Offset = GetBufferOffset();
+    uint64_t Offset = GetBufferOffset();
     assert((Offset & 3) == 0 && "Not 32-bit aligned");
     return Offset / 4;
   }
@@ -129,9 +253,36 @@ public:
   explicit NaClBitstreamWriter(SmallVectorImpl<char> &O)
       : Out(O), CurBit(0), CurValue(0), CurCodeSize() {}
 
+  /// Writes the output to OS as top-level blocks are completed, using O to
+  /// buffer the current top-level block. Block sizes are backpatched with
+  /// pwrite by FlushToStream, which must be called once all blocks are
+  /// exited.
+  NaClBitstreamWriter(SmallVectorImpl<char> &O, raw_pwrite_stream &OS)
+      : Out(O), OutStream(&OS), StreamStart(OS.tell()), CurBit(0),
+        CurValue(0), CurCodeSize() {}
+
+  /// Creates a writer of blocks to be added to the current block of Parent
+  /// with EmitDetachedBlock, so that the blocks can be written on several
+  /// threads. The writer gets its own copies of the blockinfo abbreviations
+  /// of Parent. Once a top-level block is written, the caller may take the
+  /// contents of O, before the next block is written.
+  NaClBitstreamWriter(SmallVectorImpl<char> &O,
+                      const NaClBitstreamWriter &Parent)
+      : Out(O), CurBit(0), CurValue(0), CurCodeSize(Parent.CurCodeSize),
+        AlignBitcodeRecords(Parent.AlignBitcodeRecords) {
+    for (const BlockInfo &Info : Parent.BlockInfoRecords) {
+      BlockInfoRecords.push_back(BlockInfo());
+      BlockInfoRecords.back().BlockID = Info.BlockID;
+      for (const NaClBitCodeAbbrev *Abbrev : Info.Abbrevs)
+        BlockInfoRecords.back().Abbrevs.push_back(Abbrev->Copy());
+    }
+  }
+
   ~NaClBitstreamWriter() {
     assert(CurBit == 0 && "Unflushed data remaining");
     assert(BlockScope.empty() && CurAbbrevs.empty() && "Block imbalance");
+    assert((!OutStream || (Out.empty() && PendingPatches.empty())) &&
+           "Output not flushed to stream");
 
     // Free the BlockInfoRecords.
     while (!BlockInfoRecords.empty()) {
@@ -151,6 +302,10 @@ public:
   /// \brief Retrieve the current position in the stream, in bits.
   uint64_t GetCurrentBitNo() const { return GetBufferOffset() * 8 + CurBit; }
 
+  /// \brief Returns the number of bits used to write abbreviation indices
+  /// in the current block.
+  unsigned getAbbrevIDWidth() const { return CurCodeSize.NumBits; }
+
   /// \brief Returns the maximum abbreviation index allowed for the
   /// current block.
   size_t getMaxCurAbbrevIndex() const {
@@ -278,10 +433,13 @@ private:
                      BlockInfo *Info) {
     // Block header:
     //    [ENTER_SUBBLOCK, blockid, newcodelen, <align4bytes>, blocklen]
+    uint64_t HeaderStart = GetCurrentBitNo();
     EmitCode(naclbitc::ENTER_SUBBLOCK);
     EmitVBR(BlockID, naclbitc::BlockIDWidth);
     assert(CodeLen.IsFixed && "Block codelens must be fixed");
     EmitVBR(CodeLen.NumBits, naclbitc::CodeLenWidth);
+    if (BlockScope.empty())
+      BlockHeaderBits = GetCurrentBitNo() - HeaderStart;
     FlushToWord();
 
     unsigned BlockSizeWordIndex = GetWordIndex();
@@ -351,7 +509,7 @@ public:
 
     // Compute the size of the block, in words, not counting the size field.
     unsigned SizeInWords = GetWordIndex() - B.StartSizeWord - 1;
-    unsigned ByteNo = B.StartSizeWord*4;
+    uint64_t ByteNo = uint64_t(B.StartSizeWord)*4;
 
     // Update the block size field in the header of this sub-block.
     BackpatchWord(ByteNo, SizeInWords);
@@ -360,6 +518,10 @@ public:
     CurCodeSize = B.PrevCodeSize;
     BlockScope.back().PrevAbbrevs.swap(CurAbbrevs);
     BlockScope.pop_back();
+
+    // Write out the completed top-level block.
+    if (OutStream && BlockScope.size() <= 1)
+      FlushBuffer();
   }
 
   //===--------------------------------------------------------------------===//
@@ -501,6 +663,35 @@ public:
       naclbitc::FIRST_APPLICATION_ABBREV;
   }
 
+  /// \brief Returns the number of bits in the header of the last top-level
+  /// block entered.
+  unsigned getBlockHeaderBits() const { return BlockHeaderBits; }
+
+  /// EmitDetachedBlock - Adds Block, a top-level block written by a writer
+  /// created for this writer while in the current block, to the current
+  /// block. HeaderBits is the writer's getBlockHeaderBits() for the block.
+  void EmitDetachedBlock(ArrayRef<char> Block, unsigned HeaderBits) {
+    assert(!BlockScope.empty() && "Not in a block");
+    assert(Block.size() % 4 == 0 && "Block not 32-bit aligned");
+    // The header was written at the start of a word, so it is copied bit by
+    // bit. The rest of the block follows the alignment to a word boundary.
+    const unsigned char *Data =
+        reinterpret_cast<const unsigned char *>(Block.data());
+    for (unsigned Bit = 0; Bit < HeaderBits; Bit += 32) {
+      const unsigned char *Word = Data + Bit / CHAR_BIT;
+      Emit(Word[0] | (Word[1] << 8) | (Word[2] << 16) |
+               (uint32_t(Word[3]) << 24),
+           std::min(32U, HeaderBits - Bit));
+    }
+    FlushToWord();
+    size_t HeaderSize = (HeaderBits + 31) / 32 * 4;
+    Out.append(Block.begin() + HeaderSize, Block.end());
+
+    // Write out the completed top-level block.
+    if (OutStream && BlockScope.size() <= 1)
+      FlushBuffer();
+  }
+
   //===--------------------------------------------------------------------===//
   // BlockInfo Block Emission
   //===--------------------------------------------------------------------===//
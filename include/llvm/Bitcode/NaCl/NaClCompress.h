@@ -30,12 +30,20 @@ public:
           ShowValueDistributions(false),
           ShowAbbrevLookupTries(false),
           ShowAbbreviationFrequencies(false),
-          RemoveAbbreviations(false) {}
+          RemoveAbbreviations(false),
+          SynthesizeAbbreviations(false),
+          NumThreads(1) {}
     bool TraceGeneratedAbbreviations;
     bool ShowValueDistributions;
     bool ShowAbbrevLookupTries;
     bool ShowAbbreviationFrequencies;
     bool RemoveAbbreviations;
+    /// If true, also adds abbreviations built from the value
+    /// distributions of the records, when they save bits.
+    bool SynthesizeAbbreviations;
+    /// The number of threads reading and writing function blocks. The
+    /// output does not depend on it.
+    unsigned NumThreads;
   };
   CompressFlags Flags;
 
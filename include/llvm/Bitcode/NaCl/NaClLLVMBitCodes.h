@@ -47,7 +47,8 @@ namespace naclbitc {
     TYPE_BLOCK_ID_NEW,
 
     USELIST_BLOCK_ID,          // Not used in PNaCl.
-    GLOBALVAR_BLOCK_ID
+    GLOBALVAR_BLOCK_ID,
+    FUNCTION_INDEX_BLOCK_ID    // Optional, see NaClFunctionIndexCodes.
   };
 
 
@@ -128,6 +129,17 @@ namespace naclbitc {
     VST_CODE_BBENTRY = 2   // VST_BBENTRY: [bbid, namechar x N]
   };
 
+  /// The optional function index block comes after the value symbol table,
+  /// before the function blocks, and has one FUNCTION_INDEX_ENTRY record
+  /// for each function block, in the order of the function blocks. Each
+  /// entry gives the position of the start of the function block (its
+  /// ENTER_SUBBLOCK abbreviation index), and the size of the whole block,
+  /// both in 32-bit words. Function blocks are always word aligned, since
+  /// they follow other blocks.
+  enum NaClFunctionIndexCodes {
+    FUNCTION_INDEX_ENTRY = 1  // ENTRY: [startword, numwords]
+  };
+
   // Not used in PNaCl.
   enum NaClMetadataCodes {
     METADATA_STRING        = 1,   // MDSTRING:      [values]
@@ -0,0 +1,140 @@
+//===-- llvm/Bitcode/NaCl/NaClModuleSnapshot.h - ---------------*- C++ -*-===//
+//      Shared module-level records of PNaCl bitcode.
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This header defines a snapshot of the module-level records of a PNaCl
+// bitcode file, so that several modules can be instantiated from one parse
+// of the module header.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_BITCODE_NACL_NACLMODULESNAPSHOT_H
+#define LLVM_BITCODE_NACL_NACLMODULESNAPSHOT_H
+
+#include "llvm/Bitcode/NaCl/NaClBitstreamReader.h"
+#include "llvm/IR/CallingConv.h"
+#include "llvm/IR/GlobalValue.h"
+#include "llvm/Support/Mutex.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+
+class NaClBitcodeReader;
+
+/// An immutable, context-free copy of the module-level records of a PNaCl
+/// bitcode file: the type table, the global variables and function
+/// prototypes, their names, and the abbreviations of the blockinfo block.
+/// Global variables are kept without their initializers.
+///
+/// Modules instantiated from a snapshot (see getNaClSnapshotModule) get
+/// declarations for all global variables and prototypes for all functions,
+/// in the same order as the module the snapshot was taken from, and read
+/// their function bodies lazily without parsing the module header again.
+/// The positions of the function bodies are found once, by skipping over
+/// the blocks of the module, and are shared by all such modules.
+///
+/// A snapshot can be used by several threads at once.
+class NaClModuleSnapshot {
+  NaClModuleSnapshot(const NaClModuleSnapshot &) = delete;
+  void operator=(const NaClModuleSnapshot &) = delete;
+
+public:
+  ~NaClModuleSnapshot();
+
+  /// Returns the number of function bodies in the module.
+  unsigned getNumFunctionBodies() const { return BodyBits.size(); }
+
+  /// Sets Bit and Size to the position and size in bits of the block of
+  /// function body Index. Returns true if the body could not be found.
+  bool findFunctionBody(unsigned Index, uint64_t &Bit, uint64_t &Size);
+
+private:
+  friend class NaClBitcodeReader;
+
+  // Locates function bodies in Streamer, which must start with a bitcode
+  // header of HeaderSize bytes. Takes ownership of Streamer.
+  NaClModuleSnapshot(StreamingMemoryObject *Streamer, size_t HeaderSize,
+                     bool AlignBitcodeRecords);
+
+  // Scans the module block until body Index is found.
+  bool scanToFunctionBody(unsigned Index);
+
+  // Forgets the bodies not passed by ScanStream, so that they are found
+  // again by scanning. Used when a body read from a function index is not
+  // where the index says.
+  void forgetFoundBodies();
+
+  // Gives Reader a copy of the blockinfo abbreviations.
+  void installBlockInfo(NaClBitstreamReader &Reader) const;
+
+  // Each type, as its TYPE_CODE and the operands of its type record.
+  struct TypeEntry {
+    unsigned Code;
+    std::vector<uint64_t> Ops;
+  };
+
+  struct GlobalVarEntry {
+    // Index in the value list.
+    unsigned ValueID;
+    unsigned Alignment;
+    bool IsConstant;
+    // The byte size of each initializer, or RelocInit for a relocation.
+    std::vector<uint64_t> InitSizes;
+  };
+  static const uint64_t RelocInit = ~uint64_t(0);
+
+  struct FunctionEntry {
+    // Index in the value list.
+    unsigned ValueID;
+    // Index in Types of the type in the function record. For intrinsics,
+    // this is the type before pointer types are added.
+    unsigned TypeID;
+    CallingConv::ID CallingConv;
+    GlobalValue::LinkageTypes Linkage;
+    // Index in BodyBits, or NoBody for a prototype.
+    unsigned BodyIndex;
+  };
+  static const unsigned NoBody = ~0U;
+
+  size_t HeaderSize;
+  bool AlignBitcodeRecords;
+  // The abbreviation ID width of the module block.
+  unsigned ModuleAbbrevIDWidth;
+  // True if the bodies found by the reader the snapshot was taken from were
+  // read from a function index, so that each must be checked before use.
+  bool BodiesFromIndex;
+  std::vector<TypeEntry> Types;
+  // In value list order, which is also module order.
+  std::vector<GlobalVarEntry> GlobalVars;
+  std::vector<FunctionEntry> Functions;
+  unsigned NumValues;
+  // The name of value i is NamePool[NameOffsets[i], NameOffsets[i + 1]).
+  std::string NamePool;
+  std::vector<unsigned> NameOffsets;
+  std::vector<NaClBitstreamReader::BlockInfo> BlockInfos;
+
+  // Guards the fields below, which locate the function bodies.
+  sys::Mutex ScanLock;
+  std::unique_ptr<NaClBitstreamReader> ScanFile;
+  NaClBitstreamCursor ScanStream;
+  bool ScanStarted;
+  // The number of function bodies passed by ScanStream.
+  unsigned NumBodiesScanned;
+  // The number of function bodies found so far, either by ScanStream or
+  // already by the reader the snapshot was taken from.
+  unsigned NumBodiesFound;
+  std::vector<uint64_t> BodyBits;
+  std::vector<uint64_t> BodyBitSizes;
+};
+
+} // end llvm namespace
+
+#endif
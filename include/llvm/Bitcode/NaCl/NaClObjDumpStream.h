@@ -864,6 +864,14 @@ public:
   /// the error message using ErrorAt(naclbitc::Fatal,...).
   void FlushThenQuit();
 
+  /// Dumps the buffered assembly, comments, and errors, and then
+  /// Text, which was generated by another objdump stream with the same
+  /// flags, into the objdump stream.
+  void WriteText(StringRef Text) {
+    Flush();
+    Stream << Text;
+  }
+
   /// Increments the record indent by one.
   void IncRecordIndent() {
     RecordFormatter.Inc();
@@ -920,6 +928,11 @@ public:
     LastKnownBit = Bit;
   }
 
+  /// Returns the bit of the record being processed.
+  uint64_t GetRecordBitAddress() const {
+    return LastKnownBit;
+  }
+
 private:
   // The stream to dump to.
   raw_ostream &Stream;
@@ -20,15 +20,19 @@
 #include "llvm/Support/ErrorOr.h"
 #include "llvm/Support/MemoryBuffer.h"
 
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace llvm {
   class LLVMContext;
   class Module;
   class NaClBitcodeHeader;
   class NaClBitstreamWriter;
+  class NaClModuleSnapshot;
   class StreamingMemoryObject;
   class raw_ostream;
+  class raw_pwrite_stream;
 
   /// Defines the data layout used for PNaCl bitcode files. We set the
   /// data layout of the module in the bitcode readers rather than in
@@ -79,8 +83,38 @@ namespace llvm {
                                        std::string *ErrMsg = nullptr,
                                        bool AcceptSupportedOnly = true);
 
+  /// Sets BitSizes to the size in bits of the body of each function with a
+  /// body in M, in module order. M must have been returned by
+  /// getNaClLazyBitcodeModule or getNaClStreamedBitcodeModule. When
+  /// streaming, this reads the rest of the stream to find the bodies.
+  std::error_code getNaClFunctionBodyBitSizes(Module *M,
+                                              std::vector<uint64_t> &BitSizes);
+
+  /// Takes a snapshot of the module-level values of M, which must have been
+  /// returned by getNaClStreamedBitcodeModule. Streamer must read the same
+  /// bitcode, and is used by the snapshot to locate function bodies; the
+  /// snapshot takes ownership of it. Returns null if M can't be described
+  /// by a snapshot.
+  std::unique_ptr<NaClModuleSnapshot>
+  getNaClModuleSnapshot(Module *M, StreamingMemoryObject *Streamer);
+
+  /// Instantiates a module from Snapshot, and prepares for lazy
+  /// deserialization of function bodies from streamer, which must read the
+  /// same bitcode as the module the snapshot was taken from. Global
+  /// variables are declarations. On error, this returns null, and fills in
+  /// *ErrMsg with an error description if ErrMsg is non-null.
+  Module *getNaClSnapshotModule(const std::string &name,
+                                NaClModuleSnapshot &Snapshot,
+                                StreamingMemoryObject *streamer,
+                                LLVMContext &Context,
+                                raw_ostream *Verbose = nullptr,
+                                std::string *ErrMsg = nullptr);
+
   /// Read the bitcode file from a buffer, returning the module.
   ///
+  /// Function blocks are decoded on the number of threads given by
+  /// -bitcode-decode-threads. The IR is built on the calling thread.
+  ///
   /// See getNaClLazyBitcodeModule for an explanation of arguments
   /// Verbose, AcceptSupportedOnly.
   ErrorOr<Module *> NaClParseBitcodeFile(MemoryBufferRef Buffer,
@@ -107,9 +141,19 @@ namespace llvm {
   ///       supported, as well as running experiments on the bitcode format.
   /// When AcceptSupportedOnly is true, only form 1 is allowed. When
   /// AcceptSupportedOnly is false, forms 1 and 2 are allowed.
+  ///
+  /// Function blocks are written on the number of threads given by the
+  /// -bitcode-write-threads option. The output does not depend on it.
   void NaClWriteBitcodeToFile(const Module *M, raw_ostream &Out,
                               bool AcceptSupportedOnly = true);
 
+  /// Like NaClWriteBitcodeToFile, but writes each top-level block of the
+  /// module to Out as soon as it is complete, and then backpatches the block
+  /// sizes in place. Only the largest top-level block (typically a function
+  /// block) is held in memory, rather than the whole module.
+  void NaClWriteBitcodeToStream(const Module *M, raw_pwrite_stream &Out,
+                                bool AcceptSupportedOnly = true);
+
   /// isNaClBitcode - Return true if the given bytes are the magic bytes for
   /// PNaCl bitcode wire format.
   ///
@@ -134,9 +178,11 @@ namespace llvm {
 
   /// NaClObjDump - Read PNaCl bitcode file from input, and print a
   /// textual representation of its contents. NoRecords and NoAssembly
-  /// define what should not be included in the dump.
+  /// define what should not be included in the dump. Function blocks
+  /// are disassembled on NumThreads threads, which doesn't change the
+  /// dump.
   bool NaClObjDump(MemoryBufferRef Input, raw_ostream &output,
-                   bool NoRecords, bool NoAssembly);
+                   bool NoRecords, bool NoAssembly, unsigned NumThreads = 1);
 
 } // end llvm namespace
 #endif
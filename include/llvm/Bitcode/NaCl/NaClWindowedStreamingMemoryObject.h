@@ -0,0 +1,87 @@
+//===-- NaClWindowedStreamingMemoryObject.h - Windowed stream ---*- C++ -*-===//
+//      Reads a data stream keeping only its most recent bytes.
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This header defines a memory object over a DataStreamer that only keeps
+// a window of the bytes read in memory, so that bitcode can be parsed once,
+// front to back, in bounded memory.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_BITCODE_NACL_NACLWINDOWEDSTREAMINGMEMORYOBJECT_H
+#define LLVM_BITCODE_NACL_NACLWINDOWEDSTREAMINGMEMORYOBJECT_H
+
+#include "llvm/Support/DataStream.h"
+#include "llvm/Support/MemoryObject.h"
+#include <memory>
+#include <vector>
+
+namespace llvm {
+
+// Reads the bytes of a DataStreamer, only keeping the last WindowSize
+// bytes read in memory. Hence, bytes must be read (mostly) in order,
+// which is the case when the bitcode is parsed once, front to back.
+// Reading a byte that has been dropped is a fatal error.
+class NaClWindowedStreamingMemoryObject : public MemoryObject {
+  NaClWindowedStreamingMemoryObject(
+      const NaClWindowedStreamingMemoryObject&) = delete;
+  void operator=(const NaClWindowedStreamingMemoryObject&) = delete;
+
+public:
+  // The default number of bytes kept before the last byte read.
+  static const size_t DefaultWindowSize = 1 << 20;
+  // The default number of bytes requested from the streamer at a time.
+  static const size_t DefaultChunkSize = 1 << 16;
+
+  // Takes ownership of Streamer.
+  explicit NaClWindowedStreamingMemoryObject(
+      DataStreamer *Streamer, size_t WindowSize = DefaultWindowSize,
+      size_t ChunkSize = DefaultChunkSize);
+
+  ~NaClWindowedStreamingMemoryObject() override;
+
+  // Note: Reads (and drops) the rest of the stream.
+  uint64_t getExtent() const override;
+
+  uint64_t readBytes(uint8_t *Buf, uint64_t Size,
+                     uint64_t Address) const override;
+
+  const uint8_t *getPointer(uint64_t Address, uint64_t Size) const override;
+
+  bool isValidAddress(uint64_t Address) const override;
+
+  // Returns the number of bytes read from the stream so far.
+  uint64_t getNumBytesRead() const {
+    return WindowStart + NumBytes;
+  }
+
+  // Returns the address of the first byte still held in memory.
+  uint64_t getWindowStart() const {
+    return WindowStart;
+  }
+
+private:
+  const size_t WindowSize;
+  const size_t ChunkSize;
+  std::unique_ptr<DataStreamer> Streamer;
+  // The bytes read, starting with the byte at address WindowStart.
+  mutable std::vector<unsigned char> Bytes;
+  mutable uint64_t WindowStart;
+  // The number of bytes held in Bytes.
+  mutable size_t NumBytes;
+  mutable bool EOFReached;
+
+  // Reads from the stream until the byte at Pos is read, dropping
+  // leading bytes when Bytes is full. Returns true if Pos can be read.
+  bool fetchToPos(uint64_t Pos) const;
+};
+
+} // end namespace llvm
+
+#endif // LLVM_BITCODE_NACL_NACLWINDOWEDSTREAMINGMEMORYOBJECT_H
@@ -1,6 +1,9 @@
 #ifndef LLVM_DLINKER_DLINKER_H
 #define LLVM_DLINKER_DLINKER_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/Constants.h"
 #include <vector>
@@ -8,11 +11,17 @@
 
 namespace llvm {
 
-    /* @2 = internal constant [4 x i8] c"add\00", align 1
+    class DataLayout;
+    class ExportIndex;
+
+    /* @2 = private constant [8 x i8] c"add\00sub\00", align 1
      *
-     * ImportName: i32 ptrtoint ([4 x i8]* @2 to i32)
+     * ImportName: i32 ptrtoint ([8 x i8]* @2 to i32), or
+     *             i32 add (i32 ptrtoint ([8 x i8]* @2 to i32), i32 4) for sub
      * FunctionName: add
-     * ImportFunction: declare i32 @add(i32)
+     * ImportFunction: declare i32 @add(i32), or null if it was dropped
+     *                 because all calls go through a lazy binding slot
+     * ImportLibrary: the library field of the import before linking
      * 
      */
 
@@ -20,6 +29,7 @@ namespace llvm {
         Constant *ImportName;
         std::string FunctionName;
         Function *ImportFunction;
+        Constant *ImportLibrary;
     } ImportEntry;
 
     class DLinkDiagnosticInfo : public DiagnosticInfo {
@@ -36,22 +46,57 @@ namespace llvm {
             ~DLinker();
 
             bool linkPsoRoot(Module* M);
+            /// Links the exports recorded in Index as if they were read from
+            /// the PSO root of the module ModuleID.
+            bool linkExportIndex(const ExportIndex &Index, StringRef ModuleID);
+            /// Resolves the imports of the composite against the exports in
+            /// CS. Returns true if at least one import was resolved.
             bool Linking(ConstantStruct *CS);
+
+            /// Appends the indices, in the import table of the composite, of
+            /// the imports named by ExportNames.
+            void findImports(ArrayRef<StringRef> ExportNames,
+                             std::vector<unsigned> &Imports) const;
+            /// Resolves the imports at the given indices to the module
+            /// ModuleID, whose data layout is DL. Linking a module is the
+            /// same as linking the imports that findImports returns for its
+            /// exports, so a previous link can be replayed without reading
+            /// the module again.
+            bool linkImports(const DataLayout &DL, StringRef ModuleID,
+                             ArrayRef<unsigned> Imports);
+            unsigned getNumImports() const { return ImportTable.size(); }
+
+            /// Collects the names exported by the PSO root of M.
+            static void getExports(Module *M, std::vector<StringRef> &ExportNames);
         private:
             Module *Composite;
             LLVMContext &Context;
             DiagnosticHandlerFunction DiagnosticHandler;
             std::vector<ImportEntry> ImportTable;
+            /// Import name to the indices of its entries in ImportTable.
+            StringMap<SmallVector<unsigned, 1> > ImportIndex;
             std::string ExportFileName;
 
             GlobalVariable *PsoRoot;
             std::vector<Constant*> Constants;
             std::vector<Type*> Types;
             GlobalVariable *ZeroInitializer;
+            /// The names of the linked libraries, NUL terminated, which are
+            /// emitted as a single string table global.
+            std::string LibraryNames;
+            StringMap<unsigned> LibraryNameOffsets;
+            /// Offset in LibraryNames of the library that resolved each
+            /// import, or -1 if it is unresolved.
+            std::vector<int> LibraryOffsets;
+            GlobalVariable *LibraryPool;
 
             bool areTypesIsomorphic(Type *DstTy, Type *SrcTy);        
             bool areFunctionsIsomorphic(Function *Dst, Function *Src);
             void setImportTable();
+            void linkDataLayout(const DataLayout &DL, StringRef ModuleID);
+            void resolveImport(unsigned Idx);
+            unsigned getLibraryOffset(StringRef Library);
+            void rebuildImportTable();
 
             void emitWarning(const Twine &Message) {
                 DiagnosticHandler(DLinkDiagnosticInfo(DS_Warning, Message));
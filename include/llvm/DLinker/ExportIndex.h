@@ -0,0 +1,77 @@
+//===- ExportIndex.h - On-disk cache of PSO export tables -------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// An export index records the data layout and the exported symbol names of a
+// PSO, keyed by the content hash of the file they were read from. Indices are
+// kept as one file per key in a cache directory, so that a library that has
+// not changed can be linked without parsing its bitcode again.
+//
+// The file is read in place (memory mapped when large enough):
+//
+//   char     Magic[4]            "PDXI"
+//   uint32   Version
+//   uint32   NumExports
+//   uint32   DataLayoutSize
+//   uint32   Offsets[NumExports + 1]   export name i is the string pool range
+//                                      [Offsets[i], Offsets[i + 1])
+//   char     DataLayout[DataLayoutSize]
+//   char     StringPool[]
+//
+// All integers are little endian.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_DLINKER_EXPORTINDEX_H
+#define LLVM_DLINKER_EXPORTINDEX_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <memory>
+#include <string>
+#include <system_error>
+
+namespace llvm {
+
+    class ExportIndex {
+        public:
+            /// Returns the cache key of the file contents in Buffer.
+            static std::string getKey(MemoryBufferRef Buffer);
+
+            /// Reads the index stored for Key in Dir. Returns null if there
+            /// is none or if it is malformed.
+            static std::unique_ptr<ExportIndex> read(StringRef Dir, StringRef Key);
+
+            /// Stores the index for Key in Dir. The file is written under a
+            /// temporary name and then renamed, so concurrent links never see
+            /// a partial index.
+            static std::error_code write(StringRef Dir, StringRef Key,
+                                         StringRef DataLayout,
+                                         ArrayRef<StringRef> Exports);
+
+            StringRef getDataLayout() const { return DataLayout; }
+            unsigned size() const { return NumExports; }
+            StringRef getExport(unsigned i) const;
+
+        private:
+            explicit ExportIndex(std::unique_ptr<MemoryBuffer> Buffer)
+                : Buffer(std::move(Buffer)), NumExports(0), Offsets(nullptr),
+                  StringPool(nullptr) {}
+
+            bool parse();
+
+            std::unique_ptr<MemoryBuffer> Buffer;
+            StringRef DataLayout;
+            unsigned NumExports;
+            const char *Offsets;
+            const char *StringPool;
+    };
+}
+
+#endif
@@ -61,6 +61,13 @@ public:
   /// @param address - address of the byte, in the same space as getBase()
   /// @result        - true if the address may be read with readByte()
   virtual bool isValidAddress(uint64_t address) const = 0;
+
+  /// @LOCALMOD -- Returns a pointer to the whole region if all of it is in
+  /// memory at an address that stays valid for the lifetime of the object
+  /// (e.g. a mapped file), and null otherwise. Readers can then read the
+  /// region in place, without calling readBytes. The size of the region is
+  /// getExtent(), which must not block when this returns non-null.
+  virtual const uint8_t *getStablePointer() const { return nullptr; }
 };
 
 }
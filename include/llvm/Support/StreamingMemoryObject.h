@@ -15,6 +15,7 @@
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/MemoryObject.h"
 #include <memory>
+#include <string>
 #include <vector>
 
 namespace llvm {
@@ -104,5 +105,12 @@ private:
 MemoryObject *getNonStreamedMemoryObject(
     const unsigned char *Start, const unsigned char *End);
 
+/// @LOCALMOD -- Returns a StreamingMemoryObject for the contents of the file
+/// Filename, mapped into memory rather than copied. Its bytes are available
+/// at once, and getStablePointer() returns them. Returns null, and sets *Err,
+/// if the file cannot be mapped (e.g. it is empty or not a regular file).
+StreamingMemoryObject *getMappedFileMemoryObject(const std::string &Filename,
+                                                 std::string *Err);
+
 }
 #endif  // STREAMINGMEMORYOBJECT_H_
@@ -0,0 +1,134 @@
+//===- PsoExportHash.h - Hash table for PSO export lookup -------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// When PNaClPsoRoot is run with -pnacl-pso-export-hash, the __exports array is
+// sorted by name, so a loader can binary search it, and __pnacl_pso_root also
+// points at a GNU-hash-style table over it. The table is a flat array of i32:
+//
+//   [0]                     NBuckets
+//   [1]                     BloomWords (a power of 2)
+//   [2]                     BloomShift
+//   Bloom[BloomWords]       bloom filter words
+//   Buckets[NBuckets]       first chain entry of each bucket, NumExports if
+//                           the bucket is empty
+//   Chain[NumExports]       hash of each entry, low bit set on the last entry
+//                           of its bucket
+//   Order[NumExports]       index in __exports of each entry
+//
+// Chain and Order are grouped by bucket. This header is shared by the pass and
+// loaders so that both agree on the hash function and the layout.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_NACL_PSOEXPORTHASH_H
+#define LLVM_TRANSFORMS_NACL_PSOEXPORTHASH_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MathExtras.h"
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+namespace PsoExportHash {
+
+enum {
+  NBucketsIndex = 0,
+  BloomWordsIndex = 1,
+  BloomShiftIndex = 2,
+  HeaderSize = 3
+};
+
+/// The GNU hash function (h * 33 + c), as used by ELF .gnu.hash sections.
+inline uint32_t hash(const char *Name, size_t Len) {
+  uint32_t H = 5381;
+  for (size_t i = 0; i < Len; ++i)
+    H = H * 33 + static_cast<unsigned char>(Name[i]);
+  return H;
+}
+
+/// Returns true if the bloom filter of Table may contain a name with hash H.
+inline bool bloomMayContain(const uint32_t *Table, uint32_t H) {
+  uint32_t BloomWords = Table[BloomWordsIndex];
+  uint32_t BloomShift = Table[BloomShiftIndex];
+  uint32_t Word = Table[HeaderSize + ((H / 32) & (BloomWords - 1))];
+  uint32_t Mask = (1u << (H % 32)) | (1u << ((H >> BloomShift) % 32));
+  return (Word & Mask) == Mask;
+}
+
+/// Builds the table for the exports Names into Table.
+inline void build(ArrayRef<StringRef> Names, std::vector<uint32_t> &Table) {
+  uint32_t NumExports = Names.size();
+  uint32_t NBuckets = std::max<uint32_t>(1, NumExports / 2);
+  uint32_t BloomWords =
+      NextPowerOf2(std::max<uint32_t>(1, NumExports / 4) - 1);
+  uint32_t BloomShift = 5;
+
+  Table.assign(HeaderSize + BloomWords + NBuckets + 2 * NumExports, 0);
+  Table[NBucketsIndex] = NBuckets;
+  Table[BloomWordsIndex] = BloomWords;
+  Table[BloomShiftIndex] = BloomShift;
+  uint32_t *Bloom = &Table[HeaderSize];
+  uint32_t *Buckets = Bloom + BloomWords;
+  uint32_t *Chain = Buckets + NBuckets;
+  uint32_t *Order = Chain + NumExports;
+
+  // Group the exports by bucket, keeping their order within a bucket.
+  std::vector<uint32_t> Hashes(NumExports);
+  std::vector<std::pair<uint32_t, uint32_t> > Entries(NumExports);
+  for (uint32_t i = 0; i < NumExports; ++i) {
+    uint32_t H = hash(Names[i].data(), Names[i].size());
+    Bloom[(H / 32) & (BloomWords - 1)] |=
+        (1u << (H % 32)) | (1u << ((H >> BloomShift) % 32));
+    Hashes[i] = H;
+    Entries[i] = std::make_pair(H % NBuckets, i);
+  }
+  std::sort(Entries.begin(), Entries.end());
+
+  for (uint32_t b = 0; b < NBuckets; ++b)
+    Buckets[b] = NumExports;
+  for (uint32_t Pos = 0; Pos < NumExports; ++Pos) {
+    uint32_t Bucket = Entries[Pos].first;
+    uint32_t Index = Entries[Pos].second;
+    if (Buckets[Bucket] == NumExports)
+      Buckets[Bucket] = Pos;
+    bool Last = Pos + 1 == NumExports || Entries[Pos + 1].first != Bucket;
+    Chain[Pos] = (Hashes[Index] & ~1u) | (Last ? 1u : 0u);
+    Order[Pos] = Index;
+  }
+}
+
+/// Looks up Name in Table. GetName(i) returns the NUL-terminated name of
+/// export i. Returns the index of the export, or NumExports if not found.
+template <typename NameFn>
+uint32_t lookup(const uint32_t *Table, uint32_t NumExports, const char *Name,
+                NameFn GetName) {
+  uint32_t H = hash(Name, strlen(Name));
+  if (!bloomMayContain(Table, H))
+    return NumExports;
+  uint32_t NBuckets = Table[NBucketsIndex];
+  const uint32_t *Buckets = Table + HeaderSize + Table[BloomWordsIndex];
+  const uint32_t *Chain = Buckets + NBuckets;
+  const uint32_t *Order = Chain + NumExports;
+  for (uint32_t i = Buckets[H % NBuckets]; i < NumExports; ++i) {
+    if ((Chain[i] | 1) == (H | 1) && strcmp(GetName(Order[i]), Name) == 0)
+      return Order[i];
+    if (Chain[i] & 1)
+      break;
+  }
+  return NumExports;
+}
+
+} // end namespace PsoExportHash
+} // end namespace llvm
+
+#endif
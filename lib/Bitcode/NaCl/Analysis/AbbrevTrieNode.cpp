@@ -10,6 +10,7 @@
 
 #include "llvm/Bitcode/NaCl/AbbrevTrieNode.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeValueDist.h"
+#include <algorithm>
 
 using namespace llvm;
 
@@ -293,3 +294,100 @@ void llvm::NaClBuildAbbrevLookupMap(
     AddAbbrevPairToLookupMap(LookupMap, Pair);
   }
 }
+
+const uint32_t AbbrevLookupTable::NoNode;
+
+void AbbrevLookupTable::Build(const AbbrevLookupSizeMap &LookupMap) {
+  Nodes.clear();
+  Groups.clear();
+  Edges.clear();
+  Abbreviations.clear();
+  Roots.clear();
+  for (AbbrevLookupSizeMap::const_iterator
+           Iter = LookupMap.begin(), IterEnd = LookupMap.end();
+       Iter != IterEnd; ++Iter) {
+    if (Iter->second == 0) continue;
+    if (Roots.size() <= Iter->first)
+      Roots.resize(Iter->first + 1, NoNode);
+    Roots[Iter->first] = AddNode(Iter->second);
+  }
+}
+
+uint32_t AbbrevLookupTable::AddNode(const AbbrevTrieNode *TrieNode) {
+  uint32_t NodeIndex = Nodes.size();
+  Nodes.push_back(Node());
+  const std::set<AbbrevIndexPair> &TrieAbbrevs =
+      TrieNode->GetAbbreviations();
+  Nodes[NodeIndex].FirstAbbrev = Abbreviations.size();
+  Nodes[NodeIndex].NumAbbrevs = TrieAbbrevs.size();
+  Abbreviations.insert(Abbreviations.end(),
+                       TrieAbbrevs.begin(), TrieAbbrevs.end());
+
+  // The labels are sorted by index, and then by value. Reserve the
+  // groups and edges of this node before adding the successors, so
+  // that they are contiguous.
+  AbbrevTrieNode::SuccessorLabels Labels;
+  TrieNode->GetSuccessorLabels(Labels);
+  uint32_t FirstGroup = Groups.size();
+  uint32_t FirstEdge = Edges.size();
+  for (size_t i = 0, e = Labels.size(); i != e; ++i) {
+    if (i == 0 || Labels[i].first != Labels[i-1].first) {
+      EdgeGroup Group;
+      Group.Index = Labels[i].first;
+      Group.FirstEdge = FirstEdge + i;
+      Group.NumEdges = 0;
+      Groups.push_back(Group);
+    }
+    ++Groups.back().NumEdges;
+    Edge NewEdge;
+    NewEdge.Value = Labels[i].second;
+    NewEdge.Node = NoNode;
+    Edges.push_back(NewEdge);
+  }
+  Nodes[NodeIndex].FirstGroup = FirstGroup;
+  Nodes[NodeIndex].NumGroups = Groups.size() - FirstGroup;
+
+  for (size_t i = 0, e = Labels.size(); i != e; ++i) {
+    if (const AbbrevTrieNode *Successor =
+        TrieNode->GetSuccessor(Labels[i].first, Labels[i].second)) {
+      uint32_t SuccessorIndex = AddNode(Successor);
+      Edges[FirstEdge + i].Node = SuccessorIndex;
+    }
+  }
+  return NodeIndex;
+}
+
+ArrayRef<AbbrevIndexPair> AbbrevLookupTable::
+MatchRecord(const NaClBitcodeRecordData &Record) const {
+  size_t Size = Record.Values.size() + 1;
+  if (Size > NaClValueIndexCutoff) Size = NaClValueIndexCutoff + 1;
+  if (Size >= Roots.size() || Roots[Size] == NoNode)
+    return ArrayRef<AbbrevIndexPair>();
+
+  // Follows the same edges as AbbrevTrieNode::MatchRecord.
+  const Node *Current = &Nodes[Roots[Size]];
+  bool Refined = true;
+  while (Refined) {
+    Refined = false;
+    for (const EdgeGroup *Group = Groups.data() + Current->FirstGroup,
+             *GroupEnd = Group + Current->NumGroups;
+         Group != GroupEnd; ++Group) {
+      if (Group->Index > Record.Values.size())
+        break;
+      uint64_t Value = Group->Index == 0
+          ? Record.Code : Record.Values[Group->Index - 1];
+      const Edge *First = Edges.data() + Group->FirstEdge;
+      const Edge *Last = First + Group->NumEdges;
+      const Edge *Pos = std::lower_bound(
+          First, Last, Value,
+          [](const Edge &E, uint64_t Value) { return E.Value < Value; });
+      if (Pos != Last && Pos->Value == Value && Pos->Node != NoNode) {
+        Current = &Nodes[Pos->Node];
+        Refined = true;
+        break;
+      }
+    }
+  }
+  return ArrayRef<AbbrevIndexPair>(Abbreviations)
+      .slice(Current->FirstAbbrev, Current->NumAbbrevs);
+}
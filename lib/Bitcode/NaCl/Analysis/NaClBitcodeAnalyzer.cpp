@@ -18,6 +18,8 @@
 #include "llvm/Bitcode/NaCl/NaClBitstreamReader.h"
 #include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
 #include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
+#include "llvm/Bitcode/NaCl/NaClWindowedStreamingMemoryObject.h"
+#include "llvm/Support/DataStream.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/Format.h"
 #include "llvm/Support/MemoryBuffer.h"
@@ -398,28 +400,21 @@ static void PrintSize(uint64_t Bits, raw_ostream &OS) {
                (double)Bits/8, (unsigned long)(Bits/32));
 }
 
-int AnalyzeBitcodeInBuffer(const std::unique_ptr<MemoryBuffer> &Buf,
-                           raw_ostream &OS,
-                           const AnalysisDumpOptions &DumpOptions) {
-  DEBUG(dbgs() << "-> AnalyzeBitcodeInBuffer\n");
-
-  if (Buf->getBufferSize() & 3)
-    return Error("Bitcode stream should be a multiple of 4 bytes in length");
-
-  const unsigned char *BufPtr = (const unsigned char *)Buf->getBufferStart();
-  const unsigned char *EndBufPtr = BufPtr + Buf->getBufferSize();
-
-  NaClBitcodeHeader Header;
-  if (Header.Read(BufPtr, EndBufPtr))
-    return Error("Invalid PNaCl bitcode header");
-
+// Checks the header of the bitcode read by StreamFile, prints its
+// fields, and parses the rest. Prints a summary of the file using
+// NumBytes, which returns the size of the file once parsed.
+template <typename SizeFn>
+static int AnalyzeBitcode(NaClBitcodeHeader &Header,
+                          NaClBitstreamReader &StreamFile,
+                          raw_ostream &OS,
+                          const AnalysisDumpOptions &DumpOptions,
+                          SizeFn NumBytes) {
   if (!Header.IsSupported())
     errs() << "Warning: " << Header.Unsupported() << "\n";
 
   if (!Header.IsReadable())
     Error("Bitcode file is not readable");
 
-  NaClBitstreamReader StreamFile(BufPtr, EndBufPtr, Header);
   NaClBitstreamCursor Stream(StreamFile);
 
   unsigned NumTopBlocks = 0;
@@ -441,7 +436,7 @@ int AnalyzeBitcodeInBuffer(const std::unique_ptr<MemoryBuffer> &Buf,
 
   if (DumpOptions.DumpRecords) return 0;
 
-  uint64_t BufferSizeBits = (EndBufPtr-BufPtr)*CHAR_BIT;
+  uint64_t BufferSizeBits = NumBytes()*CHAR_BIT;
   // Print a summary
   OS << "Total size: ";
   PrintSize(BufferSizeBits, OS);
@@ -455,8 +450,64 @@ int AnalyzeBitcodeInBuffer(const std::unique_ptr<MemoryBuffer> &Buf,
   return 0;
 }
 
+int AnalyzeBitcodeInBuffer(const std::unique_ptr<MemoryBuffer> &Buf,
+                           raw_ostream &OS,
+                           const AnalysisDumpOptions &DumpOptions) {
+  DEBUG(dbgs() << "-> AnalyzeBitcodeInBuffer\n");
+
+  if (Buf->getBufferSize() & 3)
+    return Error("Bitcode stream should be a multiple of 4 bytes in length");
+
+  const unsigned char *BufPtr = (const unsigned char *)Buf->getBufferStart();
+  const unsigned char *EndBufPtr = BufPtr + Buf->getBufferSize();
+
+  NaClBitcodeHeader Header;
+  if (Header.Read(BufPtr, EndBufPtr))
+    return Error("Invalid PNaCl bitcode header");
+
+  NaClBitstreamReader StreamFile(BufPtr, EndBufPtr, Header);
+  return AnalyzeBitcode(Header, StreamFile, OS, DumpOptions,
+                        [&]() { return EndBufPtr - BufPtr; });
+}
+
+// Runs the analysis on the file, reading it as a stream. The size of
+// the file is only known, and checked, at the end of the stream.
+static int AnalyzeBitcodeInStream(const StringRef &InputFilename,
+                                  raw_ostream &OS,
+                                  const AnalysisDumpOptions &DumpOptions) {
+  DEBUG(dbgs() << "-> AnalyzeBitcodeInStream\n");
+
+  std::string StrError;
+  DataStreamer *Streamer = getDataFileStreamer(InputFilename, &StrError);
+  if (Streamer == nullptr) {
+    // Note: StrError ends with a newline.
+    errs() << StrError;
+    return 1;
+  }
+  NaClWindowedStreamingMemoryObject *Bytes =
+      new NaClWindowedStreamingMemoryObject(Streamer);
+
+  NaClBitcodeHeader Header;
+  if (Header.Read(Bytes)) {
+    delete Bytes;
+    return Error("Invalid PNaCl bitcode header");
+  }
+
+  // Note: The reader takes ownership of Bytes.
+  NaClBitstreamReader StreamFile(Bytes, Header);
+  if (int Result = AnalyzeBitcode(Header, StreamFile, OS, DumpOptions,
+                                  [&]() { return Bytes->getNumBytesRead(); }))
+    return Result;
+  if (Bytes->getNumBytesRead() & 3)
+    return Error("Bitcode stream should be a multiple of 4 bytes in length");
+  return 0;
+}
+
 int AnalyzeBitcodeInFile(const StringRef &InputFilename, raw_ostream &OS,
                          const AnalysisDumpOptions &DumpOptions) {
+  if (DumpOptions.Streaming)
+    return AnalyzeBitcodeInStream(InputFilename, OS, DumpOptions);
+
   ErrorOr<std::unique_ptr<MemoryBuffer>> ErrOrFile =
       MemoryBuffer::getFileOrSTDIN(InputFilename);
   if (std::error_code EC = ErrOrFile.getError())
@@ -24,6 +24,13 @@ AddRecord(const NaClBitcodeRecord &Record) {
   }
 }
 
+void NaClBitcodeBitsAndAbbrevsDistElement::
+Merge(const NaClBitcodeDistElement &Element) {
+  NaClBitcodeBitsDistElement::Merge(Element);
+  NumAbbrevs +=
+      cast<NaClBitcodeBitsAndAbbrevsDistElement>(Element).NumAbbrevs;
+}
+
 void NaClBitcodeBitsAndAbbrevsDistElement::
 PrintStatsHeader(raw_ostream &Stream) const {
   NaClBitcodeBitsDistElement::PrintStatsHeader(Stream);
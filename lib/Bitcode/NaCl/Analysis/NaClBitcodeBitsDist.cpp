@@ -25,6 +25,16 @@ void NaClBitcodeBitsDistElement::AddBlock(const NaClBitcodeBlock &Block) {
   TotalBits += Block.GetLocalNumBits();
 }
 
+void NaClBitcodeBitsDistElement::
+Merge(const NaClBitcodeDistElement &Element) {
+  NaClBitcodeDistElement::Merge(Element);
+  // Note: Block distribution elements are bits distribution elements
+  // whose kind is outside RDE_BitsDist, so cast<> can't be used. The
+  // kinds are the same (see NaClBitcodeDistElement::Merge).
+  TotalBits += static_cast<const NaClBitcodeBitsDistElement &>(Element)
+      .TotalBits;
+}
+
 void NaClBitcodeBitsDistElement::PrintStatsHeader(raw_ostream &Stream) const {
   NaClBitcodeDistElement::PrintStatsHeader(Stream);
   Stream << "    # Bits    Bits/Elmt";
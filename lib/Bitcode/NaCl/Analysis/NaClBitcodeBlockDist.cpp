@@ -36,6 +36,7 @@ static const char *GetBlockName(unsigned BlockID) {
   case naclbitc::METADATA_ATTACHMENT_ID:   return "METADATA_ATTACHMENT_BLOCK";
   case naclbitc::USELIST_BLOCK_ID:         return "USELIST_BLOCK_ID";
   case naclbitc::GLOBALVAR_BLOCK_ID:       return "GLOBALVAR_BLOCK";
+  case naclbitc::FUNCTION_INDEX_BLOCK_ID:  return "FUNCTION_INDEX_BLOCK";
   }
 }
 
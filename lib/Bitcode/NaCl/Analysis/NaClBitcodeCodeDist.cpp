@@ -169,6 +169,11 @@ static const char *GetCodeName(unsigned CodeID, unsigned BlockID) {
     case naclbitc::GLOBALVAR_RELOC:      return "RELOC";
     case naclbitc::GLOBALVAR_COUNT:      return "COUNT";
     }
+  case naclbitc::FUNCTION_INDEX_BLOCK_ID:
+    switch (CodeID) {
+    default: return 0;
+    case naclbitc::FUNCTION_INDEX_ENTRY: return "ENTRY";
+    }
   }
 }
 
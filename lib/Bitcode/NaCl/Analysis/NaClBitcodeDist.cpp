@@ -58,6 +58,16 @@ void NaClBitcodeDist::AddBlock(const NaClBitcodeBlock &Block) {
   Element->AddBlock(Block);
 }
 
+void NaClBitcodeDist::Merge(const NaClBitcodeDist &Dist) {
+  assert(StorageKind == Dist.StorageKind);
+  RemoveCachedDistribution();
+  Total += Dist.Total;
+  for (const_iterator Iter = Dist.begin(), IterEnd = Dist.end();
+       Iter != IterEnd; ++Iter) {
+    GetElement(Iter->first)->Merge(*Iter->second);
+  }
+}
+
 void NaClBitcodeDist::Print(raw_ostream &Stream,
                             const std::string &Indent) const {
   const Distribution *Dist = GetDistribution();
@@ -113,6 +123,19 @@ void NaClBitcodeDistElement::AddBlock(const NaClBitcodeBlock &Block) {
   ++NumInstances;
 }
 
+void NaClBitcodeDistElement::Merge(const NaClBitcodeDistElement &Element) {
+  assert(Kind == Element.Kind);
+  NumInstances += Element.NumInstances;
+  const SmallVectorImpl<NaClBitcodeDist*> *Dists = GetNestedDistributions();
+  if (Dists == 0) return;
+  const SmallVectorImpl<NaClBitcodeDist*> *ElementDists =
+      Element.GetNestedDistributions();
+  assert(ElementDists && Dists->size() == ElementDists->size());
+  for (size_t I = 0, E = Dists->size(); I < E; ++I) {
+    (*Dists)[I]->Merge(*(*ElementDists)[I]);
+  }
+}
+
 void NaClBitcodeDistElement::GetValueList(const NaClBitcodeRecord &Record,
                                           ValueListType &ValueList) const {
   // By default, assume no record values are defined.
@@ -148,8 +171,8 @@ PrintHeader(raw_ostream &Stream) const {
 void NaClBitcodeDistElement::
 PrintRowStats(raw_ostream &Stream,
               const NaClBitcodeDist *Distribution) const {
-  unsigned Count = GetNumInstances();
-  Stream << format("%8d %6.2f",
+  uint64_t Count = GetNumInstances();
+  Stream << format("%8" PRIu64 " %6.2f",
                    Count,
                    (double) Count/Distribution->GetTotal()*100.0);
 }
@@ -31,6 +31,22 @@
 // figures out that leaving the record unabbreviated is best) and
 // writes the record out accordingly.
 //
+// With more than one thread (see CompressFlags::NumThreads), each pass
+// skips the function blocks of the module block, and parses each run
+// of consecutive function blocks on several threads, once the run
+// ends. The analysis collects a distribution map per thread, and
+// merges them. The copy writes the function blocks with a writer per
+// thread, and adds them to the module block in order. The result is
+// the same as with one thread.
+//
+// With CompressFlags::SynthesizeAbbreviations, an extra pass between
+// the two proposes an abbreviation for each record code and size,
+// choosing literal, fixed, VBR and array operands from the value
+// distributions of the analysis. The records are then read again to
+// measure the bits each proposal saves over the abbreviations already
+// found, and proposals that save more than they cost to define and
+// select are added.
+//
 // TODO(kschimpf): The current implementation does a trivial solution
 // for the first round.  It just converts all abbreviations (local and
 // global) into global abbreviations.  Future refinements of this file
@@ -47,7 +63,17 @@
 #include "llvm/Bitcode/NaCl/NaClBitcodeHeader.h"
 #include "llvm/Bitcode/NaCl/NaClBitstreamWriter.h"
 #include "llvm/Bitcode/NaCl/NaClCompressBlockDist.h"
+#include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
 #include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/Format.h"
+
+#include <limits>
+#include <tuple>
+
+#if LLVM_ENABLE_THREADS
+#include <thread>
+#endif
 
 namespace {
 
@@ -224,12 +250,20 @@ public:
   }
 
   // Builds the corresponding fast lookup map for finding abbreviations
-  // that applies to abbreviations in the block
+  // that applies to abbreviations in the block. Replaces the map
+  // built by a previous call, if any.
   void buildAbbrevLookupSizeMap(
       const NaClBitcodeCompressor::CompressFlags &Flags) {
+    for (AbbrevLookupSizeMap::const_iterator
+             Iter = LookupMap.begin(), IterEnd = LookupMap.end();
+         Iter != IterEnd; ++Iter) {
+      delete Iter->second;
+    }
+    LookupMap.clear();
     NaClBuildAbbrevLookupMap(getLookupMap(),
                              getAbbrevs(),
                              getFirstApplicationAbbreviation());
+    LookupTable.Build(getLookupMap());
     if (Flags.ShowAbbrevLookupTries) printLookupMap(errs());
   }
 
@@ -248,40 +282,36 @@ public:
 
   // Returns the abbreviation (index) to use for the corresponding
   // record, based on the abbreviations of this block.  Note: Assumes
-  // that buildAbbrevLookupSizeMap has already been called.
-  unsigned getRecordAbbrevIndex(const NaClBitcodeRecordData &Record) {
+  // that buildAbbrevLookupSizeMap has already been called. Only reads
+  // the block abbreviations, so it can be called by several threads.
+  unsigned getRecordAbbrevIndex(const NaClBitcodeRecordData &Record) const {
+    uint64_t NumBits;
+    return getRecordAbbrevIndex(Record, NumBits);
+  }
+
+  // Same as above, but also sets NumBits to the number of bits the
+  // record takes with the returned abbreviation (index).
+  unsigned getRecordAbbrevIndex(const NaClBitcodeRecordData &Record,
+                                uint64_t &NumBits) const {
     unsigned BestIndex = 0; // Ignored unless found candidate.
     unsigned BestScore = 0; // Number of bits associated with BestIndex.
     bool FoundCandidate = false;
     NaClBitcodeValues Values(Record);
-    size_t Size = Values.size();
-
-    if (Size > NaClValueIndexCutoff) Size = NaClValueIndexCutoff+1;
-    AbbrevLookupSizeMap::const_iterator Pos = LookupMap.find(Size);
-    if (Pos != LookupMap.end()) {
-      if (const AbbrevTrieNode *Node = Pos->second) {
-        if (const AbbrevTrieNode *MatchNode =
-            Node->MatchRecord(Record)) {
-          const std::set<AbbrevIndexPair> &Abbreviations =
-              MatchNode->GetAbbreviations();
-          for (std::set<AbbrevIndexPair>::const_iterator
-                   Iter = Abbreviations.begin(),
-                   IterEnd = Abbreviations.end();
-               Iter != IterEnd; ++Iter) {
-            uint64_t NumBits = 0;
-            if (canUseAbbreviation(Values, Iter->second, NumBits)) {
-              if (!FoundCandidate || NumBits < BestScore) {
-                // Use this as candidate.
-                BestIndex = Iter->first;
-                BestScore = NumBits;
-                FoundCandidate = true;
-              }
-            }
-          }
+
+    for (const AbbrevIndexPair &Pair : LookupTable.MatchRecord(Record)) {
+      uint64_t AbbrevBits = 0;
+      if (canUseAbbreviation(Values, Pair.second, AbbrevBits)) {
+        if (!FoundCandidate || AbbrevBits < BestScore) {
+          // Use this as candidate.
+          BestIndex = Pair.first;
+          BestScore = AbbrevBits;
+          FoundCandidate = true;
         }
       }
     }
-    if (FoundCandidate && BestScore <= unabbreviatedSize(Record)) {
+    NumBits = unabbreviatedSize(Record);
+    if (FoundCandidate && BestScore <= NumBits) {
+      NumBits = BestScore;
       return BestIndex;
     }
     return naclbitc::UNABBREV_RECORD;
@@ -403,7 +433,7 @@ public:
     while (1) {
       // values emitted Width-1 bits at a time (plus a continue bit).
       NumBits += Width;
-      if ((Val & (1U << (Width-1))) == 0)
+      if ((Val >> (Width-1)) == 0)
         return NumBits;
       Val >>= Width-1;
     }
@@ -424,6 +454,8 @@ private:
   // A fast lookup map for finding the abbreviation that applies
   // to a record.
   AbbrevLookupSizeMap LookupMap;
+  // The flat copy of LookupMap used to match records.
+  AbbrevLookupTable LookupTable;
 
   void printLookupMap(raw_ostream &Stream) const {
     Stream << "------------------------------\n";
@@ -461,6 +493,142 @@ static BlockAbbrevs *getAbbrevs(BlockAbbrevsMapType &AbbrevsMap,
   return Abbrevs;
 }
 
+/// Gets the block abbreviations for a block ID, which must already be
+/// in AbbrevsMap. Unlike getAbbrevs, AbbrevsMap is only read, so
+/// worker threads can share it.
+static BlockAbbrevs *findAbbrevs(const BlockAbbrevsMapType &AbbrevsMap,
+                                 unsigned BlockID) {
+  BlockAbbrevsMapType::const_iterator Pos = AbbrevsMap.find(BlockID);
+  assert(Pos != AbbrevsMap.end() && Pos->second &&
+         "No abbreviations for block");
+  return Pos->second;
+}
+
+/// The position of a function block within the module block.
+struct FunctionBlockPos {
+  FunctionBlockPos(uint64_t StartBit, uint64_t BodyBit)
+      : StartBit(StartBit), BodyBit(BodyBit) {}
+  // The first bit of the (begin) block record of the function block.
+  uint64_t StartBit;
+  // The bit following the block ID in the (begin) block record.
+  uint64_t BodyBit;
+};
+
+/// Collects a run of consecutive function blocks of the module block,
+/// which the module block parser skips, and parses them on several
+/// threads, before the parser handles anything that follows the run.
+class FunctionBlockBatch {
+  FunctionBlockBatch(const FunctionBlockBatch &) = delete;
+  void operator=(const FunctionBlockBatch &) = delete;
+
+public:
+  /// Creates a batch of function blocks of the bitcode in [BufPtr,
+  /// EndBufPtr), which starts with Header, to be parsed on NumThreads
+  /// threads.
+  FunctionBlockBatch(NaClBitcodeHeader &Header, const unsigned char *BufPtr,
+                     const unsigned char *EndBufPtr, unsigned NumThreads)
+      : Header(Header), BufPtr(BufPtr), EndBufPtr(EndBufPtr),
+        NumThreads(NumThreads) {}
+
+  unsigned getNumThreads() const { return NumThreads; }
+
+  bool empty() const { return Blocks.empty(); }
+
+  /// Returns the function blocks in the batch, in bitcode order.
+  const std::vector<FunctionBlockPos> &getBlocks() const { return Blocks; }
+
+  /// Adds the function block at the given position to the batch.
+  void add(uint64_t StartBit, uint64_t BodyBit) {
+    Blocks.push_back(FunctionBlockPos(StartBit, BodyBit));
+  }
+
+  void clear() { Blocks.clear(); }
+
+  /// Calls ParseFcn(Thread, Cursor, Blocks) on each thread, to parse
+  /// the consecutive slice Blocks of the batch with Cursor. Each
+  /// thread has its own reader, with a copy of the blockinfo
+  /// abbreviations of BlockInfoSource. Returns true if any call
+  /// returns true.
+  template <typename ParseFcnType>
+  bool parse(const NaClBitstreamReader &BlockInfoSource,
+             ParseFcnType ParseFcn);
+
+private:
+  NaClBitcodeHeader &Header;
+  const unsigned char *BufPtr;
+  const unsigned char *EndBufPtr;
+  unsigned NumThreads;
+  std::vector<FunctionBlockPos> Blocks;
+};
+
+template <typename ParseFcnType>
+bool FunctionBlockBatch::parse(const NaClBitstreamReader &BlockInfoSource,
+                               ParseFcnType ParseFcn) {
+  // Not a std::vector<bool>, which threads can't write to concurrently.
+  std::vector<char> Failed(NumThreads, false);
+  auto ParseSlice = [&](unsigned Thread) {
+    // Abbreviations are reference counted without locking, so each
+    // reader gets its own copies.
+    NaClBitstreamReader Reader(BufPtr, EndBufPtr, Header);
+    for (const NaClBitstreamReader::BlockInfo &Info :
+         BlockInfoSource.getBlockInfoRecords()) {
+      NaClBitstreamReader::BlockInfo &Copy =
+          Reader.getOrCreateBlockInfo(Info.BlockID);
+      for (const NaClBitCodeAbbrev *Abbrev : Info.Abbrevs)
+        Copy.Abbrevs.push_back(Abbrev->Copy());
+    }
+    NaClBitstreamCursor Cursor(Reader);
+    size_t Begin = Blocks.size() * Thread / NumThreads;
+    size_t End = Blocks.size() * (Thread + 1) / NumThreads;
+    Failed[Thread] = ParseFcn(
+        Thread, Cursor,
+        ArrayRef<FunctionBlockPos>(Blocks).slice(Begin, End - Begin));
+  };
+#if LLVM_ENABLE_THREADS
+  // The calling thread parses the first slice.
+  std::vector<std::thread> Threads;
+  for (unsigned Thread = 1; Thread < NumThreads; ++Thread)
+    Threads.emplace_back(ParseSlice, Thread);
+  ParseSlice(0);
+  for (std::thread &Thread : Threads)
+    Thread.join();
+#else
+  // The slices are parsed in turn, which gives the same result.
+  for (unsigned Thread = 0; Thread < NumThreads; ++Thread)
+    ParseSlice(Thread);
+#endif
+  return std::find(Failed.begin(), Failed.end(), true) != Failed.end();
+}
+
+/// The state of a thread analyzing function blocks. The (global)
+/// block abbreviations are shared, and only read. Blocks that don't
+/// have abbreviations yet get new (empty) ones here, which are added
+/// to the shared map, in the same order, once the thread is done.
+struct AnalyzeWorkerState {
+  AnalyzeWorkerState()
+      : BlockDist(&NaClCompressBlockDistElement::Sentinel),
+        DefinesAbbrevs(false) {}
+
+  ~AnalyzeWorkerState() {
+    DeleteContainerSeconds(NewAbbrevsMap);
+  }
+
+  // Distribution of records in the function blocks analyzed.
+  NaClBitcodeBlockDist BlockDist;
+
+  // Abbreviations of blocks not in the shared map.
+  BlockAbbrevsMapType NewAbbrevsMap;
+
+  // The IDs of the blocks in NewAbbrevsMap, in the order found.
+  std::vector<unsigned> NewBlockIDs;
+
+  // True if a function block defined abbreviations, which must be
+  // added to the shared map in bitcode order. The results are then
+  // not used, and the function blocks are analyzed again on one
+  // thread.
+  bool DefinesAbbrevs;
+};
+
 /// Parses the bitcode file, analyzes it, and generates the
 /// corresponding lists of global abbreviations to use in the
 /// generated (compressed) bitcode file.
@@ -470,15 +638,22 @@ class NaClAnalyzeParser : public NaClBitcodeParser {
 
 public:
   // Creates the analysis parser, which will fill the given
-  // BlockAbbrevsMap with appropriate abbreviations, after
-  // analyzing the bitcode file defined by Cursor.
+  // BlockAbbrevsMap with appropriate abbreviations, and BlockDist
+  // with the distribution of records, after analyzing the bitcode
+  // file defined by Cursor. If Batch is non-null, function blocks
+  // of the module block are analyzed in batches. If Worker is
+  // non-null, the parser analyzes function blocks on a worker
+  // thread.
   NaClAnalyzeParser(const NaClBitcodeCompressor::CompressFlags &Flags,
                     NaClBitstreamCursor &Cursor,
-                    BlockAbbrevsMapType &BlockAbbrevsMap)
+                    BlockAbbrevsMapType &BlockAbbrevsMap,
+                    NaClBitcodeBlockDist &BlockDist,
+                    FunctionBlockBatch *Batch = nullptr,
+                    AnalyzeWorkerState *Worker = nullptr)
       : NaClBitcodeParser(Cursor), Flags(Flags),
-        BlockAbbrevsMap(BlockAbbrevsMap),
-        BlockDist(&NaClCompressBlockDistElement::Sentinel),
-        AbbrevListener(this)
+        BlockAbbrevsMap(BlockAbbrevsMap), BlockDist(BlockDist),
+        Batch(Batch), Worker(Worker), BatchFailed(false),
+        FunctionsDefineAbbrevs(false), AbbrevListener(this)
   {
     SetListener(&AbbrevListener);
   }
@@ -487,6 +662,25 @@ public:
 
   virtual bool ParseBlock(unsigned BlockID);
 
+  /// Returns the set of (global) block abbreviations defined for the
+  /// given block ID.
+  BlockAbbrevs *getBlockAbbrevs(unsigned BlockID) {
+    if (Worker == nullptr)
+      return getAbbrevs(BlockAbbrevsMap, BlockID);
+    BlockAbbrevsMapType::const_iterator Pos = BlockAbbrevsMap.find(BlockID);
+    if (Pos != BlockAbbrevsMap.end() && Pos->second)
+      return Pos->second;
+    BlockAbbrevs *&Abbrevs = Worker->NewAbbrevsMap[BlockID];
+    if (Abbrevs == nullptr) {
+      Abbrevs = new BlockAbbrevs(BlockID);
+      Worker->NewBlockIDs.push_back(BlockID);
+    }
+    return Abbrevs;
+  }
+
+  /// Analyzes the function blocks collected in Batch, if any.
+  void analyzeFunctionBlocks();
+
   const NaClBitcodeCompressor::CompressFlags &Flags;
 
   // Mapping from block ID's to the corresponding list of abbreviations
@@ -494,7 +688,20 @@ public:
   BlockAbbrevsMapType &BlockAbbrevsMap;
 
   // Nested distribution capturing distribution of records in bitcode file.
-  NaClBitcodeBlockDist BlockDist;
+  NaClBitcodeBlockDist &BlockDist;
+
+  // The function blocks to analyze in parallel, if any.
+  FunctionBlockBatch *Batch;
+
+  // The state of the worker thread, if any.
+  AnalyzeWorkerState *Worker;
+
+  // True if unable to parse the function blocks of a batch.
+  bool BatchFailed;
+
+  // True if function blocks define abbreviations, and hence must be
+  // parsed in order, on one thread.
+  bool FunctionsDefineAbbrevs;
 
   // Listener used to get abbreviations as they are read.
   NaClBitcodeParserListener AbbrevListener;
@@ -530,11 +737,27 @@ protected:
 
 public:
   virtual bool ParseBlock(unsigned BlockID) {
+    if (Context->Batch && GetBlockID() == naclbitc::MODULE_BLOCK_ID) {
+      if (BlockID == naclbitc::FUNCTION_BLOCK_ID) {
+        Context->Batch->add(Record.GetStartBit(),
+                            Record.GetCursor().GetCurrentBitNo());
+        return SkipNestedBlock();
+      }
+      Context->analyzeFunctionBlocks();
+    }
     NaClBlockAnalyzeParser Parser(BlockID, this);
     return Parser.ParseThisBlock();
   }
 
+  virtual void ExitBlock() {
+    analyzeFunctionBlocks();
+  }
+
   virtual void ProcessRecord() {
+    if (Context->Worker && Context->Worker->DefinesAbbrevs)
+      return;
+    analyzeFunctionBlocks();
+
     // Before processing the record, we need to rename the abbreviation
     // index, so that we can look it up in the set of block abbreviations
     // being defined.
@@ -567,6 +790,12 @@ public:
   virtual void ProcessAbbreviation(unsigned BlockID,
                                    NaClBitCodeAbbrev *Abbrev,
                                    bool IsLocal) {
+    if (Context->Worker) {
+      Context->Worker->DefinesAbbrevs = true;
+      return;
+    }
+    analyzeFunctionBlocks();
+
     int Index;
     addAbbreviation(BlockID, Abbrev->Simplify(), Index);
     if (IsLocal) {
@@ -590,7 +819,14 @@ protected:
   /// Returns the set of (global) block abbreviations defined for the
   /// given block ID.
   BlockAbbrevs *getGlobalAbbrevs(unsigned BlockID) {
-    return getAbbrevs(Context->BlockAbbrevsMap, BlockID);
+    return Context->getBlockAbbrevs(BlockID);
+  }
+
+  // Analyzes the function blocks that precede the next entry of the
+  // module block, if skipped.
+  void analyzeFunctionBlocks() {
+    if (Context->Batch && GetBlockID() == naclbitc::MODULE_BLOCK_ID)
+      Context->analyzeFunctionBlocks();
   }
 
   // Adds the abbreviation to the list of abbreviations for the given
@@ -626,6 +862,73 @@ bool NaClAnalyzeParser::ParseBlock(unsigned BlockID) {
   return Parser.ParseThisBlock();
 }
 
+// Analyzes the function blocks at Blocks with Cursor, collecting
+// abbreviations in BlockAbbrevsMap, and records in BlockDist. Worker
+// is the state of the worker thread, if any. Returns true if unable
+// to parse.
+static bool analyzeFunctionBlocks(
+    const NaClBitcodeCompressor::CompressFlags &Flags,
+    NaClBitstreamCursor &Cursor, ArrayRef<FunctionBlockPos> Blocks,
+    BlockAbbrevsMapType &BlockAbbrevsMap, NaClBitcodeBlockDist &BlockDist,
+    AnalyzeWorkerState *Worker) {
+  for (const FunctionBlockPos &Pos : Blocks) {
+    if (Worker && Worker->DefinesAbbrevs)
+      break;
+    // The block starts where the parser starts.
+    Cursor.JumpToBit(Pos.StartBit);
+    NaClAnalyzeParser Parser(Flags, Cursor, BlockAbbrevsMap, BlockDist,
+                             nullptr, Worker);
+    Cursor.JumpToBit(Pos.BodyBit);
+    if (Parser.ParseBlock(naclbitc::FUNCTION_BLOCK_ID))
+      return true;
+  }
+  return false;
+}
+
+void NaClAnalyzeParser::analyzeFunctionBlocks() {
+  if (Batch == nullptr || Batch->empty())
+    return;
+  std::vector<std::unique_ptr<AnalyzeWorkerState>> Workers;
+  for (unsigned i = 0; i < Batch->getNumThreads(); ++i)
+    Workers.emplace_back(new AnalyzeWorkerState());
+  if (Batch->parse(Record.GetReader(),
+                   [&](unsigned Thread, NaClBitstreamCursor &Cursor,
+                       ArrayRef<FunctionBlockPos> Blocks) {
+                     AnalyzeWorkerState *Worker = Workers[Thread].get();
+                     return ::analyzeFunctionBlocks(Flags, Cursor, Blocks,
+                                                    BlockAbbrevsMap,
+                                                    Worker->BlockDist, Worker);
+                   })) {
+    BatchFailed = true;
+    Batch->clear();
+    return;
+  }
+
+  bool DefinesAbbrevs = false;
+  for (const std::unique_ptr<AnalyzeWorkerState> &Worker : Workers)
+    DefinesAbbrevs |= Worker->DefinesAbbrevs;
+  if (!DefinesAbbrevs) {
+    for (const std::unique_ptr<AnalyzeWorkerState> &Worker : Workers) {
+      for (unsigned BlockID : Worker->NewBlockIDs)
+        getAbbrevs(BlockAbbrevsMap, BlockID);
+      BlockDist.Merge(Worker->BlockDist);
+    }
+    Batch->clear();
+    return;
+  }
+
+  // Analyze the function blocks again on this thread, which can add
+  // their abbreviations, and parse the remaining function blocks as
+  // they are found.
+  NaClBitstreamCursor Cursor(Record.GetReader());
+  if (::analyzeFunctionBlocks(Flags, Cursor, Batch->getBlocks(),
+                              BlockAbbrevsMap, BlockDist, nullptr))
+    BatchFailed = true;
+  Batch->clear();
+  Batch = nullptr;
+  FunctionsDefineAbbrevs = true;
+}
+
 /// Models the unrolling of an abbreviation into its sequence of
 /// individual operators. That is, unrolling arrays to match the width
 /// of the abbreviation.
@@ -1122,14 +1425,14 @@ static void displayAbbreviationFrequencies(
       NaClBitcodeDist &AbbrevDist = BlockElement->GetAbbrevDist();
       const NaClBitcodeDist::Distribution *AbbrevDistribution =
           AbbrevDist.GetDistribution();
-      unsigned Total = AbbrevDist.GetTotal();
+      uint64_t Total = AbbrevDist.GetTotal();
       for (NaClBitcodeDist::Distribution::const_iterator
                AbbrevIter = AbbrevDistribution->begin(),
                AbbrevIterEnd = AbbrevDistribution->end();
            AbbrevIter != AbbrevIterEnd; ++AbbrevIter) {
         unsigned Index = static_cast<unsigned>(AbbrevIter->second);
-        unsigned Count = AbbrevDist.at(Index)->GetNumInstances();
-        Output << format("%8u (%6.2f%%): ", Count,
+        uint64_t Count = AbbrevDist.at(Index)->GetNumInstances();
+        Output << format("%8" PRIu64 " (%6.2f%%): ", Count,
                          (double) Count/Total*100.0);
         BlockPos->second->getIndexedAbbrev(Index)->Print(Output);
       }
@@ -1138,15 +1441,80 @@ static void displayAbbreviationFrequencies(
   }
 }
 
+/// The distribution of the values at a value index of records, as the
+/// number of values in each value range (see GetNaClValueRange).
+typedef std::map<NaClValueRangeIndexType, uint64_t> ValueRangeCounts;
+
+/// The values of the records of a given block ID, code, and size.
+/// Records with NaClValueIndexCutoff or more values share one size.
+struct RecordShapeValues {
+  RecordShapeValues() : NumInstances(0) {}
+  // The number of records.
+  uint64_t NumInstances;
+  // The distribution of values at each tracked value index.
+  std::vector<ValueRangeCounts> IndexValues;
+};
+
+/// Maps (BlockID, Code, Size) to the values of the corresponding
+/// records.
+typedef std::tuple<unsigned, unsigned, unsigned> RecordShape;
+typedef std::map<RecordShape, RecordShapeValues> RecordShapeMap;
+
+// Collects the values of records in BlockDist into Shapes, over all
+// abbreviations the records were read with.
+static void collectRecordShapes(NaClBitcodeBlockDist &BlockDist,
+                                RecordShapeMap &Shapes) {
+  for (const auto &BlockPair : BlockDist) {
+    unsigned BlockID = static_cast<unsigned>(BlockPair.first);
+    if (BlockID == naclbitc::BLOCKINFO_BLOCK_ID)
+      continue;
+    NaClBitcodeDist &AbbrevDist =
+        cast<NaClCompressBlockDistElement>(BlockPair.second)->GetAbbrevDist();
+    for (const auto &AbbrevPair : AbbrevDist) {
+      NaClBitcodeDist &CodeDist =
+          cast<NaClBitcodeAbbrevDistElement>(AbbrevPair.second)
+          ->GetCodeDist();
+      for (const auto &CodePair : CodeDist) {
+        unsigned Code = static_cast<unsigned>(CodePair.first);
+        NaClBitcodeDist &SizeDist =
+            cast<NaClCompressCodeDistElement>(CodePair.second)->GetSizeDist();
+        for (const auto &SizePair : SizeDist) {
+          unsigned Size = static_cast<unsigned>(SizePair.first);
+          NaClBitcodeSizeDistElement *SizeElmt =
+              cast<NaClBitcodeSizeDistElement>(SizePair.second);
+          RecordShapeValues &Shape =
+              Shapes[std::make_tuple(BlockID, Code, Size)];
+          Shape.NumInstances += SizeElmt->GetNumInstances();
+          for (const auto &IndexPair : SizeElmt->GetValueIndexDist()) {
+            size_t Index = static_cast<size_t>(IndexPair.first);
+            if (Shape.IndexValues.size() <= Index)
+              Shape.IndexValues.resize(Index + 1);
+            ValueRangeCounts &Counts = Shape.IndexValues[Index];
+            for (const auto &ValuePair :
+                 cast<NaClBitcodeValueIndexDistElement>(IndexPair.second)
+                 ->GetValueDist()) {
+              Counts[ValuePair.first] += ValuePair.second->GetNumInstances();
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
 // Read in bitcode, analyze data, and figure out set of abbreviations
 // to use, from memory buffer MemBuf containing the input bitcode file.
 // If ShowAbbreviationFrequencies or Flag.ShowValueDistributions are
-// defined, the corresponding results is printed to Output.
+// defined, the corresponding results is printed to Output. Sets
+// FunctionsDefineAbbrevs if function blocks define abbreviations. If
+// Shapes is non-null, the values of the records are collected into it.
 static bool analyzeBitcode(
     const NaClBitcodeCompressor::CompressFlags &Flags,
     MemoryBuffer *MemBuf,
     raw_ostream &Output,
-    BlockAbbrevsMapType &BlockAbbrevsMap) {
+    BlockAbbrevsMapType &BlockAbbrevsMap,
+    bool &FunctionsDefineAbbrevs,
+    RecordShapeMap *Shapes = nullptr) {
   // TODO(kschimpf): The current code only extracts abbreviations
   // defined in the bitcode file. This code needs to be updated to
   // collect data distributions and figure out better (global)
@@ -1170,17 +1538,26 @@ static bool analyzeBitcode(
   NaClBitstreamCursor Stream(StreamFile);
 
   // Parse the the bitcode file.
-  NaClAnalyzeParser Parser(Flags, Stream, BlockAbbrevsMap);
+  NaClBitcodeBlockDist BlockDist(&NaClCompressBlockDistElement::Sentinel);
+  std::unique_ptr<FunctionBlockBatch> Batch;
+  if (Flags.NumThreads > 1)
+    Batch.reset(
+        new FunctionBlockBatch(Header, BufPtr, EndBufPtr, Flags.NumThreads));
+  NaClAnalyzeParser Parser(Flags, Stream, BlockAbbrevsMap, BlockDist,
+                           Batch.get());
   while (!Stream.AtEndOfStream()) {
-    if (Parser.Parse()) return true;
+    if (Parser.Parse() || Parser.BatchFailed) return true;
   }
+  FunctionsDefineAbbrevs = Parser.FunctionsDefineAbbrevs;
 
   if (Flags.ShowAbbreviationFrequencies)
-    displayAbbreviationFrequencies(Output, Parser.BlockDist, BlockAbbrevsMap);
+    displayAbbreviationFrequencies(Output, BlockDist, BlockAbbrevsMap);
   if (Flags.ShowValueDistributions)
-    Parser.BlockDist.Print(Output);
+    BlockDist.Print(Output);
 
-  addNewAbbreviations(Flags, Parser.BlockDist, BlockAbbrevsMap);
+  addNewAbbreviations(Flags, BlockDist, BlockAbbrevsMap);
+  if (Shapes)
+    collectRecordShapes(BlockDist, *Shapes);
   return false;
 }
 
@@ -1199,18 +1576,33 @@ class SelectedAbbrevsQueue {
   SelectedAbbrevsQueue(const SelectedAbbrevsQueue &) = delete;
   SelectedAbbrevsQueue &operator=(const SelectedAbbrevsQueue &) = delete;
 
+public:
   // The minimum number of times an abbreviation must be used in the
   // compressed version of the bitcode file, if it is going to be used
   // at all.
   static const uint32_t MinUsageCount = 5;
 
-public:
   SelectedAbbrevsQueue() : AbbrevsIndexQueueFront(0) {}
 
   /// Adds the given selected abbreviation index to the end of the
   /// queue.
   void addIndex(unsigned Index) { AbbrevsIndexQueue.push_back(Index); }
 
+  /// Counts a use of the given selected abbreviation index, by a
+  /// record that is not added to the queue. Such records are copied
+  /// using getKeptAbbrevIndex.
+  void countIndex(unsigned Index) {
+    if (Index != naclbitc::UNABBREV_RECORD)
+      ++UsageMap[Index];
+  }
+
+  /// Adds the uses counted by the given queue to this queue.
+  void addCounts(const SelectedAbbrevsQueue &Queue) {
+    assert(Queue.AbbrevsIndexQueue.empty());
+    for (const auto &Pair : Queue.UsageMap)
+      UsageMap[Pair.first] += Pair.second;
+  }
+
   /// Removes the next selected abbreviation index from the
   /// queue.
   unsigned removeIndex() {
@@ -1240,6 +1632,17 @@ public:
     return KeptAbbrevs.size() + naclbitc::DEFAULT_MAX_ABBREV;
   }
 
+  /// Returns the abbreviation index to use for a record, given its
+  /// selected abbreviation index. Should be called after
+  /// installFrequentlyUsedAbbrevs.
+  unsigned getKeptAbbrevIndex(unsigned Index) const {
+    std::map<unsigned, unsigned>::const_iterator Pos =
+        KeepIndexMap.find(Index);
+    return Pos == KeepIndexMap.end()
+               ? static_cast<unsigned>(naclbitc::UNABBREV_RECORD)
+               : Pos->second;
+  }
+
 protected:
   // Defines a queue of abbreviations indices using a
   // vector. AbbrevsIndexQueueFront is used to point to the front of
@@ -1249,21 +1652,23 @@ protected:
   // The list of abbreviations that should be defined for the block,
   // in the order they should be defined.
   std::vector<NaClBitCodeAbbrev *> KeptAbbrevs;
+  // The number of uses of each selected abbreviation index, by records
+  // not on the queue.
+  std::map<unsigned, uint32_t> UsageMap;
+  // Map from selected abbreviation indices to the corresponding kept
+  // abbreviation indices.
+  std::map<unsigned, unsigned> KeepIndexMap;
 };
 
 void SelectedAbbrevsQueue::installFrequentlyUsedAbbrevs(BlockAbbrevs *Abbrevs) {
   // Start by collecting usage counts for each abbreviation.
   assert(AbbrevsIndexQueueFront == 0);
   assert(KeptAbbrevs.empty());
-  std::map<unsigned, uint32_t> UsageMap;
-  for (unsigned Index : AbbrevsIndexQueue) {
-    if (Index != naclbitc::UNABBREV_RECORD)
-      ++UsageMap[Index];
-  }
+  for (unsigned Index : AbbrevsIndexQueue)
+    countIndex(Index);
 
   // Install results
-  std::map<unsigned, unsigned> KeepIndexMap;
-  for (const std::pair<unsigned, uint32_t> &Pair : UsageMap) {
+  for (const auto &Pair : UsageMap) {
     if (Pair.second >= MinUsageCount) {
       KeepIndexMap[Pair.first] =
           KeptAbbrevs.size() + naclbitc::FIRST_APPLICATION_ABBREV;
@@ -1273,12 +1678,8 @@ void SelectedAbbrevsQueue::installFrequentlyUsedAbbrevs(BlockAbbrevs *Abbrevs) {
 
   // Update the queue of selected abbreviation indices to match kept
   // abbreviations.
-  for (unsigned &AbbrevIndex : AbbrevsIndexQueue) {
-    std::map<unsigned, unsigned>::const_iterator NewPos =
-        KeepIndexMap.find(AbbrevIndex);
-    AbbrevIndex = NewPos == KeepIndexMap.end() ? naclbitc::UNABBREV_RECORD
-                                               : NewPos->second;
-  }
+  for (unsigned &AbbrevIndex : AbbrevsIndexQueue)
+    AbbrevIndex = getKeptAbbrevIndex(AbbrevIndex);
 }
 
 /// Models the kept queue of abbreviations associated with each block ID.
@@ -1303,22 +1704,42 @@ installFrequentlyUsedAbbrevs(BlockAbbrevsMapType &AbbrevsMap,
 /// compressed bitcode file.
 class NaClAssignAbbrevsParser : public NaClBitcodeParser {
 public:
+  /// Creates the parser. If Batch is non-null, function blocks of the
+  /// module block are parsed in batches. If CountOnly is true, the
+  /// selected abbreviations are only counted (see
+  /// SelectedAbbrevsQueue::countIndex).
   NaClAssignAbbrevsParser(NaClBitstreamCursor &Cursor,
                           BlockAbbrevsMapType &AbbrevsMap,
-                          BlockAbbrevsQueueMap &AbbrevsQueueMap)
+                          BlockAbbrevsQueueMap &AbbrevsQueueMap,
+                          FunctionBlockBatch *Batch = nullptr,
+                          bool CountOnly = false)
       : NaClBitcodeParser(Cursor), AbbrevsMap(AbbrevsMap),
-        AbbrevsQueueMap(AbbrevsQueueMap) {}
+        AbbrevsQueueMap(AbbrevsQueueMap), Batch(Batch),
+        CountOnly(CountOnly), BatchFailed(false) {}
 
   ~NaClAssignAbbrevsParser() final {}
 
   bool ParseBlock(unsigned BlockID) final;
 
+  /// Chooses abbreviations for the function blocks collected in
+  /// Batch, if any.
+  void chooseFunctionBlockAbbrevs();
+
   /// The abbreviations to use for the compressed bitcode.
   BlockAbbrevsMapType &AbbrevsMap;
 
   /// The corresponding selected abbreviation indices to for each
   /// block.
   BlockAbbrevsQueueMap &AbbrevsQueueMap;
+
+  /// The function blocks to parse in parallel, if any.
+  FunctionBlockBatch *Batch;
+
+  /// True if selected abbreviations are only counted.
+  bool CountOnly;
+
+  /// True if unable to parse the function blocks of a batch.
+  bool BatchFailed;
 };
 
 /// Block parser to queue abbreviation indices used by the records in
@@ -1350,7 +1771,11 @@ protected:
   }
 
   void init() {
-    Abbreviations = getAbbrevs(Context->AbbrevsMap, BlockID);
+    // Worker threads (which only count) share AbbrevsMap, and hence
+    // must not insert into it. Their queues are their own.
+    Abbreviations = Context->CountOnly
+                        ? findAbbrevs(Context->AbbrevsMap, BlockID)
+                        : getAbbrevs(Context->AbbrevsMap, BlockID);
     Queue = Context->AbbrevsQueueMap[BlockID];
     if (Queue == nullptr) {
       Queue = new SelectedAbbrevsQueue();
@@ -1359,14 +1784,38 @@ protected:
   }
 
   bool ParseBlock(unsigned BlockID) final {
+    if (Context->Batch && this->BlockID == naclbitc::MODULE_BLOCK_ID) {
+      if (BlockID == naclbitc::FUNCTION_BLOCK_ID) {
+        Context->Batch->add(Record.GetStartBit(),
+                            Record.GetCursor().GetCurrentBitNo());
+        return SkipBlock();
+      }
+      Context->chooseFunctionBlockAbbrevs();
+    }
     NaClAssignAbbrevsBlockParser Parser(BlockID, this);
     return Parser.ParseThisBlock();
   }
 
+  void ExitBlock() final {
+    chooseFunctionBlockAbbrevs();
+  }
+
   void ProcessRecord() final {
+    chooseFunctionBlockAbbrevs();
     // Find best fitting abbreviation to use, and save.
-    Queue->addIndex(
-        Abbreviations->getRecordAbbrevIndex(Record.GetRecordData()));
+    unsigned Index =
+        Abbreviations->getRecordAbbrevIndex(Record.GetRecordData());
+    if (Context->CountOnly)
+      Queue->countIndex(Index);
+    else
+      Queue->addIndex(Index);
+  }
+
+  // Chooses abbreviations for the function blocks that precede the
+  // next entry of the module block, if skipped.
+  void chooseFunctionBlockAbbrevs() {
+    if (Context->Batch && BlockID == naclbitc::MODULE_BLOCK_ID)
+      Context->chooseFunctionBlockAbbrevs();
   }
 };
 
@@ -1375,11 +1824,58 @@ bool NaClAssignAbbrevsParser::ParseBlock(unsigned BlockID) {
   return Parser.ParseThisBlock();
 }
 
+// Chooses abbreviations for the records of the function blocks at
+// Blocks, which are parsed with Cursor, and adds them to (or, if
+// CountOnly, counts them in) AbbrevsQueueMap. Returns true if unable
+// to parse.
+static bool chooseFunctionBlockAbbrevs(NaClBitstreamCursor &Cursor,
+                                       ArrayRef<FunctionBlockPos> Blocks,
+                                       BlockAbbrevsMapType &AbbrevsMap,
+                                       BlockAbbrevsQueueMap &AbbrevsQueueMap,
+                                       bool CountOnly) {
+  for (const FunctionBlockPos &Pos : Blocks) {
+    Cursor.JumpToBit(Pos.BodyBit);
+    NaClAssignAbbrevsParser Parser(Cursor, AbbrevsMap, AbbrevsQueueMap,
+                                   nullptr, CountOnly);
+    if (Parser.ParseBlock(naclbitc::FUNCTION_BLOCK_ID))
+      return true;
+  }
+  return false;
+}
+
+void NaClAssignAbbrevsParser::chooseFunctionBlockAbbrevs() {
+  if (Batch == nullptr || Batch->empty())
+    return;
+  // The (global) block abbreviations are only read, and each thread
+  // counts the selected abbreviations in its own queues.
+  std::vector<BlockAbbrevsQueueMap> WorkerQueueMaps(Batch->getNumThreads());
+  if (Batch->parse(Record.GetReader(),
+                   [&](unsigned Thread, NaClBitstreamCursor &Cursor,
+                       ArrayRef<FunctionBlockPos> Blocks) {
+                     return ::chooseFunctionBlockAbbrevs(
+                         Cursor, Blocks, AbbrevsMap, WorkerQueueMaps[Thread],
+                         /*CountOnly=*/true);
+                   }))
+    BatchFailed = true;
+  for (BlockAbbrevsQueueMap &WorkerQueueMap : WorkerQueueMaps) {
+    for (const auto &Pair : WorkerQueueMap) {
+      SelectedAbbrevsQueue *&Queue = AbbrevsQueueMap[Pair.first];
+      if (Queue == nullptr)
+        Queue = new SelectedAbbrevsQueue();
+      Queue->addCounts(*Pair.second);
+    }
+    DeleteContainerSeconds(WorkerQueueMap);
+  }
+  Batch->clear();
+}
+
 // Reads the bitcode in MemBuf, using the abbreviations in AbbrevsMap,
 // and queues the selected abbrevations for each record into
-// AbbrevsQueueMap.
+// AbbrevsQueueMap. With more than one thread, the abbreviations
+// selected for records in function blocks are only counted.
 static bool chooseAbbrevs(MemoryBuffer *MemBuf, BlockAbbrevsMapType &AbbrevsMap,
-                          BlockAbbrevsQueueMap &AbbrevsQueueMap) {
+                          BlockAbbrevsQueueMap &AbbrevsQueueMap,
+                          unsigned NumThreads) {
   const unsigned char *BufPtr = (const unsigned char *)MemBuf->getBufferStart();
   const unsigned char *EndBufPtr = BufPtr + MemBuf->getBufferSize();
 
@@ -1394,11 +1890,15 @@ static bool chooseAbbrevs(MemoryBuffer *MemBuf, BlockAbbrevsMapType &AbbrevsMap,
   NaClBitstreamCursor Stream(StreamFile);
 
   // Set up the parser.
-  NaClAssignAbbrevsParser Parser(Stream, AbbrevsMap, AbbrevsQueueMap);
+  std::unique_ptr<FunctionBlockBatch> Batch;
+  if (NumThreads > 1)
+    Batch.reset(new FunctionBlockBatch(Header, BufPtr, EndBufPtr, NumThreads));
+  NaClAssignAbbrevsParser Parser(Stream, AbbrevsMap, AbbrevsQueueMap,
+                                 Batch.get());
 
   // Parse the bitcode and choose abbreviations for records.
   while (!Stream.AtEndOfStream()) {
-    if (Parser.Parse()) {
+    if (Parser.Parse() || Parser.BatchFailed) {
       installFrequentlyUsedAbbrevs(AbbrevsMap, AbbrevsQueueMap);
       return true;
     }
@@ -1415,19 +1915,31 @@ class NaClBitcodeCopyParser : public NaClBitcodeParser {
 public:
   // Top-level constructor to build the appropriate block parser
   // using the given BlockAbbrevsMap to define abbreviations.
+  // If Batch is non-null, function blocks of the module block are
+  // copied in batches. If ChooseAbbrevs is true, the abbreviations
+  // of records are chosen again, rather than taken from the queues
+  // of selected abbreviations (see
+  // SelectedAbbrevsQueue::getKeptAbbrevIndex). This is only done on
+  // worker threads, which share (and hence only read) the maps.
   NaClBitcodeCopyParser(const NaClBitcodeCompressor::CompressFlags &Flags,
                         NaClBitstreamCursor &Cursor,
                         BlockAbbrevsMapType &BlockAbbrevsMap,
                         BlockAbbrevsQueueMap &AbbrevsQueueMap,
-                        NaClBitstreamWriter &Writer)
+                        NaClBitstreamWriter &Writer,
+                        FunctionBlockBatch *Batch = nullptr,
+                        bool ChooseAbbrevs = false)
       : NaClBitcodeParser(Cursor), Flags(Flags),
         BlockAbbrevsMap(BlockAbbrevsMap), AbbrevsQueueMap(AbbrevsQueueMap),
-        Writer(Writer) {}
+        Writer(Writer), Batch(Batch), ChooseAbbrevs(ChooseAbbrevs),
+        BatchFailed(false) {}
 
   virtual ~NaClBitcodeCopyParser() {}
 
   bool ParseBlock(unsigned BlockID) final;
 
+  /// Copies the function blocks collected in Batch, if any.
+  void copyFunctionBlocks();
+
   const NaClBitcodeCompressor::CompressFlags &Flags;
 
   // The abbreviations to use for the copied bitcode.
@@ -1438,6 +1950,15 @@ public:
 
   // The bitstream to copy the compressed bitcode into.
   NaClBitstreamWriter &Writer;
+
+  // The function blocks to copy in parallel, if any.
+  FunctionBlockBatch *Batch;
+
+  // True if the abbreviations of records are chosen again.
+  bool ChooseAbbrevs;
+
+  // True if unable to parse the function blocks of a batch.
+  bool BatchFailed;
 };
 
 class NaClBlockCopyParser : public NaClBitcodeParser {
@@ -1476,17 +1997,40 @@ protected:
   void init() {
     unsigned BlockID = GetBlockID();
     BlockAbbreviations = getGlobalAbbrevs(BlockID);
-    SelectedAbbrevs = Context->AbbrevsQueueMap[BlockID];
+    if (Context->ChooseAbbrevs) {
+      // Worker threads share the maps, and hence must not insert
+      // into them.
+      BlockAbbrevsQueueMap::const_iterator Pos =
+          Context->AbbrevsQueueMap.find(BlockID);
+      assert(Pos != Context->AbbrevsQueueMap.end());
+      SelectedAbbrevs = Pos->second;
+    } else {
+      SelectedAbbrevs = Context->AbbrevsQueueMap[BlockID];
+    }
     assert(SelectedAbbrevs);
   }
 
   /// Returns the set of (global) block abbreviations defined for the
   /// given block ID.
   BlockAbbrevs *getGlobalAbbrevs(unsigned BlockID) {
+    if (Context->ChooseAbbrevs)
+      return findAbbrevs(Context->BlockAbbrevsMap, BlockID);
     return getAbbrevs(Context->BlockAbbrevsMap, BlockID);
   }
 
   virtual bool ParseBlock(unsigned BlockID) {
+    if (Context->Batch && GetBlockID() == naclbitc::MODULE_BLOCK_ID) {
+      if (BlockID == naclbitc::FUNCTION_BLOCK_ID) {
+        Context->Batch->add(Record.GetStartBit(),
+                            Record.GetCursor().GetCurrentBitNo());
+        return SkipBlock();
+      }
+      Context->copyFunctionBlocks();
+    }
+    // The function index gives the positions of the function blocks, which
+    // move when the bitcode is compressed, so it is dropped.
+    if (BlockID == naclbitc::FUNCTION_INDEX_BLOCK_ID)
+      return SkipBlock();
     NaClBlockCopyParser Parser(BlockID, this);
     return Parser.ParseThisBlock();
   }
@@ -1545,10 +2089,12 @@ protected:
   }
 
   virtual void ExitBlock() {
+    Context->copyFunctionBlocks();
     Context->Writer.ExitBlock();
   }
 
   virtual void ProcessRecord() {
+    Context->copyFunctionBlocks();
     const NaClBitcodeRecord::RecordVector &Values = Record.GetValues();
     if (Context->Flags.RemoveAbbreviations) {
       Context->Writer.EmitRecord(Record.GetCode(), Values, 0);
@@ -1556,7 +2102,12 @@ protected:
     }
     // Find best fitting abbreviation to use, and print out the record
     // using that abbreviation.
-    unsigned AbbrevIndex = SelectedAbbrevs->removeIndex();
+    unsigned AbbrevIndex =
+        Context->ChooseAbbrevs
+            ? SelectedAbbrevs->getKeptAbbrevIndex(
+                  BlockAbbreviations->getRecordAbbrevIndex(
+                      Record.GetRecordData()))
+            : SelectedAbbrevs->removeIndex();
     if (AbbrevIndex == naclbitc::UNABBREV_RECORD) {
       Context->Writer.EmitRecord(Record.GetCode(), Values, 0);
     } else {
@@ -1570,13 +2121,83 @@ bool NaClBitcodeCopyParser::ParseBlock(unsigned BlockID) {
   return Parser.ParseThisBlock();
 }
 
+/// The state of a thread copying function blocks. The blocks are
+/// written one after the other, to be added to the module block by
+/// NaClBitstreamWriter::EmitDetachedBlock.
+struct CopyWorkerState {
+  CopyWorkerState(const NaClBitstreamWriter &ModuleWriter)
+      : Writer(Buffer, ModuleWriter) {}
+
+  SmallVector<char, 0> Buffer;
+  NaClBitstreamWriter Writer;
+  // The offset in Buffer, and the header bits (see
+  // NaClBitstreamWriter::getBlockHeaderBits), of each block written.
+  std::vector<std::pair<size_t, unsigned>> Blocks;
+};
+
+// Copies the function blocks at Blocks, which are parsed with Cursor,
+// to the writer of Worker, using the abbreviations in BlockAbbrevsMap
+// kept in AbbrevsQueueMap. Returns true if unable to parse.
+static bool copyFunctionBlocks(
+    const NaClBitcodeCompressor::CompressFlags &Flags,
+    NaClBitstreamCursor &Cursor, ArrayRef<FunctionBlockPos> Blocks,
+    BlockAbbrevsMapType &BlockAbbrevsMap,
+    BlockAbbrevsQueueMap &AbbrevsQueueMap, CopyWorkerState &Worker) {
+  for (const FunctionBlockPos &Pos : Blocks) {
+    Cursor.JumpToBit(Pos.BodyBit);
+    NaClBitcodeCopyParser Parser(Flags, Cursor, BlockAbbrevsMap,
+                                 AbbrevsQueueMap, Worker.Writer, nullptr,
+                                 /*ChooseAbbrevs=*/true);
+    size_t Offset = Worker.Buffer.size();
+    if (Parser.ParseBlock(naclbitc::FUNCTION_BLOCK_ID))
+      return true;
+    Worker.Blocks.push_back(
+        std::make_pair(Offset, Worker.Writer.getBlockHeaderBits()));
+  }
+  return false;
+}
+
+void NaClBitcodeCopyParser::copyFunctionBlocks() {
+  if (Batch == nullptr || Batch->empty())
+    return;
+  std::vector<std::unique_ptr<CopyWorkerState>> Workers;
+  for (unsigned i = 0; i < Batch->getNumThreads(); ++i)
+    Workers.emplace_back(new CopyWorkerState(Writer));
+  bool Failed =
+      Batch->parse(Record.GetReader(),
+                   [&](unsigned Thread, NaClBitstreamCursor &Cursor,
+                       ArrayRef<FunctionBlockPos> Blocks) {
+                     return ::copyFunctionBlocks(Flags, Cursor, Blocks,
+                                                 BlockAbbrevsMap,
+                                                 AbbrevsQueueMap,
+                                                 *Workers[Thread]);
+                   });
+  Batch->clear();
+  if (Failed) {
+    BatchFailed = true;
+    return;
+  }
+  for (const std::unique_ptr<CopyWorkerState> &Worker : Workers) {
+    ArrayRef<char> Buffer(Worker->Buffer);
+    for (size_t i = 0, e = Worker->Blocks.size(); i != e; ++i) {
+      size_t Offset = Worker->Blocks[i].first;
+      size_t End = i + 1 == e ? Buffer.size() : Worker->Blocks[i + 1].first;
+      Writer.EmitDetachedBlock(Buffer.slice(Offset, End - Offset),
+                               Worker->Blocks[i].second);
+    }
+  }
+}
+
 // Read in bitcode, and write it back out using the abbreviations in
 // BlockAbbrevsMap, from memory buffer MemBuf containing the input
-// bitcode file. The bitcode is copied to Output.
+// bitcode file. The bitcode is copied to Output. With more than one
+// thread, the abbreviations of records in function blocks are chosen
+// again.
 static bool copyBitcode(const NaClBitcodeCompressor::CompressFlags &Flags,
                         MemoryBuffer *MemBuf, raw_ostream &Output,
                         BlockAbbrevsMapType &BlockAbbrevsMap,
-                        BlockAbbrevsQueueMap &AbbrevsQueueMap) {
+                        BlockAbbrevsQueueMap &AbbrevsQueueMap,
+                        unsigned NumThreads) {
 
   const unsigned char *BufPtr = (const unsigned char *)MemBuf->getBufferStart();
   const unsigned char *EndBufPtr = BufPtr + MemBuf->getBufferSize();
@@ -1600,12 +2221,15 @@ static bool copyBitcode(const NaClBitcodeCompressor::CompressFlags &Flags,
   NaClWriteHeader(Header, StreamWriter);
 
   // Set up the parser.
+  std::unique_ptr<FunctionBlockBatch> Batch;
+  if (NumThreads > 1)
+    Batch.reset(new FunctionBlockBatch(Header, BufPtr, EndBufPtr, NumThreads));
   NaClBitcodeCopyParser Parser(Flags, Stream, BlockAbbrevsMap, AbbrevsQueueMap,
-                               StreamWriter);
+                               StreamWriter, Batch.get());
 
   // Parse the bitcode and copy.
   while (!Stream.AtEndOfStream()) {
-    if (Parser.Parse())
+    if (Parser.Parse() || Parser.BatchFailed)
       return true;
   }
 
@@ -1627,26 +2251,377 @@ static void buildAbbrevLookupMaps(
   }
 }
 
+/// An abbreviation synthesized for the records of a record shape,
+/// and the number of bits it saves.
+struct SynthesizedAbbrev {
+  explicit SynthesizedAbbrev(NaClBitCodeAbbrev *Abbrev)
+      : Abbrev(Abbrev), NumUses(0), SavedBits(0) {}
+  NaClBitCodeAbbrev *Abbrev;
+  // The number of records that are smaller with the abbreviation.
+  uint64_t NumUses;
+  // The number of bits saved by those records.
+  uint64_t SavedBits;
+};
+
+typedef std::map<RecordShape, SynthesizedAbbrev> SynthesizedAbbrevMap;
+
+// Returns the abbreviation operand that encodes the values counted
+// in Counts in the fewest bits. Each value is priced as the largest
+// value of its range. If AllowLiteral, a single value is encoded as a
+// literal.
+static NaClBitCodeAbbrevOp chooseAbbrevOp(const ValueRangeCounts &Counts,
+                                          bool AllowLiteral) {
+  if (AllowLiteral && Counts.size() == 1) {
+    NaClValueRangeType Range = GetNaClValueRange(Counts.begin()->first);
+    if (Range.first == Range.second)
+      return NaClBitCodeAbbrevOp(Range.first);
+  }
+  NaClBitcodeDistValue MaxValue = 0;
+  uint64_t NumValues = 0;
+  for (const auto &Pair : Counts) {
+    MaxValue = std::max(MaxValue, GetNaClValueRange(Pair.first).second);
+    NumValues += Pair.second;
+  }
+  NaClBitCodeAbbrevOp BestOp(NaClBitCodeAbbrevOp::VBR, 6);
+  uint64_t BestBits = std::numeric_limits<uint64_t>::max();
+  if (MaxValue <= std::numeric_limits<uint32_t>::max()) {
+    unsigned Width = std::max(1u, NaClBitsNeededForValue(MaxValue));
+    BestOp = NaClBitCodeAbbrevOp(NaClBitCodeAbbrevOp::Fixed, Width);
+    BestBits = NumValues * Width;
+  }
+  for (unsigned Width = 2; Width <= naclbitc::MaxAbbrevWidth; ++Width) {
+    uint64_t NumBits = 0;
+    for (const auto &Pair : Counts)
+      NumBits += Pair.second * BlockAbbrevs::matchVBRBits(
+                                   GetNaClValueRange(Pair.first).second, Width);
+    if (NumBits < BestBits) {
+      BestOp = NaClBitCodeAbbrevOp(NaClBitCodeAbbrevOp::VBR, Width);
+      BestBits = NumBits;
+    }
+  }
+  return BestOp;
+}
+
+// Builds an abbreviation for each record shape in Shapes that is
+// frequent enough to be kept, and is not already defined, and adds it
+// to Candidates. Records with NaClValueIndexCutoff or more values end
+// with an array, whose elements are encoded like the last tracked
+// value. Hence, at most one candidate applies to a record.
+static void proposeAbbrevs(const RecordShapeMap &Shapes,
+                           BlockAbbrevsMapType &AbbrevsMap,
+                           SynthesizedAbbrevMap &Candidates) {
+  for (const auto &Pair : Shapes) {
+    const RecordShapeValues &Values = Pair.second;
+    if (Values.NumInstances < SelectedAbbrevsQueue::MinUsageCount)
+      continue;
+    unsigned BlockID = std::get<0>(Pair.first);
+    unsigned Code = std::get<1>(Pair.first);
+    unsigned Size = std::get<2>(Pair.first);
+    assert(Values.IndexValues.size() >= Size);
+    NaClBitCodeAbbrev *Abbrev = new NaClBitCodeAbbrev();
+    Abbrev->Add(NaClBitCodeAbbrevOp(Code));
+    for (unsigned Index = 0; Index < Size; ++Index)
+      Abbrev->Add(chooseAbbrevOp(Values.IndexValues[Index], true));
+    if (Size == NaClValueIndexCutoff) {
+      Abbrev->Add(NaClBitCodeAbbrevOp(NaClBitCodeAbbrevOp::Array));
+      Abbrev->Add(chooseAbbrevOp(Values.IndexValues[Size - 1], false));
+    }
+    if (getAbbrevs(AbbrevsMap, BlockID)->findAbbreviation(Abbrev) !=
+        BlockAbbrevs::NO_SUCH_ABBREVIATION) {
+      Abbrev->dropRef();
+      continue;
+    }
+    Candidates.insert(std::make_pair(Pair.first, SynthesizedAbbrev(Abbrev)));
+  }
+}
+
+/// The uses of abbreviation indices in all instances of a block.
+struct BlockAbbrevUses {
+  BlockAbbrevUses() : NumAbbrevIds(0) {}
+  // The number of abbreviation indices written for the block
+  // (records, subblocks, and the end of the block).
+  uint64_t NumAbbrevIds;
+  // The number of records selecting each abbreviation index.
+  std::map<unsigned, uint64_t> NumSelected;
+};
+
+/// Top level parser to measure the bits each synthesized abbreviation
+/// saves, over the abbreviations already in the corresponding block.
+class NaClScoreAbbrevsParser : public NaClBitcodeParser {
+public:
+  NaClScoreAbbrevsParser(NaClBitstreamCursor &Cursor,
+                         BlockAbbrevsMapType &AbbrevsMap,
+                         SynthesizedAbbrevMap &Candidates)
+      : NaClBitcodeParser(Cursor), AbbrevsMap(AbbrevsMap),
+        Candidates(Candidates) {}
+
+  ~NaClScoreAbbrevsParser() final {}
+
+  bool ParseBlock(unsigned BlockID) final;
+
+  /// The abbreviations already defined for each block.
+  BlockAbbrevsMapType &AbbrevsMap;
+
+  /// The synthesized abbreviations to score.
+  SynthesizedAbbrevMap &Candidates;
+
+  /// The uses of abbreviation indices, for each block ID.
+  std::map<unsigned, BlockAbbrevUses> AbbrevUses;
+};
+
+/// Block parser to score the synthesized abbreviations against the
+/// records in the block.
+class NaClScoreAbbrevsBlockParser : public NaClBitcodeParser {
+public:
+  NaClScoreAbbrevsBlockParser(unsigned BlockID,
+                              NaClScoreAbbrevsParser *Context)
+      : NaClBitcodeParser(BlockID, Context), BlockID(BlockID),
+        Context(Context) {
+    init();
+  }
+
+  ~NaClScoreAbbrevsBlockParser() final {}
+
+protected:
+  unsigned BlockID;
+  NaClScoreAbbrevsParser *Context;
+  // Cached abbreviations defined for this block.
+  BlockAbbrevs *Abbreviations;
+  // Cached uses of abbreviation indices for this block.
+  BlockAbbrevUses *Uses;
+
+  NaClScoreAbbrevsBlockParser(unsigned BlockID,
+                              NaClScoreAbbrevsBlockParser *EnclosingParser)
+      : NaClBitcodeParser(BlockID, EnclosingParser), BlockID(BlockID),
+        Context(EnclosingParser->Context) {
+    init();
+  }
+
+  void init() {
+    Abbreviations = getAbbrevs(Context->AbbrevsMap, BlockID);
+    Uses = &Context->AbbrevUses[BlockID];
+  }
+
+  bool ParseBlock(unsigned BlockID) final {
+    ++Uses->NumAbbrevIds;
+    NaClScoreAbbrevsBlockParser Parser(BlockID, this);
+    return Parser.ParseThisBlock();
+  }
+
+  void ExitBlock() final {
+    ++Uses->NumAbbrevIds;
+  }
+
+  void ProcessRecord() final {
+    ++Uses->NumAbbrevIds;
+    const NaClBitcodeRecordData &Data = Record.GetRecordData();
+    uint64_t NumBits;
+    unsigned Index = Abbreviations->getRecordAbbrevIndex(Data, NumBits);
+    if (Index != naclbitc::UNABBREV_RECORD)
+      ++Uses->NumSelected[Index];
+    unsigned Size = std::min<size_t>(Data.Values.size(),
+                                     NaClValueIndexCutoff);
+    SynthesizedAbbrevMap::iterator Pos =
+        Context->Candidates.find(std::make_tuple(BlockID, Data.Code, Size));
+    if (Pos == Context->Candidates.end())
+      return;
+    SynthesizedAbbrev &Cand = Pos->second;
+    NaClBitcodeValues Values(Data);
+    uint64_t CandBits;
+    if (BlockAbbrevs::canUseAbbreviation(Values, Cand.Abbrev, CandBits) &&
+        CandBits < NumBits) {
+      ++Cand.NumUses;
+      Cand.SavedBits += NumBits - CandBits;
+    }
+  }
+};
+
+bool NaClScoreAbbrevsParser::ParseBlock(unsigned BlockID) {
+  NaClScoreAbbrevsBlockParser Parser(BlockID, this);
+  return Parser.ParseThisBlock();
+}
+
+// Returns the number of bits needed to define Abbrev, when
+// abbreviation indices are AbbrevIdWidth bits wide (see
+// NaClBitstreamWriter::EncodeAbbrev).
+static uint64_t abbrevDefinitionBits(const NaClBitCodeAbbrev *Abbrev,
+                                     unsigned AbbrevIdWidth) {
+  uint64_t NumBits = AbbrevIdWidth;
+  NumBits += BlockAbbrevs::matchVBRBits(Abbrev->getNumOperandInfos(), 5);
+  for (unsigned i = 0, e = Abbrev->getNumOperandInfos(); i != e; ++i) {
+    const NaClBitCodeAbbrevOp &Op = Abbrev->getOperandInfo(i);
+    NumBits += 1;
+    if (Op.isLiteral()) {
+      NumBits += BlockAbbrevs::matchVBRBits(Op.getValue(), 8);
+    } else {
+      NumBits += 3;
+      if (Op.hasValue())
+        NumBits += BlockAbbrevs::matchVBRBits(Op.getValue(), 5);
+    }
+  }
+  return NumBits;
+}
+
+// Returns the number of bits of the SETBID record of the blockinfo
+// block that precedes the abbreviations of BlockID.
+static uint64_t setBlockIDBits(unsigned BlockID) {
+  NaClBitcodeRecordData SetBID;
+  SetBID.Code = naclbitc::BLOCKINFO_CODE_SETBID;
+  SetBID.Values.push_back(BlockID);
+  return NaClBitsNeededForValue(naclbitc::DEFAULT_MAX_ABBREV) +
+         BlockAbbrevs::unabbreviatedSize(SetBID);
+}
+
+// Adds the scored candidates of the block with the given ID, that save
+// more bits than they cost, to Abbrevs. The cost of a candidate is its
+// definition, the SETBID record if it is the first abbreviation of a
+// blockinfo entry, and the widening of every abbreviation index of
+// the block if it needs an extra bit. Uses counts how the existing
+// abbreviations are selected. Returns the number of bits saved.
+static uint64_t selectSynthesizedAbbrevs(
+    const NaClBitcodeCompressor::CompressFlags &Flags, unsigned BlockID,
+    std::vector<SynthesizedAbbrev *> &Cands, const BlockAbbrevUses &Uses,
+    BlockAbbrevs *Abbrevs) {
+  // The existing abbreviations that will be kept (see
+  // SelectedAbbrevsQueue::installFrequentlyUsedAbbrevs).
+  unsigned NumKept = 0;
+  for (const auto &Pair : Uses.NumSelected)
+    if (Pair.second >= SelectedAbbrevsQueue::MinUsageCount)
+      ++NumKept;
+
+  std::stable_sort(Cands.begin(), Cands.end(),
+                   [](const SynthesizedAbbrev *C1, const SynthesizedAbbrev *C2) {
+                     return C1->SavedBits > C2->SavedBits;
+                   });
+  uint64_t TotalSavedBits = 0;
+  for (SynthesizedAbbrev *Cand : Cands) {
+    if (Cand->NumUses < SelectedAbbrevsQueue::MinUsageCount)
+      continue;
+    unsigned Width =
+        NaClBitsNeededForValue(NumKept + naclbitc::DEFAULT_MAX_ABBREV);
+    unsigned NewWidth =
+        NaClBitsNeededForValue(NumKept + 1 + naclbitc::DEFAULT_MAX_ABBREV);
+    // Module abbreviations are defined in the module block, and all
+    // others in the blockinfo block.
+    uint64_t Cost;
+    if (BlockID == naclbitc::MODULE_BLOCK_ID) {
+      Cost = abbrevDefinitionBits(Cand->Abbrev, NewWidth);
+    } else {
+      Cost = abbrevDefinitionBits(
+          Cand->Abbrev, NaClBitsNeededForValue(naclbitc::DEFAULT_MAX_ABBREV));
+      if (NumKept == 0)
+        Cost += setBlockIDBits(BlockID);
+    }
+    Cost += (NewWidth - Width) * Uses.NumAbbrevIds;
+    if (Cand->SavedBits <= Cost)
+      continue;
+    if (Flags.TraceGeneratedAbbreviations) {
+      errs() << format("%12" PRIu64, Cand->SavedBits - Cost) << ": ";
+      printAbbrev(errs(), BlockID, Cand->Abbrev);
+    }
+    Abbrevs->addAbbreviation(Cand->Abbrev);
+    Cand->Abbrev = nullptr;
+    ++NumKept;
+    TotalSavedBits += Cand->SavedBits - Cost;
+  }
+  return TotalSavedBits;
+}
+
+// Synthesizes abbreviations for the record shapes in Shapes, collected
+// from the bitcode in MemBuf, scores them against the abbreviations
+// in AbbrevsMap, and adds those that save bits to AbbrevsMap. Assumes
+// that the lookup maps of AbbrevsMap are built. Returns true if unable
+// to parse the bitcode.
+static bool synthesizeAbbrevs(const NaClBitcodeCompressor::CompressFlags &Flags,
+                              MemoryBuffer *MemBuf,
+                              const RecordShapeMap &Shapes,
+                              BlockAbbrevsMapType &AbbrevsMap) {
+  SynthesizedAbbrevMap Candidates;
+  proposeAbbrevs(Shapes, AbbrevsMap, Candidates);
+
+  const unsigned char *BufPtr = (const unsigned char *)MemBuf->getBufferStart();
+  const unsigned char *EndBufPtr = BufPtr + MemBuf->getBufferSize();
+
+  // Read header. No verification is needed since AnalyzeBitcode has
+  // already checked it.
+  NaClBitcodeHeader Header;
+  if (Header.Read(BufPtr, EndBufPtr))
+    return Error("Invalid PNaCl bitcode header");
+
+  // Create the bitcode reader, and score the candidates.
+  NaClBitstreamReader StreamFile(BufPtr, EndBufPtr, Header);
+  NaClBitstreamCursor Stream(StreamFile);
+  NaClScoreAbbrevsParser Parser(Stream, AbbrevsMap, Candidates);
+  bool Failed = false;
+  while (!Stream.AtEndOfStream()) {
+    if (Parser.Parse()) {
+      Failed = true;
+      break;
+    }
+  }
+
+  // Add the candidates that pay for themselves, one block at a time.
+  if (!Failed) {
+    if (Flags.TraceGeneratedAbbreviations)
+      errs() << "-- Synthesized abbreviations:\n";
+    uint64_t TotalSavedBits = 0;
+    for (SynthesizedAbbrevMap::iterator Iter = Candidates.begin(),
+                                        IterEnd = Candidates.end();
+         Iter != IterEnd;) {
+      unsigned BlockID = std::get<0>(Iter->first);
+      std::vector<SynthesizedAbbrev *> Cands;
+      for (; Iter != IterEnd && std::get<0>(Iter->first) == BlockID; ++Iter)
+        Cands.push_back(&Iter->second);
+      TotalSavedBits +=
+          selectSynthesizedAbbrevs(Flags, BlockID, Cands,
+                                   Parser.AbbrevUses[BlockID],
+                                   getAbbrevs(AbbrevsMap, BlockID));
+    }
+    if (Flags.TraceGeneratedAbbreviations)
+      errs() << "-- Estimated savings: " << TotalSavedBits << " bits\n";
+  }
+  for (std::pair<const RecordShape, SynthesizedAbbrev> &Pair : Candidates) {
+    if (Pair.second.Abbrev)
+      Pair.second.Abbrev->dropRef();
+  }
+  return Failed;
+}
+
 }  // namespace
 
 bool NaClBitcodeCompressor::analyze(MemoryBuffer *MemBuf, raw_ostream &Output) {
   BlockAbbrevsMapType BlockAbbrevsMap;
-  return !analyzeBitcode(Flags, MemBuf, Output, BlockAbbrevsMap);
+  bool FunctionsDefineAbbrevs;
+  return !analyzeBitcode(Flags, MemBuf, Output, BlockAbbrevsMap,
+                         FunctionsDefineAbbrevs);
 }
 
 bool NaClBitcodeCompressor::compress(MemoryBuffer *MemBuf,
                                      raw_ostream &BitcodeOutput,
                                      raw_ostream &ShowOutput) {
   BlockAbbrevsMapType BlockAbbrevsMap;
-  if (analyzeBitcode(Flags, MemBuf, ShowOutput, BlockAbbrevsMap))
+  bool FunctionsDefineAbbrevs;
+  RecordShapeMap Shapes;
+  if (analyzeBitcode(Flags, MemBuf, ShowOutput, BlockAbbrevsMap,
+                     FunctionsDefineAbbrevs,
+                     Flags.SynthesizeAbbreviations ? &Shapes : nullptr))
     return false;
   buildAbbrevLookupMaps(Flags, BlockAbbrevsMap);
+  if (Flags.SynthesizeAbbreviations) {
+    if (synthesizeAbbrevs(Flags, MemBuf, Shapes, BlockAbbrevsMap))
+      return false;
+    buildAbbrevLookupMaps(Flags, BlockAbbrevsMap);
+  }
+  // Function blocks that define abbreviations can change the blockinfo
+  // abbreviations used by later function blocks, so they are read in
+  // order.
+  unsigned NumThreads = FunctionsDefineAbbrevs ? 1 : Flags.NumThreads;
   BlockAbbrevsQueueMap AbbrevsQueueMap;
   bool Result = true;
-  if (chooseAbbrevs(MemBuf, BlockAbbrevsMap, AbbrevsQueueMap))
+  if (chooseAbbrevs(MemBuf, BlockAbbrevsMap, AbbrevsQueueMap, NumThreads))
     Result = false;
   else if (copyBitcode(Flags, MemBuf, BitcodeOutput, BlockAbbrevsMap,
-                       AbbrevsQueueMap))
+                       AbbrevsQueueMap, NumThreads))
     Result = false;
   DeleteContainerSeconds(AbbrevsQueueMap);
   return Result;
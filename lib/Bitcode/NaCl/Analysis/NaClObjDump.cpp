@@ -17,18 +17,28 @@
 #include "llvm/Bitcode/NaCl/NaClBitCodes.h"
 #include "llvm/Bitcode/NaCl/NaClObjDumpStream.h"
 #include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Format.h"
+#include "llvm/Support/Mutex.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <limits>
 #include <map>
 
+#if LLVM_ENABLE_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
 namespace {
 
 using namespace llvm;
@@ -45,6 +55,10 @@ IgnorePNaClABIChecks(
     cl::desc("Ignore checking bitcode for PNaCl ABI violations"),
     cl::init(false));
 
+/// Guards the creation of types in the global context, which function
+/// blocks disassembled on worker threads share.
+static ManagedStatic<sys::Mutex> TypeLock;
+
 /// Class to handle sign rotations in a human readable form. That is,
 /// the sign is in the low bit. The two special cases are:
 /// 1) -1 is true for i1.
@@ -163,6 +177,7 @@ raw_ostream &operator<<(raw_ostream &Stream, const BitcodeId &Id) {
 }
 
 class NaClDisBlockParser;
+class NaClDisFunctionWorker;
 
 /// The text formatter for PNaClAsm instructions.
 class AssemblyTextFormatter : public naclbitc::TextFormatter {
@@ -574,7 +589,12 @@ public:
         UnknownType(Type::getVoidTy(Mod.getContext())),
         PointerType(Type::getInt32Ty(Mod.getContext())),
         ComparisonType(Type::getInt1Ty(Mod.getContext())),
-        NumDefinedFunctions(0) {
+        NumDefinedFunctions(0),
+        NumThreads(1),
+        BufPtr(nullptr),
+        EndBufPtr(nullptr),
+        Worker(nullptr),
+        IntrinsicsChanged(false) {
     SetListener(&AbbrevListener);
   }
 
@@ -590,16 +610,61 @@ public:
 
   /// Generates an error with the given message.
   bool ErrorAt(naclbitc::ErrorLevel Level, uint64_t Bit,
-               const std::string &Message) final {
-    ObjDump.ErrorAt(Level, Bit) << Message << "\n";
-    if (Level == naclbitc::Fatal)
-      ObjDump.FlushThenQuit();
-    return true;
-  }
+               const std::string &Message) final;
 
   /// Parses the top-level module block.
   bool ParseBlock(unsigned BlockID) override;
 
+  /// Disassembles runs of function blocks of the module block on
+  /// NumThreads threads, which read the bitcode file in [BufPtr,
+  /// EndBufPtr) on their own.
+  void SetNumThreads(unsigned NewNumThreads, const unsigned char *NewBufPtr,
+                     const unsigned char *NewEndBufPtr) {
+    NumThreads = NewNumThreads;
+    BufPtr = NewBufPtr;
+    EndBufPtr = NewEndBufPtr;
+  }
+
+  unsigned GetNumThreads() const {
+    return NumThreads;
+  }
+
+  const unsigned char *GetBufPtr() const {
+    return BufPtr;
+  }
+
+  const unsigned char *GetEndBufPtr() const {
+    return EndBufPtr;
+  }
+
+  NaClBitcodeHeader &GetHeader() {
+    return Header;
+  }
+
+  naclbitc::ObjDumpStream &GetObjDump() {
+    return ObjDump;
+  }
+
+  /// Sets up this parser to disassemble function blocks on worker
+  /// thread NewWorker, with the module-level state of the module
+  /// being disassembled by Module.
+  void InitFunctionWorker(NaClDisTopLevelParser &Module,
+                          NaClDisFunctionWorker *NewWorker);
+
+  /// Prepares to disassemble the function block of the Index defined
+  /// function, without the function blocks before it.
+  void StartFunctionBlock(NaClBcIndexSize_t Index) {
+    NumDefinedFunctions = Index;
+    IntrinsicsChanged = false;
+  }
+
+  /// Returns true if a function was marked as intrinsic since the
+  /// last call to StartFunctionBlock. The marks change how later
+  /// function blocks are disassembled.
+  bool GetIntrinsicsChanged() const {
+    return IntrinsicsChanged;
+  }
+
   /// Installs the given type to the next available type index.
   void InstallType(Type *Ty) {
     TypeIdType.push_back(Ty);
@@ -668,6 +733,8 @@ public:
       BitcodeId Id('f', Index);
       Errors() << "Can't define " << Id << " as intrinsic, no definition";
     }
+    if (!FunctionIdIsIntrinsic[Index])
+      IntrinsicsChanged = true;
     FunctionIdIsIntrinsic[Index] = true;
   }
 
@@ -686,6 +753,7 @@ public:
   /// Returns the type of the Name'd intrinsic, if defined as an
   /// allowed intrinsic name. Otherwise returns 0.
   FunctionType *GetIntrinsicType(const std::string &Name) {
+    sys::ScopedLock L(*TypeLock);
     return AllowedIntrinsics.getIntrinsicType(Name);
   }
 
@@ -711,7 +779,7 @@ public:
   /// function block.
   NaClBcIndexSize_t GetDefinedFunctionIndex(NaClBcIndexSize_t Index) const {
     assert(Index < DefinedFunctions.size());
-    return DefinedFunctions[NumDefinedFunctions];
+    return DefinedFunctions[Index];
   }
 
   /// Returns true if there is a next defined function index.
@@ -740,6 +808,12 @@ public:
     ++NumDefinedFunctions;
   }
 
+  /// Returns the number of (currently) defined functions in the
+  /// bitcode file.
+  NaClBcIndexSize_t GetNumDefinedFunctions() const {
+    return NumDefinedFunctions;
+  }
+
   void IncNumGlobals() {
     NumGlobals++;
   }
@@ -1047,6 +1121,16 @@ public:
     ObjDump.DecRecordIndent();
   }
 
+  /// Sets the number of tabs used to indent assembly and records.
+  void SetIndentation(unsigned AssemblyNumTabs, unsigned RecordNumTabs) {
+    while (GetAssemblyNumTabs() < AssemblyNumTabs) IncAssemblyIndent();
+    while (GetAssemblyNumTabs() > AssemblyNumTabs) DecAssemblyIndent();
+    while (ObjDump.GetRecordIndenter().GetNumTabs() < RecordNumTabs)
+      IncRecordIndent();
+    while (ObjDump.GetRecordIndenter().GetNumTabs() > RecordNumTabs)
+      DecRecordIndent();
+  }
+
   void ObjDumpFlush() {
     ObjDump.Flush();
   }
@@ -1153,8 +1237,37 @@ private:
   NaClBcIndexSize_t NumDefinedFunctions;
   // Holds the number of global abbreviations defined for each block.
   std::map<unsigned, NaClBcIndexSize_t> GlobalAbbrevsCountMap;
+  // The number of threads disassembling runs of function blocks.
+  unsigned NumThreads;
+  // The bitcode file, as read by the threads disassembling function
+  // blocks.
+  const unsigned char *BufPtr;
+  const unsigned char *EndBufPtr;
+  // The worker thread disassembling function blocks with this
+  // parser, if any.
+  NaClDisFunctionWorker *Worker;
+  // True if a function was marked as intrinsic since the last call
+  // to StartFunctionBlock.
+  bool IntrinsicsChanged;
 };
 
+void NaClDisTopLevelParser::InitFunctionWorker(
+    NaClDisTopLevelParser &Module, NaClDisFunctionWorker *NewWorker) {
+  Worker = NewWorker;
+  // Function blocks only read the module-level state, except for
+  // intrinsic marks (see GetIntrinsicsChanged).
+  TypeIdType = Module.TypeIdType;
+  FunctionIdType = Module.FunctionIdType;
+  FunctionIdIsIntrinsic = Module.FunctionIdIsIntrinsic;
+  FunctionIdAddress = Module.FunctionIdAddress;
+  NumFunctions = Module.NumFunctions;
+  NumGlobals = Module.NumGlobals;
+  ExpectedNumGlobals = Module.ExpectedNumGlobals;
+  DefinedFunctions = Module.DefinedFunctions;
+  NumDefinedFunctions = Module.NumDefinedFunctions;
+  GlobalAbbrevsCountMap = Module.GlobalAbbrevsCountMap;
+}
+
 BitcodeId NaClDisTopLevelParser::GetBitcodeId(NaClBcIndexSize_t Index) {
   if (Index < NumFunctions) {
     return BitcodeId('f', Index);
@@ -1640,6 +1753,9 @@ void NaClDisBlockInfoParser::SetBID() {
   case naclbitc::GLOBALVAR_BLOCK_ID:
     Tokens() << "globals";
     break;
+  case naclbitc::FUNCTION_INDEX_BLOCK_ID:
+    Tokens() << "functionindex";
+    break;
   default:
     Tokens() << "block" << OpenParen() << BlockID << CloseParen();
     Errors() << "Block id " << BlockID << " not understood.\n";
@@ -2103,6 +2219,59 @@ void NaClDisGlobalsParser::ProcessRecord() {
     InsertCloseInitializer();
 }
 
+/// Parses and disassembles the function index block.
+class NaClDisFunctionIndexParser : public NaClDisBlockParser {
+public:
+  NaClDisFunctionIndexParser(unsigned BlockID,
+                             NaClDisBlockParser *EnclosingParser)
+      : NaClDisBlockParser(BlockID, EnclosingParser), NumEntries(0) {
+  }
+
+  ~NaClDisFunctionIndexParser() override {}
+
+private:
+  // The number of function index entries processed so far.
+  NaClBcIndexSize_t NumEntries;
+
+  void PrintBlockHeader() override;
+
+  void ProcessRecord() override;
+};
+
+void NaClDisFunctionIndexParser::PrintBlockHeader() {
+  Tokens() << "functionindex" << Space() << OpenCurly()
+           << Space() << Space() << "// BlockID = " << GetBlockID()
+           << Endline();
+}
+
+void NaClDisFunctionIndexParser::ProcessRecord() {
+  ObjDumpSetRecordBitAddress(Record.GetStartBit());
+  const NaClBitcodeRecord::RecordVector &Values = Record.GetValues();
+  switch (Record.GetCode()) {
+  case naclbitc::FUNCTION_INDEX_ENTRY:
+    // ENTRY: [startword, numwords]
+    if (Values.size() != 2) {
+      Errors() << "Function index entry record expects 2 arguments. Found: "
+               << Values.size() << "\n";
+      break;
+    }
+    if (!Context->HasDefinedFunctionIndex(NumEntries)) {
+      Errors() << "Function index entry has no defined function.\n";
+      break;
+    }
+    Tokens() << BitcodeId('f', Context->GetDefinedFunctionIndex(NumEntries))
+             << Space() << Colon() << Space() << "word" << Space()
+             << Values[0] << Comma() << Space() << "size" << Space()
+             << Values[1] << Semicolon() << TokenizeAbbrevIndex()
+             << Endline();
+    ++NumEntries;
+    break;
+  default:
+    Errors() << "Unknown record found in function index block.\n";
+  }
+  ObjDumpWrite(Record.GetStartBit(), Record);
+}
+
 /// Parsers and disassembles a valuesymtab block.
 class NaClDisValueSymtabParser : public NaClDisBlockParser {
 public:
@@ -2576,6 +2745,7 @@ NaClDisFunctionParser::NaClDisFunctionParser(
   } else {
     FcnId = 0;
     SmallVector<Type*, 8> Signature;
+    sys::ScopedLock L(*TypeLock);
     FcnTy = FunctionType::get(GetVoidType(), Signature, 0);
     Errors() <<
         "No corresponding defining function address for function block.\n";
@@ -3132,6 +3302,7 @@ void NaClDisFunctionParser::ProcessRecord() {
              << GetBitcodeId(Arg2) << Semicolon() << FinishCluster();
     Type *ResultType = GetComparisonType();
     if (Arg1Type->isVectorTy()) {
+      sys::ScopedLock L(*TypeLock);
       ResultType = VectorType::get(ResultType,
                                    Arg1Type->getVectorNumElements());
     }
@@ -3338,6 +3509,349 @@ void NaClDisFunctionParser::ProcessRecord() {
   ObjDumpWrite(Record.GetStartBit(), Record);
 }
 
+/// The position of a function block within the module block.
+struct NaClDisFunctionBlockPos {
+  NaClDisFunctionBlockPos(uint64_t StartBit, uint64_t BodyBit, uint64_t EndBit)
+      : StartBit(StartBit), BodyBit(BodyBit), EndBit(EndBit) {}
+  // The first bit of the (begin) block record of the function block.
+  uint64_t StartBit;
+  // The bit following the block ID in the (begin) block record.
+  uint64_t BodyBit;
+  // The bit following the function block, as defined by its size.
+  uint64_t EndBit;
+};
+
+/// Stands in for the module block parser, to disassemble a function
+/// block of the module block on its own.
+class NaClDisFunctionBlockStarter : public NaClDisBlockParser {
+public:
+  /// Disassembles the function block at Pos with Context, whose
+  /// cursor is Cursor. ModuleBit is the start bit of the module block.
+  /// Returns true if unable to parse the block.
+  static bool Parse(NaClDisTopLevelParser *Context,
+                    NaClBitstreamCursor &Cursor,
+                    const NaClDisFunctionBlockPos &Pos, uint64_t ModuleBit) {
+    // Like the module block parser, report errors before the first
+    // record at the start of the module block.
+    Context->ObjDumpSetRecordBitAddress(ModuleBit);
+    // The function block starts where the record of its enclosing
+    // parser starts.
+    Cursor.JumpToBit(Pos.StartBit);
+    NaClDisFunctionBlockStarter Starter(Context);
+    Cursor.JumpToBit(Pos.BodyBit);
+    NaClDisFunctionParser Parser(naclbitc::FUNCTION_BLOCK_ID, &Starter);
+    return Parser.ParseThisBlock();
+  }
+
+private:
+  explicit NaClDisFunctionBlockStarter(NaClDisTopLevelParser *Context)
+      : NaClDisBlockParser(naclbitc::MODULE_BLOCK_ID, Context) {}
+};
+
+#if LLVM_ENABLE_THREADS
+
+class NaClDisFunctionDumper;
+
+/// The text of a function block disassembled on a worker thread.
+struct NaClDisFunctionText {
+  NaClDisFunctionText() : Usable(false), LastBit(0) {}
+  // The disassembled text.
+  std::string Text;
+  // True if Text is the text the module block parser generates for
+  // the block. Otherwise the block reported errors (which count
+  // towards the maximum), didn't end where its size says, or marked
+  // intrinsics used by later blocks, and must be disassembled again,
+  // in order.
+  bool Usable;
+  // The bit of the last record of the block.
+  uint64_t LastBit;
+};
+
+/// A worker thread disassembling function blocks. It has its own
+/// reader, objdump stream, and copy of the module-level state.
+class NaClDisFunctionWorker {
+  NaClDisFunctionWorker(const NaClDisFunctionWorker &) = delete;
+  void operator=(const NaClDisFunctionWorker &) = delete;
+
+public:
+  /// Creates worker ID of Dumper, for the module being disassembled
+  /// by Module. Must be created on the thread of Module, since the
+  /// placeholder module of the parser is added to the global context.
+  NaClDisFunctionWorker(NaClDisFunctionDumper *Dumper, unsigned ID,
+                        NaClDisTopLevelParser &Module,
+                        const NaClBitstreamReader &BlockInfoSource);
+
+  unsigned getID() const { return ID; }
+
+  size_t getIndex() const { return Index; }
+
+  /// Disassembles the function block at Pos, which is block Index of
+  /// the run and the DefinedIndex defined function, into Text.
+  void dump(const NaClDisFunctionBlockPos &Pos, size_t Index,
+            NaClBcIndexSize_t DefinedIndex, NaClDisFunctionText &Text);
+
+  /// Called on a fatal error, which can't stop the executable until
+  /// the text of the blocks before it is written. Never returns, and
+  /// hence leaks the thread (see NaClDisFunctionDumper::park).
+  LLVM_ATTRIBUTE_NORETURN void park();
+
+private:
+  NaClDisFunctionDumper *Dumper;
+  unsigned ID;
+  // The index (in the run) of the block being disassembled.
+  size_t Index;
+  NaClBitstreamReader Reader;
+  NaClBitstreamCursor Cursor;
+  std::string Buffer;
+  raw_string_ostream BufferStream;
+  naclbitc::ObjDumpStream ObjDump;
+  NaClDisTopLevelParser Parser;
+  // The indentation of the module block.
+  unsigned AssemblyNumTabs;
+  unsigned RecordNumTabs;
+};
+
+/// Disassembles the first NumBlocks of a run of function blocks, at
+/// positions Blocks, on worker threads while the texts already
+/// disassembled are written out in order. Workers stay at most a fixed number
+/// of blocks ahead of the oldest text not released yet, which bounds
+/// the memory used. They don't start blocks after the first block
+/// known to be unusable, since the blocks from there on are
+/// disassembled again, in order.
+class NaClDisFunctionDumper {
+  NaClDisFunctionDumper(const NaClDisFunctionDumper &) = delete;
+  void operator=(const NaClDisFunctionDumper &) = delete;
+
+public:
+  NaClDisFunctionDumper(NaClDisTopLevelParser &Module,
+                        const NaClBitstreamReader &BlockInfoSource,
+                        uint64_t ModuleBit,
+                        const std::vector<NaClDisFunctionBlockPos> &Blocks,
+                        size_t NumBlocks);
+  ~NaClDisFunctionDumper();
+
+  /// Returns the text of block Index, waiting until it is disassembled.
+  const NaClDisFunctionText &getText(size_t Index);
+
+  /// Frees the text of block Index, which must be the oldest text not
+  /// released yet.
+  void releaseText(size_t Index);
+
+private:
+  friend class NaClDisFunctionWorker;
+
+  void run(NaClDisFunctionWorker *Worker);
+
+  // Stores an unusable text for the block of Worker, which stops
+  // there for good. The block is disassembled again on the main
+  // thread, which normally stops the executable at the same error.
+  // Otherwise (e.g. if the main thread stops the run of blocks
+  // earlier), the parked thread, and the state of its worker, are
+  // leaked. Since workers don't start blocks after the first unusable
+  // one, fatal errors in later blocks are only found on the main
+  // thread.
+  void park(NaClDisFunctionWorker *Worker);
+
+  // Notes that the text of block Index is unusable. Must hold Lock.
+  void setUnusable(size_t Index) {
+    FirstUnusable = std::min(FirstUnusable, Index);
+  }
+
+  // The start bit of the module block.
+  uint64_t ModuleBit;
+  const std::vector<NaClDisFunctionBlockPos> &Blocks;
+  size_t NumBlocks;
+  // The defined function index of the first block.
+  NaClBcIndexSize_t FirstDefinedIndex;
+  size_t Window;
+  std::vector<std::unique_ptr<NaClDisFunctionWorker>> Workers;
+  std::vector<std::thread> Threads;
+  std::mutex Lock;
+  // Signaled when a text is released, or the workers should stop.
+  std::condition_variable WorkAvailable;
+  // Signaled when a text is stored.
+  std::condition_variable TextReady;
+  // Signaled when a worker returns or parks.
+  std::condition_variable WorkerStopped;
+  // The fields below are guarded by Lock.
+  std::vector<std::unique_ptr<NaClDisFunctionText>> Texts;
+  size_t NextBlock;
+  size_t NumReleased;
+  // The index of the first block known to be unusable, or NumBlocks.
+  size_t FirstUnusable;
+  // Not a std::vector<bool>, which threads can't write to concurrently.
+  std::vector<char> Parked;
+  unsigned NumStopped;
+  bool Stop;
+};
+
+NaClDisFunctionWorker::NaClDisFunctionWorker(
+    NaClDisFunctionDumper *Dumper, unsigned ID, NaClDisTopLevelParser &Module,
+    const NaClBitstreamReader &BlockInfoSource)
+    : Dumper(Dumper), ID(ID), Index(0),
+      Reader(Module.GetBufPtr(), Module.GetEndBufPtr(), Module.GetHeader()),
+      Cursor(Reader), BufferStream(Buffer),
+      ObjDump(BufferStream, Module.GetObjDump().GetDumpRecords(),
+              Module.GetObjDump().GetDumpAssembly()),
+      Parser(Module.GetHeader(), Cursor, ObjDump),
+      AssemblyNumTabs(Module.GetAssemblyNumTabs()),
+      RecordNumTabs(Module.GetObjDump().GetRecordIndenter().GetNumTabs()) {
+  // Abbreviations are reference counted without locking, so each
+  // reader gets its own copies.
+  for (const NaClBitstreamReader::BlockInfo &Info :
+       BlockInfoSource.getBlockInfoRecords()) {
+    NaClBitstreamReader::BlockInfo &Copy =
+        Reader.getOrCreateBlockInfo(Info.BlockID);
+    for (const NaClBitCodeAbbrev *Abbrev : Info.Abbrevs)
+      Copy.Abbrevs.push_back(Abbrev->Copy());
+  }
+  // Errors make the text unusable, so there is no need to stop at
+  // the maximum.
+  ObjDump.SetMaxErrors(std::numeric_limits<unsigned>::max());
+  Parser.InitFunctionWorker(Module, this);
+}
+
+void NaClDisFunctionWorker::dump(const NaClDisFunctionBlockPos &Pos,
+                                 size_t NewIndex,
+                                 NaClBcIndexSize_t DefinedIndex,
+                                 NaClDisFunctionText &Text) {
+  Index = NewIndex;
+  // A block that failed to parse may leave the indentation off.
+  Parser.SetIndentation(AssemblyNumTabs, RecordNumTabs);
+  Parser.StartFunctionBlock(DefinedIndex);
+  unsigned NumErrors = ObjDump.GetNumErrors();
+  bool Failed = NaClDisFunctionBlockStarter::Parse(&Parser, Cursor, Pos,
+                                                   Dumper->ModuleBit);
+  ObjDump.Flush();
+  Text.Usable = !Failed && ObjDump.GetNumErrors() == NumErrors &&
+                Cursor.GetCurrentBitNo() == Pos.EndBit &&
+                !Parser.GetIntrinsicsChanged();
+  Text.LastBit = ObjDump.GetRecordBitAddress();
+  Text.Text.swap(Buffer);
+}
+
+void NaClDisFunctionWorker::park() {
+  Dumper->park(this);
+  // The main thread disassembles the block again, and stops the
+  // executable at the same error. The lock and condition variable are
+  // never destroyed, since the thread waits on them until the
+  // executable exits.
+  static std::mutex *ParkLock = new std::mutex();
+  static std::condition_variable *Parked = new std::condition_variable();
+  std::unique_lock<std::mutex> L(*ParkLock);
+  while (true)
+    Parked->wait(L);
+}
+
+NaClDisFunctionDumper::NaClDisFunctionDumper(
+    NaClDisTopLevelParser &Module, const NaClBitstreamReader &BlockInfoSource,
+    uint64_t ModuleBit, const std::vector<NaClDisFunctionBlockPos> &Blocks,
+    size_t NumBlocks)
+    : ModuleBit(ModuleBit), Blocks(Blocks), NumBlocks(NumBlocks),
+      FirstDefinedIndex(Module.GetNumDefinedFunctions()),
+      Window(16 * Module.GetNumThreads()), Texts(NumBlocks),
+      NextBlock(0), NumReleased(0), FirstUnusable(NumBlocks), NumStopped(0),
+      Stop(false) {
+  unsigned NumThreads = std::min<size_t>(Module.GetNumThreads(), NumBlocks);
+  for (unsigned i = 0; i < NumThreads; ++i)
+    Workers.emplace_back(
+        new NaClDisFunctionWorker(this, i, Module, BlockInfoSource));
+  Parked.resize(NumThreads, false);
+  for (unsigned i = 0; i < NumThreads; ++i)
+    Threads.emplace_back(&NaClDisFunctionDumper::run, this, Workers[i].get());
+}
+
+NaClDisFunctionDumper::~NaClDisFunctionDumper() {
+  {
+    std::lock_guard<std::mutex> L(Lock);
+    Stop = true;
+  }
+  WorkAvailable.notify_all();
+  std::unique_lock<std::mutex> L(Lock);
+  WorkerStopped.wait(L, [this] { return NumStopped == Threads.size(); });
+  for (unsigned i = 0; i < Threads.size(); ++i) {
+    if (Parked[i]) {
+      // A parked worker never resumes. Its state is kept, since the
+      // stack of its thread still refers to it.
+      Threads[i].detach();
+      Workers[i].release();
+    } else {
+      Threads[i].join();
+    }
+  }
+}
+
+const NaClDisFunctionText &NaClDisFunctionDumper::getText(size_t Index) {
+  std::unique_lock<std::mutex> L(Lock);
+  TextReady.wait(L, [this, Index] { return Texts[Index] != nullptr; });
+  return *Texts[Index];
+}
+
+void NaClDisFunctionDumper::releaseText(size_t Index) {
+  {
+    std::lock_guard<std::mutex> L(Lock);
+    assert(Index == NumReleased && "Texts released out of order");
+    Texts[Index].reset();
+    ++NumReleased;
+  }
+  WorkAvailable.notify_all();
+}
+
+void NaClDisFunctionDumper::run(NaClDisFunctionWorker *Worker) {
+  while (true) {
+    size_t Index;
+    {
+      std::unique_lock<std::mutex> L(Lock);
+      WorkAvailable.wait(L, [this] {
+        return Stop || (NextBlock < FirstUnusable &&
+                        NextBlock < NumReleased + Window);
+      });
+      if (Stop) {
+        ++NumStopped;
+        break;
+      }
+      Index = NextBlock++;
+    }
+    std::unique_ptr<NaClDisFunctionText> Text(new NaClDisFunctionText());
+    Worker->dump(Blocks[Index], Index, FirstDefinedIndex + Index, *Text);
+    {
+      std::lock_guard<std::mutex> L(Lock);
+      if (!Text->Usable)
+        setUnusable(Index);
+      Texts[Index] = std::move(Text);
+    }
+    TextReady.notify_all();
+  }
+  WorkerStopped.notify_all();
+}
+
+void NaClDisFunctionDumper::park(NaClDisFunctionWorker *Worker) {
+  {
+    std::lock_guard<std::mutex> L(Lock);
+    Texts[Worker->getIndex()].reset(new NaClDisFunctionText());
+    setUnusable(Worker->getIndex());
+    Parked[Worker->getID()] = true;
+    ++NumStopped;
+  }
+  TextReady.notify_all();
+  WorkerStopped.notify_all();
+}
+
+#endif // LLVM_ENABLE_THREADS
+
+bool NaClDisTopLevelParser::ErrorAt(naclbitc::ErrorLevel Level, uint64_t Bit,
+                                    const std::string &Message) {
+  ObjDump.ErrorAt(Level, Bit) << Message << "\n";
+  if (Level == naclbitc::Fatal) {
+#if LLVM_ENABLE_THREADS
+    if (Worker)
+      Worker->park();
+#endif
+    ObjDump.FlushThenQuit();
+  }
+  return true;
+}
+
 /// Parses and disassembles the module block.
 class NaClDisModuleParser : public NaClDisBlockParser {
 public:
@@ -3352,6 +3866,24 @@ public:
   void PrintBlockHeader() override;
 
   void ProcessRecord() override;
+
+private:
+  // The positions of the run of function blocks not disassembled yet,
+  // when disassembling function blocks on multiple threads.
+  std::vector<NaClDisFunctionBlockPos> FunctionBlocks;
+
+  // Adds the function block just entered to the current run of
+  // function blocks, and disassembles the run once it ends. Returns
+  // true if unable to parse.
+  bool BatchFunctionBlock();
+
+  // Returns true if the next entry of the module block is a function
+  // block. Doesn't move the cursor.
+  bool AtFunctionBlock();
+
+  // Disassembles the run of function blocks, in order. Returns true
+  // if unable to parse.
+  bool DumpFunctionBlocks();
 };
 
 NaClDisModuleParser::~NaClDisModuleParser() {
@@ -3402,14 +3934,89 @@ bool NaClDisModuleParser::ParseBlock(unsigned BlockID) {
     return Parser.ParseThisBlock();
   }
   case naclbitc::FUNCTION_BLOCK_ID: {
+    if (Context->GetNumThreads() > 1)
+      return BatchFunctionBlock();
     NaClDisFunctionParser Parser(BlockID, this);
     return Parser.ParseThisBlock();
   }
+  case naclbitc::FUNCTION_INDEX_BLOCK_ID: {
+    NaClDisFunctionIndexParser Parser(BlockID, this);
+    return Parser.ParseThisBlock();
+  }
   default:
     return NaClDisBlockParser::ParseBlock(BlockID);
   }
 }
 
+bool NaClDisModuleParser::BatchFunctionBlock() {
+  NaClBitstreamCursor &Cursor = Record.GetCursor();
+  uint64_t StartBit = Record.GetStartBit();
+  uint64_t BodyBit = Cursor.GetCurrentBitNo();
+  if (Cursor.SkipBlock()) {
+    // The block can't be located, so leave it to the serial
+    // disassembly to report.
+    FunctionBlocks.emplace_back(StartBit, BodyBit,
+                                std::numeric_limits<uint64_t>::max());
+    return DumpFunctionBlocks();
+  }
+  FunctionBlocks.emplace_back(StartBit, BodyBit, Cursor.GetCurrentBitNo());
+  if (AtFunctionBlock())
+    return false;
+  return DumpFunctionBlocks();
+}
+
+bool NaClDisModuleParser::AtFunctionBlock() {
+  NaClBitstreamCursor &Cursor = Record.GetCursor();
+  if (Cursor.AtEndOfStream())
+    return false;
+  uint64_t Bit = Cursor.GetCurrentBitNo();
+  bool IsFunctionBlock =
+      Cursor.ReadCode() == naclbitc::ENTER_SUBBLOCK &&
+      Cursor.ReadSubBlockID() == naclbitc::FUNCTION_BLOCK_ID;
+  Cursor.JumpToBit(Bit);
+  return IsFunctionBlock;
+}
+
+bool NaClDisModuleParser::DumpFunctionBlocks() {
+  size_t NumDumped = 0;
+#if LLVM_ENABLE_THREADS
+  // The last block is disassembled here, so that the state of its
+  // values is left as the serial disassembly leaves it.
+  if (FunctionBlocks.size() > 1) {
+    size_t NumBlocks = FunctionBlocks.size() - 1;
+    NaClDisFunctionDumper Dumper(
+        *Context, *Record.GetCursor().getBitStreamReader(),
+        GetBlock().GetStartBit(), FunctionBlocks, NumBlocks);
+    naclbitc::ObjDumpStream &ObjDump = Context->GetObjDump();
+    for (; NumDumped < NumBlocks; ++NumDumped) {
+      const NaClDisFunctionText &Text = Dumper.getText(NumDumped);
+      // Disassemble the rest in order, so that errors are reported as
+      // the serial disassembly does.
+      if (!Text.Usable)
+        break;
+      ObjDump.WriteText(Text.Text);
+      ObjDump.SetRecordBitAddress(Text.LastBit);
+      Context->IncNumDefinedFunctions();
+      Dumper.releaseText(NumDumped);
+    }
+  }
+#endif
+  NaClBitstreamCursor &Cursor = Record.GetCursor();
+  for (; NumDumped < FunctionBlocks.size(); ++NumDumped) {
+    const NaClDisFunctionBlockPos &Pos = FunctionBlocks[NumDumped];
+    if (NaClDisFunctionBlockStarter::Parse(Context, Cursor, Pos,
+                                           GetBlock().GetStartBit())) {
+      FunctionBlocks.clear();
+      return true;
+    }
+    // The module block continues where the block ended.
+    if (Cursor.GetCurrentBitNo() != Pos.EndBit)
+      break;
+  }
+  FunctionBlocks.clear();
+  return false;
+}
+
 void NaClDisModuleParser::PrintBlockHeader() {
   Tokens() << "module" << Space() << OpenCurly()
            << Space() << Space() << "// BlockID = " << GetBlockID()
@@ -3540,7 +4147,7 @@ bool NaClDisTopLevelParser::ParseBlock(unsigned BlockID) {
 namespace llvm {
 
 bool NaClObjDump(MemoryBufferRef MemBuf, raw_ostream &Output,
-                 bool NoRecords, bool NoAssembly) {
+                 bool NoRecords, bool NoAssembly, unsigned NumThreads) {
   // Create objects needed to run parser.
   naclbitc::ObjDumpStream ObjDump(Output, !NoRecords, !NoAssembly);
 
@@ -3573,6 +4180,10 @@ bool NaClObjDump(MemoryBufferRef MemBuf, raw_ostream &Output,
 
   // Parse the the bitcode file.
   ::NaClDisTopLevelParser Parser(Header, InputStream, ObjDump);
+#if LLVM_ENABLE_THREADS
+  if (NumThreads > 1)
+    Parser.SetNumThreads(NumThreads, BufPtr, EndBufPtr);
+#endif
   int NumBlocksRead = 0;
   bool ErrorsFound = false;
   while (!InputStream.AtEndOfStream()) {
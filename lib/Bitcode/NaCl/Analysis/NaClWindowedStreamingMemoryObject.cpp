@@ -0,0 +1,77 @@
+//===- NaClWindowedStreamingMemoryObject.cpp ------------------------------===//
+//      Reads a data stream keeping only its most recent bytes.
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Bitcode/NaCl/NaClWindowedStreamingMemoryObject.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace llvm;
+
+const size_t NaClWindowedStreamingMemoryObject::DefaultWindowSize;
+const size_t NaClWindowedStreamingMemoryObject::DefaultChunkSize;
+
+NaClWindowedStreamingMemoryObject::NaClWindowedStreamingMemoryObject(
+    DataStreamer *Streamer, size_t WindowSize, size_t ChunkSize)
+    : WindowSize(WindowSize), ChunkSize(ChunkSize), Streamer(Streamer),
+      Bytes(WindowSize + ChunkSize), WindowStart(0), NumBytes(0),
+      EOFReached(false) {
+  assert(ChunkSize > 0 && "Can't read the stream in empty chunks");
+}
+
+NaClWindowedStreamingMemoryObject::~NaClWindowedStreamingMemoryObject() {}
+
+uint64_t NaClWindowedStreamingMemoryObject::getExtent() const {
+  while (!EOFReached)
+    fetchToPos(getNumBytesRead());
+  return getNumBytesRead();
+}
+
+uint64_t NaClWindowedStreamingMemoryObject::readBytes(uint8_t *Buf,
+                                                      uint64_t Size,
+                                                      uint64_t Address) const {
+  if (Address < WindowStart)
+    report_fatal_error("Bitcode read before the streamed window");
+  fetchToPos(Address + Size - 1);
+  uint64_t End = std::min(Address + Size, getNumBytesRead());
+  if (Address >= End)
+    return 0;
+  memcpy(Buf, &Bytes[Address - WindowStart], End - Address);
+  return End - Address;
+}
+
+const uint8_t *
+NaClWindowedStreamingMemoryObject::getPointer(uint64_t Address,
+                                              uint64_t Size) const {
+  llvm_unreachable("Streamed bitcode is not contiguous in memory");
+}
+
+bool NaClWindowedStreamingMemoryObject::isValidAddress(
+    uint64_t Address) const {
+  return Address < WindowStart || fetchToPos(Address);
+}
+
+bool NaClWindowedStreamingMemoryObject::fetchToPos(uint64_t Pos) const {
+  while (Pos >= getNumBytesRead() && !EOFReached) {
+    if (NumBytes + ChunkSize > Bytes.size()) {
+      size_t Drop = NumBytes - WindowSize;
+      memmove(&Bytes[0], &Bytes[Drop], NumBytes - Drop);
+      WindowStart += Drop;
+      NumBytes -= Drop;
+    }
+    size_t Read = Streamer->GetBytes(&Bytes[NumBytes], ChunkSize);
+    // Note: Reading a file streamer returns -1 on failure.
+    if (Read == 0 || Read > ChunkSize)
+      EOFReached = true;
+    else
+      NumBytes += Read;
+  }
+  return Pos < getNumBytesRead();
+}
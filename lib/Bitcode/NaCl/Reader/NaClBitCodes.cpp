@@ -98,8 +98,10 @@ void NaClBitCodeAbbrev::Print(raw_ostream &Stream, bool AddNewLine) const {
   if (AddNewLine) Stream << "\n";
 }
 
+const unsigned NaClBitCodeAbbrev::VariableWidth;
+
 NaClBitCodeAbbrev *NaClBitCodeAbbrev::Simplify() const {
-  NaClBitCodeAbbrev *Abbrev = new NaClBitCodeAbbrev();
+  SmallVector<NaClBitCodeAbbrevOp, 8> Ops;
   for (unsigned i = 0; i < OperandList.size(); ++i) {
     const NaClBitCodeAbbrevOp &Op = OperandList[i];
     // Simplify if possible.  Currently, the only simplification known
@@ -107,12 +109,16 @@ NaClBitCodeAbbrev *NaClBitCodeAbbrev::Simplify() const {
     // array operator. That is, apply the simplification:
     //    Op Array(Op) -> Array(Op)
     assert(!Op.isArrayOp() || i == OperandList.size()-2);
-    while (Op.isArrayOp() && !Abbrev->OperandList.empty() &&
-           Abbrev->OperandList.back() == OperandList[i+1]) {
-      Abbrev->OperandList.pop_back();
+    while (Op.isArrayOp() && !Ops.empty() && Ops.back() == OperandList[i+1]) {
+      Ops.pop_back();
     }
-    Abbrev->OperandList.push_back(Op);
+    Ops.push_back(Op);
   }
+  // Add the operands only once they are final, so that the decoding shape
+  // of the abbreviation is computed from them.
+  NaClBitCodeAbbrev *Abbrev = new NaClBitCodeAbbrev();
+  for (const NaClBitCodeAbbrevOp &Op : Ops)
+    Abbrev->Add(Op);
   return Abbrev;
 }
 
@@ -16,6 +16,7 @@
 #include "llvm/Analysis/NaCl/PNaClABITypeChecker.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeDecoders.h"
 #include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/AutoUpgrade.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -29,6 +30,11 @@
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
+#if LLVM_ENABLE_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
 using namespace llvm;
 
 
@@ -38,6 +44,13 @@ llvm::PNaClAllowLocalSymbolTables(
     cl::desc("Allow (function) local symbol tables in PNaCl bitcode files"),
     cl::init(false));
 
+static cl::opt<unsigned>
+DecodeThreads(
+    "bitcode-decode-threads",
+    cl::desc("Number of threads decoding function blocks when a whole PNaCl "
+             "bitcode module in memory is materialized"),
+    cl::init(1));
+
 static_assert(sizeof(NaClBcIndexSize_t) <= sizeof(size_t),
               "NaClBcIndexSize_t incorrectly defined");
 
@@ -47,6 +60,7 @@ void NaClBitcodeReader::FreeState() {
 
   std::vector<Function*>().swap(FunctionsWithBodies);
   DeferredFunctionInfo.clear();
+  DeferredFunctionBitSizes.clear();
 }
 
 //===----------------------------------------------------------------------===//
@@ -66,6 +80,12 @@ static bool ConvertToString(ArrayRef<uint64_t> Record, size_t Idx,
   return false;
 }
 
+NaClBitcodeReaderValueList::~NaClBitcodeReaderValueList() {
+  for (auto &Entry : FreePlaceholders)
+    for (Argument *Placeholder : Entry.second)
+      delete Placeholder;
+}
+
 void NaClBitcodeReaderValueList::AssignValue(Value *V, NaClBcIndexSize_t Idx) {
   assert(V);
   if (Idx == size()) {
@@ -76,28 +96,31 @@ void NaClBitcodeReaderValueList::AssignValue(Value *V, NaClBcIndexSize_t Idx) {
   if (Idx >= size())
     resize(Idx+1);
 
-  WeakVH &OldV = ValuePtrs[Idx];
-  if (OldV == 0) {
-    OldV = V;
+  Value *PrevVal = get(Idx);
+  set(Idx, V);
+  if (PrevVal == 0)
     return;
-  }
 
-  // If there was a forward reference to this value, replace it.
-  Value *PrevVal = OldV;
-  OldV->replaceAllUsesWith(V);
-  delete PrevVal;
+  // If there was a forward reference to this value, replace it, and keep
+  // the placeholder for the next forward reference of its type.
+  PrevVal->replaceAllUsesWith(V);
+  Argument *Placeholder = dyn_cast<Argument>(PrevVal);
+  if (Placeholder && Placeholder->getParent() == 0)
+    FreePlaceholders[Placeholder->getType()].push_back(Placeholder);
+  else
+    delete PrevVal;
 }
 
 void NaClBitcodeReaderValueList::OverwriteValue(Value *V,
                                                 NaClBcIndexSize_t Idx) {
-  ValuePtrs[Idx] = V;
+  set(Idx, V);
 }
 
 Value *NaClBitcodeReaderValueList::getValueFwdRef(NaClBcIndexSize_t Idx) {
   if (Idx >= size())
     return 0;
 
-  if (Value *V = ValuePtrs[Idx])
+  if (Value *V = get(Idx))
     return V;
 
   return 0;
@@ -109,7 +132,7 @@ bool NaClBitcodeReaderValueList::createValueFwdRef(NaClBcIndexSize_t Idx,
     resize(Idx + 1);
 
   // Return an error if this a duplicate definition of Idx.
-  if (ValuePtrs[Idx])
+  if (get(Idx))
     return true;
 
   // No type specified, must be invalid reference.
@@ -117,7 +140,13 @@ bool NaClBitcodeReaderValueList::createValueFwdRef(NaClBcIndexSize_t Idx,
     return true;
 
   // Create a placeholder, which will later be RAUW'd.
-  ValuePtrs[Idx] = new Argument(Ty);
+  std::vector<Argument*> &Free = FreePlaceholders[Ty];
+  if (Free.empty()) {
+    set(Idx, new Argument(Ty));
+  } else {
+    set(Idx, Free.back());
+    Free.pop_back();
+  }
   return false;
 }
 
@@ -197,7 +226,9 @@ static_assert(
 std::error_code NaClBitcodeReader::Error(ErrorType E,
                                          const std::string &Message) const {
   if (Verbose) {
-    naclbitc::ErrorAt(*Verbose, naclbitc::Error, Stream.GetCurrentBitNo())
+    naclbitc::ErrorAt(*Verbose, naclbitc::Error,
+                      Replay ? Replay->Entries[ReplayEntry - 1].EndBit
+                             : Stream.GetCurrentBitNo())
         << Message << "\n";
   }
   return Error(E);
@@ -258,16 +289,8 @@ std::error_code NaClBitcodeReader::ParseTypeTableBody() {
     Record.clear();
     Type *ResultTy = 0;
     unsigned TypeCode = Stream.readRecord(Entry.ID, Record);
-    switch (TypeCode) {
-    default: {
-      std::string Message;
-      raw_string_ostream StrM(Message);
-      StrM << "Unknown type code in type table: " << TypeCode;
-      StrM.flush();
-      return Error(InvalidValue, Message);
-    }
-
-    case naclbitc::TYPE_CODE_NUMENTRY: { // TYPE_CODE_NUMENTRY: [numentries]
+    if (TypeCode == naclbitc::TYPE_CODE_NUMENTRY) {
+      // TYPE_CODE_NUMENTRY: [numentries]
       // TYPE_CODE_NUMENTRY contains a count of the number of types in the
       // type list.  This allows us to reserve space.
       if (Record.size() != 1)
@@ -284,63 +307,11 @@ std::error_code NaClBitcodeReader::ParseTypeTableBody() {
       // smaller space.
       TypeList.resize(std::min(Size, (uint64_t) 1000000));
       ExpectedNumRecords = Size;
-      // No type was defined, skip the checks that follow the switch.
+      // No type was defined, skip the checks that follow.
       continue;
     }
-    case naclbitc::TYPE_CODE_VOID: // VOID
-      if (Record.size() != 0)
-        return Error(InvalidRecord, "Invalid TYPE_CODE_VOID record");
-      ResultTy = Type::getVoidTy(Context);
-      break;
-
-    case naclbitc::TYPE_CODE_FLOAT: // FLOAT
-      if (Record.size() != 0)
-        return Error(InvalidRecord, "Invalid TYPE_CODE_FLOAT record");
-      ResultTy = Type::getFloatTy(Context);
-      break;
-
-    case naclbitc::TYPE_CODE_DOUBLE: // DOUBLE
-      if (Record.size() != 0)
-        return Error(InvalidRecord, "Invalid TYPE_CODE_DOUBLE record");
-      ResultTy = Type::getDoubleTy(Context);
-      break;
-
-    case naclbitc::TYPE_CODE_INTEGER: // INTEGER: [width]
-      if (Record.size() != 1)
-        return Error(InvalidRecord, "Invalid TYPE_CODE_INTEGER record");
-      // TODO(kschimpf): Should we check if Record[0] is in range?
-      ResultTy = IntegerType::get(Context, Record[0]);
-      break;
-
-    case naclbitc::TYPE_CODE_FUNCTION: {
-      // FUNCTION: [vararg, retty, paramty x N]
-      if (Record.size() < 2)
-        return Error(InvalidRecord, "Invalid TYPE_CODE_FUNCTION record");
-      SmallVector<Type *, 8> ArgTys;
-      for (size_t i = 2, e = Record.size(); i != e; ++i) {
-        if (Type *T = getTypeByID(Record[i]))
-          ArgTys.push_back(T);
-        else
-          break;
-      }
-
-      ResultTy = getTypeByID(Record[1]);
-      if (ResultTy == 0 || ArgTys.size() < Record.size() - 2)
-        return Error(InvalidType, "invalid type in function type");
-
-      ResultTy = FunctionType::get(ResultTy, ArgTys, Record[0]);
-      break;
-    }
-    case naclbitc::TYPE_CODE_VECTOR: { // VECTOR: [numelts, eltty]
-      if (Record.size() != 2)
-        return Error(InvalidRecord, "Invalid VECTOR type record");
-      if ((ResultTy = getTypeByID(Record[1])))
-        ResultTy = VectorType::get(ResultTy, Record[0]);
-      else
-        return Error(InvalidType, "invalid type in vector type");
-      break;
-    }
-    }
+    if (std::error_code EC = getTypeFromRecord(TypeCode, Record, ResultTy))
+      return EC;
 
     if (NumRecords >= ExpectedNumRecords)
       return Error(MalformedBlock, "invalid TYPE table");
@@ -353,6 +324,74 @@ std::error_code NaClBitcodeReader::ParseTypeTableBody() {
   return std::error_code();
 }
 
+std::error_code NaClBitcodeReader::getTypeFromRecord(
+    unsigned TypeCode, ArrayRef<uint64_t> Record, Type *&ResultTy) {
+  switch (TypeCode) {
+  default: {
+    std::string Message;
+    raw_string_ostream StrM(Message);
+    StrM << "Unknown type code in type table: " << TypeCode;
+    StrM.flush();
+    return Error(InvalidValue, Message);
+  }
+
+  case naclbitc::TYPE_CODE_VOID: // VOID
+    if (Record.size() != 0)
+      return Error(InvalidRecord, "Invalid TYPE_CODE_VOID record");
+    ResultTy = Type::getVoidTy(Context);
+    break;
+
+  case naclbitc::TYPE_CODE_FLOAT: // FLOAT
+    if (Record.size() != 0)
+      return Error(InvalidRecord, "Invalid TYPE_CODE_FLOAT record");
+    ResultTy = Type::getFloatTy(Context);
+    break;
+
+  case naclbitc::TYPE_CODE_DOUBLE: // DOUBLE
+    if (Record.size() != 0)
+      return Error(InvalidRecord, "Invalid TYPE_CODE_DOUBLE record");
+    ResultTy = Type::getDoubleTy(Context);
+    break;
+
+  case naclbitc::TYPE_CODE_INTEGER: // INTEGER: [width]
+    if (Record.size() != 1)
+      return Error(InvalidRecord, "Invalid TYPE_CODE_INTEGER record");
+    // TODO(kschimpf): Should we check if Record[0] is in range?
+    ResultTy = IntegerType::get(Context, Record[0]);
+    break;
+
+  case naclbitc::TYPE_CODE_FUNCTION: {
+    // FUNCTION: [vararg, retty, paramty x N]
+    if (Record.size() < 2)
+      return Error(InvalidRecord, "Invalid TYPE_CODE_FUNCTION record");
+    SmallVector<Type *, 8> ArgTys;
+    for (size_t i = 2, e = Record.size(); i != e; ++i) {
+      if (Type *T = getTypeByID(Record[i]))
+        ArgTys.push_back(T);
+      else
+        break;
+    }
+
+    ResultTy = getTypeByID(Record[1]);
+    if (ResultTy == 0 || ArgTys.size() < Record.size() - 2)
+      return Error(InvalidType, "invalid type in function type");
+
+    ResultTy = FunctionType::get(ResultTy, ArgTys, Record[0]);
+    break;
+  }
+  case naclbitc::TYPE_CODE_VECTOR: { // VECTOR: [numelts, eltty]
+    if (Record.size() != 2)
+      return Error(InvalidRecord, "Invalid VECTOR type record");
+    if ((ResultTy = getTypeByID(Record[1])))
+      ResultTy = VectorType::get(ResultTy, Record[0]);
+    else
+      return Error(InvalidType, "invalid type in vector type");
+    break;
+  }
+  }
+  return std::error_code();
+}
+
 namespace {
 
 // Class to process globals in two passes. In the first pass, build
@@ -698,7 +737,7 @@ std::error_code NaClBitcodeReader::ParseGlobalVars() {
 
 std::error_code NaClBitcodeReader::ParseValueSymbolTable() {
   DEBUG(dbgs() << "-> ParseValueSymbolTable\n");
-  if (Stream.EnterSubBlock(naclbitc::VALUE_SYMTAB_BLOCK_ID))
+  if (EnterSubBlockInFunction(naclbitc::VALUE_SYMTAB_BLOCK_ID))
     return Error(InvalidRecord, "Malformed block record");
 
   SmallVector<uint64_t, 64> Record;
@@ -706,7 +745,7 @@ std::error_code NaClBitcodeReader::ParseValueSymbolTable() {
   // Read all the records for this value table.
   SmallString<128> ValueName;
   while (1) {
-    NaClBitstreamEntry Entry = Stream.advance(0, nullptr);
+    NaClBitstreamEntry Entry = advanceInFunction();
 
     switch (Entry.Kind) {
     case NaClBitstreamEntry::SubBlock:
@@ -724,7 +763,7 @@ std::error_code NaClBitcodeReader::ParseValueSymbolTable() {
 
     // Read a record.
     Record.clear();
-    switch (Stream.readRecord(Entry.ID, Record)) {
+    switch (readRecordInFunction(Entry.ID, Record)) {
     default:  // Default behavior: unknown type.
       break;
     case naclbitc::VST_CODE_ENTRY: {  // VST_ENTRY: [valueid, namechar x N]
@@ -755,7 +794,7 @@ std::error_code NaClBitcodeReader::ParseValueSymbolTable() {
 
 std::error_code NaClBitcodeReader::ParseConstants() {
   DEBUG(dbgs() << "-> ParseConstants\n");
-  if (Stream.EnterSubBlock(naclbitc::CONSTANTS_BLOCK_ID))
+  if (EnterSubBlockInFunction(naclbitc::CONSTANTS_BLOCK_ID))
     return Error(InvalidRecord, "Malformed block record");
 
   SmallVector<uint64_t, 64> Record;
@@ -764,7 +803,7 @@ std::error_code NaClBitcodeReader::ParseConstants() {
   Type *CurTy = Type::getInt32Ty(Context);
   NaClBcIndexSize_t NextCstNo = ValueList.size();
   while (1) {
-    NaClBitstreamEntry Entry = Stream.advance(0, nullptr);
+    NaClBitstreamEntry Entry = advanceInFunction();
 
     switch (Entry.Kind) {
     case NaClBitstreamEntry::SubBlock:
@@ -785,7 +824,7 @@ std::error_code NaClBitcodeReader::ParseConstants() {
     // Read a record.
     Record.clear();
     Value *V = 0;
-    unsigned BitCode = Stream.readRecord(Entry.ID, Record);
+    unsigned BitCode = readRecordInFunction(Entry.ID, Record);
     switch (BitCode) {
     default: {
       std::string Message;
@@ -853,10 +892,130 @@ std::error_code NaClBitcodeReader::RememberAndSkipFunctionBody() {
   // Skip over the function block for now.
   if (Stream.SkipBlock())
     return Error(InvalidSkippedBlock, "Unable to skip function block.");
+  DeferredFunctionBitSizes[Fn] = Stream.GetCurrentBitNo() - CurBit;
   DEBUG(dbgs() << "<- RememberAndSkipFunctionBody\n");
   return std::error_code();
 }
 
+/// ParseFunctionIndex - Read the positions of the function bodies from the
+/// function index block, so that a streamed function body can be found
+/// without first skipping over the bodies before it.
+///
+/// The index is only used if its entries are the function blocks that follow
+/// it, one after the other and inside the module block. The block header at
+/// each position is checked when its body is read (see isFunctionBlockAt).
+/// If a check fails, the index is dropped, and the bodies are found by
+/// skipping over the blocks before them, as without an index.
+std::error_code NaClBitcodeReader::ParseFunctionIndex() {
+  DEBUG(dbgs() << "-> ParseFunctionIndex\n");
+  // Unless streaming, the bodies are all found while parsing the module.
+  if (!LazyStreamer || SeenFirstFunctionBody) {
+    if (Stream.SkipBlock())
+      return Error(InvalidSkippedBlock, "Unable to skip function index block");
+    DEBUG(dbgs() << "<- ParseFunctionIndex\n");
+    return std::error_code();
+  }
+
+  // The index locates whole function blocks, but the position of a body is
+  // kept after the abbreviation index and block ID of its block (see
+  // RememberAndSkipFunctionBody), which use the widths of the module block.
+  assert(naclbitc::FUNCTION_BLOCK_ID < (1U << (naclbitc::BlockIDWidth - 1)) &&
+         "Function block ID not read as a single VBR chunk");
+  uint64_t HeaderBits = ModuleAbbrevIDWidth + naclbitc::BlockIDWidth;
+  unsigned NumWords;
+  if (Stream.EnterSubBlock(naclbitc::FUNCTION_INDEX_BLOCK_ID, &NumWords))
+    return Error(InvalidRecord, "Malformed block record");
+
+  SmallVector<uint64_t, 2> Record;
+  std::vector<std::pair<uint64_t, uint64_t>> Bodies;
+  // The bodies follow the index, in order.
+  uint64_t NextBit = Stream.GetCurrentBitNo() + NumWords * 32ULL;
+  bool Matches = true;
+  while (1) {
+    NaClBitstreamEntry Entry = Stream.advance(0, nullptr);
+
+    switch (Entry.Kind) {
+    case NaClBitstreamEntry::SubBlock:
+      return Error(InvalidBlock, "Invalid block in the function index block");
+    case NaClBitstreamEntry::Error:
+      return Error(MalformedBlock, "malformed function index block");
+    case NaClBitstreamEntry::EndBlock:
+      if (!Matches || Bodies.size() != FunctionsWithBodies.size()) {
+        DEBUG(dbgs() << "Function index does not match the function bodies\n"
+                     << "<- ParseFunctionIndex\n");
+        return std::error_code();
+      }
+      for (size_t i = 0, e = Bodies.size(); i != e; ++i) {
+        Function *Fn = FunctionsWithBodies[i];
+        DeferredFunctionInfo[Fn] = Bodies[i].first;
+        DeferredFunctionBitSizes[Fn] = Bodies[i].second;
+      }
+      UsesFunctionIndex = true;
+      DEBUG(dbgs() << "<- ParseFunctionIndex\n");
+      return std::error_code();
+    case NaClBitstreamEntry::Record:
+      // The interesting case.
+      break;
+    }
+
+    // Read a record.
+    Record.clear();
+    switch (Stream.readRecord(Entry.ID, Record)) {
+    default:
+      return Error(InvalidValue, "Invalid FUNCTION_INDEX code");
+    case naclbitc::FUNCTION_INDEX_ENTRY: {  // ENTRY: [startword, numwords]
+      if (!Matches || Record.size() != 2) {
+        Matches = false;
+        break;
+      }
+      uint64_t StartBit = Record[0] * 32;
+      uint64_t NumBits = Record[1] * 32;
+      if (StartBit != NextBit || NumBits <= HeaderBits ||
+          StartBit > ModuleEndBit || NumBits > ModuleEndBit - StartBit) {
+        Matches = false;
+        break;
+      }
+      Bodies.push_back(std::make_pair(StartBit + HeaderBits,
+                                      NumBits - HeaderBits));
+      NextBit = StartBit + NumBits;
+      break;
+    }
+    }
+  }
+}
+
+/// isFunctionBlockAt - Returns true if the body at Bit, of BitSize bits, is
+/// that of a function block whose header ends at Bit. Moves Stream.
+bool NaClBitcodeReader::isFunctionBlockAt(uint64_t Bit, uint64_t BitSize) {
+  uint64_t HeaderBits = ModuleAbbrevIDWidth + naclbitc::BlockIDWidth;
+  uint64_t EndBit = Bit + BitSize;
+  if (Bit < HeaderBits || EndBit <= Bit ||
+      !Stream.canSkipToPos(EndBit / CHAR_BIT))
+    return false;
+  Stream.JumpToBit(Bit - HeaderBits);
+  if (Stream.Read(ModuleAbbrevIDWidth) != naclbitc::ENTER_SUBBLOCK ||
+      Stream.ReadSubBlockID() != naclbitc::FUNCTION_BLOCK_ID ||
+      Stream.SkipBlock())
+    return false;
+  return Stream.GetCurrentBitNo() == EndBit;
+}
+
+/// dropFunctionIndex - Forget the positions of the function bodies that were
+/// read from the function index, so that they are found by skipping over
+/// the blocks before them.
+void NaClBitcodeReader::dropFunctionIndex() {
+  if (Snapshot) {
+    Snapshot->forgetFoundBodies();
+    return;
+  }
+  UsesFunctionIndex = false;
+  // The bodies not yet skipped over.
+  for (Function *Fn : FunctionsWithBodies) {
+    DeferredFunctionInfo[Fn] = 0;
+    DeferredFunctionBitSizes.erase(Fn);
+  }
+}
+
 std::error_code NaClBitcodeReader::GlobalCleanup() {
   // Look for intrinsic functions which need to be upgraded at some point
   for (Module::iterator FI = TheModule->begin(), FE = TheModule->end();
@@ -930,10 +1089,15 @@ void NaClBitcodeReader::AddPointerTypesToIntrinsicParams() {
 
 std::error_code NaClBitcodeReader::ParseModule(bool Resume) {
   DEBUG(dbgs() << "-> ParseModule\n");
-  if (Resume)
+  if (Resume) {
     Stream.JumpToBit(NextUnreadBit);
-  else if (Stream.EnterSubBlock(naclbitc::MODULE_BLOCK_ID))
-    return Error(InvalidRecord, "Malformed block record");
+  } else {
+    unsigned NumWords;
+    if (Stream.EnterSubBlock(naclbitc::MODULE_BLOCK_ID, &NumWords))
+      return Error(InvalidRecord, "Malformed block record");
+    ModuleAbbrevIDWidth = Stream.getAbbrevIDWidth();
+    ModuleEndBit = Stream.GetCurrentBitNo() + NumWords * 32ULL;
+  }
 
   SmallVector<uint64_t, 64> Record;
 
@@ -979,6 +1143,10 @@ std::error_code NaClBitcodeReader::ParseModule(bool Resume) {
         // pointer types to the intrinsic declarations' types.
         AddPointerTypesToIntrinsicParams();
         break;
+      case naclbitc::FUNCTION_INDEX_BLOCK_ID:
+        if (std::error_code EC = ParseFunctionIndex())
+          return EC;
+        break;
       case naclbitc::FUNCTION_BLOCK_ID:
         // If this is the first function body we've seen, reverse the
         // FunctionsWithBodies list.
@@ -1132,6 +1300,219 @@ std::error_code NaClBitcodeReader::ParseBitcodeInto(Module *M) {
   }
 }
 
+std::unique_ptr<NaClModuleSnapshot>
+NaClBitcodeReader::takeSnapshot(StreamingMemoryObject *Streamer) {
+  std::unique_ptr<NaClModuleSnapshot> S(new NaClModuleSnapshot(
+      Streamer, Header.getHeaderSize(), Header.getAlignBitcodeRecords()));
+  if (!TheModule || !LazyStreamer || Snapshot)
+    return nullptr;
+
+  // Record each type as the type record it was read from.
+  DenseMap<Type*, unsigned> TypeIDs;
+  S->Types.resize(TypeList.size());
+  for (size_t i = 0, e = TypeList.size(); i != e; ++i) {
+    Type *Ty = TypeList[i];
+    if (!Ty)
+      return nullptr;
+    NaClModuleSnapshot::TypeEntry &Entry = S->Types[i];
+    switch (Ty->getTypeID()) {
+    default:
+      return nullptr;
+    case Type::VoidTyID:
+      Entry.Code = naclbitc::TYPE_CODE_VOID;
+      break;
+    case Type::FloatTyID:
+      Entry.Code = naclbitc::TYPE_CODE_FLOAT;
+      break;
+    case Type::DoubleTyID:
+      Entry.Code = naclbitc::TYPE_CODE_DOUBLE;
+      break;
+    case Type::IntegerTyID:
+      Entry.Code = naclbitc::TYPE_CODE_INTEGER;
+      Entry.Ops.push_back(cast<IntegerType>(Ty)->getBitWidth());
+      break;
+    case Type::FunctionTyID:
+      // FUNCTION: [vararg, retty, paramty x N]
+      Entry.Code = naclbitc::TYPE_CODE_FUNCTION;
+      Entry.Ops.push_back(cast<FunctionType>(Ty)->isVarArg());
+      break;
+    case Type::VectorTyID:
+      // VECTOR: [numelts, eltty]
+      Entry.Code = naclbitc::TYPE_CODE_VECTOR;
+      Entry.Ops.push_back(cast<VectorType>(Ty)->getNumElements());
+      break;
+    }
+    for (Type *SubTy : Ty->subtypes()) {
+      DenseMap<Type*, unsigned>::iterator Pos = TypeIDs.find(SubTy);
+      if (Pos == TypeIDs.end())
+        return nullptr;
+      Entry.Ops.push_back(Pos->second);
+    }
+    TypeIDs.insert(std::make_pair(Ty, static_cast<unsigned>(i)));
+  }
+
+  // Record the functions and global variables in value list order, which
+  // is the order they were created in.
+  std::vector<Function*> Bodies;
+  S->NumValues = ValueList.size();
+  S->NameOffsets.reserve(S->NumValues + 1);
+  for (unsigned ValueID = 0; ValueID < S->NumValues; ++ValueID) {
+    Value *V = ValueList[ValueID];
+    if (!V)
+      return nullptr;
+    S->NameOffsets.push_back(S->NamePool.size());
+    S->NamePool.append(V->getName().begin(), V->getName().end());
+
+    if (Function *Func = dyn_cast<Function>(V)) {
+      NaClModuleSnapshot::FunctionEntry Entry;
+      Entry.ValueID = ValueID;
+      // Intrinsics were declared with pointer arguments replaced by
+      // IntPtrType, and got their pointer types from their names.
+      FunctionType *FTy = Func->getFunctionType();
+      if (Func->isIntrinsic()) {
+        SmallVector<Type*, 8> ArgTys;
+        for (Type *ArgTy : FTy->params())
+          ArgTys.push_back(ArgTy->isPointerTy() ? IntPtrType : ArgTy);
+        Type *RetTy = FTy->getReturnType();
+        FTy = FunctionType::get(RetTy->isPointerTy() ? IntPtrType : RetTy,
+                                ArgTys, FTy->isVarArg());
+      }
+      DenseMap<Type*, unsigned>::iterator Pos = TypeIDs.find(FTy);
+      if (Pos == TypeIDs.end())
+        return nullptr;
+      Entry.TypeID = Pos->second;
+      Entry.CallingConv = Func->getCallingConv();
+      Entry.Linkage = Func->getLinkage();
+      Entry.BodyIndex = NaClModuleSnapshot::NoBody;
+      if (DeferredFunctionInfo.count(Func)) {
+        Entry.BodyIndex = Bodies.size();
+        Bodies.push_back(Func);
+      }
+      S->Functions.push_back(Entry);
+      continue;
+    }
+
+    GlobalVariable *GV = dyn_cast<GlobalVariable>(V);
+    if (!GV)
+      return nullptr;
+    NaClModuleSnapshot::GlobalVarEntry Entry;
+    Entry.ValueID = ValueID;
+    Entry.Alignment = GV->getAlignment();
+    Entry.IsConstant = GV->isConstant();
+    // Recover the initializer records from the type of the variable, as
+    // built by ParseGlobalsHandler::GenerateGlobalVarsPass.
+    Type *Ty = GV->getType()->getElementType();
+    ArrayRef<Type*> InitTys(Ty);
+    if (StructType *STy = dyn_cast<StructType>(Ty)) {
+      if (!STy->isLiteral() || !STy->isPacked() || STy->getNumElements() < 2)
+        return nullptr;
+      InitTys = STy->elements();
+    }
+    for (Type *InitTy : InitTys) {
+      if (InitTy == IntPtrType) {
+        Entry.InitSizes.push_back(NaClModuleSnapshot::RelocInit);
+        continue;
+      }
+      ArrayType *ATy = dyn_cast<ArrayType>(InitTy);
+      if (!ATy || !ATy->getElementType()->isIntegerTy(8))
+        return nullptr;
+      Entry.InitSizes.push_back(ATy->getNumElements());
+    }
+    S->GlobalVars.push_back(Entry);
+  }
+  S->NameOffsets.push_back(S->NamePool.size());
+
+  // Share the positions of the bodies found so far.
+  S->ModuleAbbrevIDWidth = ModuleAbbrevIDWidth;
+  S->BodiesFromIndex = UsesFunctionIndex;
+  S->BodyBits.resize(Bodies.size());
+  S->BodyBitSizes.resize(Bodies.size());
+  for (Function *Func : Bodies) {
+    uint64_t Bit = DeferredFunctionInfo.lookup(Func);
+    if (Bit == 0)
+      break;
+    S->BodyBits[S->NumBodiesFound] = Bit;
+    S->BodyBitSizes[S->NumBodiesFound] = DeferredFunctionBitSizes.lookup(Func);
+    ++S->NumBodiesFound;
+  }
+
+  for (const NaClBitstreamReader::BlockInfo &Info :
+       StreamFile->getBlockInfoRecords()) {
+    S->BlockInfos.push_back(NaClBitstreamReader::BlockInfo());
+    S->BlockInfos.back().BlockID = Info.BlockID;
+    for (const NaClBitCodeAbbrev *Abbrev : Info.Abbrevs)
+      S->BlockInfos.back().Abbrevs.push_back(Abbrev->Copy());
+  }
+  return S;
+}
+
+std::error_code NaClBitcodeReader::ParseSnapshotInto(Module *M) {
+  assert(Snapshot && LazyStreamer && "No snapshot to instantiate");
+  TheModule = M;
+  M->setDataLayout(PNaClDataLayout);
+
+  // The header was accepted when the snapshot was taken.
+  StreamFile.reset(new NaClBitstreamReader(LazyStreamer, Snapshot->HeaderSize,
+                                           Snapshot->AlignBitcodeRecords));
+  Snapshot->installBlockInfo(*StreamFile);
+  Stream.init(StreamFile.get());
+  ModuleAbbrevIDWidth = Snapshot->ModuleAbbrevIDWidth;
+
+  TypeList.resize(Snapshot->Types.size());
+  for (size_t i = 0, e = TypeList.size(); i != e; ++i) {
+    const NaClModuleSnapshot::TypeEntry &Entry = Snapshot->Types[i];
+    if (std::error_code EC =
+            getTypeFromRecord(Entry.Code, Entry.Ops, TypeList[i]))
+      return EC;
+  }
+
+  // Recreate the values the way ParseModule does, so that the functions
+  // and global variables end up in the same order.
+  const std::string &NamePool = Snapshot->NamePool;
+  const std::vector<unsigned> &NameOffsets = Snapshot->NameOffsets;
+  ValueList.resize(Snapshot->NumValues);
+  for (const NaClModuleSnapshot::FunctionEntry &Entry : Snapshot->Functions) {
+    Function *Func = Function::Create(
+        cast<FunctionType>(TypeList[Entry.TypeID]), Entry.Linkage,
+        StringRef(NamePool.data() + NameOffsets[Entry.ValueID],
+                  NameOffsets[Entry.ValueID + 1] - NameOffsets[Entry.ValueID]),
+        TheModule);
+    Func->setCallingConv(Entry.CallingConv);
+    ValueList.AssignValue(Func, Entry.ValueID);
+    if (Entry.BodyIndex != NaClModuleSnapshot::NoBody) {
+      Func->setIsMaterializable(true);
+      DeferredFunctionInfo[Func] = 0;
+      SnapshotBodyIndex[Func] = Entry.BodyIndex;
+    }
+  }
+
+  // Global variables are declarations, as in the split modules of
+  // pnacl-llc, so their initializers are never needed.
+  for (const NaClModuleSnapshot::GlobalVarEntry &Entry : Snapshot->GlobalVars) {
+    SmallVector<Type*, 10> VarType;
+    for (uint64_t Size : Entry.InitSizes) {
+      if (Size == NaClModuleSnapshot::RelocInit)
+        VarType.push_back(IntPtrType);
+      else
+        VarType.push_back(ArrayType::get(Type::getInt8Ty(Context), Size));
+    }
+    Type *Ty = VarType.size() == 1 ? VarType[0]
+                                   : StructType::get(Context, VarType, true);
+    GlobalVariable *GV = new GlobalVariable(
+        *TheModule, Ty, Entry.IsConstant, GlobalValue::ExternalLinkage,
+        nullptr,
+        StringRef(NamePool.data() + NameOffsets[Entry.ValueID],
+                  NameOffsets[Entry.ValueID + 1] - NameOffsets[Entry.ValueID]));
+    GV->setAlignment(Entry.Alignment);
+    ValueList.AssignValue(GV, Entry.ValueID);
+  }
+
+  SeenValueSymbolTable = true;
+  AddPointerTypesToIntrinsicParams();
+  SeenFirstFunctionBody = true;
+  return GlobalCleanup();
+}
+
 // Returns true if error occured installing I into BB.
 std::error_code NaClBitcodeReader::InstallInstruction(
     BasicBlock *BB, Instruction *I) {
@@ -1152,18 +1533,16 @@ NaClBitcodeReader::CreateCast(NaClBcIndexSize_t BBIndex,
                               Type *CT, Value *V, bool DeferInsertion) {
   if (BBIndex >= FunctionBBs.size())
     report_fatal_error("CreateCast on unknown basic block");
-  BasicBlockInfo &BBInfo = FunctionBBs[BBIndex];
   NaClBitcodeReaderCast ModeledCast(Op, CT, V);
-  CastInst *Cast = BBInfo.CastMap[ModeledCast];
+  CastInst *&Cast = CastMap[std::make_pair(BBIndex, ModeledCast)];
   if (Cast == NULL) {
     Cast = CastInst::Create(Op, V, CT);
-    BBInfo.CastMap[ModeledCast] = Cast;
     if (DeferInsertion) {
-      BBInfo.PhiCasts.push_back(Cast);
+      PhiCasts.push_back(std::make_pair(BBIndex, Cast));
     }
   }
   if (!DeferInsertion && Cast->getParent() == 0) {
-    InstallInstruction(BBInfo.BB, Cast);
+    InstallInstruction(FunctionBBs[BBIndex], Cast);
   }
   return Cast;
 }
@@ -1199,12 +1578,102 @@ Value *NaClBitcodeReader::ConvertOpToType(Value *Op, Type *T,
   report_fatal_error(StrM.str());
 }
 
+void NaClDecodedBlock::decode(NaClBitstreamCursor &Cursor, uint64_t Bit) {
+  Entries.clear();
+  Values.clear();
+  SmallVector<uint64_t, 64> Record;
+  Cursor.JumpToBit(Bit);
+  // The first entry is the function block itself. As for all subblocks, its
+  // Code is non-zero if the block could not be entered.
+  EntryInfo Info;
+  Info.Entry = NaClBitstreamEntry::getSubBlock(naclbitc::FUNCTION_BLOCK_ID);
+  Info.Code = Cursor.EnterSubBlock(naclbitc::FUNCTION_BLOCK_ID);
+  Info.ValuesEnd = 0;
+  Info.EndBit = Cursor.GetCurrentBitNo();
+  Entries.push_back(Info);
+  if (Info.Code)
+    return;
+  unsigned Depth = 1;
+  while (true) {
+    Info.Entry = Cursor.advance(0, nullptr);
+    Info.Code = 0;
+    switch (Info.Entry.Kind) {
+    case NaClBitstreamEntry::Error:
+      break;
+    case NaClBitstreamEntry::EndBlock:
+      --Depth;
+      break;
+    case NaClBitstreamEntry::SubBlock:
+      // Only the blocks ParseFunctionBody accepts are entered. The parse
+      // stops at any other block, so there is no need to decode further.
+      if (Depth > 1 ||
+          (Info.Entry.ID != naclbitc::CONSTANTS_BLOCK_ID &&
+           (Info.Entry.ID != naclbitc::VALUE_SYMTAB_BLOCK_ID ||
+            !PNaClAllowLocalSymbolTables))) {
+        Depth = 0;
+        break;
+      }
+      Info.Code = Cursor.EnterSubBlock(Info.Entry.ID);
+      if (Info.Code)
+        Depth = 0;
+      else
+        ++Depth;
+      break;
+    case NaClBitstreamEntry::Record:
+      Record.clear();
+      Info.Code = Cursor.readRecord(Info.Entry.ID, Record);
+      Values.insert(Values.end(), Record.begin(), Record.end());
+      break;
+    }
+    Info.ValuesEnd = Values.size();
+    Info.EndBit = Cursor.GetCurrentBitNo();
+    Entries.push_back(Info);
+    if (Info.Entry.Kind == NaClBitstreamEntry::Error || Depth == 0)
+      return;
+  }
+}
+
+NaClBitstreamEntry NaClBitcodeReader::advanceInFunction() {
+  if (!Replay)
+    return Stream.advance(0, nullptr);
+  if (ReplayEntry == Replay->Entries.size())
+    return NaClBitstreamEntry::getError();
+  return Replay->Entries[ReplayEntry++].Entry;
+}
+
+unsigned NaClBitcodeReader::readRecordInFunction(
+    unsigned AbbrevID, SmallVectorImpl<uint64_t> &Vals) {
+  if (!Replay)
+    return Stream.readRecord(AbbrevID, Vals);
+  // Called right after advanceInFunction returned the record.
+  const NaClDecodedBlock::EntryInfo &Info = Replay->Entries[ReplayEntry - 1];
+  Vals.append(Replay->Values.begin() + ReplayValue,
+              Replay->Values.begin() + Info.ValuesEnd);
+  ReplayValue = Info.ValuesEnd;
+  return Info.Code;
+}
+
+bool NaClBitcodeReader::EnterSubBlockInFunction(unsigned BlockID) {
+  if (!Replay)
+    return Stream.EnterSubBlock(BlockID);
+  // The block was entered when decoded. The function block is the first
+  // entry, which is consumed here.
+  if (ReplayEntry == 0)
+    ++ReplayEntry;
+  return Replay->Entries[ReplayEntry - 1].Code != 0;
+}
+
 /// ParseFunctionBody - Lazily parse the specified function body block.
 std::error_code NaClBitcodeReader::ParseFunctionBody(Function *F) {
   DEBUG(dbgs() << "-> ParseFunctionBody\n");
-  if (Stream.EnterSubBlock(naclbitc::FUNCTION_BLOCK_ID))
+  if (EnterSubBlockInFunction(naclbitc::FUNCTION_BLOCK_ID))
     return Error(InvalidRecord, "Malformed block record");
 
+  // Start from empty per-function state, even if the last parse failed.
+  ValueList.beginFunctionValues();
+  FunctionBBs.clear();
+  CastMap.clear();
+  PhiCasts.clear();
   NaClBcIndexSize_t ModuleValueListSize = ValueList.size();
 
   // Add all the function arguments to the value table.
@@ -1218,7 +1687,7 @@ std::error_code NaClBitcodeReader::ParseFunctionBody(Function *F) {
   // Read all the records.
   SmallVector<uint64_t, 64> Record;
   while (1) {
-    NaClBitstreamEntry Entry = Stream.advance(0, nullptr);
+    NaClBitstreamEntry Entry = advanceInFunction();
 
     switch (Entry.Kind) {
     case NaClBitstreamEntry::Error:
@@ -1255,7 +1724,7 @@ std::error_code NaClBitcodeReader::ParseFunctionBody(Function *F) {
     // Read a record.
     Record.clear();
     Instruction *I = 0;
-    unsigned BitCode = Stream.readRecord(Entry.ID, Record);
+    unsigned BitCode = readRecordInFunction(Entry.ID, Record);
     switch (BitCode) {
     default: {// Default behavior: reject
       std::string Message;
@@ -1275,11 +1744,9 @@ std::error_code NaClBitcodeReader::ParseFunctionBody(Function *F) {
       // TODO(kschimpf): Figure out how to handle size values that
       // are too large.
       FunctionBBs.resize(Record[0]);
-      for (size_t i = 0, e = FunctionBBs.size(); i != e; ++i) {
-        BasicBlockInfo &BBInfo = FunctionBBs[i];
-        BBInfo.BB = BasicBlock::Create(Context, "", F);
-      }
-      CurBB = FunctionBBs.at(0).BB;
+      for (size_t i = 0, e = FunctionBBs.size(); i != e; ++i)
+        FunctionBBs[i] = BasicBlock::Create(Context, "", F);
+      CurBB = FunctionBBs.at(0);
       continue;
 
     case naclbitc::FUNC_CODE_INST_BINOP: {
@@ -1724,20 +2191,15 @@ OutOfRecordLoop:
   // Add PHI conversions to corresponding incoming block, if not
   // already in the block. Also clear all conversions after fixing
   // PHI conversions.
-  for (size_t I = 0, NumBBs = FunctionBBs.size(); I < NumBBs; ++I) {
-    BasicBlockInfo &BBInfo = FunctionBBs[I];
-    std::vector<CastInst*> &PhiCasts = BBInfo.PhiCasts;
-    for (std::vector<CastInst*>::iterator Iter = PhiCasts.begin(),
-           IterEnd = PhiCasts.end(); Iter != IterEnd; ++Iter) {
-      CastInst *Cast = *Iter;
-      if (Cast->getParent() == 0) {
-        BasicBlock *BB = BBInfo.BB;
-        BB->getInstList().insert(BB->getTerminator(), Cast);
-      }
+  for (size_t I = 0, E = PhiCasts.size(); I < E; ++I) {
+    CastInst *Cast = PhiCasts[I].second;
+    if (Cast->getParent() == 0) {
+      BasicBlock *BB = FunctionBBs[PhiCasts[I].first];
+      BB->getInstList().insert(BB->getTerminator(), Cast);
     }
-    PhiCasts.clear();
-    BBInfo.CastMap.clear();
   }
+  PhiCasts.clear();
+  CastMap.clear();
 
   // Check the function list for unresolved values.
   if (Argument *A = dyn_cast<Argument>(ValueList.back())) {
@@ -1754,7 +2216,7 @@ OutOfRecordLoop:
   }
 
   // Trim the value list down to the size it was before we parsed this function.
-  ValueList.shrinkTo(ModuleValueListSize);
+  ValueList.endFunctionValues();
   FunctionBBs.clear();
   DEBUG(dbgs() << "-> ParseFunctionBody\n");
   return std::error_code();
@@ -1764,6 +2226,16 @@ OutOfRecordLoop:
 std::error_code NaClBitcodeReader::FindFunctionInStream(
     Function *F,
     DenseMap<Function*, uint64_t>::iterator DeferredFunctionInfoIterator) {
+  if (Snapshot) {
+    // The snapshot locates the bodies for all modules instantiated from it.
+    uint64_t Bit, BitSize;
+    if (Snapshot->findFunctionBody(SnapshotBodyIndex.lookup(F), Bit, BitSize))
+      return Error(CouldNotFindFunctionInStream,
+                   "Could not find Function in stream");
+    DeferredFunctionInfoIterator->second = Bit;
+    DeferredFunctionBitSizes[F] = BitSize;
+    return std::error_code();
+  }
   while (DeferredFunctionInfoIterator->second == 0) {
     if (Stream.AtEndOfStream())
       return Error(CouldNotFindFunctionInStream,
@@ -1776,6 +2248,24 @@ std::error_code NaClBitcodeReader::FindFunctionInStream(
   return std::error_code();
 }
 
+std::error_code NaClBitcodeReader::getFunctionBodyBitSizes(
+    std::vector<uint64_t> &BitSizes) {
+  BitSizes.clear();
+  for (Module::iterator F = TheModule->begin(), E = TheModule->end();
+       F != E; ++F) {
+    DenseMap<Function*, uint64_t>::iterator DFII =
+        DeferredFunctionInfo.find(F);
+    if (DFII == DeferredFunctionInfo.end())
+      continue;
+    if (DFII->second == 0) {
+      if (std::error_code EC = FindFunctionInStream(F, DFII))
+        return EC;
+    }
+    BitSizes.push_back(DeferredFunctionBitSizes.lookup(F));
+  }
+  return std::error_code();
+}
+
 //===----------------------------------------------------------------------===//
 // GVMaterializer implementation
 //===----------------------------------------------------------------------===//
@@ -1798,8 +2288,21 @@ std::error_code NaClBitcodeReader::materialize(GlobalValue *GV) {
     }
   }
 
-  // Move the bit stream to the saved position of the deferred function body.
-  Stream.JumpToBit(DFII->second);
+  // A position read from a function index is only used if a function block
+  // of the recorded size starts there.
+  bool FromIndex = Snapshot ? Snapshot->BodiesFromIndex : UsesFunctionIndex;
+  if (FromIndex && !Replay &&
+      !isFunctionBlockAt(DFII->second, DeferredFunctionBitSizes.lookup(F))) {
+    dropFunctionIndex();
+    DFII->second = 0;
+    if (std::error_code EC = FindFunctionInStream(F, DFII))
+      return EC;
+  }
+
+  // Move the bit stream to the saved position of the deferred function body,
+  // unless the block has already been decoded.
+  if (!Replay)
+    Stream.JumpToBit(DFII->second);
 
   if (std::error_code EC = ParseFunctionBody(F))
     return EC;
@@ -1841,17 +2344,186 @@ void NaClBitcodeReader::Dematerialize(GlobalValue *GV) {
 }
 
 
-std::error_code NaClBitcodeReader::MaterializeModule(Module *M) {
-  assert(M == TheModule &&
-         "Can only Materialize the Module this NaClBitcodeReader is attached to.");
-  // Iterate over the module, deserializing any functions that are still on
-  // disk.
+#if LLVM_ENABLE_THREADS
+namespace {
+
+// Decodes function blocks on worker threads, in the order of their positions
+// Bits, while the IR of the blocks already decoded is built. Workers stay at
+// most a fixed number of blocks ahead of the oldest block not yet released,
+// which bounds the memory used.
+class NaClParallelBlockDecoder {
+  NaClParallelBlockDecoder(const NaClParallelBlockDecoder &) = delete;
+  void operator=(const NaClParallelBlockDecoder &) = delete;
+
+public:
+  NaClParallelBlockDecoder(const unsigned char *Start, const unsigned char *End,
+                           NaClBitcodeHeader &Header,
+                           const NaClBitstreamReader &BlockInfoSource,
+                           const std::vector<uint64_t> &Bits,
+                           unsigned NumThreads);
+  ~NaClParallelBlockDecoder();
+
+  // Returns block Index, waiting until it is decoded.
+  const NaClDecodedBlock &getBlock(size_t Index);
+
+  // Frees block Index, which must be the oldest block not released yet.
+  void releaseBlock(size_t Index);
+
+private:
+  void run(NaClBitstreamReader *Reader);
+
+  const std::vector<uint64_t> &Bits;
+  size_t Window;
+  // One reader per worker, since abbreviations are reference counted without
+  // locking.
+  std::vector<std::unique_ptr<NaClBitstreamReader>> Readers;
+  std::vector<std::thread> Workers;
+  std::mutex Lock;
+  // Signaled when a block is released, or the workers should stop.
+  std::condition_variable WorkAvailable;
+  // Signaled when a block is decoded.
+  std::condition_variable BlockReady;
+  // The fields below are guarded by Lock.
+  std::vector<std::unique_ptr<NaClDecodedBlock>> Blocks;
+  size_t NextBlock;
+  size_t NumReleased;
+  bool Stop;
+};
+
+} // end of anonymous namespace
+
+NaClParallelBlockDecoder::NaClParallelBlockDecoder(
+    const unsigned char *Start, const unsigned char *End,
+    NaClBitcodeHeader &Header, const NaClBitstreamReader &BlockInfoSource,
+    const std::vector<uint64_t> &Bits, unsigned NumThreads)
+    : Bits(Bits), Window(16 * NumThreads), Blocks(Bits.size()), NextBlock(0),
+      NumReleased(0), Stop(false) {
+  for (unsigned i = 0; i < NumThreads; ++i) {
+    Readers.emplace_back(new NaClBitstreamReader(Start, End, Header));
+    for (const NaClBitstreamReader::BlockInfo &Info :
+         BlockInfoSource.getBlockInfoRecords()) {
+      NaClBitstreamReader::BlockInfo &Copy =
+          Readers.back()->getOrCreateBlockInfo(Info.BlockID);
+      for (const NaClBitCodeAbbrev *Abbrev : Info.Abbrevs)
+        Copy.Abbrevs.push_back(Abbrev->Copy());
+    }
+  }
+  for (unsigned i = 0; i < NumThreads; ++i)
+    Workers.emplace_back(&NaClParallelBlockDecoder::run, this,
+                         Readers[i].get());
+}
+
+NaClParallelBlockDecoder::~NaClParallelBlockDecoder() {
+  {
+    std::lock_guard<std::mutex> L(Lock);
+    Stop = true;
+  }
+  WorkAvailable.notify_all();
+  for (std::thread &Worker : Workers)
+    Worker.join();
+}
+
+const NaClDecodedBlock &NaClParallelBlockDecoder::getBlock(size_t Index) {
+  std::unique_lock<std::mutex> L(Lock);
+  BlockReady.wait(L, [this, Index] { return Blocks[Index] != nullptr; });
+  return *Blocks[Index];
+}
+
+void NaClParallelBlockDecoder::releaseBlock(size_t Index) {
+  {
+    std::lock_guard<std::mutex> L(Lock);
+    assert(Index == NumReleased && "Blocks released out of order");
+    Blocks[Index].reset();
+    ++NumReleased;
+  }
+  WorkAvailable.notify_all();
+}
+
+void NaClParallelBlockDecoder::run(NaClBitstreamReader *Reader) {
+  NaClBitstreamCursor Cursor(*Reader);
+  while (true) {
+    size_t Index;
+    {
+      std::unique_lock<std::mutex> L(Lock);
+      WorkAvailable.wait(L, [this] {
+        return Stop || (NextBlock < Bits.size() &&
+                        NextBlock < NumReleased + Window);
+      });
+      if (Stop)
+        return;
+      Index = NextBlock++;
+    }
+    std::unique_ptr<NaClDecodedBlock> Block(new NaClDecodedBlock());
+    Block->decode(Cursor, Bits[Index]);
+    {
+      std::lock_guard<std::mutex> L(Lock);
+      Blocks[Index] = std::move(Block);
+    }
+    BlockReady.notify_all();
+  }
+}
+
+std::error_code NaClBitcodeReader::MaterializeFunctionsInParallel(
+    unsigned NumThreads) {
+  // Find all function bodies first, so that they can be handed out to the
+  // workers.
+  std::vector<Function *> Functions;
+  std::vector<uint64_t> Bits;
   for (Module::iterator F = TheModule->begin(), E = TheModule->end();
        F != E; ++F) {
-    if (F->isMaterializable()) {
-      if (std::error_code EC = materialize(F))
+    if (!F->isMaterializable())
+      continue;
+    DenseMap<Function*, uint64_t>::iterator DFII =
+        DeferredFunctionInfo.find(F);
+    assert(DFII != DeferredFunctionInfo.end() && "Deferred function not found!");
+    if (DFII->second == 0) {
+      if (std::error_code EC = FindFunctionInStream(F, DFII))
         return EC;
     }
+    Functions.push_back(F);
+    Bits.push_back(DFII->second);
+  }
+
+  // Building the IR uses the context, so it is done on this thread, in
+  // module order.
+  const unsigned char *Start = (const unsigned char *)Buffer->getBufferStart();
+  NaClParallelBlockDecoder Decoder(Start, Start + Buffer->getBufferSize(),
+                                   Header, *StreamFile, Bits, NumThreads);
+  for (size_t i = 0, e = Functions.size(); i != e; ++i) {
+    Replay = &Decoder.getBlock(i);
+    ReplayEntry = 0;
+    ReplayValue = 0;
+    std::error_code EC = materialize(Functions[i]);
+    Replay = nullptr;
+    Decoder.releaseBlock(i);
+    if (EC)
+      return EC;
+  }
+  return std::error_code();
+}
+#endif
+
+std::error_code NaClBitcodeReader::MaterializeModule(Module *M) {
+  assert(M == TheModule &&
+         "Can only Materialize the Module this NaClBitcodeReader is attached to.");
+  // When the whole module is in memory, function blocks can be decoded by
+  // other threads.
+#if LLVM_ENABLE_THREADS
+  if (DecodeThreads > 1 && Buffer) {
+    if (std::error_code EC = MaterializeFunctionsInParallel(DecodeThreads))
+      return EC;
+  } else
+#endif
+  {
+    // Iterate over the module, deserializing any functions that are still on
+    // disk.
+    for (Module::iterator F = TheModule->begin(), E = TheModule->end();
+         F != E; ++F) {
+      if (F->isMaterializable()) {
+        if (std::error_code EC = materialize(F))
+          return EC;
+      }
+    }
   }
 
   // At this point, if there are any function bodies, the current bit is
@@ -1978,6 +2650,40 @@ Module *llvm::getNaClStreamedBitcodeModule(const std::string &name,
   return M;
 }
 
+std::error_code llvm::getNaClFunctionBodyBitSizes(
+    Module *M, std::vector<uint64_t> &BitSizes) {
+  NaClBitcodeReader *R = static_cast<NaClBitcodeReader *>(M->getMaterializer());
+  assert(R && "Module was not read lazily");
+  return R->getFunctionBodyBitSizes(BitSizes);
+}
+
+std::unique_ptr<NaClModuleSnapshot>
+llvm::getNaClModuleSnapshot(Module *M, StreamingMemoryObject *Streamer) {
+  NaClBitcodeReader *R = static_cast<NaClBitcodeReader *>(M->getMaterializer());
+  assert(R && "Module was not read lazily");
+  return R->takeSnapshot(Streamer);
+}
+
+Module *llvm::getNaClSnapshotModule(const std::string &name,
+                                    NaClModuleSnapshot &Snapshot,
+                                    StreamingMemoryObject *Streamer,
+                                    LLVMContext &Context,
+                                    raw_ostream *Verbose,
+                                    std::string *ErrMsg) {
+  Module *M = new Module(name, Context);
+  NaClBitcodeReader *R =
+      new NaClBitcodeReader(&Snapshot, Streamer, Context, Verbose);
+  M->setMaterializer(R);
+  if (std::error_code EC = R->ParseSnapshotInto(M)) {
+    if (ErrMsg)
+      *ErrMsg = EC.message();
+    delete M;  // Also deletes R.
+    return nullptr;
+  }
+
+  return M;
+}
+
 ErrorOr<Module *> llvm::NaClParseBitcodeFile(
     MemoryBufferRef Buffer, LLVMContext& Context, raw_ostream *Verbose,
     bool AcceptSupportedOnly){
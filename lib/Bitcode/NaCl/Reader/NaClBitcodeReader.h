@@ -21,6 +21,7 @@
 #include "llvm/Bitcode/NaCl/NaClBitstreamReader.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeDefs.h"
 #include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
+#include "llvm/Bitcode/NaCl/NaClModuleSnapshot.h"
 #include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/GVMaterializer.h"
@@ -77,38 +78,112 @@ public:
   }
 };
 
+//===----------------------------------------------------------------------===//
+//                          NaClDecodedBlock Class
+//===----------------------------------------------------------------------===//
+
+// The entries and records of a function block, decoded from the bitstream
+// ahead of time (possibly on another thread), so that the function body can
+// be parsed without reading the bitstream again.
+struct NaClDecodedBlock {
+  struct EntryInfo {
+    NaClBitstreamEntry Entry;
+    // For records, the record code, and the end of its values in Values.
+    unsigned Code;
+    size_t ValuesEnd;
+    // The bit position after the entry was read (and entered, for entered
+    // subblocks), which is reported in errors.
+    uint64_t EndBit;
+  };
+  // The function block itself, followed by the entries in it, ending with
+  // its EndBlock, or where the parse would stop on an error. For subblocks,
+  // Code is non-zero if the block could not be entered.
+  std::vector<EntryInfo> Entries;
+  std::vector<uint64_t> Values;
+
+  // Decodes the function block starting at Bit, which must be the position
+  // after its block id, as recorded in DeferredFunctionInfo.
+  void decode(NaClBitstreamCursor &Cursor, uint64_t Bit);
+};
+
 //===----------------------------------------------------------------------===//
 //                          NaClBitcodeReaderValueList Class
 //===----------------------------------------------------------------------===//
 
 class NaClBitcodeReaderValueList {
+  // The module-level values. They are tracked with value handles, since
+  // they may be replaced or deleted between the parses of function bodies.
   std::vector<WeakVH> ValuePtrs;
+  // The values local to the function body being parsed, which follow the
+  // module-level values. They only live while the body is parsed, so they
+  // don't need value handles, and the storage is reused for the next body.
+  std::vector<Value*> LocalValuePtrs;
+  // True while a function body is parsed.
+  bool InFunction;
+  // Forward reference placeholders that have been replaced, by type, for
+  // reuse by later forward references.
+  DenseMap<Type*, std::vector<Argument*> > FreePlaceholders;
+
+  Value *get(size_t i) const {
+    size_t NumModuleValues = ValuePtrs.size();
+    if (i < NumModuleValues)
+      return ValuePtrs[i];
+    return LocalValuePtrs[i - NumModuleValues];
+  }
+  void set(size_t i, Value *V) {
+    size_t NumModuleValues = ValuePtrs.size();
+    if (i < NumModuleValues)
+      ValuePtrs[i] = V;
+    else
+      LocalValuePtrs[i - NumModuleValues] = V;
+  }
+
 public:
-  NaClBitcodeReaderValueList() {}
-  ~NaClBitcodeReaderValueList() {}
+  NaClBitcodeReaderValueList() : InFunction(false) {}
+  ~NaClBitcodeReaderValueList();
 
   // vector compatibility methods
-  size_t size() const { return ValuePtrs.size(); }
-  void resize(size_t N) { ValuePtrs.resize(N); }
+  size_t size() const { return ValuePtrs.size() + LocalValuePtrs.size(); }
+  void resize(size_t N) {
+    if (InFunction) {
+      assert(N >= ValuePtrs.size() && "Can't resize module-level values");
+      LocalValuePtrs.resize(N - ValuePtrs.size());
+    } else {
+      ValuePtrs.resize(N);
+    }
+  }
   void push_back(Value *V) {
-    ValuePtrs.push_back(V);
+    if (InFunction)
+      LocalValuePtrs.push_back(V);
+    else
+      ValuePtrs.push_back(V);
   }
 
   void clear() {
     ValuePtrs.clear();
+    LocalValuePtrs.clear();
+    InFunction = false;
   }
 
   Value *operator[](size_t i) const {
-    assert(i < ValuePtrs.size());
-    return ValuePtrs[i];
+    assert(i < size());
+    return get(i);
   }
 
-  Value *back() const { return ValuePtrs.back(); }
-  void pop_back() { ValuePtrs.pop_back(); }
-  bool empty() const { return ValuePtrs.empty(); }
-  void shrinkTo(size_t N) {
-    assert(N <= size() && "Invalid shrinkTo request!");
-    ValuePtrs.resize(N);
+  Value *back() const { return get(size() - 1); }
+  bool empty() const { return size() == 0; }
+
+  // Starts the values of a function body. Values added until
+  // endFunctionValues are local to the body.
+  void beginFunctionValues() {
+    LocalValuePtrs.clear();
+    InFunction = true;
+  }
+
+  // Removes the values local to the function body.
+  void endFunctionValues() {
+    LocalValuePtrs.clear();
+    InFunction = false;
   }
 
   // Declares the type of the forward-referenced value Idx.  Returns
@@ -139,25 +214,34 @@ class NaClBitcodeReader : public GVMaterializer {
   std::unique_ptr<NaClBitstreamReader> StreamFile;
   NaClBitstreamCursor Stream;
   StreamingMemoryObject *LazyStreamer;
+  // If non-null, the function block being parsed is read from this instead
+  // of Stream. ReplayEntry and ReplayValue are the next entry and value.
+  const NaClDecodedBlock *Replay;
+  size_t ReplayEntry;
+  size_t ReplayValue;
   uint64_t NextUnreadBit;
+  // The abbreviation ID width of the module block, and the bit after its
+  // end.
+  unsigned ModuleAbbrevIDWidth;
+  uint64_t ModuleEndBit;
   bool SeenValueSymbolTable;
   std::vector<Type*> TypeList;
   NaClBitcodeReaderValueList ValueList;
 
-  // Holds information about each BasicBlock in the function being read.
-  struct BasicBlockInfo {
-    // A basic block within the function being modeled.
-    BasicBlock *BB;
-    // The set of generated conversions.
-    DenseMap<NaClBitcodeReaderCast, CastInst*> CastMap;
-    // The set of generated conversions that were added for phi nodes,
-    // and may need thier parent basic block defined.
-    std::vector<CastInst*> PhiCasts;
-  };
-
   /// FunctionBBs - While parsing a function body, this is a list of the basic
   /// blocks for the function.
-  std::vector<BasicBlockInfo> FunctionBBs;
+  std::vector<BasicBlock*> FunctionBBs;
+
+  // The conversions generated in each basic block (by index) of the function
+  // being read. This and PhiCasts are cleared, but keep their storage, after
+  // each function.
+  DenseMap<std::pair<NaClBcIndexSize_t, NaClBitcodeReaderCast>, CastInst*>
+      CastMap;
+
+  // The conversions that were added for phi nodes, with the index of the
+  // basic block they belong to, which may need their parent basic block
+  // defined.
+  std::vector<std::pair<NaClBcIndexSize_t, CastInst*> > PhiCasts;
 
   // When reading the module header, this list is populated with functions that
   // have bodies later in the file.
@@ -178,6 +262,22 @@ class NaClBitcodeReader : public GVMaterializer {
   /// stream.
   DenseMap<Function*, uint64_t> DeferredFunctionInfo;
 
+  /// DeferredFunctionBitSizes - The size in bits of each function body block
+  /// recorded in DeferredFunctionInfo, once it has been found.
+  DenseMap<Function*, uint64_t> DeferredFunctionBitSizes;
+
+  /// UsesFunctionIndex - True if the positions of the function bodies not yet
+  /// skipped over were read from a function index block. Each is checked
+  /// before its body is read.
+  bool UsesFunctionIndex;
+
+  /// If non-null, the module was instantiated from this snapshot, which
+  /// locates its function bodies.
+  NaClModuleSnapshot *Snapshot;
+
+  /// SnapshotBodyIndex - The index in Snapshot of each function body.
+  DenseMap<Function*, unsigned> SnapshotBodyIndex;
+
   /// \brief True if we should only accept supported bitcode format.
   bool AcceptSupportedBitcodeOnly;
 
@@ -213,9 +313,11 @@ public:
                              bool AcceptSupportedOnly)
       : Context(C), TheModule(nullptr), Verbose(Verbose), AllowedIntrinsics(&C),
         Buffer(buffer),
-        LazyStreamer(nullptr), NextUnreadBit(0), SeenValueSymbolTable(false),
-        ValueList(),
-        SeenFirstFunctionBody(false),
+        LazyStreamer(nullptr), Replay(nullptr), ReplayEntry(0),
+        ReplayValue(0), NextUnreadBit(0), ModuleAbbrevIDWidth(0),
+        ModuleEndBit(0), SeenValueSymbolTable(false), ValueList(),
+        SeenFirstFunctionBody(false), UsesFunctionIndex(false),
+        Snapshot(nullptr),
         AcceptSupportedBitcodeOnly(AcceptSupportedOnly),
         IntPtrType(IntegerType::get(C, PNaClIntPtrTypeBitSize)) {
   }
@@ -225,12 +327,28 @@ public:
                              bool AcceptSupportedOnly)
       : Context(C), TheModule(nullptr), Verbose(Verbose), AllowedIntrinsics(&C),
         Buffer(nullptr),
-        LazyStreamer(streamer), NextUnreadBit(0), SeenValueSymbolTable(false),
-        ValueList(),
-        SeenFirstFunctionBody(false),
+        LazyStreamer(streamer), Replay(nullptr), ReplayEntry(0),
+        ReplayValue(0), NextUnreadBit(0), ModuleAbbrevIDWidth(0),
+        ModuleEndBit(0), SeenValueSymbolTable(false), ValueList(),
+        SeenFirstFunctionBody(false), UsesFunctionIndex(false),
+        Snapshot(nullptr),
         AcceptSupportedBitcodeOnly(AcceptSupportedOnly),
         IntPtrType(IntegerType::get(C, PNaClIntPtrTypeBitSize)) {
   }
+  explicit NaClBitcodeReader(NaClModuleSnapshot *Snapshot,
+                             StreamingMemoryObject *streamer,
+                             LLVMContext &C,
+                             raw_ostream *Verbose)
+      : Context(C), TheModule(nullptr), Verbose(Verbose), AllowedIntrinsics(&C),
+        Buffer(nullptr),
+        LazyStreamer(streamer), Replay(nullptr), ReplayEntry(0),
+        ReplayValue(0), NextUnreadBit(0), ModuleAbbrevIDWidth(0),
+        ModuleEndBit(0), SeenValueSymbolTable(false), ValueList(),
+        SeenFirstFunctionBody(false), UsesFunctionIndex(false),
+        Snapshot(Snapshot),
+        AcceptSupportedBitcodeOnly(false),
+        IntPtrType(IntegerType::get(C, PNaClIntPtrTypeBitSize)) {
+  }
   ~NaClBitcodeReader() override {
     FreeState();
   }
@@ -244,6 +362,11 @@ public:
   void Dematerialize(GlobalValue *GV) override;
   void releaseBuffer();
 
+  /// Sets BitSizes to the size in bits of each function body in the module,
+  /// in module order, reading the rest of the stream if some bodies have not
+  /// been found yet.
+  std::error_code getFunctionBodyBitSizes(std::vector<uint64_t> &BitSizes);
+
   std::error_code Error(ErrorType E) const {
     return std::error_code(E, BitcodeErrorCategory());
   }
@@ -255,6 +378,16 @@ public:
   /// @returns true if an error occurred.
   std::error_code ParseBitcodeInto(Module *M);
 
+  /// Instantiates the module-level values of Snapshot into M, instead of
+  /// parsing them from the bitcode.
+  std::error_code ParseSnapshotInto(Module *M);
+
+  /// Takes a snapshot of the module-level values read so far. Streamer is
+  /// used by the snapshot to locate the function bodies not found yet.
+  /// Returns null if the module can't be described by a snapshot.
+  std::unique_ptr<NaClModuleSnapshot>
+  takeSnapshot(StreamingMemoryObject *Streamer);
+
   /// Convert alignment exponent (i.e. power of two (or zero)) to the
   /// corresponding alignment to use. If alignment is too large, it generates
   /// an error message and returns corresponding error code.
@@ -283,9 +416,14 @@ private:
     return Header.GetPNaClVersion();
   }
   Type *getTypeByID(NaClBcIndexSize_t ID);
+  /// Sets ResultTy to the type described by the type record Record with code
+  /// TypeCode.
+  std::error_code getTypeFromRecord(unsigned TypeCode,
+                                    ArrayRef<uint64_t> Record,
+                                    Type *&ResultTy);
   BasicBlock *getBasicBlock(NaClBcIndexSize_t ID) const {
     if (ID >= FunctionBBs.size()) return 0; // Invalid ID
-    return FunctionBBs[ID].BB;
+    return FunctionBBs[ID];
   }
 
   /// \brief Read a value out of the specified record from slot '*Slot'.
@@ -354,14 +492,26 @@ private:
   FunctionType *AddPointerTypesToIntrinsicType(StringRef Name,
                                                FunctionType *FTy);
   void AddPointerTypesToIntrinsicParams();
+  // Versions of the cursor methods used while parsing a function block,
+  // which read from Replay if set.
+  NaClBitstreamEntry advanceInFunction();
+  unsigned readRecordInFunction(unsigned AbbrevID,
+                                SmallVectorImpl<uint64_t> &Vals);
+  bool EnterSubBlockInFunction(unsigned BlockID);
   std::error_code ParseModule(bool Resume);
   std::error_code ParseTypeTable();
   std::error_code ParseTypeTableBody();
   std::error_code ParseGlobalVars();
   std::error_code ParseValueSymbolTable();
   std::error_code ParseConstants();
+  std::error_code ParseFunctionIndex();
+  bool isFunctionBlockAt(uint64_t Bit, uint64_t BitSize);
+  void dropFunctionIndex();
   std::error_code RememberAndSkipFunctionBody();
   std::error_code ParseFunctionBody(Function *F);
+  /// Materializes all functions of the module, decoding their blocks on
+  /// NumThreads threads while the IR is built on this one.
+  std::error_code MaterializeFunctionsInParallel(unsigned NumThreads);
   std::error_code GlobalCleanup();
   std::error_code InitStream();
   std::error_code InitStreamFromBuffer();
@@ -43,6 +43,37 @@ raw_ostream &llvm::naclbitc::ErrorAt(
 //  NaClBitstreamCursor implementation
 //===----------------------------------------------------------------------===//
 
+// Returns the bits at Bit, Bit + NumBits, ... of a 64-bit word.
+static constexpr uint64_t getEveryNthBit(unsigned NumBits, unsigned Bit) {
+  return Bit >= 64 ? 0
+                   : (uint64_t(1) << Bit) | getEveryNthBit(NumBits,
+                                                           Bit + NumBits);
+}
+
+#define VBR_CONTINUATION_MASK(NumBits) getEveryNthBit(NumBits, NumBits - 1)
+
+const uint64_t NaClBitstreamCursor::VBRContinuationMasks[33] = {
+  0,
+  VBR_CONTINUATION_MASK(1),  VBR_CONTINUATION_MASK(2),
+  VBR_CONTINUATION_MASK(3),  VBR_CONTINUATION_MASK(4),
+  VBR_CONTINUATION_MASK(5),  VBR_CONTINUATION_MASK(6),
+  VBR_CONTINUATION_MASK(7),  VBR_CONTINUATION_MASK(8),
+  VBR_CONTINUATION_MASK(9),  VBR_CONTINUATION_MASK(10),
+  VBR_CONTINUATION_MASK(11), VBR_CONTINUATION_MASK(12),
+  VBR_CONTINUATION_MASK(13), VBR_CONTINUATION_MASK(14),
+  VBR_CONTINUATION_MASK(15), VBR_CONTINUATION_MASK(16),
+  VBR_CONTINUATION_MASK(17), VBR_CONTINUATION_MASK(18),
+  VBR_CONTINUATION_MASK(19), VBR_CONTINUATION_MASK(20),
+  VBR_CONTINUATION_MASK(21), VBR_CONTINUATION_MASK(22),
+  VBR_CONTINUATION_MASK(23), VBR_CONTINUATION_MASK(24),
+  VBR_CONTINUATION_MASK(25), VBR_CONTINUATION_MASK(26),
+  VBR_CONTINUATION_MASK(27), VBR_CONTINUATION_MASK(28),
+  VBR_CONTINUATION_MASK(29), VBR_CONTINUATION_MASK(30),
+  VBR_CONTINUATION_MASK(31), VBR_CONTINUATION_MASK(32)
+};
+
+#undef VBR_CONTINUATION_MASK
+
 void NaClBitstreamCursor::ErrorHandler::
 Fatal(const std::string &ErrorMessage) const {
   // Default implementation is simply print message, and the bit where
@@ -89,10 +120,15 @@ bool NaClBitstreamCursor::EnterSubBlock(unsigned BlockID, unsigned *NumWordsP) {
   // Save the current block's state on BlockScope.
   BlockScope.push_back(Block(CurCodeSize));
   BlockScope.back().PrevAbbrevs.swap(CurAbbrevs);
+  if (!SpareAbbrevLists.empty()) {
+    CurAbbrevs.swap(SpareAbbrevLists.back());
+    SpareAbbrevLists.pop_back();
+  }
 
   // Add the abbrevs specific to this block to the CurAbbrevs list.
   if (const NaClBitstreamReader::BlockInfo *Info =
       BitStream->getBlockInfo(BlockID)) {
+    CurAbbrevs.reserve(Info->Abbrevs.size());
     for (size_t i = 0, e = Info->Abbrevs.size(); i != e; ++i) {
       CurAbbrevs.push_back(Info->Abbrevs[i]);
       CurAbbrevs.back()->addRef();
@@ -150,27 +186,34 @@ void NaClBitstreamCursor::skipRecord(unsigned AbbrevID) {
 
   const NaClBitCodeAbbrev *Abbv = getAbbrev(AbbrevID);
 
-  for (unsigned i = 0, e = Abbv->getNumOperandInfos(); i != e; ++i) {
-    const NaClBitCodeAbbrevOp &Op = Abbv->getOperandInfo(i);
-    switch (Op.getEncoding()) {
-    default:
-      skipAbbreviatedField(Op);
-      break;
-    case NaClBitCodeAbbrevOp::Literal:
-      break;
-    case NaClBitCodeAbbrevOp::Array: {
-      // Array case.  Read the number of elements as a vbr6.
-      unsigned NumElts = ReadVBR(6);
+  unsigned NumScalars = Abbv->getNumScalarOperands();
+  unsigned ScalarWidth = Abbv->getScalarWidth();
+  if (ScalarWidth != NaClBitCodeAbbrev::VariableWidth) {
+    skipBits(ScalarWidth);
+  } else {
+    for (unsigned i = 0; i != NumScalars; ++i)
+      skipAbbreviatedField(Abbv->getOperandInfo(i));
+  }
 
-      // Get the element encoding.
-      const NaClBitCodeAbbrevOp &EltEnc = Abbv->getOperandInfo(++i);
+  if (const NaClBitCodeAbbrevOp *EltEnc = Abbv->getArrayElementOp()) {
+    // Array case.  Read the number of elements as a vbr6.
+    unsigned NumElts = ReadVBR(6);
 
-      // Read all the elements.
+    // Skip all the elements, at once if they have a fixed width.
+    switch (EltEnc->getEncoding()) {
+    case NaClBitCodeAbbrevOp::Literal:
+      break;
+    case NaClBitCodeAbbrevOp::Fixed:
+      skipBits(NumElts * EltEnc->getValue());
+      break;
+    case NaClBitCodeAbbrevOp::Char6:
+      skipBits(NumElts * uint64_t(6));
+      break;
+    default:
       for (; NumElts; --NumElts)
-        skipAbbreviatedField(EltEnc);
+        skipAbbreviatedField(*EltEnc);
       break;
     }
-    }
   }
   SkipToByteBoundaryIfAligned();
 }
@@ -220,11 +263,110 @@ uint64_t NaClBitstreamCursor::readArrayAbbreviatedField(
 void NaClBitstreamCursor::readArrayAbbrev(
     const NaClBitCodeAbbrevOp &Op, unsigned NumArrayElements,
     SmallVectorImpl<uint64_t> &Vals) {
-  for (; NumArrayElements; --NumArrayElements) {
-    Vals.push_back(readArrayAbbreviatedField(Op));
+  switch (Op.getEncoding()) {
+  case NaClBitCodeAbbrevOp::Literal:
+    Vals.append(NumArrayElements, Op.getValue());
+    return;
+  case NaClBitCodeAbbrevOp::Fixed:
+    if (Op.getValue() == 0) {
+      Vals.append(NumArrayElements, 0);
+      return;
+    }
+    readFixedArray<false>(Op.getValue(), NumArrayElements, Vals);
+    return;
+  case NaClBitCodeAbbrevOp::Char6:
+    readFixedArray<true>(6, NumArrayElements, Vals);
+    return;
+  case NaClBitCodeAbbrevOp::VBR: {
+    unsigned NumBits = Op.getValue();
+    size_t Size = Vals.size();
+    Vals.resize(Size + NumArrayElements);
+    for (uint64_t *V = Vals.begin() + Size, *E = Vals.end(); V != E; ++V)
+      *V = ReadVBR64(NumBits);
+    return;
+  }
+  case NaClBitCodeAbbrevOp::Array:
+    // This can't happen because the abbreviation must be valid.
+    llvm_unreachable("Bad array abbreviation encoding!");
   }
 }
 
+// The characters of the char6 encoding, indexed by their encoding.
+static const char Char6Chars[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._";
+
+template <bool IsChar6>
+void NaClBitstreamCursor::readFixedArray(unsigned NumBits,
+                                         unsigned NumArrayElements,
+                                         SmallVectorImpl<uint64_t> &Vals) {
+  static const unsigned BitsInWord = sizeof(word_t) * 8;
+  const unsigned EltsPerWord = BitsInWord / NumBits;
+  const word_t Mask = ~word_t(0) >> (BitsInWord - NumBits);
+  size_t Size = Vals.size();
+  Vals.resize(Size + NumArrayElements);
+  uint64_t *V = Vals.begin() + Size;
+  while (NumArrayElements) {
+    unsigned NumElts = std::min(NumArrayElements, EltsPerWord);
+    word_t Bits = Read(NumElts * NumBits);
+    for (unsigned i = 0; i != NumElts; ++i) {
+      word_t Elt = (Bits >> (i * NumBits)) & Mask;
+      *V++ = IsChar6 ? Char6Chars[Elt] : Elt;
+    }
+    NumArrayElements -= NumElts;
+  }
+}
+
+unsigned NaClBitstreamCursor::readScalarAbbrevFields(
+    const NaClBitCodeAbbrev *Abbv, SmallVectorImpl<uint64_t> &Vals) {
+  unsigned NumScalars = Abbv->getNumScalarOperands();
+  unsigned ScalarWidth = Abbv->getScalarWidth();
+  uint64_t Value;
+  if (ScalarWidth == NaClBitCodeAbbrev::VariableWidth ||
+      ScalarWidth > sizeof(word_t) * 8) {
+    readRecordAbbrevField(Abbv->getOperandInfo(0), Value);
+    unsigned Code = Value;
+    for (unsigned i = 1; i != NumScalars; ++i) {
+      readRecordAbbrevField(Abbv->getOperandInfo(i), Value);
+      Vals.push_back(Value);
+    }
+    return Code;
+  }
+
+  // All fields fit in a word, so read them at once and split them up.
+  word_t Bits = ScalarWidth ? Read(ScalarWidth) : 0;
+  unsigned Code = 0;
+  unsigned Bit = 0;
+  for (unsigned i = 0; i != NumScalars; ++i) {
+    const NaClBitCodeAbbrevOp &Op = Abbv->getOperandInfo(i);
+    switch (Op.getEncoding()) {
+    case NaClBitCodeAbbrevOp::Literal:
+      Value = Op.getValue();
+      break;
+    case NaClBitCodeAbbrevOp::Fixed: {
+      unsigned NumBits = Op.getValue();
+      if (NumBits == 0) {
+        Value = 0;
+        break;
+      }
+      Value = (Bits >> Bit) & (~word_t(0) >> (sizeof(word_t) * 8 - NumBits));
+      Bit += NumBits;
+      break;
+    }
+    case NaClBitCodeAbbrevOp::Char6:
+      Value = Char6Chars[(Bits >> Bit) & 0x3f];
+      Bit += 6;
+      break;
+    default:
+      llvm_unreachable("Abbreviation operand does not have a fixed width!");
+    }
+    if (i == 0)
+      Code = Value;
+    else
+      Vals.push_back(Value);
+  }
+  return Code;
+}
+
 unsigned NaClBitstreamCursor::readRecord(unsigned AbbrevID,
                                          SmallVectorImpl<uint64_t> &Vals) {
   if (AbbrevID == naclbitc::UNABBREV_RECORD) {
@@ -236,38 +378,27 @@ unsigned NaClBitstreamCursor::readRecord(unsigned AbbrevID,
     return Code;
   }
 
-  // Read code.
   const NaClBitCodeAbbrev *Abbv = getAbbrev(AbbrevID);
-  uint64_t Value;
+  const NaClBitCodeAbbrevOp *EltOp = Abbv->getArrayElementOp();
   unsigned Code;
-  if (readRecordAbbrevField(Abbv->getOperandInfo(0), Value)) {
-    // Array found, use to read all elements.
-    if (Value == 0)
+  if (Abbv->getNumScalarOperands() == 0) {
+    // The code is the first element of the array.
+    unsigned NumElts = ReadVBR(6);
+    if (NumElts == 0)
       ErrHandler->Fatal("No code found for record!");
-    const NaClBitCodeAbbrevOp &Op = Abbv->getOperandInfo(1);
-    Code = readArrayAbbreviatedField(Op);
-    readArrayAbbrev(Op, Value - 1, Vals);
+    Code = readArrayAbbreviatedField(*EltOp);
+    readArrayAbbrev(*EltOp, NumElts - 1, Vals);
     SkipToByteBoundaryIfAligned();
     return Code;
   }
-  Code = Value;
-
-  // Read arguments.
-  unsigned NumOperands = Abbv->getNumOperandInfos();
-  for (unsigned i = 1; i != NumOperands; ++i) {
-    if (readRecordAbbrevField(Abbv->getOperandInfo(i), Value)) {
-      ++i;
-      readArrayAbbrev(Abbv->getOperandInfo(i), Value, Vals);
-      SkipToByteBoundaryIfAligned();
-      return Code;
-    }
-    Vals.push_back(Value);
-  }
+
+  Code = readScalarAbbrevFields(Abbv, Vals);
+  if (EltOp)
+    readArrayAbbrev(*EltOp, ReadVBR(6), Vals);
   SkipToByteBoundaryIfAligned();
   return Code;
 }
 
-
 NaClBitCodeAbbrevOp::Encoding NaClBitstreamCursor::
 getEncoding(uint64_t Value) {
   if (!NaClBitCodeAbbrevOp::isValidEncoding(Value)) {
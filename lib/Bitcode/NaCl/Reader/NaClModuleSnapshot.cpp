@@ -0,0 +1,119 @@
+//===- NaClModuleSnapshot.cpp ---------------------------------------------===//
+//     Shared module-level records of PNaCl bitcode.
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The snapshot itself is taken and instantiated by NaClBitcodeReader. This
+// file locates the function bodies for the modules instantiated from it.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Bitcode/NaCl/NaClModuleSnapshot.h"
+#include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
+
+using namespace llvm;
+
+const uint64_t NaClModuleSnapshot::RelocInit;
+const unsigned NaClModuleSnapshot::NoBody;
+
+NaClModuleSnapshot::NaClModuleSnapshot(StreamingMemoryObject *Streamer,
+                                       size_t HeaderSize,
+                                       bool AlignBitcodeRecords)
+    : HeaderSize(HeaderSize), AlignBitcodeRecords(AlignBitcodeRecords),
+      ModuleAbbrevIDWidth(0), BodiesFromIndex(false), NumValues(0),
+      ScanFile(new NaClBitstreamReader(Streamer, HeaderSize,
+                                       AlignBitcodeRecords)),
+      ScanStarted(false), NumBodiesScanned(0), NumBodiesFound(0) {}
+
+NaClModuleSnapshot::~NaClModuleSnapshot() {
+  // The cursor refers to ScanFile, so release it first.
+  ScanStream.init(nullptr);
+  for (NaClBitstreamReader::BlockInfo &Info : BlockInfos)
+    for (NaClBitCodeAbbrev *Abbrev : Info.Abbrevs)
+      Abbrev->dropRef();
+}
+
+void NaClModuleSnapshot::installBlockInfo(NaClBitstreamReader &Reader) const {
+  // Abbreviations are reference counted without locking, so each reader gets
+  // its own copies.
+  for (const NaClBitstreamReader::BlockInfo &Info : BlockInfos) {
+    NaClBitstreamReader::BlockInfo &Copy =
+        Reader.getOrCreateBlockInfo(Info.BlockID);
+    for (const NaClBitCodeAbbrev *Abbrev : Info.Abbrevs)
+      Copy.Abbrevs.push_back(Abbrev->Copy());
+  }
+}
+
+bool NaClModuleSnapshot::findFunctionBody(unsigned Index, uint64_t &Bit,
+                                          uint64_t &Size) {
+  sys::ScopedLock L(ScanLock);
+  if (Index >= BodyBits.size())
+    return true;
+  if (Index >= NumBodiesFound && scanToFunctionBody(Index))
+    return true;
+  Bit = BodyBits[Index];
+  Size = BodyBitSizes[Index];
+  return false;
+}
+
+void NaClModuleSnapshot::forgetFoundBodies() {
+  sys::ScopedLock L(ScanLock);
+  NumBodiesFound = NumBodiesScanned;
+}
+
+bool NaClModuleSnapshot::scanToFunctionBody(unsigned Index) {
+  if (!ScanStarted) {
+    installBlockInfo(*ScanFile);
+    ScanStream.init(ScanFile.get());
+    NaClBitstreamEntry Entry =
+        ScanStream.advance(NaClBitstreamCursor::AF_DontAutoprocessAbbrevs,
+                           nullptr);
+    if (Entry.Kind != NaClBitstreamEntry::SubBlock ||
+        Entry.ID != naclbitc::MODULE_BLOCK_ID ||
+        ScanStream.EnterSubBlock(naclbitc::MODULE_BLOCK_ID))
+      return true;
+    ScanStarted = true;
+  }
+
+  // Skip over everything but the function blocks, which only needs the
+  // block sizes and the abbreviations of the module block.
+  while (NumBodiesScanned <= Index) {
+    NaClBitstreamEntry Entry = ScanStream.advance(0, nullptr);
+    switch (Entry.Kind) {
+    case NaClBitstreamEntry::Error:
+    case NaClBitstreamEntry::EndBlock:
+      return true;
+    case NaClBitstreamEntry::Record:
+      ScanStream.skipRecord(Entry.ID);
+      break;
+    case NaClBitstreamEntry::SubBlock:
+      if (Entry.ID == naclbitc::BLOCKINFO_BLOCK_ID) {
+        // Already installed, so this skips it.
+        if (ScanStream.ReadBlockInfoBlock(nullptr))
+          return true;
+        break;
+      }
+      if (Entry.ID != naclbitc::FUNCTION_BLOCK_ID) {
+        if (ScanStream.SkipBlock())
+          return true;
+        break;
+      }
+      if (NumBodiesScanned == BodyBits.size())
+        return true;
+      uint64_t CurBit = ScanStream.GetCurrentBitNo();
+      if (ScanStream.SkipBlock())
+        return true;
+      BodyBits[NumBodiesScanned] = CurBit;
+      BodyBitSizes[NumBodiesScanned] = ScanStream.GetCurrentBitNo() - CurBit;
+      ++NumBodiesScanned;
+      break;
+    }
+  }
+  NumBodiesFound = NumBodiesScanned;
+  return false;
+}
@@ -18,6 +18,7 @@
 #include "NaClValueEnumerator.h"
 #include "llvm/Bitcode/NaCl/NaClBitstreamWriter.h"
 #include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/InlineAsm.h"
@@ -33,6 +34,12 @@
 #include "llvm/Support/raw_ostream.h"
 #include <cctype>
 #include <map>
+#if LLVM_ENABLE_THREADS
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#endif
 using namespace llvm;
 
 static cl::opt<unsigned>
@@ -45,6 +52,18 @@ AlignBitcodeRecords("align-bitcode-records",
     cl::desc("Align bitcode records in PNaCl bitcode files (experimental)"),
     cl::init(false));
 
+static cl::opt<bool>
+EmitFunctionIndex("function-index",
+    cl::desc("Emit an index of the function bodies in PNaCl bitcode files, "
+             "which older readers can not read"),
+    cl::init(false));
+
+static cl::opt<unsigned>
+WriteThreads("bitcode-write-threads",
+    cl::desc("Number of threads writing function blocks of PNaCl bitcode "
+             "files"),
+    cl::init(1));
+
 /// These are manifest constants used by the bitcode writer. They do
 /// not need to be kept in sync with the reader, but need to be
 /// consistent within this file.
@@ -94,7 +113,11 @@ enum {
 
   // TYPE_BLOCK_ID_NEW abbrev id's.
   TYPE_FUNCTION_ABBREV = naclbitc::FIRST_APPLICATION_ABBREV,
-  TYPE_MAX_ABBREV = TYPE_FUNCTION_ABBREV
+  TYPE_MAX_ABBREV = TYPE_FUNCTION_ABBREV,
+
+  // FUNCTION_INDEX_BLOCK abbrev id's.
+  FUNCTION_INDEX_ENTRY_ABBREV = naclbitc::FIRST_APPLICATION_ABBREV,
+  FUNCTION_INDEX_MAX_ABBREV = FUNCTION_INDEX_ENTRY_ABBREV
 };
 
 LLVM_ATTRIBUTE_NORETURN
@@ -609,7 +632,6 @@ static bool WriteInstruction(const Instruction &I, unsigned InstID,
                              SmallVector<unsigned, 64> &Vals) {
   unsigned Code = 0;
   unsigned AbbrevToUse = 0;
-  VE.setInstructionID(&I);
   switch (I.getOpcode()) {
   default:
     if (Instruction::isCast(I.getOpcode())) {
@@ -916,6 +938,48 @@ static void WriteFunction(const Function &F, NaClValueEnumerator &VE,
   DEBUG(dbgs() << "<- WriteModule\n");
 }
 
+/// WriteFunctionIndex - Emit a placeholder entry for each function body, and
+/// put the bit positions of the entries in EntryBits, so that they can be
+/// filled in by BackpatchFunctionIndexEntry once the bodies are written.
+static void WriteFunctionIndex(const Module *M, NaClBitstreamWriter &Stream,
+                               SmallVectorImpl<uint64_t> &EntryBits) {
+  DEBUG(dbgs() << "-> WriteFunctionIndex\n");
+  Stream.EnterSubblock(naclbitc::FUNCTION_INDEX_BLOCK_ID,
+                       FUNCTION_INDEX_MAX_ABBREV);
+
+  // The fields are fixed width, so that they can be backpatched.
+  NaClBitCodeAbbrev *Abbv = new NaClBitCodeAbbrev();
+  Abbv->Add(NaClBitCodeAbbrevOp(naclbitc::FUNCTION_INDEX_ENTRY));
+  Abbv->Add(NaClBitCodeAbbrevOp(NaClBitCodeAbbrevOp::Fixed, 32)); // startword
+  Abbv->Add(NaClBitCodeAbbrevOp(NaClBitCodeAbbrevOp::Fixed, 32)); // numwords
+  if (FUNCTION_INDEX_ENTRY_ABBREV != Stream.EmitAbbrev(Abbv))
+    llvm_unreachable("Unexpected abbrev ordering!");
+
+  SmallVector<unsigned, 2> Vals(2);
+  for (Module::const_iterator F = M->begin(), E = M->end(); F != E; ++F) {
+    if (F->isDeclaration())
+      continue;
+    EntryBits.push_back(Stream.GetCurrentBitNo() + Stream.getAbbrevIDWidth());
+    Stream.EmitRecord(naclbitc::FUNCTION_INDEX_ENTRY, Vals,
+                      FUNCTION_INDEX_ENTRY_ABBREV);
+    Stream.KeepBitsForBackpatch(EntryBits.back(), 64);
+  }
+  Stream.ExitBlock();
+  DEBUG(dbgs() << "<- WriteFunctionIndex\n");
+}
+
+/// BackpatchFunctionIndexEntry - Fill in the function index entry at bit
+/// EntryBit with the position of the function block [StartBit, EndBit).
+static void BackpatchFunctionIndexEntry(NaClBitstreamWriter &Stream,
+                                        uint64_t EntryBit, uint64_t StartBit,
+                                        uint64_t EndBit) {
+  // Function blocks follow other blocks, which end on a word boundary.
+  assert(StartBit % 32 == 0 && EndBit % 32 == 0 &&
+         "Function block not word aligned");
+  Stream.BackpatchBits(EntryBit, StartBit / 32, 32);
+  Stream.BackpatchBits(EntryBit + 32, (EndBit - StartBit) / 32, 32);
+}
+
 // Emit blockinfo, which defines the standard abbreviations etc.
 static void WriteBlockInfo(const NaClValueEnumerator &VE,
                            NaClBitstreamWriter &Stream) {
@@ -1139,6 +1203,155 @@ static void WriteBlockInfo(const NaClValueEnumerator &VE,
   Stream.ExitBlock();
 }
 
+#if LLVM_ENABLE_THREADS
+namespace {
+
+// Writes function blocks on worker threads, each with its own copy of the
+// module-level enumeration, while the blocks already written are added to the
+// module block in module order. Workers stay at most a fixed number of blocks
+// ahead of the oldest block not yet released, which bounds the memory used.
+class NaClParallelFunctionWriter {
+  NaClParallelFunctionWriter(const NaClParallelFunctionWriter &) = delete;
+  void operator=(const NaClParallelFunctionWriter &) = delete;
+
+public:
+  struct WrittenBlock {
+    SmallVector<char, 0> Data;
+    unsigned HeaderBits;
+  };
+
+  NaClParallelFunctionWriter(const std::vector<const Function *> &Functions,
+                             const NaClValueEnumerator &VE,
+                             const NaClBitstreamWriter &Stream,
+                             unsigned NumThreads);
+  ~NaClParallelFunctionWriter();
+
+  // Returns the block of function Index, waiting until it is written.
+  const WrittenBlock &getBlock(size_t Index);
+
+  // Frees block Index, which must be the oldest block not released yet.
+  void releaseBlock(size_t Index);
+
+private:
+  struct Worker {
+    std::unique_ptr<NaClValueEnumerator> VE;
+    SmallVector<char, 0> Buffer;
+    std::unique_ptr<NaClBitstreamWriter> Stream;
+  };
+
+  void run(Worker *W);
+
+  const std::vector<const Function *> &Functions;
+  size_t Window;
+  std::vector<Worker> Workers;
+  std::vector<std::thread> Threads;
+  std::mutex Lock;
+  // Signaled when a block is released, or the workers should stop.
+  std::condition_variable WorkAvailable;
+  // Signaled when a block is written.
+  std::condition_variable BlockReady;
+  // The fields below are guarded by Lock.
+  std::vector<std::unique_ptr<WrittenBlock>> Blocks;
+  size_t NextBlock;
+  size_t NumReleased;
+  bool Stop;
+};
+
+} // end of anonymous namespace
+
+NaClParallelFunctionWriter::NaClParallelFunctionWriter(
+    const std::vector<const Function *> &Functions,
+    const NaClValueEnumerator &VE, const NaClBitstreamWriter &Stream,
+    unsigned NumThreads)
+    : Functions(Functions), Window(16 * NumThreads), Workers(NumThreads),
+      Blocks(Functions.size()), NextBlock(0), NumReleased(0), Stop(false) {
+  // Abbreviations are reference counted without locking, so each worker gets
+  // its own writer.
+  for (Worker &W : Workers) {
+    W.VE.reset(new NaClValueEnumerator(VE));
+    W.Stream.reset(new NaClBitstreamWriter(W.Buffer, Stream));
+  }
+  for (Worker &W : Workers)
+    Threads.emplace_back(&NaClParallelFunctionWriter::run, this, &W);
+}
+
+NaClParallelFunctionWriter::~NaClParallelFunctionWriter() {
+  {
+    std::lock_guard<std::mutex> L(Lock);
+    Stop = true;
+  }
+  WorkAvailable.notify_all();
+  for (std::thread &Thread : Threads)
+    Thread.join();
+}
+
+const NaClParallelFunctionWriter::WrittenBlock &
+NaClParallelFunctionWriter::getBlock(size_t Index) {
+  std::unique_lock<std::mutex> L(Lock);
+  BlockReady.wait(L, [this, Index] { return Blocks[Index] != nullptr; });
+  return *Blocks[Index];
+}
+
+void NaClParallelFunctionWriter::releaseBlock(size_t Index) {
+  {
+    std::lock_guard<std::mutex> L(Lock);
+    assert(Index == NumReleased && "Blocks released out of order");
+    Blocks[Index].reset();
+    ++NumReleased;
+  }
+  WorkAvailable.notify_all();
+}
+
+void NaClParallelFunctionWriter::run(Worker *W) {
+  while (true) {
+    size_t Index;
+    {
+      std::unique_lock<std::mutex> L(Lock);
+      WorkAvailable.wait(L, [this] {
+        return Stop || (NextBlock < Functions.size() &&
+                        NextBlock < NumReleased + Window);
+      });
+      if (Stop)
+        return;
+      Index = NextBlock++;
+    }
+    std::unique_ptr<WrittenBlock> Block(new WrittenBlock());
+    WriteFunction(*Functions[Index], *W->VE, *W->Stream);
+    Block->HeaderBits = W->Stream->getBlockHeaderBits();
+    Block->Data.swap(W->Buffer);
+    {
+      std::lock_guard<std::mutex> L(Lock);
+      Blocks[Index] = std::move(Block);
+    }
+    BlockReady.notify_all();
+  }
+}
+
+/// WriteFunctionsInParallel - Emit the function bodies of the module, writing
+/// them on NumThreads threads.
+static void WriteFunctionsInParallel(const Module *M,
+                                     const NaClValueEnumerator &VE,
+                                     NaClBitstreamWriter &Stream,
+                                     ArrayRef<uint64_t> IndexEntryBits,
+                                     unsigned NumThreads) {
+  std::vector<const Function *> Functions;
+  for (Module::const_iterator F = M->begin(), E = M->end(); F != E; ++F)
+    if (!F->isDeclaration())
+      Functions.push_back(F);
+
+  NaClParallelFunctionWriter Writer(Functions, VE, Stream, NumThreads);
+  for (size_t i = 0, e = Functions.size(); i != e; ++i) {
+    const NaClParallelFunctionWriter::WrittenBlock &Block = Writer.getBlock(i);
+    uint64_t StartBit = Stream.GetCurrentBitNo();
+    Stream.EmitDetachedBlock(Block.Data, Block.HeaderBits);
+    if (EmitFunctionIndex)
+      BackpatchFunctionIndexEntry(Stream, IndexEntryBits[i], StartBit,
+                                  Stream.GetCurrentBitNo());
+    Writer.releaseBlock(i);
+  }
+}
+#endif
+
 /// WriteModule - Emit the specified module to the bitstream.
 static void WriteModule(const Module *M, NaClBitstreamWriter &Stream) {
   DEBUG(dbgs() << "-> WriteModule\n");
@@ -1166,10 +1379,29 @@ static void WriteModule(const Module *M, NaClBitstreamWriter &Stream) {
   // Emit names for globals/functions etc.
   WriteValueSymbolTable(M->getValueSymbolTable(), VE, Stream);
 
+  // Emit an index of the function bodies, if requested.
+  SmallVector<uint64_t, 32> IndexEntryBits;
+  if (EmitFunctionIndex)
+    WriteFunctionIndex(M, Stream, IndexEntryBits);
+
   // Emit function bodies.
-  for (Module::const_iterator F = M->begin(), E = M->end(); F != E; ++F)
-    if (!F->isDeclaration())
+#if LLVM_ENABLE_THREADS
+  if (WriteThreads > 1) {
+    WriteFunctionsInParallel(M, VE, Stream, IndexEntryBits, WriteThreads);
+  } else
+#endif
+  {
+    unsigned BodyIndex = 0;
+    for (Module::const_iterator F = M->begin(), E = M->end(); F != E; ++F) {
+      if (F->isDeclaration())
+        continue;
+      uint64_t StartBit = Stream.GetCurrentBitNo();
       WriteFunction(*F, VE, Stream);
+      if (EmitFunctionIndex)
+        BackpatchFunctionIndexEntry(Stream, IndexEntryBits[BodyIndex++],
+                                    StartBit, Stream.GetCurrentBitNo());
+    }
+  }
 
   Stream.ExitBlock();
   DEBUG(dbgs() << "<- WriteModule\n");
@@ -1256,3 +1488,16 @@ void llvm::NaClWriteBitcodeToFile(const Module *M, raw_ostream &Out,
   // Write the generated bitstream to "Out".
   Out.write((char*)&Buffer.front(), Buffer.size());
 }
+
+/// NaClWriteBitcodeToStream - Write the specified module to the specified
+/// output stream, one top-level block at a time.
+void llvm::NaClWriteBitcodeToStream(const Module *M, raw_pwrite_stream &Out,
+                                    bool AcceptSupportedOnly) {
+  SmallVector<char, 0> Buffer;
+  Buffer.reserve(256*1024);
+
+  NaClBitstreamWriter Stream(Buffer, Out);
+  NaClWriteHeader(Stream, AcceptSupportedOnly);
+  WriteModule(M, Stream);
+  Stream.FlushToStream();
+}
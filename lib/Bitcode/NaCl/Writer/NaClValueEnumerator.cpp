@@ -114,7 +114,7 @@ NaClValueEnumerator::NaClValueEnumerator(const Module *M) {
   TypeCountMap = NULL;
 
   // Optimize constant ordering.
-  OptimizeConstants(FirstConstant, Values.size());
+  OptimizeConstants(FirstConstant, Values.size(), ValueMap);
 }
 
 void NaClValueEnumerator::OptimizeTypes(const Module *M) {
@@ -149,17 +149,13 @@ void NaClValueEnumerator::OptimizeTypes(const Module *M) {
   }
 }
 
-unsigned NaClValueEnumerator::getInstructionID(const Instruction *Inst) const {
-  InstructionMapType::const_iterator I = InstructionMap.find(Inst);
-  assert(I != InstructionMap.end() && "Instruction is not mapped!");
-  return I->second;
-}
-
-void NaClValueEnumerator::setInstructionID(const Instruction *I) {
-  InstructionMap[I] = InstructionCount++;
-}
-
 unsigned NaClValueEnumerator::getValueID(const Value *V) const {
+  // Global values are only in the module-level map.
+  if (!isa<GlobalValue>(V)) {
+    ValueMapType::const_iterator I = FunctionValueMap.find(V);
+    if (I != FunctionValueMap.end())
+      return I->second-1;
+  }
   ValueMapType::const_iterator I = ValueMap.find(V);
   assert(I != ValueMap.end() && "Value not in slotcalculator!");
   return I->second-1;
@@ -168,6 +164,8 @@ unsigned NaClValueEnumerator::getValueID(const Value *V) const {
 void NaClValueEnumerator::dump() const {
   print(dbgs(), ValueMap, "Default");
   dbgs() << '\n';
+  print(dbgs(), FunctionValueMap, "Function");
+  dbgs() << '\n';
 }
 
 void NaClValueEnumerator::print(raw_ostream &OS, const ValueMapType &Map,
@@ -217,8 +215,10 @@ namespace {
   };
 }
 
-/// OptimizeConstants - Reorder constant pool for denser encoding.
-void NaClValueEnumerator::OptimizeConstants(unsigned CstStart, unsigned CstEnd) {
+/// OptimizeConstants - Reorder constant pool for denser encoding. Map holds
+/// the IDs of the constants.
+void NaClValueEnumerator::OptimizeConstants(unsigned CstStart, unsigned CstEnd,
+                                            ValueMapType &Map) {
   if (CstStart == CstEnd || CstStart+1 == CstEnd) return;
 
   CstSortPredicate P(*this);
@@ -230,9 +230,9 @@ void NaClValueEnumerator::OptimizeConstants(unsigned CstStart, unsigned CstEnd)
   std::partition(Values.begin()+CstStart, Values.begin()+CstEnd,
                  isIntOrIntVectorValue);
 
-  // Rebuild the modified portion of ValueMap.
+  // Rebuild the modified portion of Map.
   for (; CstStart != CstEnd; ++CstStart)
-    ValueMap[Values[CstStart].first] = CstStart+1;
+    Map[Values[CstStart].first] = CstStart+1;
 }
 
 
@@ -294,6 +294,48 @@ void NaClValueEnumerator::EnumerateValue(const Value *VIn) {
   ValueID = Values.size();
 }
 
+/// EnumerateFunctionValue - Like EnumerateValue, for the values of the
+/// incorporated function. Their types were enumerated with the module.
+void NaClValueEnumerator::EnumerateFunctionValue(const Value *VIn) {
+  // Skip over elided values.
+  const Value *V = ElideCasts(VIn);
+  if (V != VIn) return;
+
+  assert(!V->getType()->isVoidTy() && "Can't insert void values!");
+
+  // Check to see if it's already in, as a module-level value!
+  ValueMapType::iterator I = ValueMap.find(V);
+  if (I != ValueMap.end()) {
+    Values[I->second-1].second++;
+    return;
+  }
+
+  unsigned &ValueID = FunctionValueMap[V];
+  if (ValueID) {
+    Values[ValueID-1].second++;
+    return;
+  }
+
+  if (const Constant *C = dyn_cast<Constant>(V)) {
+    if (C->getNumOperands()) {
+      // Enumerate the operands of the constant before the constant, as
+      // EnumerateValue does.
+      for (User::const_op_iterator OI = C->op_begin(), E = C->op_end();
+           OI != E; ++OI)
+        if (!isa<BasicBlock>(*OI))
+          EnumerateFunctionValue(*OI);
+
+      // ValueID may be dangling.
+      Values.push_back(std::make_pair(V, 1U));
+      FunctionValueMap[V] = Values.size();
+      return;
+    }
+  }
+
+  Values.push_back(std::make_pair(V, 1U));
+  ValueID = Values.size();
+}
+
 
 Type *NaClValueEnumerator::NormalizeType(Type *Ty) const {
   if (Ty->isPointerTy())
@@ -415,63 +457,60 @@ void NaClValueEnumerator::EnumerateOperandType(const Value *V) {
 }
 
 void NaClValueEnumerator::incorporateFunction(const Function &F) {
-  InstructionCount = 0;
   NumModuleValues = Values.size();
 
   // Make sure no insertions outside of a function.
   assert(FnForwardTypeRefs.empty());
+  assert(FunctionValueMap.empty() && "Function already incorporated!");
 
   // Adding function arguments to the value table.
   for (Function::const_arg_iterator I = F.arg_begin(), E = F.arg_end();
        I != E; ++I)
-    EnumerateValue(I);
+    EnumerateFunctionValue(I);
 
   FirstFuncConstantID = Values.size();
 
-  // Add all function-level constants to the value table.
+  // Add all function-level constants to the value table, and collect the
+  // instructions, which are numbered after the constants, in one pass.
   for (Function::const_iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
     for (BasicBlock::const_iterator I = BB->begin(), E = BB->end(); I!=E; ++I) {
       if (const SwitchInst *SI = dyn_cast<SwitchInst>(I)) {
         // Handle switch instruction specially, so that we don't write
         // out unnecessary vector/array constants used to model case selectors.
         if (isa<Constant>(SI->getCondition())) {
-          EnumerateValue(SI->getCondition());
+          EnumerateFunctionValue(SI->getCondition());
         }
       } else {
         for (User::const_op_iterator OI = I->op_begin(), E = I->op_end();
              OI != E; ++OI) {
           if ((isa<Constant>(*OI) && !isa<GlobalValue>(*OI)) ||
               isa<InlineAsm>(*OI))
-            EnumerateValue(*OI);
+            EnumerateFunctionValue(*OI);
         }
       }
+      if (!I->getType()->isVoidTy())
+        FunctionInsts.push_back(I);
     }
     BasicBlocks.push_back(BB);
-    ValueMap[BB] = BasicBlocks.size();
+    FunctionValueMap[BB] = BasicBlocks.size();
   }
 
   // Optimize the constant layout.
-  OptimizeConstants(FirstFuncConstantID, Values.size());
+  OptimizeConstants(FirstFuncConstantID, Values.size(), FunctionValueMap);
 
   FirstInstID = Values.size();
 
   // Add all of the instructions.
-  for (Function::const_iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
-    for (BasicBlock::const_iterator I = BB->begin(), E = BB->end(); I!=E; ++I) {
-      if (!I->getType()->isVoidTy())
-        EnumerateValue(I);
-    }
-  }
+  for (const Instruction *I : FunctionInsts)
+    EnumerateFunctionValue(I);
 }
 
 void NaClValueEnumerator::purgeFunction() {
-  /// Remove purged values from the ValueMap.
-  for (unsigned i = NumModuleValues, e = Values.size(); i != e; ++i)
-    ValueMap.erase(Values[i].first);
-  for (unsigned i = 0, e = BasicBlocks.size(); i != e; ++i)
-    ValueMap.erase(BasicBlocks[i]);
-
+  // The module-level values are left as they were before the function was
+  // incorporated, and the storage for the function is kept for the next one.
   Values.resize(NumModuleValues);
+  FunctionValueMap.clear();
+  FunctionInsts.clear();
   BasicBlocks.clear();
   FnForwardTypeRefs.clear();
 }
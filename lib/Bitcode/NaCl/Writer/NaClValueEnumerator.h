@@ -56,12 +56,19 @@ private:
   ValueMapType ValueMap;
   ValueList Values;
 
-  typedef DenseMap<const Instruction*, unsigned> InstructionMapType;
-  InstructionMapType InstructionMap;
-  unsigned InstructionCount;
+  /// FunctionValueMap - The IDs of the values of the currently incorporated
+  /// function, which are kept apart from the module-level ValueMap, so that
+  /// the module-level map is not changed from function to function, and the
+  /// storage of this map is reused.
+  ValueMapType FunctionValueMap;
+
+  /// FunctionInsts - The instructions of the currently incorporated
+  /// function that define values, in order.
+  std::vector<const Instruction*> FunctionInsts;
 
   /// BasicBlocks - This contains all the basic blocks for the currently
-  /// incorporated function.  Their reverse mapping is stored in ValueMap.
+  /// incorporated function.  Their reverse mapping is stored in
+  /// FunctionValueMap.
   std::vector<const BasicBlock*> BasicBlocks;
 
   /// When a function is incorporated, this is the size of the Values list
@@ -84,11 +91,14 @@ private:
   /// \brief Integer type use for PNaCl conversion of pointers.
   Type *IntPtrType;
 
-  NaClValueEnumerator(const NaClValueEnumerator &) = delete;
   void operator=(const NaClValueEnumerator &) = delete;
 public:
   NaClValueEnumerator(const Module *M);
 
+  /// Copies the enumeration of a module, while no function is incorporated,
+  /// so that functions can be incorporated by several threads at once.
+  NaClValueEnumerator(const NaClValueEnumerator &) = default;
+
   void dump() const;
   void print(raw_ostream &OS, const ValueMapType &Map, const char *Name) const;
 
@@ -108,9 +118,6 @@ public:
     return I->second-1;
   }
 
-  unsigned getInstructionID(const Instruction *I) const;
-  void setInstructionID(const Instruction *I);
-
   /// getFunctionConstantRange - Return the range of values that corresponds to
   /// function-local constants.
   void getFunctionConstantRange(unsigned &Start, unsigned &End) const {
@@ -155,9 +162,11 @@ public:
 
 private:
   void OptimizeTypes(const Module *M);
-  void OptimizeConstants(unsigned CstStart, unsigned CstEnd);
+  void OptimizeConstants(unsigned CstStart, unsigned CstEnd,
+                         ValueMapType &Map);
 
   void EnumerateValue(const Value *V);
+  void EnumerateFunctionValue(const Value *V);
   void EnumerateType(Type *T, bool InsideOptimizeTypes=false);
   void EnumerateOperandType(const Value *V);
 
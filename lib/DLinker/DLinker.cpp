@@ -1,17 +1,22 @@
 #include "llvm/DLinker/DLinker.h"
+#include "llvm/DLinker/ExportIndex.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/Support/Debug.h"
 
 #include <vector>
 #include <string>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "dlinker"
+
 DLinkDiagnosticInfo::DLinkDiagnosticInfo(DiagnosticSeverity Severity, const Twine &Msg)
                 : DiagnosticInfo(DK_Linker, Severity), Msg(Msg) {
 }
@@ -20,34 +25,73 @@ void DLinkDiagnosticInfo::print(DiagnosticPrinter &DP) const {
     DP << Msg; 
 }
 
+// Returns the global that an i32 field of the flattened PSO root points into.
+// A field is either "ptrtoint @GV" or, for a string in a pooled string table,
+// "add (ptrtoint @GV), Offset".
+static GlobalVariable *ParsingPointer(Constant *Ptr, uint64_t &Offset) {
+    Offset = 0;
+    ConstantExpr *CE = dyn_cast<ConstantExpr>(Ptr);
+    if (CE && CE->getOpcode() == Instruction::Add) {
+        ConstantInt *CI = dyn_cast<ConstantInt>(CE->getOperand(1));
+        if (!CI) {
+            return NULL;
+        }
+        Offset = CI->getZExtValue();
+        CE = dyn_cast<ConstantExpr>(CE->getOperand(0));
+    }
+    if (CE && CE->getOpcode() == Instruction::PtrToInt) {
+        return dyn_cast<GlobalVariable>(CE->getOperand(0));
+    }
+    return NULL;
+}
+
+// Reads the NUL terminated string at Offset in the initializer of GV.
+static bool ParsingString(GlobalVariable *GV, uint64_t Offset, StringRef &Str) {
+    if (!GV->hasInitializer()) {
+        return false;
+    }
+    ConstantDataArray *CDA = dyn_cast<ConstantDataArray>(GV->getInitializer());
+    if (!CDA || !CDA->isString()) {
+        return false;
+    }
+    StringRef Data = CDA->getAsString();
+    if (Offset >= Data.size()) {
+        return false;
+    }
+    size_t End = Data.find('\0', Offset);
+    if (End == StringRef::npos) {
+        return false;
+    }
+    Str = Data.slice(Offset, End);
+    return true;
+}
+
+// Collects the imports of the PSO root. Entries alternate between the
+// imported name and the library that provides it, which is zero until the
+// import is linked. Each import names a function that is declared in the
+// module, which is found through the module symbol table instead of
+// rescanning every function for each import. With lazy binding, the
+// declaration may have been dropped once all calls went through
+// __import_funcs, so the import table itself is authoritative.
 static void ParsingImports(ConstantStruct *Imports_CS, std::vector<ImportEntry> *ImportTable) {
-    std::string FunctionName;
-    Constant *ImportName;
-    for (unsigned i = 0; i < Imports_CS->getNumOperands(); ++i) {
+    for (unsigned i = 0; i + 1 < Imports_CS->getNumOperands(); i = i + 2) {
         Constant *Import_ptr = Imports_CS->getOperand(i);
-        if (ConstantExpr *Import_CE = dyn_cast<ConstantExpr>(Import_ptr)) {
-            if (Import_CE->getOpcode() == Instruction::PtrToInt) {
-                if (GlobalVariable *Import_GV = dyn_cast<GlobalVariable>(Import_CE->getOperand(0))) {
-                    Constant *Import = Import_GV->getInitializer();
-                    if (ConstantDataArray *Import_name = dyn_cast<ConstantDataArray>(Import)) {
-                        if (Import_name->isString()) {
-                            FunctionName = Import_name->getAsString();
-                            ImportName = Import_ptr;
-                        }
-                    }
-                    if (Import->isNullValue()) {
-                        Module *M = Import_GV->getParent();
-                        for (Module::iterator F = M->begin(), E = M->end(); F != E; F++) {
-                            if(F->isDeclaration()) {
-                                if (strcmp(F->getName().data(), FunctionName.c_str()) == 0) {
-                                    ImportEntry Entry = {ImportName, FunctionName, F};
-                                    ImportTable->push_back(Entry);
-                                    Import_GV->dump();
-                                }
-                            }
-                        }
-                    }
-                }
+        Constant *Library_ptr = Imports_CS->getOperand(i + 1);
+        uint64_t NameOffset, LibraryOffset;
+        GlobalVariable *Import_GV = ParsingPointer(Import_ptr, NameOffset);
+        GlobalVariable *Library_GV = ParsingPointer(Library_ptr, LibraryOffset);
+        StringRef FunctionName;
+        if (!Import_GV || !Library_GV || !Library_GV->hasInitializer() ||
+            !ParsingString(Import_GV, NameOffset, FunctionName)) {
+            continue;
+        }
+        if (Library_GV->getInitializer()->isNullValue()) {
+            Module *M = Import_GV->getParent();
+            Function *F = M->getFunction(FunctionName);
+            if (!F || F->isDeclaration()) {
+                ImportEntry Entry = {Import_ptr, FunctionName, F, Library_ptr};
+                ImportTable->push_back(Entry);
+                DEBUG(Library_GV->dump());
             }
         }
     }
@@ -69,8 +113,23 @@ static ConstantStruct *ParsingPsoRoot(GlobalVariable *PsoRoot, const int index)
     return NULL;
 }
 
+// Collects the names in the export table of a PSO root. Entries alternate
+// between the exported name and the exported function.
+static void ParsingExports(ConstantStruct *Exports_CS, std::vector<StringRef> *ExportNames) {
+    for (unsigned i = 0; i < Exports_CS->getNumOperands(); i = i + 2) {
+        uint64_t Offset;
+        StringRef ExportName;
+        if (GlobalVariable *Export_GV = ParsingPointer(Exports_CS->getOperand(i), Offset)) {
+            if (ParsingString(Export_GV, Offset, ExportName)) {
+                ExportNames->push_back(ExportName);
+            }
+        }
+    }
+}
+
 DLinker::DLinker(Module *M, LLVMContext &Context, DiagnosticHandlerFunction DiagnosticHandler) 
-    : Composite(M), Context(Context), DiagnosticHandler(DiagnosticHandler) {
+    : Composite(M), Context(Context), DiagnosticHandler(DiagnosticHandler),
+      LibraryPool(NULL) {
     setImportTable();
 } 
 
@@ -78,15 +137,27 @@ DLinker::~DLinker() {
 }
 
 void DLinker::setImportTable() {
-    for (Module::global_iterator F = Composite->global_begin(), E = Composite->global_end(); F != E; F++) {
-        if (strcmp(F->getName().data(), "__pnacl_pso_root") == 0) {
-            PsoRoot = F;
-            ConstantStruct *Imports = ParsingPsoRoot(F, 0);                  
+    PsoRoot = Composite->getNamedGlobal("__pnacl_pso_root");
+    if (PsoRoot) {
+        if (ConstantStruct *Imports = ParsingPsoRoot(PsoRoot, 0)) {
             ParsingImports(Imports, &ImportTable);
         }
     }
+    // Intern the import names once, so that resolving the exports of each
+    // linked module is a hash lookup per export.
+    for (unsigned i = 0; i < ImportTable.size(); ++i) {
+        ImportIndex[ImportTable[i].FunctionName].push_back(i);
+    }
+    // Imports that no module resolves keep their original entry.
+    LibraryOffsets.assign(ImportTable.size(), -1);
     Constants.resize(ImportTable.size() * 2);
     Types.resize(ImportTable.size() * 2);
+    for (unsigned i = 0; i < ImportTable.size(); ++i) {
+        Constants[i * 2] = ImportTable[i].ImportName;
+        Constants[i * 2 + 1] = ImportTable[i].ImportLibrary;
+        Types[i * 2] = ImportTable[i].ImportName->getType();
+        Types[i * 2 + 1] = ImportTable[i].ImportLibrary->getType();
+    }
 }
 
 bool DLinker::areTypesIsomorphic(Type *DstTy, Type *SrcTy) {
@@ -109,105 +180,159 @@ bool DLinker::areFunctionsIsomorphic(Function *Dst, Function *Src) {
     return true;
 }
 
-bool DLinker::linkPsoRoot(Module *M) {
+void DLinker::linkDataLayout(const DataLayout &DL, StringRef ModuleID) {
     if (Composite->getDataLayout().isDefault()) {
-        Composite->setDataLayout(M->getDataLayout());
+        Composite->setDataLayout(DL);
     }
 
-    if (Composite->getDataLayout() != M->getDataLayout()) {
+    if (Composite->getDataLayout() != DL) {
         //TODO: check whether the datalayout is the same
         emitWarning("Linking tow modules of different data layouts: " +  
                 Composite->getModuleIdentifier() + "' is '" +  
                 Composite->getDataLayoutStr() + "' whereas '" + 
-                M->getModuleIdentifier() + "' is  '" +
-                M->getDataLayoutStr() + "'\n");
+                ModuleID + "' is  '" +
+                DL.getStringRepresentation() + "'\n");
     }
+}
 
-    ExportFileName = M->getModuleIdentifier();
-    for (Module::global_iterator F = M->global_begin(), E = M->global_end(); F != E; F++) {
-        if(strcmp(F->getName().data(),"__pnacl_pso_root") == 0) {
-            ConstantStruct *Exports = ParsingPsoRoot(F, 2);
-            Linking(Exports);
+void DLinker::getExports(Module *M, std::vector<StringRef> &ExportNames) {
+    if (GlobalVariable *Root = M->getNamedGlobal("__pnacl_pso_root")) {
+        if (ConstantStruct *Exports = ParsingPsoRoot(Root, 2)) {
+            ParsingExports(Exports, &ExportNames);
         }
     }
+}
 
-    if (Constants[0] != NULL) {
-        StructType *SType = StructType::get(Context, Types, true);
-        Constant *CS = ConstantStruct::get(SType, Constants);
+bool DLinker::linkPsoRoot(Module *M) {
+    std::vector<StringRef> ExportNames;
+    getExports(M, ExportNames);
+    std::vector<unsigned> Imports;
+    findImports(ExportNames, Imports);
+    return linkImports(M->getDataLayout(), M->getModuleIdentifier(), Imports);
+}
 
-        GlobalVariable *GV = new GlobalVariable(*Composite,
-            SType,
-            true,
-            GlobalVariable::InternalLinkage,
-            0,
-            "");
+bool DLinker::linkExportIndex(const ExportIndex &Index, StringRef ModuleID) {
+    std::vector<StringRef> ExportNames;
+    ExportNames.reserve(Index.size());
+    for (unsigned i = 0; i < Index.size(); ++i) {
+        ExportNames.push_back(Index.getExport(i));
+    }
+    std::vector<unsigned> Imports;
+    findImports(ExportNames, Imports);
+    return linkImports(DataLayout(Index.getDataLayout()), ModuleID, Imports);
+}
 
-        GV->setInitializer(CS);
-        GV->setAlignment(16);
+void DLinker::findImports(ArrayRef<StringRef> ExportNames,
+                          std::vector<unsigned> &Imports) const {
+    for (unsigned i = 0; i < ExportNames.size(); ++i) {
+        StringMap<SmallVector<unsigned, 1> >::const_iterator I =
+            ImportIndex.find(ExportNames[i]);
+        if (I != ImportIndex.end()) {
+            Imports.insert(Imports.end(), I->second.begin(), I->second.end());
+        }
+    }
+}
 
-        Constant *CE = ConstantExpr::getPtrToInt(GV, 
-            IntegerType::get(Context, 32));
+bool DLinker::linkImports(const DataLayout &DL, StringRef ModuleID,
+                          ArrayRef<unsigned> Imports) {
+    linkDataLayout(DL, ModuleID);
+    ExportFileName = ModuleID;
+    for (unsigned i = 0; i < Imports.size(); ++i) {
+        resolveImport(Imports[i]);
+    }
 
-        Constant *Val = PsoRoot->getInitializer();
-        if (ConstantStruct *CS = dyn_cast<ConstantStruct>(Val)) {
-            Constant *PTR = CS->getOperand(0);
-            PTR->replaceAllUsesWith(CE);
-            if (GlobalVariable *G = dyn_cast<GlobalVariable>(PTR->getOperand(0))) {
-                G->eraseFromParent();
-            }
-        }
-       
-        Composite->dump();
+    // Only rebuild the import table of the composite when this module
+    // resolved something.
+    if (!Imports.empty()) {
+        rebuildImportTable();
+        DEBUG(Composite->dump());
     }
     return 0;
 }
 
-bool DLinker::Linking(ConstantStruct *Exports_CS) {
-    std::string FunctionName;
+// Emits the names of all linked libraries as one string table, and points
+// the library field of each resolved import at its name in it.
+void DLinker::rebuildImportTable() {
+    IntegerType *Int32Ty = IntegerType::get(Context, 32);
+    Constant *Pool_arr = ConstantDataArray::getString(Context, LibraryNames, false);
+    GlobalVariable *Pool = new GlobalVariable(*Composite,
+        Pool_arr->getType(),
+        true,
+        GlobalVariable::InternalLinkage,
+        Pool_arr,
+        "");
+    Pool->setAlignment(1);
+    Constant *PoolPtr = ConstantExpr::getPtrToInt(Pool, Int32Ty);
+    for (unsigned i = 0; i < ImportTable.size(); ++i) {
+        if (LibraryOffsets[i] < 0) {
+            continue;
+        }
+        Constant *CE = PoolPtr;
+        if (LibraryOffsets[i] > 0) {
+            CE = ConstantExpr::getAdd(PoolPtr,
+                ConstantInt::get(Int32Ty, LibraryOffsets[i]));
+        }
+        Constants[i * 2 + 1] = CE;
+        Types[i * 2 + 1] = CE->getType();
+    }
 
-    for (unsigned i = 0; i < Exports_CS->getNumOperands(); i = i + 2) {
-    Constant *Export_ptr = Exports_CS->getOperand(i);
-        if (ConstantExpr *Export_CE = dyn_cast<ConstantExpr>(Export_ptr)) {
-            if (Export_CE->getOpcode() == Instruction::PtrToInt) {
-                //  Export function name
-                if (GlobalVariable *Export_GV = dyn_cast<GlobalVariable>(Export_CE->getOperand(0))) {
-                    Constant *Export = Export_GV->getInitializer();
-                    if (ConstantDataArray *Export_name = dyn_cast<ConstantDataArray>(Export)) {
-                        if (Export_name->isString()) {
-                            for (unsigned i = 0; i < ImportTable.size(); ++i) {
-                                if (strcmp(ImportTable[i].FunctionName.c_str(), 
-                                    Export_name->getAsString().data()) == 0) {
-
-                                    errs() << "Linking Symbol '" << ImportTable[i].FunctionName << "'\n";
-                                    
-                                    ArrayType *arrTy = ArrayType::get(IntegerType::get(Context,
-                                        8), ExportFileName.length() + 1);
-                                    Constant *const_arr = ConstantDataArray::getString(Context,
-                                    ExportFileName.c_str(), true);
-
-                                    GlobalVariable *global_str = new GlobalVariable(*Composite,
-                                        arrTy,
-                                        true,
-                                        GlobalVariable::InternalLinkage,
-                                        0,
-                                        "");
-                                    global_str->setAlignment(1);
-                                    global_str->setInitializer(const_arr);
-
-                                    Constant *CE = ConstantExpr::getPtrToInt(global_str, 
-                                        IntegerType::get(Context, 32));
-
-                                    Constants[i * 2] = ImportTable[i].ImportName;
-                                    Constants[i * 2 + 1] = CE;
-                                    Types[i * 2] = ImportTable[i].ImportName->getType();
-                                    Types[i * 2 + 1] = CE->getType(); 
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+    StructType *SType = StructType::get(Context, Types, true);
+    Constant *CS = ConstantStruct::get(SType, Constants);
+
+    GlobalVariable *GV = new GlobalVariable(*Composite,
+        SType,
+        true,
+        GlobalVariable::InternalLinkage,
+        0,
+        "");
+
+    GV->setInitializer(CS);
+    GV->setAlignment(16);
+
+    Constant *CE = ConstantExpr::getPtrToInt(GV, Int32Ty);
+
+    Constant *Val = PsoRoot->getInitializer();
+    if (ConstantStruct *CS = dyn_cast<ConstantStruct>(Val)) {
+        Constant *PTR = CS->getOperand(0);
+        PTR->replaceAllUsesWith(CE);
+        if (GlobalVariable *G = dyn_cast<GlobalVariable>(PTR->getOperand(0))) {
+            G->eraseFromParent();
         }
     }
-    return true;
+
+    // The previous table is only referenced by the import table just
+    // replaced.
+    if (LibraryPool) {
+        LibraryPool->removeDeadConstantUsers();
+        if (LibraryPool->use_empty()) {
+            LibraryPool->eraseFromParent();
+        }
+    }
+    LibraryPool = Pool;
+}
+
+bool DLinker::Linking(ConstantStruct *Exports_CS) {
+    std::vector<StringRef> ExportNames;
+    ParsingExports(Exports_CS, &ExportNames);
+    std::vector<unsigned> Imports;
+    findImports(ExportNames, Imports);
+    for (unsigned i = 0; i < Imports.size(); ++i) {
+        resolveImport(Imports[i]);
+    }
+    return !Imports.empty();
+}
+
+void DLinker::resolveImport(unsigned Idx) {
+    DEBUG(dbgs() << "Linking Symbol '" << ImportTable[Idx].FunctionName << "'\n");
+    LibraryOffsets[Idx] = getLibraryOffset(ExportFileName);
+}
+
+unsigned DLinker::getLibraryOffset(StringRef Library) {
+    std::pair<StringMap<unsigned>::iterator, bool> Entry =
+        LibraryNameOffsets.insert(std::make_pair(Library, LibraryNames.size()));
+    if (Entry.second) {
+        LibraryNames += Library;
+        LibraryNames.push_back('\0');
+    }
+    return Entry.first->second;
 }
@@ -0,0 +1,129 @@
+//===- ExportIndex.cpp - On-disk cache of PSO export tables --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/DLinker/ExportIndex.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileOutputBuffer.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static const char ExportIndexMagic[4] = {'P', 'D', 'X', 'I'};
+static const uint32_t ExportIndexVersion = 1;
+// Magic, version, number of exports and data layout size.
+static const size_t ExportIndexHeaderSize = 16;
+
+static void getIndexPath(StringRef Dir, StringRef Key,
+                         SmallVectorImpl<char> &Path) {
+    Path.clear();
+    sys::path::append(Path, Dir, Key + ".exports");
+}
+
+std::string ExportIndex::getKey(MemoryBufferRef Buffer) {
+    MD5 Hash;
+    Hash.update(ArrayRef<uint8_t>(
+        reinterpret_cast<const uint8_t *>(Buffer.getBufferStart()),
+        Buffer.getBufferSize()));
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    SmallString<32> Key;
+    MD5::stringifyResult(Result, Key);
+    return Key.str();
+}
+
+std::unique_ptr<ExportIndex> ExportIndex::read(StringRef Dir, StringRef Key) {
+    SmallString<128> Path;
+    getIndexPath(Dir, Key, Path);
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+        MemoryBuffer::getFile(Path, -1, false);
+    if (!BufferOrErr)
+        return nullptr;
+    std::unique_ptr<ExportIndex> Index(
+        new ExportIndex(std::move(BufferOrErr.get())));
+    if (!Index->parse())
+        return nullptr;
+    return Index;
+}
+
+bool ExportIndex::parse() {
+    const char *Start = Buffer->getBufferStart();
+    size_t Size = Buffer->getBufferSize();
+    if (Size < ExportIndexHeaderSize ||
+        memcmp(Start, ExportIndexMagic, sizeof(ExportIndexMagic)) != 0 ||
+        support::endian::read32le(Start + 4) != ExportIndexVersion)
+        return false;
+
+    NumExports = support::endian::read32le(Start + 8);
+    uint32_t DataLayoutSize = support::endian::read32le(Start + 12);
+    uint64_t OffsetsSize = (uint64_t(NumExports) + 1) * 4;
+    if (ExportIndexHeaderSize + OffsetsSize + DataLayoutSize > Size)
+        return false;
+
+    Offsets = Start + ExportIndexHeaderSize;
+    DataLayout = StringRef(Offsets + OffsetsSize, DataLayoutSize);
+    StringPool = DataLayout.end();
+    uint64_t PoolSize = Start + Size - StringPool;
+    uint32_t Prev = 0;
+    for (unsigned i = 0; i <= NumExports; ++i) {
+        uint32_t Offset = support::endian::read32le(Offsets + i * 4);
+        if (Offset < Prev || Offset > PoolSize)
+            return false;
+        Prev = Offset;
+    }
+    return true;
+}
+
+StringRef ExportIndex::getExport(unsigned i) const {
+    assert(i < NumExports && "Export index out of range");
+    uint32_t Begin = support::endian::read32le(Offsets + i * 4);
+    uint32_t End = support::endian::read32le(Offsets + (i + 1) * 4);
+    return StringRef(StringPool + Begin, End - Begin);
+}
+
+std::error_code ExportIndex::write(StringRef Dir, StringRef Key,
+                                   StringRef DataLayout,
+                                   ArrayRef<StringRef> Exports) {
+    if (std::error_code EC = sys::fs::create_directories(Dir))
+        return EC;
+
+    SmallString<128> Path;
+    getIndexPath(Dir, Key, Path);
+    SmallString<1024> Contents;
+    {
+        raw_svector_ostream OS(Contents);
+        support::endian::Writer<support::little> W(OS);
+        OS.write(ExportIndexMagic, sizeof(ExportIndexMagic));
+        W.write<uint32_t>(ExportIndexVersion);
+        W.write<uint32_t>(Exports.size());
+        W.write<uint32_t>(DataLayout.size());
+        uint32_t Offset = 0;
+        W.write<uint32_t>(Offset);
+        for (StringRef Name : Exports) {
+            Offset += Name.size();
+            W.write<uint32_t>(Offset);
+        }
+        OS << DataLayout;
+        for (StringRef Name : Exports)
+            OS << Name;
+    }
+
+    // The buffer is written to a temporary file, which is renamed over
+    // Path on commit.
+    std::unique_ptr<FileOutputBuffer> Buffer;
+    if (std::error_code EC =
+            FileOutputBuffer::create(Path, Contents.size(), Buffer))
+        return EC;
+    std::copy(Contents.begin(), Contents.end(), Buffer->getBufferStart());
+    return Buffer->commit();
+}
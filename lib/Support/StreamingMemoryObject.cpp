@@ -8,6 +8,8 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Support/StreamingMemoryObject.h"
+#include "llvm/Support/FileSystem.h" // @LOCALMOD
+#include "llvm/Support/Process.h" // @LOCALMOD
 #include <cassert>
 #include <cstddef>
 #include <cstring>
@@ -66,6 +68,63 @@ const uint8_t *RawMemoryObject::getPointer(uint64_t address,
                                            uint64_t size) const {
   return FirstChar + address;
 }
+
+// @LOCALMOD-BEGIN
+// The contents of a file, mapped read-only into memory. The whole file is
+// available from the start, so reading never blocks or copies, and the bytes
+// stay at the same address until the object is destroyed.
+class MappedFileMemoryObject : public StreamingMemoryObject {
+public:
+  explicit MappedFileMemoryObject(
+      std::unique_ptr<sys::fs::mapped_file_region> Region)
+      : Region(std::move(Region)),
+        Bytes(reinterpret_cast<const uint8_t *>(this->Region->const_data())),
+        NumBytes(this->Region->size()) {}
+
+  uint64_t getExtent() const override { return NumBytes; }
+  uint64_t readBytes(uint8_t *Buf, uint64_t Size,
+                     uint64_t Address) const override;
+  const uint8_t *getPointer(uint64_t Address, uint64_t Size) const override {
+    return Bytes + Address;
+  }
+  bool isValidAddress(uint64_t Address) const override {
+    return Address < NumBytes;
+  }
+  const uint8_t *getStablePointer() const override { return Bytes; }
+
+  bool dropLeadingBytes(size_t S) override {
+    if (S > NumBytes)
+      return true;
+    Bytes += S;
+    NumBytes -= S;
+    return false;
+  }
+
+  void setKnownObjectSize(size_t KnownSize) override {
+    if (KnownSize < NumBytes)
+      NumBytes = KnownSize;
+  }
+
+private:
+  std::unique_ptr<sys::fs::mapped_file_region> Region;
+  // The bytes left after dropLeadingBytes, and their number.
+  const uint8_t *Bytes;
+  uint64_t NumBytes;
+
+  MappedFileMemoryObject(const MappedFileMemoryObject&) = delete;
+  void operator=(const MappedFileMemoryObject&) = delete;
+};
+
+uint64_t MappedFileMemoryObject::readBytes(uint8_t *Buf, uint64_t Size,
+                                           uint64_t Address) const {
+  if (Address >= NumBytes)
+    return 0;
+  if (Size > NumBytes - Address)
+    Size = NumBytes - Address;
+  memcpy(Buf, Bytes + Address, Size);
+  return Size;
+}
+// @LOCALMOD-END
 } // anonymous namespace
 
 namespace llvm {
@@ -121,6 +180,38 @@ MemoryObject *getNonStreamedMemoryObject(const unsigned char *Start,
   return new RawMemoryObject(Start, End);
 }
 
+// @LOCALMOD-BEGIN
+StreamingMemoryObject *getMappedFileMemoryObject(const std::string &Filename,
+                                                 std::string *Err) {
+  int FD;
+  if (std::error_code EC = sys::fs::openFileForRead(Filename, FD)) {
+    if (Err)
+      *Err = Filename + ": " + EC.message();
+    return nullptr;
+  }
+  sys::fs::file_status Status;
+  std::error_code EC = sys::fs::status(FD, Status);
+  std::unique_ptr<sys::fs::mapped_file_region> Region;
+  if (!EC) {
+    if (Status.type() != sys::fs::file_type::regular_file)
+      EC = std::make_error_code(std::errc::not_supported);
+    else if (Status.getSize() == 0)
+      EC = std::make_error_code(std::errc::invalid_argument);
+    else
+      Region.reset(new sys::fs::mapped_file_region(
+          FD, sys::fs::mapped_file_region::readonly, Status.getSize(), 0, EC));
+  }
+  // The mapping stays valid after the file is closed.
+  sys::Process::SafelyCloseFileDescriptor(FD);
+  if (EC) {
+    if (Err)
+      *Err = Filename + ": " + EC.message();
+    return nullptr;
+  }
+  return new MappedFileMemoryObject(std::move(Region));
+}
+// @LOCALMOD-END
+
 // @LOCALMOD -- separated into Impl
 StreamingMemoryObjectImpl::StreamingMemoryObjectImpl(
     DataStreamer *streamer) :
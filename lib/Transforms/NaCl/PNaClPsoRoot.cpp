@@ -11,16 +11,39 @@
 // and global variables to produce a struce named __pnacl_pso_root that
 // is provided to dynamic linking using.
 //
+// With -pnacl-pso-export-hash, the exports are sorted by name and a hash
+// table over them is added to __pnacl_pso_root (see PsoExportHash.h), so
+// that the loader does not have to scan them linearly.
+//
+// With -pnacl-pso-lazy-bind, __import_funcs is initialized with a stub per
+// imported function instead of zero, and direct calls to imported functions
+// are made through their __import_funcs slot. On its first call a stub calls
+// the resolver that the loader stores in __lazy_resolver:
+//
+//   i8* resolver(i8* pso_root, i32 import_index)
+//
+// which must look up the import, store it in its __import_funcs slot, and
+// return it; the stub then tail calls it. Later calls go straight to the
+// resolved function. The loader therefore only resolves the imports that
+// are actually called, instead of filling every slot before the PSO runs.
+// __pnacl_pso_root gains a last field pointing at __lazy_resolver. Variadic
+// imports cannot be forwarded by a stub and are still bound eagerly.
+//
 //===---------------------------------------------------------------===//
 
 #include "llvm/Pass.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/NaCl.h"
+#include "llvm/Transforms/NaCl/PsoExportHash.h"
 
+#include <algorithm>
 #include <vector>
 #include <string.h>
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/GlobalVariable.h"
@@ -28,6 +51,18 @@
 using namespace llvm;
 using namespace std;
 
+static cl::opt<bool>
+PsoExportHashTable("pnacl-pso-export-hash",
+                   cl::desc("Sort the exports of __pnacl_pso_root by name and "
+                            "add a hash table for looking them up"),
+                   cl::init(false));
+
+static cl::opt<bool>
+PsoLazyBind("pnacl-pso-lazy-bind",
+            cl::desc("Bind the imports of __pnacl_pso_root lazily, on their "
+                     "first call"),
+            cl::init(false));
+
 namespace {
 
     class PNaClPsoRoot : public ModulePass {
@@ -42,6 +77,61 @@ namespace {
 
 }
 
+// Orders exports by name.
+static bool compareExportNames(const pair<StringRef, Constant*> &A,
+                               const pair<StringRef, Constant*> &B) {
+  return A.first < B.first;
+}
+
+// Creates the stub that __import_funcs slot Index initially holds for the
+// imported function F. The stub has the type of F, asks the loader's resolver
+// for the function, and forwards its arguments to it.
+static Function *createLazyStub(Module &M, Function *F, unsigned Index,
+                                GlobalVariable *Resolver, Constant *Root) {
+  Function *Stub = Function::Create(F->getFunctionType(),
+                                    GlobalValue::InternalLinkage,
+                                    "__lazy_bind." + F->getName(), &M);
+  Stub->setCallingConv(F->getCallingConv());
+  Stub->setAttributes(F->getAttributes());
+  BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry", Stub);
+  IRBuilder<> Builder(BB);
+  Value *ResolverFn = Builder.CreateLoad(Resolver, "resolver");
+  Value *Resolved = Builder.CreateCall2(
+      ResolverFn, Root,
+      ConstantInt::get(IntegerType::get(M.getContext(), 32), Index),
+      "resolved");
+  Value *Callee = Builder.CreateBitCast(Resolved, F->getType());
+  vector<Value*> Args;
+  for (Function::arg_iterator A = Stub->arg_begin(), E = Stub->arg_end();
+       A != E; ++A) {
+    Args.push_back(A);
+  }
+  CallInst *Call = Builder.CreateCall(Callee, Args);
+  Call->setCallingConv(F->getCallingConv());
+  Call->setAttributes(F->getAttributes());
+  Call->setTailCall();
+  if (F->getReturnType()->isVoidTy()) {
+    Builder.CreateRetVoid();
+  } else {
+    Builder.CreateRet(Call);
+  }
+  return Stub;
+}
+
+// Makes the direct calls to F load their callee from Slot. Other uses of F,
+// such as taking its address, keep referring to F.
+static void callThroughSlot(Function *F, Constant *Slot) {
+  for (Value::use_iterator UI = F->use_begin(), E = F->use_end(); UI != E;) {
+    Use &U = *UI++;
+    CallSite CS(U.getUser());
+    if (!CS || !CS.isCallee(&U)) {
+      continue;
+    }
+    Instruction *I = CS.getInstruction();
+    CS.setCalledFunction(new LoadInst(Slot, F->getName(), I));
+  }
+}
+
 char PNaClPsoRoot::ID = 0;
 INITIALIZE_PASS(PNaClPsoRoot, "_pnacl-pso-root",
                 "PNaCl PSO ROOT",
@@ -96,44 +186,74 @@ bool PNaClPsoRoot::runOnModule(Module &M) {
   struct_Pso_root_fields.push_back(ptrTy_Import);
   struct_Pso_root_fields.push_back(ptrTy_struct_Import_funcs);
   struct_Pso_root_fields.push_back(ptrTy_Export);
+  if (PsoExportHashTable) {
+    // Number of exports and the export hash table.
+    struct_Pso_root_fields.push_back(IntegerType::get(M.getContext(), 32));
+    struct_Pso_root_fields.push_back(
+        PointerType::get(IntegerType::get(M.getContext(), 32), 0));
+  }
+  // i8* resolver(i8* pso_root, i32 import_index)
+  vector<Type*> resolver_params;
+  resolver_params.push_back(ptrTy_int8);
+  resolver_params.push_back(IntegerType::get(M.getContext(), 32));
+  PointerType *ptrTy_resolver = PointerType::get(
+      FunctionType::get(ptrTy_int8, resolver_params, false), 0);
+  if (PsoLazyBind) {
+    struct_Pso_root_fields.push_back(PointerType::get(ptrTy_resolver, 0));
+  }
   
   if(struct_Pso_root->isOpaque()) {
     struct_Pso_root->setBody(struct_Pso_root_fields, false);
   }
   
   // functions
-  int i = 1;
   ConstantInt * const_int32_0 = ConstantInt::get(M.getContext(), APInt(32, StringRef("0"), 10));
   vector<Constant*> const_import_elems;
-  vector<Constant*> const_export_elems;
+  vector<pair<StringRef, Constant*> > const_export_elems;
   vector<Type*> struct_Import_funcs_fields;
+  vector<Function*> import_funcs;
   GlobalVariable *import_library;
   bool isInit = false;
-  // Constant *const_import_library;
+
+  // The names of all imported and exported functions are packed, NUL
+  // terminated and deduplicated, into a single string table, which the
+  // import and export entries point into.
+  string strtab;
+  StringMap<unsigned> strtab_offsets;
   for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
     if (F->getName().startswith("llvm.") || F->getName().startswith("nacl_")) {
       continue;
     }
-    // .str%d internal constant
-    char buffer[50];
-    sprintf(buffer, ".__str%d", i);
-    int str_size = (F->getName()).size();  
-    ArrayType *arrTy = ArrayType::get(IntegerType::get(M.getContext(), 8), str_size + 1);
-    Constant *const_arr = ConstantDataArray::getString(M.getContext(), F->getName().data(), true);
-    Twine twine(buffer);
-    GlobalVariable *global_str = new GlobalVariable(M,
-        /*Type=*/arrTy,
-	/*isConstant=*/true,
-	/*Linkage=*/GlobalValue::PrivateLinkage,
-	/*Initializer=*/0,
-	/*Name=*/twine);
-    global_str->setAlignment(1);
-    global_str->setInitializer(const_arr);
+    if (strtab_offsets.insert(make_pair(F->getName(), strtab.size())).second) {
+      strtab += F->getName();
+      strtab.push_back('\0');
+    }
+  }
+  ArrayType *arrTy_strtab = ArrayType::get(IntegerType::get(M.getContext(), 8), strtab.size());
+  GlobalVariable *global_strtab = NULL;
+  if (!strtab.empty()) {
+    global_strtab = new GlobalVariable(M,
+        /*Type=*/arrTy_strtab,
+        /*isConstant=*/true,
+        /*Linkage=*/GlobalValue::PrivateLinkage,
+        /*Initializer=*/0,
+        /*Name=*/".__strtab");
+    global_strtab->setAlignment(1);
+    global_strtab->setInitializer(
+        ConstantDataArray::getString(M.getContext(), strtab, false));
+  }
 
+  // Constant *const_import_library;
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (F->getName().startswith("llvm.") || F->getName().startswith("nacl_")) {
+      continue;
+    }
     vector<Constant*> const_name_indices;
     const_name_indices.push_back(const_int32_0);
-    const_name_indices.push_back(const_int32_0);
-    Constant *const_name = ConstantExpr::getGetElementPtr(arrTy, global_str, const_name_indices);
+    const_name_indices.push_back(
+        ConstantInt::get(IntegerType::get(M.getContext(), 32),
+                         strtab_offsets[F->getName()]));
+    Constant *const_name = ConstantExpr::getGetElementPtr(arrTy_strtab, global_strtab, const_name_indices);
     if (F->isDeclaration()) {
       ArrayType *arrTy_import_library = ArrayType::get(IntegerType::get(M.getContext(), 8), 1);
       //GlobalVariable *import_library = M.getNamedGlobal("__.str");
@@ -164,15 +284,15 @@ bool PNaClPsoRoot::runOnModule(Module &M) {
       const_import_elems.push_back(const_import);
 
       struct_Import_funcs_fields.push_back(PointerType::get(F->getFunctionType(), 0));  
+      import_funcs.push_back(F);
     } else {
       vector<Constant*> const_export_fields;
       const_export_fields.push_back(const_name);
       Constant *const_func = ConstantExpr::getCast(Instruction::BitCast, F, ptrTy_int8);
       const_export_fields.push_back(const_func);
       Constant *const_export = ConstantStruct::get(struct_Export, const_export_fields);
-      const_export_elems.push_back(const_export);
+      const_export_elems.push_back(make_pair(F->getName(), const_export));
     }
-    i++;
   }
 
   // GlobalVariable
@@ -201,8 +321,19 @@ bool PNaClPsoRoot::runOnModule(Module &M) {
   imports_funcs->setAlignment(8);
   imports_funcs->setInitializer(const_struct_import);
   
-  ArrayType *arrTy_Export = ArrayType::get(struct_Export, const_export_elems.size());
-  Constant* const_export_array = ConstantArray::get(arrTy_Export, const_export_elems);
+  if (PsoExportHashTable) {
+    std::stable_sort(const_export_elems.begin(), const_export_elems.end(),
+                     compareExportNames);
+  }
+  vector<StringRef> export_names;
+  vector<Constant*> const_exports;
+  for (unsigned j = 0; j < const_export_elems.size(); ++j) {
+    export_names.push_back(const_export_elems[j].first);
+    const_exports.push_back(const_export_elems[j].second);
+  }
+
+  ArrayType *arrTy_Export = ArrayType::get(struct_Export, const_exports.size());
+  Constant* const_export_array = ConstantArray::get(arrTy_Export, const_exports);
   GlobalVariable *exports = new GlobalVariable(M,
       /*Type=*/arrTy_Export,
       /*isConstant=*/true,
@@ -227,6 +358,41 @@ bool PNaClPsoRoot::runOnModule(Module &M) {
   Constant *const_ptr_2 = ConstantExpr::getGetElementPtr(arrTy_Export, exports, const_ptr_indices_2);
   struct_pso_root_fields.push_back(const_ptr_2);
 
+  if (PsoExportHashTable) {
+    vector<uint32_t> table;
+    PsoExportHash::build(export_names, table);
+    Constant *const_table = ConstantDataArray::get(M.getContext(), table);
+    GlobalVariable *export_hash = new GlobalVariable(M,
+        /*Type=*/const_table->getType(),
+        /*isConstant=*/true,
+        /*Linkage=*/GlobalValue::InternalLinkage,
+        /*Initializer=*/const_table,
+        /*Name=*/"__export_hash");
+    export_hash->setAlignment(4);
+
+    vector<Constant*> const_ptr_indices_3;
+    const_ptr_indices_3.push_back(const_int32_0);
+    const_ptr_indices_3.push_back(const_int32_0);
+    Constant *const_ptr_3 = ConstantExpr::getGetElementPtr(
+        const_table->getType(), export_hash, const_ptr_indices_3);
+    struct_pso_root_fields.push_back(
+        ConstantInt::get(IntegerType::get(M.getContext(), 32),
+                         const_exports.size()));
+    struct_pso_root_fields.push_back(const_ptr_3);
+  }
+
+  GlobalVariable *lazy_resolver = NULL;
+  if (PsoLazyBind) {
+    lazy_resolver = new GlobalVariable(M,
+        /*Type=*/ptrTy_resolver,
+        /*isConstant=*/false,
+        /*Linkage=*/GlobalValue::InternalLinkage,
+        /*Initializer=*/ConstantPointerNull::get(ptrTy_resolver),
+        /*Name=*/"__lazy_resolver");
+    lazy_resolver->setAlignment(4);
+    struct_pso_root_fields.push_back(lazy_resolver);
+  }
+
   Constant *const_pso_root = ConstantStruct::get(struct_Pso_root, struct_pso_root_fields);
 
   GlobalVariable *__pnacl_pso_root = new GlobalVariable(M,
@@ -238,6 +404,29 @@ bool PNaClPsoRoot::runOnModule(Module &M) {
   __pnacl_pso_root->setAlignment(8);
   __pnacl_pso_root->setInitializer(const_pso_root);
 
+  if (PsoLazyBind) {
+    Constant *const_root = ConstantExpr::getBitCast(__pnacl_pso_root, ptrTy_int8);
+    vector<Constant*> const_import_funcs;
+    for (unsigned j = 0; j < import_funcs.size(); ++j) {
+      Function *F = import_funcs[j];
+      PointerType *ptrTy_func = PointerType::get(F->getFunctionType(), 0);
+      if (F->isVarArg()) {
+        const_import_funcs.push_back(ConstantPointerNull::get(ptrTy_func));
+        continue;
+      }
+      const_import_funcs.push_back(
+          createLazyStub(M, F, j, lazy_resolver, const_root));
+      vector<Constant*> const_slot_indices;
+      const_slot_indices.push_back(const_int32_0);
+      const_slot_indices.push_back(
+          ConstantInt::get(IntegerType::get(M.getContext(), 32), j));
+      callThroughSlot(F, ConstantExpr::getGetElementPtr(
+          struct_Import_funcs, imports_funcs, const_slot_indices));
+    }
+    imports_funcs->setInitializer(
+        ConstantStruct::get(struct_Import_funcs, const_import_funcs));
+  }
+
   return true;
   
 }
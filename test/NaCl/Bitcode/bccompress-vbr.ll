@@ -0,0 +1,29 @@
+; Test that pnacl-bccompress computes the size of a value in a VBR
+; field from all of its bits. Constant 8256 is emitted as 16512, which
+; takes three chunks in both VBR(6) and VBR(8). Hence the record is
+; smaller with abbreviation <4, vbr(8)> (24 bits) than unabbreviated
+; (30 bits).
+
+; RUN: llvm-as < %s | pnacl-freeze | pnacl-bccompress \
+; RUN:              | pnacl-bcdis | FileCheck %s
+
+; CHECK:      {{.*}}|    3: <1, 11>               |    constants:
+; CHECK-NEXT: {{.*}}|    2: <65533, 2, 1, 4, 0, 2,|      @a0 = abbrev <4, vbr(8)>;
+
+define internal i32 @f(i32 %a) {
+  %v0 = add i32 %a, 1
+  %v1 = add i32 %v0, 2
+  %v2 = add i32 %v1, 3
+  %v3 = add i32 %v2, 4
+  %v4 = add i32 %v3, 5
+  %v5 = add i32 %v4, 6
+  %v6 = add i32 %v5, 7
+  %v7 = add i32 %v6, 8
+  %v8 = add i32 %v7, 9
+  %v9 = add i32 %v8, 10
+  %v10 = add i32 %v9, 8256
+  ret i32 %v10
+}
+
+; CHECK:      {{.*}}|      4: <4, 20>             |        %c9 = i32 10; <@a0>
+; CHECK-NEXT: {{.*}}|      4: <4, 16512>          |        %c10 = i32 8256; <@a0>
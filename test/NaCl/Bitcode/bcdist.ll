@@ -3,6 +3,10 @@
 ; RUN: llvm-as < %s | pnacl-freeze | pnacl-bcanalyzer --order-blocks-by-id \
 ; RUN:              | FileCheck %s
 
+; Streaming the input gives the same counts.
+; RUN: llvm-as < %s | pnacl-freeze | pnacl-bcanalyzer --order-blocks-by-id \
+; RUN:              -stream | FileCheck %s
+
 @bytes7 = internal global [7 x i8] c"abcdefg"
 
 @ptr_to_ptr = internal global i32 ptrtoint (i32* @ptr to i32)
@@ -0,0 +1,48 @@
+; Test the optional function index block, which gives the positions of
+; the function blocks.
+
+; Test 1: Show that the index is read back, and the bodies are found.
+; RUN: llvm-as < %s | pnacl-freeze -function-index | pnacl-thaw \
+; RUN:              | llvm-dis - | FileCheck %s
+
+; Test 2: Show the entries of the index, which precede the function blocks.
+; RUN: llvm-as < %s | pnacl-freeze -function-index | pnacl-bcdis \
+; RUN:              | FileCheck %s --check-prefix DIS
+
+; Test 3: Show that the index is dropped by pnacl-bccompress, since the
+; function blocks move.
+; RUN: llvm-as < %s | pnacl-freeze -function-index | pnacl-bccompress \
+; RUN:              | pnacl-thaw | llvm-dis - | FileCheck %s
+; RUN: llvm-as < %s | pnacl-freeze -function-index | pnacl-bccompress \
+; RUN:              | pnacl-bcdis | FileCheck %s --check-prefix COMPRESS
+
+declare void @decl()
+
+define void @f() {
+  ret void
+}
+
+define i32 @g(i32 %x) {
+  %y = add i32 %x, 1
+  ret i32 %y
+}
+
+; CHECK:      declare void @decl()
+; CHECK:      define void @f() {
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
+; CHECK:      define i32 @g(i32) {
+; CHECK-NEXT:   %2 = add i32 %0, 1
+; CHECK-NEXT:   ret i32 %2
+; CHECK-NEXT: }
+
+; DIS:      204:0|  1: <65535, 20, 3>          |  functionindex {  // BlockID = 20
+; DIS-NEXT: 212:0|    2: <65533, 3, 1, 1, 0, 1,|    %a0 = abbrev <1, fixed(32),
+; DIS-NEXT:      |        32, 0, 1, 32>        |                  fixed(32)>;
+; DIS-NEXT: 217:5|    4: <1, 59, 3>            |    @f1 : word 59, size 3; <%a0>
+; DIS-NEXT: 226:0|    4: <1, 62, 8>            |    @f2 : word 62, size 8; <%a0>
+; DIS-NEXT: 234:3|  0: <65534>                 |  }
+; DIS-NEXT: 236:0|  1: <65535, 12, 4>          |  function void @f1() {
+; DIS:      248:0|  1: <65535, 12, 4>          |  function i32 @f2(i32 %p0) {
+
+; COMPRESS-NOT: functionindex
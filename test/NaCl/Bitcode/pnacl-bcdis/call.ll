@@ -3,6 +3,10 @@
 ; RUN: llvm-as < %s | pnacl-freeze | pnacl-bccompress --remove-abbreviations \
 ; RUN:              | pnacl-bcdis | FileCheck %s
 
+; Disassembling function blocks on threads gives the same text.
+; RUN: llvm-as < %s | pnacl-freeze | pnacl-bccompress --remove-abbreviations \
+; RUN:              | pnacl-bcdis -threads=3 | FileCheck %s
+
 ; CHECK:         {{.*}}|    3: <7, 32>               |    @t0 = i32;
 ; CHECK-NEXT:    {{.*}}|    3: <2>                   |    @t1 = void;
 ; CHECK-NEXT:    {{.*}}|    3: <3>                   |    @t2 = float;
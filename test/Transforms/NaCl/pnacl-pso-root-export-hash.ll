@@ -0,0 +1,29 @@
+; RUN: opt %s -_pnacl-pso-root -S | FileCheck %s -check-prefix=DEFAULT
+; RUN: opt %s -_pnacl-pso-root -pnacl-pso-export-hash -S | FileCheck %s
+
+; Checks that -pnacl-pso-export-hash sorts the exports of __pnacl_pso_root
+; by name and adds the export count and hash table.
+
+declare void @imported()
+
+define void @zeta() {
+  ret void
+}
+
+define void @alpha() {
+  ret void
+}
+
+define void @mid() {
+  ret void
+}
+
+; DEFAULT: %struct.Pso_root = type { %struct.Import*, %struct.Import_funcs*, %struct.Export* }
+; DEFAULT: @__exports = internal constant [3 x %struct.Export] [%struct.Export { i8* getelementptr inbounds ([24 x i8], [24 x i8]* @.__strtab, i32 0, i32 9), i8* bitcast (void ()* @zeta to i8*) }, %struct.Export { i8* getelementptr inbounds ([24 x i8], [24 x i8]* @.__strtab, i32 0, i32 14), i8* bitcast (void ()* @alpha to i8*) }, %struct.Export { i8* getelementptr inbounds ([24 x i8], [24 x i8]* @.__strtab, i32 0, i32 20), i8* bitcast (void ()* @mid to i8*) }]
+; DEFAULT-NOT: @__export_hash
+
+; CHECK: %struct.Pso_root = type { %struct.Import*, %struct.Import_funcs*, %struct.Export*, i32, i32* }
+; CHECK: @__exports = internal constant [3 x %struct.Export] [%struct.Export { i8* getelementptr inbounds ([24 x i8], [24 x i8]* @.__strtab, i32 0, i32 14), i8* bitcast (void ()* @alpha to i8*) }, %struct.Export { i8* getelementptr inbounds ([24 x i8], [24 x i8]* @.__strtab, i32 0, i32 20), i8* bitcast (void ()* @mid to i8*) }, %struct.Export { i8* getelementptr inbounds ([24 x i8], [24 x i8]* @.__strtab, i32 0, i32 9), i8* bitcast (void ()* @zeta to i8*) }]
+; NBuckets, BloomWords, BloomShift, Bloom, Buckets, Chain, Order.
+; CHECK: @__export_hash = internal constant [11 x i32] [i32 1, i32 1, i32 5, i32 -2111830006, i32 0, i32 253193258, i32 193499262, i32 2090971833, i32 0, i32 1, i32 2], align 4
+; CHECK: @__pnacl_pso_root = global %struct.Pso_root { {{.*}}, i32 3, i32* getelementptr inbounds ([11 x i32], [11 x i32]* @__export_hash, i32 0, i32 0) }
@@ -0,0 +1,50 @@
+; RUN: opt %s -_pnacl-pso-root -S | FileCheck %s -check-prefix=DEFAULT
+; RUN: opt %s -_pnacl-pso-root -pnacl-pso-lazy-bind -S | FileCheck %s
+
+; Checks that -pnacl-pso-lazy-bind initializes __import_funcs with stubs that
+; resolve the import on first call, and that direct calls go through the
+; __import_funcs slots.
+
+declare i32 @add(i32, i32)
+declare void @log(i8*)
+declare void @printf_like(i8*, ...)
+
+define i32 @caller(i8* %msg) {
+  call void @log(i8* %msg)
+  call void (i8*, ...) @printf_like(i8* %msg)
+  %r = call i32 @add(i32 1, i32 2)
+  ret i32 %r
+}
+
+define void (i8*)* @address_taken() {
+  ret void (i8*)* @log
+}
+
+; DEFAULT: %struct.Pso_root = type { %struct.Import*, %struct.Import_funcs*, %struct.Export* }
+; DEFAULT: @__import_funcs = internal global %struct.Import_funcs zeroinitializer
+; DEFAULT-NOT: @__lazy_resolver
+; DEFAULT: call i32 @add(i32 1, i32 2)
+; DEFAULT-NOT: __lazy_bind
+
+; CHECK: %struct.Pso_root = type { %struct.Import*, %struct.Import_funcs*, %struct.Export*, i8* (i8*, i32)** }
+; CHECK: @__import_funcs = internal global %struct.Import_funcs { i32 (i32, i32)* @__lazy_bind.add, void (i8*)* @__lazy_bind.log, void (i8*, ...)* null }
+; CHECK: @__lazy_resolver = internal global i8* (i8*, i32)* null, align 4
+; CHECK: @__pnacl_pso_root = global %struct.Pso_root { {{.*}}, i8* (i8*, i32)** @__lazy_resolver }
+
+; CHECK: define i32 @caller(i8* %msg) {
+; CHECK-NEXT: %log = load void (i8*)*, void (i8*)** getelementptr inbounds (%struct.Import_funcs, %struct.Import_funcs* @__import_funcs, i32 0, i32 1)
+; CHECK-NEXT: call void %log(i8* %msg)
+; CHECK-NEXT: call void (i8*, ...) @printf_like(i8* %msg)
+; CHECK-NEXT: %add = load i32 (i32, i32)*, i32 (i32, i32)** getelementptr inbounds (%struct.Import_funcs, %struct.Import_funcs* @__import_funcs, i32 0, i32 0)
+; CHECK-NEXT: %r = call i32 %add(i32 1, i32 2)
+
+; CHECK: define void (i8*)* @address_taken() {
+; CHECK-NEXT: ret void (i8*)* @log
+
+; CHECK: define internal i32 @__lazy_bind.add(i32, i32) {
+; CHECK-NEXT: entry:
+; CHECK-NEXT: %resolver = load i8* (i8*, i32)*, i8* (i8*, i32)** @__lazy_resolver
+; CHECK-NEXT: %resolved = call i8* %resolver(i8* bitcast (%struct.Pso_root* @__pnacl_pso_root to i8*), i32 0)
+; CHECK-NEXT: %2 = bitcast i8* %resolved to i32 (i32, i32)*
+; CHECK-NEXT: %3 = tail call i32 %2(i32 %0, i32 %1)
+; CHECK-NEXT: ret i32 %3
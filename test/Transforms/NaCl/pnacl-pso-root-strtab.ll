@@ -0,0 +1,19 @@
+; RUN: opt %s -_pnacl-pso-root -S | FileCheck %s
+
+; Checks that the names of the imports and exports of __pnacl_pso_root are
+; packed into a single string table, and that every entry points into it.
+
+declare void @imported()
+
+define void @exported() {
+  ret void
+}
+
+define void @nacl_skipped() {
+  ret void
+}
+
+; CHECK: @.__strtab = private constant [18 x i8] c"imported\00exported\00", align 1
+; CHECK-NOT: @.__str1
+; CHECK: @__imports = internal global [1 x %struct.Import] [%struct.Import { i8* getelementptr inbounds ([18 x i8], [18 x i8]* @.__strtab, i32 0, i32 0), {{.*}} }]
+; CHECK: @__exports = internal constant [1 x %struct.Export] [%struct.Export { i8* getelementptr inbounds ([18 x i8], [18 x i8]* @.__strtab, i32 0, i32 9), i8* bitcast (void ()* @exported to i8*) }]
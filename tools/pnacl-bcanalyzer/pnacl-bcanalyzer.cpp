@@ -58,6 +58,12 @@ static cl::opt<bool> OrderBlocksByID(
     cl::desc("Print blocks statistics based on block id rather than size"),
     cl::init(false));
 
+static cl::opt<bool> Streaming(
+    "stream",
+    cl::desc("Read the input as a stream, only keeping the most recently "
+             "read part of it in memory. For analyzing very large files"),
+    cl::init(false));
+
 int main(int argc, char **argv) {
   // Print a stack trace if we signal out.
   sys::PrintStackTraceOnErrorSignal();
@@ -75,6 +81,7 @@ int main(int argc, char **argv) {
   DumpOptions.DumpDetails = OptDumpDetails;
   DumpOptions.OpsPerLine = OpsPerLine;
   DumpOptions.OrderBlocksByID = OrderBlocksByID;
+  DumpOptions.Streaming = Streaming;
 
   return AnalyzeBitcodeInFile(InputFilename, outs(), DumpOptions);
 }
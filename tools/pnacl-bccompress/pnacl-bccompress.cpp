@@ -77,6 +77,20 @@ RemoveAbbreviations(
     cl::desc("Remove abbreviations from input bitcode file."),
     cl::init(false));
 
+static cl::opt<bool>
+SynthesizeAbbreviations(
+    "synthesize-abbreviations",
+    cl::desc("Add abbreviations built from the value distributions of "
+             "records, when they make the output smaller."),
+    cl::init(false));
+
+static cl::opt<unsigned>
+NumThreads(
+    "threads",
+    cl::desc("Number of threads reading and writing function blocks. "
+             "The output does not depend on it."),
+    cl::init(1));
+
 static bool Fatal(const std::string &Err) {
   errs() << Err << "\n";
   exit(1);
@@ -118,6 +132,8 @@ int main(int argc, char **argv) {
   Compressor.Flags.ShowAbbrevLookupTries = ShowAbbrevLookupTries;
   Compressor.Flags.ShowAbbreviationFrequencies = ShowAbbreviationFrequencies;
   Compressor.Flags.RemoveAbbreviations = RemoveAbbreviations;
+  Compressor.Flags.SynthesizeAbbreviations = SynthesizeAbbreviations;
+  Compressor.Flags.NumThreads = NumThreads;
 
   if (ShowValueDistributions
       || ShowAbbreviationFrequencies
@@ -43,6 +43,12 @@ NoAssembly("no-assembly",
            cl::desc("Don't include assembly"),
            cl::init(false));
 
+static cl::opt<unsigned>
+NumThreads("threads",
+           cl::desc("Number of threads disassembling function blocks. "
+                    "The output does not depend on it."),
+           cl::init(1));
+
 // Reads and disassembles the bitcode file. Returns false
 // if successful, true otherwise.
 static bool DisassembleBitcode() {
@@ -65,7 +71,7 @@ static bool DisassembleBitcode() {
 
   // Parse the the bitcode file.
   return NaClObjDump(ErrOrFile.get()->getMemBufferRef(), Output, NoRecords,
-                     NoAssembly);
+                     NoAssembly, NumThreads);
 }
 
 }
@@ -13,7 +13,11 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/DLinker/DLinker.h"
+#include "llvm/DLinker/ExportIndex.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
 #include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/IR/AutoUpgrade.h"
 #include "llvm/IR/DiagnosticInfo.h"
@@ -26,8 +30,11 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DataStream.h"
+#include "llvm/Support/FileOutputBuffer.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
@@ -36,6 +43,7 @@
 #include "llvm/Support/StreamingMemoryObject.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include <memory>
+#include <pthread.h>
 using namespace llvm;
 
 static cl::opt<NaClFileFormat>
@@ -72,6 +80,30 @@ static cl::opt<bool>
 SuppressWarnings("suppress-warnings", cl::desc("Suppress all linking warnings"),
                  cl::init(false));
 
+static cl::opt<unsigned>
+LoadThreads("load-threads",
+            cl::desc("Number of threads used to load and verify the inputs"),
+            cl::init(1U));
+
+static cl::opt<bool>
+LazyExports("lazy-exports",
+            cl::desc("Only read the module-level records of the linked "
+                     "inputs, never their function bodies"),
+            cl::init(false));
+
+static cl::opt<std::string>
+ExportCacheDir("export-cache",
+               cl::desc("Directory of cached export tables of the linked "
+                        "inputs, keyed by their contents"),
+               cl::value_desc("directory"), cl::init(""));
+
+static cl::opt<std::string>
+IncrementalState("incremental-state",
+                 cl::desc("Record which imports each input resolved in this "
+                          "file, and only reparse the inputs that changed "
+                          "since the recorded link"),
+                 cl::value_desc("filename"), cl::init(""));
+
 static cl::opt<bool> PreserveBitcodeUseListOrder(
     "preserve-bc-uselistorder",
     cl::desc("Preserve use-list order when writing LLVM bitcode."),
@@ -82,14 +114,30 @@ static cl::opt<bool> PreserveAssemblyUseListOrder(
     cl::desc("Preserve use-list order when writing LLVM assembly."),
     cl::init(false), cl::Hidden);
 
+// When ExportsOnly is set, PNaCl inputs are streamed from the file and parsing
+// stops at the first function block, so only the module-level records
+// (globals, including the PSO root, and the symbol table) are read. Function
+// bodies are never materialized.
 static std::unique_ptr<Module> getModule(StringRef InputFilename, LLVMContext &Context,
-    StreamingMemoryObject *StreamingObject) {
+    SMDiagnostic &Err, bool ExportsOnly) {
 
     std::unique_ptr<Module> M;
-    SMDiagnostic Err;
     std::string VerboseBuffer;
     raw_string_ostream VerboseStrm(VerboseBuffer);
-    M = NaClParseIRFile(InputFilename, InputFileFormat, Err, &VerboseStrm, Context);
+    if (ExportsOnly && InputFileFormat == PNaClFormat) {
+        std::string StrError;
+        DataStreamer *FileStreamer = getDataFileStreamer(InputFilename, &StrError);
+        if (FileStreamer) {
+            // The bitcode reader takes ownership of the streaming object.
+            M.reset(getNaClStreamedBitcodeModule(InputFilename,
+                new StreamingMemoryObjectImpl(FileStreamer), Context,
+                &VerboseStrm, &StrError));
+        }
+        if (!StrError.empty())
+            Err = SMDiagnostic(InputFilename, SourceMgr::DK_Error, StrError);
+    } else {
+        M = NaClParseIRFile(InputFilename, InputFileFormat, Err, &VerboseStrm, Context);
+    }
     return std::move(M);
 }
 
@@ -97,16 +145,17 @@ static std::unique_ptr<Module> getModule(StringRef InputFilename, LLVMContext &C
 // link path for the specified file to try to find it...
 //
 static std::unique_ptr<Module>
-loadFile(const char *argv0, const std::string &FN, LLVMContext &Context) {
+loadFile(const char *argv0, const std::string &FN, LLVMContext &Context,
+         raw_ostream &Errs, bool ExportsOnly = false) {
     SMDiagnostic Err;
-    if (Verbose) errs() << "Loading '" << FN << "'\n";
- 
-    std::unique_ptr<StreamingMemoryObject> StreamingObject;
+    if (Verbose) Errs << "Loading '" << FN << "'\n";
 
-    std::unique_ptr<Module> Result = getModule(FN, Context, StreamingObject.get());
+    std::unique_ptr<Module> Result = getModule(FN, Context, Err, ExportsOnly);
   
-    if (!Result)
-        Err.print(argv0, errs());
+    if (!Result) {
+        Err.print(argv0, Errs);
+        return Result;
+    }
 
     Result->materializeMetadata();
     UpgradeDebugInfo(*Result);
@@ -114,6 +163,195 @@ loadFile(const char *argv0, const std::string &FN, LLVMContext &Context) {
     return Result;
 }
 
+// What a link recorded about one input in the -incremental-state file: enough
+// to tell whether the input changed, and to replay its part of the link
+// without parsing it. The file has a header line followed by three lines per
+// input:
+//
+//   pnacl-dlink-state <version> <number of inputs> <number of imports>
+//   input <content key> <path>
+//   layout <data layout>
+//   imports <count> <index in the import table>...
+//
+// Import indices refer to the import table of the first input, so the record
+// is only reused while that input is unchanged.
+struct InputState {
+    std::string Path;
+    std::string Key;
+    std::string DataLayout;
+    std::vector<unsigned> Imports;
+};
+
+static const unsigned LinkStateVersion = 2;
+
+static bool readLinkState(StringRef Path, unsigned &NumImports,
+                          std::vector<InputState> &States) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+        MemoryBuffer::getFile(Path, -1, false);
+    if (!BufferOrErr)
+        return false;
+    SmallVector<StringRef, 16> Lines;
+    BufferOrErr.get()->getBuffer().split(Lines, "\n");
+
+    SmallVector<StringRef, 4> Header;
+    unsigned Version, NumInputs;
+    if (Lines.empty())
+        return false;
+    Lines[0].split(Header, " ");
+    if (Header.size() != 4 || Header[0] != "pnacl-dlink-state" ||
+        Header[1].getAsInteger(10, Version) || Version != LinkStateVersion ||
+        Header[2].getAsInteger(10, NumInputs) ||
+        Header[3].getAsInteger(10, NumImports) ||
+        Lines.size() < 1 + 3 * uint64_t(NumInputs))
+        return false;
+
+    States.resize(NumInputs);
+    for (unsigned i = 0; i < NumInputs; ++i) {
+        InputState &State = States[i];
+        StringRef Input = Lines[1 + 3 * i];
+        StringRef Layout = Lines[2 + 3 * i];
+        StringRef Imports = Lines[3 + 3 * i];
+
+        SmallVector<StringRef, 3> Fields;
+        Input.split(Fields, " ", 2);
+        if (Fields.size() != 3 || Fields[0] != "input")
+            return false;
+        State.Key = Fields[1];
+        State.Path = Fields[2];
+
+        if (!Layout.startswith("layout "))
+            return false;
+        State.DataLayout = Layout.substr(strlen("layout "));
+
+        SmallVector<StringRef, 16> Indices;
+        Imports.split(Indices, " ");
+        unsigned Count;
+        if (Indices.size() < 2 || Indices[0] != "imports" ||
+            Indices[1].getAsInteger(10, Count) || Count != Indices.size() - 2)
+            return false;
+        State.Imports.resize(Count);
+        for (unsigned j = 0; j < Count; ++j) {
+            if (Indices[j + 2].getAsInteger(10, State.Imports[j]) ||
+                State.Imports[j] >= NumImports)
+                return false;
+        }
+    }
+    return true;
+}
+
+static std::error_code writeLinkState(StringRef Path, unsigned NumImports,
+                                      const std::vector<InputState> &States) {
+    std::string Contents;
+    {
+        raw_string_ostream OS(Contents);
+        OS << "pnacl-dlink-state " << LinkStateVersion << " " << States.size()
+           << " " << NumImports << "\n";
+        for (const InputState &State : States) {
+            OS << "input " << State.Key << " " << State.Path << "\n";
+            OS << "layout " << State.DataLayout << "\n";
+            OS << "imports " << State.Imports.size();
+            for (unsigned Import : State.Imports)
+                OS << " " << Import;
+            OS << "\n";
+        }
+    }
+
+    // The buffer is written to a temporary file, which is renamed over
+    // Path on commit.
+    std::unique_ptr<FileOutputBuffer> Buffer;
+    if (std::error_code EC =
+            FileOutputBuffer::create(Path, Contents.size(), Buffer))
+        return EC;
+    std::copy(Contents.begin(), Contents.end(), Buffer->getBufferStart());
+    return Buffer->commit();
+}
+
+// Fills in the content key of the input file Path. The contents are always
+// hashed: the size and the modification time can't tell a file rewritten
+// within the resolution of the time stamps apart.
+static bool getInputState(StringRef Path, InputState &State) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+        MemoryBuffer::getFile(Path, -1, false);
+    if (!BufferOrErr)
+        return false;
+    State.Path = Path;
+    State.Key = ExportIndex::getKey(BufferOrErr.get()->getMemBufferRef());
+    return true;
+}
+
+// An input that has been loaded and verified, possibly by a worker thread
+// into its own context. Diagnostics are buffered so that they are reported
+// in input order.
+//
+// When an export cache is used, an input whose contents have a cached export
+// index is not parsed at all, and Index is set instead of M. When the input is
+// unchanged since the link recorded in the -incremental-state file, it is only
+// hashed, not parsed, and Reused is set.
+struct LoadedInput {
+    LoadedInput() : Failed(false), Reused(false) {}
+
+    std::unique_ptr<LLVMContext> Context;
+    std::unique_ptr<Module> M;
+    std::unique_ptr<ExportIndex> Index;
+    std::string CacheKey;
+    std::string Diagnostics;
+    bool Failed;
+    bool Reused;
+};
+
+static bool loadAndVerify(const char *argv0, unsigned Index,
+                          LLVMContext &Context, LoadedInput &Input) {
+    if (Input.Reused)
+        return true;
+    raw_string_ostream Errs(Input.Diagnostics);
+    Input.Failed = true;
+    if (!ExportCacheDir.empty()) {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+            MemoryBuffer::getFile(InputFilenames[Index], -1, false);
+        if (BufferOrErr) {
+            Input.CacheKey = ExportIndex::getKey(BufferOrErr.get()->getMemBufferRef());
+            Input.Index = ExportIndex::read(ExportCacheDir, Input.CacheKey);
+            if (Input.Index) {
+                if (Verbose) Errs << "Using cached exports of '" << InputFilenames[Index] << "'\n";
+                Input.Failed = false;
+                return true;
+            }
+        }
+    }
+
+    Input.M = loadFile(argv0, InputFilenames[Index], Context, Errs, LazyExports);
+    if (!Input.M.get()) {
+        Errs << argv0 << ": error loading file '" << InputFilenames[Index] << "'\n";
+        return false;
+    }
+
+    if (verifyModule(*Input.M, &Errs)) {
+        Errs << argv0 << ": " << InputFilenames[Index]
+             << ": error: input module is broken!\n";
+        return false;
+    }
+    Input.Failed = false;
+    return true;
+}
+
+struct LoadThreadData {
+    const char *argv0;
+    std::vector<LoadedInput> *Inputs;
+    volatile unsigned *NextInput;
+};
+
+static void *runLoadThread(void *Arg) {
+    LoadThreadData *Data = reinterpret_cast<LoadThreadData *>(Arg);
+    std::vector<LoadedInput> &Inputs = *Data->Inputs;
+    unsigned Index;
+    while ((Index = __sync_fetch_and_add(Data->NextInput, 1)) < Inputs.size()) {
+        LoadedInput &Input = Inputs[Index];
+        Input.Context.reset(new LLVMContext());
+        loadAndVerify(Data->argv0, Index, *Input.Context, Input);
+    }
+    return nullptr;
+}
+
 static void diagnosticHandler(const DiagnosticInfo &DI) {
     unsigned Severity = DI.getSeverity();
     switch (Severity) {
@@ -146,27 +384,138 @@ int main(int argc, char **argv) {
   llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
   cl::ParseCommandLineOptions(argc, argv, "pnacl dlink\n");
 
+  std::vector<LoadedInput> Inputs(InputFilenames.size());
+
+  // Find the inputs that are unchanged since the recorded link. Their import
+  // indices are only meaningful while the first input is unchanged.
+  unsigned RecordedNumImports = 0;
+  std::vector<InputState> Recorded;
+  std::vector<InputState> States;
+  if (!IncrementalState.empty()) {
+    if (!readLinkState(IncrementalState, RecordedNumImports, Recorded) ||
+        Recorded.size() != InputFilenames.size())
+      Recorded.clear();
+    States.resize(InputFilenames.size());
+    for (unsigned i = 0; i < InputFilenames.size(); ++i) {
+      const InputState *Prev = nullptr;
+      if (!Recorded.empty() && Recorded[i].Path == InputFilenames[i])
+        Prev = &Recorded[i];
+      if (!getInputState(InputFilenames[i], States[i])) {
+        errs() << argv[0] << ": error loading file '" << InputFilenames[i]
+               << "'\n";
+        return 1;
+      }
+      Inputs[i].Reused = Prev && Prev->Key == States[i].Key &&
+                         (i == 0 || Inputs[0].Reused);
+    }
+  }
+
+  // With more than one load thread, every input is parsed and verified in its
+  // own context on a worker thread while the composite is loaded here. The
+  // inputs are still linked in command line order, so the output is the same
+  // as when loading serially.
+  unsigned NumThreads = std::min<unsigned>(LoadThreads, InputFilenames.size());
+  volatile unsigned NextInput = 0;
+  SmallVector<pthread_t, 4> Pthreads;
+  SmallVector<LoadThreadData, 4> ThreadDatas;
+  if (NumThreads > 1) {
+    Pthreads.resize(NumThreads);
+    ThreadDatas.resize(NumThreads);
+    for (unsigned i = 0; i < NumThreads; ++i) {
+      ThreadDatas[i].argv0 = argv[0];
+      ThreadDatas[i].Inputs = &Inputs;
+      ThreadDatas[i].NextInput = &NextInput;
+      if (pthread_create(&Pthreads[i], nullptr, runLoadThread,
+                         &ThreadDatas[i]))
+        report_fatal_error("Failed to create thread");
+    }
+  }
+
   // auto Composite = make_unique<Module>("pnacl-dlink", Context);
-  auto Composite = loadFile(argv[0], InputFilenames[0], Context);
+  auto Composite = loadFile(argv[0], InputFilenames[0], Context, errs());
+
+  for (unsigned i = 0; i < Pthreads.size(); ++i) {
+    if (pthread_join(Pthreads[i], nullptr))
+      report_fatal_error("Failed to join thread");
+  }
+
+  if (!Composite.get()) {
+    errs() << argv[0] << ": error loading file '" << InputFilenames[0] << "'\n";
+    return 1;
+  }
   DLinker dlinker(Composite.get(), Context, diagnosticHandler);
 
-  for (unsigned i = 0; i < InputFilenames.size(); ++i) {
-    std::unique_ptr<Module> M = loadFile(argv[0], InputFilenames[i], Context);
-    if (!M.get()) {
-      errs() << argv[0] << ": error loading file '" <<InputFilenames[i]<< "'\n";
-      return 1;
+  // A recorded link of a different import table cannot be replayed.
+  if (RecordedNumImports != dlinker.getNumImports()) {
+    for (unsigned i = 0; i < Inputs.size(); ++i) {
+      if (!Inputs[i].Reused)
+        continue;
+      Inputs[i].Reused = false;
+      if (NumThreads > 1) {
+        Inputs[i].Context.reset(new LLVMContext());
+        loadAndVerify(argv[0], i, *Inputs[i].Context, Inputs[i]);
+      }
     }
+  }
 
-    if (verifyModule(*M, &errs())) {
-      errs() << argv[0] << ": " << InputFilenames[i]
-             << ": error: input module is broken!\n";
+  for (unsigned i = 0; i < InputFilenames.size(); ++i) {
+    LoadedInput &Input = Inputs[i];
+    if (NumThreads <= 1)
+      loadAndVerify(argv[0], i, Context, Input);
+    errs() << Input.Diagnostics;
+    if (Input.Failed)
       return 1;
-    }
 
     if (Verbose) errs() << "Linking in '" << InputFilenames[i] << "'\n";
 
-    if (dlinker.linkPsoRoot(M.get()))
+    // Replay the recorded resolutions of an unchanged input.
+    if (Input.Reused) {
+      States[i].DataLayout = Recorded[i].DataLayout;
+      States[i].Imports = Recorded[i].Imports;
+      if (dlinker.linkImports(DataLayout(States[i].DataLayout),
+                              InputFilenames[i], States[i].Imports))
+        return 1;
+      continue;
+    }
+
+    std::vector<StringRef> ExportNames;
+    std::vector<unsigned> Imports;
+    if (Input.Index) {
+      for (unsigned j = 0; j < Input.Index->size(); ++j)
+        ExportNames.push_back(Input.Index->getExport(j));
+      dlinker.findImports(ExportNames, Imports);
+      if (dlinker.linkImports(DataLayout(Input.Index->getDataLayout()),
+                              InputFilenames[i], Imports))
         return 1;
+      if (!States.empty()) {
+        States[i].DataLayout = Input.Index->getDataLayout();
+        States[i].Imports = Imports;
+      }
+      Input.Index.reset();
+      continue;
+    }
+
+    DLinker::getExports(Input.M.get(), ExportNames);
+    dlinker.findImports(ExportNames, Imports);
+    if (dlinker.linkImports(Input.M->getDataLayout(),
+                            Input.M->getModuleIdentifier(), Imports))
+        return 1;
+    if (!States.empty()) {
+      States[i].DataLayout = Input.M->getDataLayoutStr();
+      States[i].Imports = Imports;
+    }
+
+    if (!Input.CacheKey.empty()) {
+      if (std::error_code EC = ExportIndex::write(
+              ExportCacheDir, Input.CacheKey, Input.M->getDataLayoutStr(),
+              ExportNames))
+        errs() << argv[0] << ": warning: could not cache exports of '"
+               << InputFilenames[i] << "': " << EC.message() << "\n";
+    }
+
+    // The linked module is no longer needed.
+    Input.M.reset();
+    Input.Context.reset();
   }
 
   if (DumpAsm) errs() << "Here's the assembly:\n" << *Composite;
@@ -189,8 +538,25 @@ int main(int argc, char **argv) {
   } else if (Force || !CheckBitcodeOutputToConsole(Out.os(), true))
     WriteBitcodeToFile(Composite.get(), Out.os(), PreserveBitcodeUseListOrder);
 
+  Out.os().close();
+  if (Out.os().has_error()) {
+    errs() << argv[0] << ": error: could not write '" << OutputFilename
+           << "'\n";
+    Out.os().clear_error();
+    return 1;
+  }
+
   // Declare success.
   Out.keep();
+
+  // Only record the link once its output is written, so that the state
+  // never describes output that doesn't exist.
+  if (!IncrementalState.empty()) {
+    if (std::error_code EC = writeLinkState(IncrementalState,
+                                            dlinker.getNumImports(), States))
+      errs() << argv[0] << ": warning: could not write '" << IncrementalState
+             << "': " << EC.message() << "\n";
+  }
     
 
   return 0;
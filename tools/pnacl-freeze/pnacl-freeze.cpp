@@ -44,7 +44,12 @@ static void WriteOutputFile(const Module *M) {
     exit(1);
   }
 
-  NaClWriteBitcodeToFile(M, Out->os(), /* AcceptSupportedOnly = */ false);
+  // Files are written a block at a time, so that the whole pexe need not be
+  // held in memory.
+  if (Out->os().supportsSeeking())
+    NaClWriteBitcodeToStream(M, Out->os(), /* AcceptSupportedOnly = */ false);
+  else
+    NaClWriteBitcodeToFile(M, Out->os(), /* AcceptSupportedOnly = */ false);
 
   // Declare success.
   Out->keep();
@@ -10,8 +10,12 @@
 #ifndef THREADEDFUNCTIONQUEUE_H
 #define THREADEDFUNCTIONQUEUE_H
 
+#include <algorithm>
+#include <deque>
 #include <limits>
+#include <vector>
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/ErrorHandling.h"
 
@@ -84,6 +88,84 @@ class ThreadedFunctionQueue {
     return false;
   }
 
+  // Assign functions between threads by estimated cost. Costs[i] is the
+  // cost of compiling function i, e.g. the size of its body in bits.
+  //
+  // Each thread gets a deque of functions, dealt largest first to the
+  // thread with the least work so far. The threads then work through their
+  // deques, biggest functions first, and a thread whose deque is empty
+  // steals the smallest function of the thread with the most work left.
+  // The stealing is replayed here with the costs as the clock rather than
+  // done at run time, so that which thread compiles a function (and so
+  // which object file it ends up in) only depends on the input.
+  //
+  // The balance is only as good as the estimates, and all the costs must be
+  // known before any thread starts, so streamed input is read to the end
+  // before compilation begins rather than overlapping with it.
+  void ScheduleByCost(ArrayRef<uint64_t> Costs) {
+    assert(Costs.size() == NumFunctions);
+    std::vector<unsigned> Order(NumFunctions);
+    for (unsigned i = 0; i < NumFunctions; ++i)
+      Order[i] = i;
+    std::stable_sort(Order.begin(), Order.end(),
+                     [&Costs](unsigned A, unsigned B) {
+                       return Costs[A] > Costs[B];
+                     });
+
+    std::vector<std::deque<unsigned> > Deques(NumThreads);
+    std::vector<uint64_t> Remaining(NumThreads, 0);
+    for (unsigned i : Order) {
+      unsigned Thread =
+          std::min_element(Remaining.begin(), Remaining.end()) -
+          Remaining.begin();
+      Deques[Thread].push_back(i);
+      // Count every function as some work, so that functions of unknown
+      // (zero) cost are still spread between threads.
+      Remaining[Thread] += std::max<uint64_t>(1, Costs[i]);
+    }
+
+    Owner.assign(NumFunctions, 0);
+    std::vector<uint64_t> Clock(NumThreads, 0);
+    std::vector<bool> Done(NumThreads, false);
+    while (true) {
+      // The thread that is next out of work, lowest index on ties.
+      unsigned Thread = NumThreads;
+      for (unsigned t = 0; t < NumThreads; ++t)
+        if (!Done[t] && (Thread == NumThreads || Clock[t] < Clock[Thread]))
+          Thread = t;
+      if (Thread == NumThreads)
+        break;
+      unsigned Func;
+      unsigned Victim = Thread;
+      if (!Deques[Thread].empty()) {
+        Func = Deques[Thread].front();
+        Deques[Thread].pop_front();
+      } else {
+        Victim = NumThreads;
+        for (unsigned t = 0; t < NumThreads; ++t)
+          if (!Deques[t].empty() &&
+              (Victim == NumThreads || Remaining[t] > Remaining[Victim]))
+            Victim = t;
+        if (Victim == NumThreads) {
+          Done[Thread] = true;
+          continue;
+        }
+        Func = Deques[Victim].back();
+        Deques[Victim].pop_back();
+      }
+      uint64_t Cost = std::max<uint64_t>(1, Costs[Func]);
+      Remaining[Victim] -= Cost;
+      Clock[Thread] += Cost;
+      Owner[Func] = Thread;
+    }
+  }
+
+  // Returns true if ScheduleByCost() assigned FuncIndex to ThreadIndex.
+  bool GrabFunctionByCost(unsigned FuncIndex, unsigned ThreadIndex) const {
+    assert(FuncIndex < Owner.size() && ThreadIndex < NumThreads);
+    return Owner[FuncIndex] == ThreadIndex;
+  }
+
   // Returns a recommended ChunkSize for use in calling GrabFunctionDynamic().
   // ChunkSize starts out "large" to reduce synchronization cost. However,
   // it cannot be too large, otherwise it will encompass too many bytes
@@ -106,6 +188,8 @@ class ThreadedFunctionQueue {
   const unsigned NumThreads;
   unsigned NumFunctions;
   volatile unsigned CurrentFunction;
+  // The thread of each function, set by ScheduleByCost().
+  std::vector<unsigned> Owner;
 
   ThreadedFunctionQueue(
       const ThreadedFunctionQueue&) = delete;
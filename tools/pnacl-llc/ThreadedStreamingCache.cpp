@@ -11,45 +11,142 @@
 #include "llvm/Support/Compiler.h"
 #include "llvm/Support/Mutex.h"
 #include <cstring>
+#include <memory>
 
 using namespace llvm;
 using llvm::sys::ScopedLock;
 
-ThreadedStreamingCache::ThreadedStreamingCache(
+ThreadedStreamingPages::ThreadedStreamingPages(
     llvm::StreamingMemoryObject *S) : Streamer(S),
-                                      Cache(kCacheSize),
-                                      MinObjectSize(0),
-                                      CacheBase(-1) {
-  static_assert((kCacheSize & (kCacheSize - 1)) == 0,
-                "kCacheSize must be a power of 2");
+                                      KnownSize(0) {
+  static_assert((kPageSize & (kPageSize - 1)) == 0,
+                "kPageSize must be a power of 2");
+  for (uint64_t i = 0; i < kNumChunks; ++i)
+    Chunks[i].store(nullptr, std::memory_order_relaxed);
+  initStableBytes();
 }
 
-void ThreadedStreamingCache::fetchCacheLine(uint64_t Address) const {
-  uint64_t Base = Address & kCacheSizeMask;
+ThreadedStreamingPages::~ThreadedStreamingPages() {
+  for (uint64_t i = 0; i < kNumChunks; ++i) {
+    std::atomic<Page *> *Chunk = Chunks[i].load(std::memory_order_relaxed);
+    if (!Chunk)
+      continue;
+    for (uint64_t j = 0; j < kPagesPerChunk; ++j)
+      delete Chunk[j].load(std::memory_order_relaxed);
+    delete[] Chunk;
+  }
+}
+
+void ThreadedStreamingPages::setKnownSize(uint64_t Size) {
+  // Only called with FetchLock held, so the size only grows.
+  if (Size > KnownSize.load(std::memory_order_relaxed))
+    KnownSize.store(Size, std::memory_order_release);
+}
+
+void ThreadedStreamingPages::initStableBytes() {
+  StableBytes = Streamer->getStablePointer();
+  if (StableBytes)
+    KnownSize.store(Streamer->getExtent(), std::memory_order_release);
+}
+
+const ThreadedStreamingPages::Page *
+ThreadedStreamingPages::fetchPage(uint64_t Index) {
+  if (Index >= kNumChunks * kPagesPerChunk)
+    llvm::report_fatal_error("Bitcode stream is too large");
+  ScopedLock L(FetchLock);
+  // Another thread may have published the page while we waited.
+  std::atomic<Page *> *Chunk =
+      Chunks[Index / kPagesPerChunk].load(std::memory_order_relaxed);
+  if (!Chunk) {
+    Chunk = new std::atomic<Page *>[kPagesPerChunk];
+    for (uint64_t i = 0; i < kPagesPerChunk; ++i)
+      Chunk[i].store(nullptr, std::memory_order_relaxed);
+    Chunks[Index / kPagesPerChunk].store(Chunk, std::memory_order_release);
+  }
+  if (const Page *P =
+          Chunk[Index % kPagesPerChunk].load(std::memory_order_relaxed))
+    return P;
+
+  std::unique_ptr<Page> P(new Page);
+  uint64_t Base = Index * kPageSize;
   uint64_t BytesFetched;
-  ScopedLock L(StreamerLock);
-  if (Streamer->isValidAddress(Base + kCacheSize - 1)) {
-    BytesFetched = Streamer->readBytes(&Cache[0], kCacheSize, Base);
-    if (BytesFetched != kCacheSize) {
+  if (Streamer->isValidAddress(Base + kPageSize - 1)) {
+    BytesFetched = Streamer->readBytes(P->Data, kPageSize, Base);
+    if (BytesFetched != kPageSize) {
       llvm::report_fatal_error(
-          "fetchCacheLine failed to fetch a full cache line");
+          "fetchPage failed to fetch a full page");
     }
-    MinObjectSize = Base + kCacheSize;
   } else {
     uint64_t End = Streamer->getExtent();
-    assert(End > Address && End <= Base + kCacheSize);
-    BytesFetched = Streamer->readBytes(&Cache[0], End - Base, Base);
+    assert(End > Base && End <= Base + kPageSize);
+    BytesFetched = Streamer->readBytes(P->Data, End - Base, Base);
     if (BytesFetched != (End - Base)) {
       llvm::report_fatal_error(
-          "fetchCacheLine failed to fetch rest of stream");
+          "fetchPage failed to fetch rest of stream");
     }
-    MinObjectSize = End;
   }
-  CacheBase = Base;
+  P->Size = BytesFetched;
+  setKnownSize(Base + BytesFetched);
+  // Make the page contents visible before the page itself.
+  Chunk[Index % kPagesPerChunk].store(P.get(), std::memory_order_release);
+  return P.release();
+}
+
+bool ThreadedStreamingPages::isValidAddress(uint64_t Address) {
+  if (Address < getKnownSize())
+    return true;
+  ScopedLock L(FetchLock);
+  bool Valid = Streamer->isValidAddress(Address);
+  if (Valid)
+    setKnownSize(Address + 1);
+  return Valid;
+}
+
+bool ThreadedStreamingPages::dropLeadingBytes(size_t S) {
+  ScopedLock L(FetchLock);
+  if (Streamer->dropLeadingBytes(S))
+    return true;
+  // The stable bytes, if any, now start later.
+  if (StableBytes)
+    initStableBytes();
+  return false;
+}
+
+void ThreadedStreamingPages::setKnownObjectSize(size_t Size) {
+  ScopedLock L(FetchLock);
+  Streamer->setKnownObjectSize(Size);
+  if (StableBytes)
+    KnownSize.store(Streamer->getExtent(), std::memory_order_release);
+  else
+    setKnownSize(Size);
+}
+
+ThreadedStreamingCache::ThreadedStreamingCache(
+    ThreadedStreamingPages *P) : Pages(P),
+                                 CachePage(nullptr),
+                                 MinObjectSize(0),
+                                 CacheBase(-1) {
+}
+
+void ThreadedStreamingCache::fetchCacheLine(uint64_t Address) const {
+  CachePage = Pages->getPage(Address);
+  CacheBase = Address & kCacheSizeMask;
+  assert(CacheBase + CachePage->Size > Address);
+  if (CacheBase + CachePage->Size > MinObjectSize)
+    MinObjectSize = CacheBase + CachePage->Size;
 }
 
 uint64_t ThreadedStreamingCache::readBytes(uint8_t* Buf, uint64_t Size,
                                            uint64_t Address) const {
+  if (const uint8_t *Bytes = Pages->getStableBytes()) {
+    uint64_t End = Pages->getKnownSize();
+    if (Address >= End)
+      return 0;
+    if (Size > End - Address)
+      Size = End - Address;
+    memcpy(Buf, Bytes + Address, Size);
+    return Size;
+  }
   // To keep the cache fetch simple, we currently require that no request cross
   // the cache line. This isn't a problem for the bitcode reader because it only
   // fetches a byte or a word (word may be 4 to 8 bytes) at a time.
@@ -62,19 +159,20 @@ uint64_t ThreadedStreamingCache::readBytes(uint8_t* Buf, uint64_t Size,
     fetchCacheLine(Address);
   }
   // Now the start Address should at least fit in the cache line,
-  // but Upper may still be beyond the Extent / MinObjectSize, so clamp.
-  if (Upper > MinObjectSize) {
-    // If in the cacheline but stretches beyone the MinObjectSize,
-    // only read up to MinObjectSize (caller uses readBytes to check EOF,
-    // and can guess / try to read more). MinObjectSize should be the same
-    // as EOF in this case otherwise it would have fit in the cacheline.
-    Size = MinObjectSize - Address;
+  // but Upper may still be beyond the end of the stream, so clamp.
+  if (Upper > CacheBase + CachePage->Size) {
+    // If in the cacheline but stretches beyond the last page of the stream,
+    // only read up to its end (caller uses readBytes to check EOF, and can
+    // guess / try to read more).
+    Size = CacheBase + CachePage->Size - Address;
   }
-  memcpy(Buf, &Cache[Address - CacheBase], Size);
+  memcpy(Buf, &CachePage->Data[Address - CacheBase], Size);
   return Size;
 }
 
 uint64_t ThreadedStreamingCache::getExtent() const {
+  if (Pages->getStableBytes())
+    return Pages->getKnownSize();
   llvm::report_fatal_error(
       "getExtent should not be called for pnacl streaming bitcode");
   return 0;
@@ -83,24 +181,26 @@ uint64_t ThreadedStreamingCache::getExtent() const {
 bool ThreadedStreamingCache::isValidAddress(uint64_t Address) const {
   if (Address < MinObjectSize)
     return true;
-  ScopedLock L(StreamerLock);
-  bool Valid = Streamer->isValidAddress(Address);
-  if (Valid)
-    MinObjectSize = Address;
-  return Valid;
+  // Another thread may have already found the address valid.
+  uint64_t KnownSize = Pages->getKnownSize();
+  if (Address < KnownSize) {
+    MinObjectSize = KnownSize;
+    return true;
+  }
+  return Pages->isValidAddress(Address);
 }
 
 bool ThreadedStreamingCache::dropLeadingBytes(size_t S) {
-  ScopedLock L(StreamerLock);
-  return Streamer->dropLeadingBytes(S);
+  return Pages->dropLeadingBytes(S);
 }
 
 void ThreadedStreamingCache::setKnownObjectSize(size_t Size) {
   MinObjectSize = Size;
-  ScopedLock L(StreamerLock);
-  Streamer->setKnownObjectSize(Size);
+  Pages->setKnownObjectSize(Size);
 }
 
+const uint64_t ThreadedStreamingPages::kPageSize;
+const uint64_t ThreadedStreamingPages::kPagesPerChunk;
+const uint64_t ThreadedStreamingPages::kNumChunks;
 const uint64_t ThreadedStreamingCache::kCacheSize;
 const uint64_t ThreadedStreamingCache::kCacheSizeMask;
-llvm::sys::SmartMutex<false> ThreadedStreamingCache::StreamerLock;
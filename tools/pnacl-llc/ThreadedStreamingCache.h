@@ -13,23 +13,105 @@
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/Mutex.h"
 #include "llvm/Support/StreamingMemoryObject.h"
+#include <atomic>
 
 namespace llvm {
 
+// The pages of a StreamingMemoryObject, shared by the ThreadedStreamingCaches
+// of all translation threads. Each page is fetched from the streamer once,
+// under FetchLock, and is immutable after that: it is published into an
+// append-only page table, with release stores, which readers access with
+// acquire loads and without taking the lock. Only
+// fetching a page that no thread has read yet, or asking about an address
+// past the known end of the stream, goes to the streamer.
+//
+// If the streamer keeps all of its bytes at a stable address, e.g. because
+// it maps the input file, no pages are made: the caches read the streamer's
+// bytes in place, without copying or locking.
+
+class ThreadedStreamingPages {
+ public:
+  const static uint64_t kPageSize = 4 * 4096;
+
+  struct Page {
+    // Number of valid bytes, which is less than kPageSize only for the last
+    // page of the stream.
+    uint64_t Size;
+    uint8_t Data[kPageSize];
+  };
+
+  explicit ThreadedStreamingPages(llvm::StreamingMemoryObject *S);
+  ~ThreadedStreamingPages();
+
+  // Returns the page that contains Address, fetching it if no thread has
+  // yet. Address must be valid.
+  const Page *getPage(uint64_t Address) {
+    uint64_t Index = Address / kPageSize;
+    if (Index < kNumChunks * kPagesPerChunk) {
+      const std::atomic<Page *> *Chunk =
+          Chunks[Index / kPagesPerChunk].load(std::memory_order_acquire);
+      if (Chunk) {
+        // The page contents are written before the page is published, and
+        // are only read through the published pointer.
+        if (const Page *P =
+                Chunk[Index % kPagesPerChunk].load(std::memory_order_acquire))
+          return P;
+      }
+    }
+    return fetchPage(Index);
+  }
+
+  // The stream is at least this many bytes long.
+  uint64_t getKnownSize() const {
+    return KnownSize.load(std::memory_order_acquire);
+  }
+
+  // The bytes of the stream if the streamer keeps them at a stable address,
+  // or null. There are getKnownSize() of them.
+  const uint8_t *getStableBytes() const { return StableBytes; }
+
+  bool isValidAddress(uint64_t Address);
+  bool dropLeadingBytes(size_t S);
+  void setKnownObjectSize(size_t Size);
+
+ private:
+  const static uint64_t kPagesPerChunk = 1024;
+  const static uint64_t kNumChunks = 4096;
+
+  const Page *fetchPage(uint64_t Index);
+  void setKnownSize(uint64_t Size);
+  void initStableBytes();
+
+  llvm::StreamingMemoryObject *Streamer;
+  llvm::sys::Mutex FetchLock;
+  // Two-level page table: Chunks[i][j] is page i * kPagesPerChunk + j. Both
+  // levels are allocated on demand and never freed or moved while in use.
+  std::atomic<std::atomic<Page *> *> Chunks[kNumChunks];
+  // Only grows, and is only written with FetchLock held.
+  std::atomic<uint64_t> KnownSize;
+  const uint8_t *StableBytes;
+
+  ThreadedStreamingPages(
+      const ThreadedStreamingPages&) = delete;
+  void operator=(const ThreadedStreamingPages&) = delete;
+};
+
 // An implementation of StreamingMemoryObject for use in multithreaded
 // translation. Each thread has one of these objects, each of which has a
-// pointer to a shared StreamingMemoryObject. This object is effectively
-// a thread-local cache for the bitcode streamer to avoid contention, since
+// pointer to the shared ThreadedStreamingPages. This object is effectively
+// a thread-local cache of the current page for the bitcode streamer, since
 // bits are only read from the bitcode stream one word at a time.
 
 class ThreadedStreamingCache : public llvm::StreamingMemoryObject {
  public:
-  explicit ThreadedStreamingCache(llvm::StreamingMemoryObject *S);
+  explicit ThreadedStreamingCache(ThreadedStreamingPages *P);
   uint64_t getExtent() const override;
   uint64_t readBytes(uint8_t *Buf, uint64_t Size,
                      uint64_t Address) const override;
   const uint8_t *getPointer(uint64_t Address,
                             uint64_t Size) const override {
+    if (const uint8_t *Bytes = Pages->getStableBytes())
+      return Bytes + Address;
     // This could be fixed by ensuring the bytes are fetched and making a copy,
     // requiring that the bitcode size be known, or otherwise ensuring that
     // the memory doesn't go away/get reallocated, but it's
@@ -38,6 +120,9 @@ class ThreadedStreamingCache : public llvm::StreamingMemoryObject {
     return NULL;
   }
   bool isValidAddress(uint64_t Address) const override;
+  const uint8_t *getStablePointer() const override {
+    return Pages->getStableBytes();
+  }
 
   /// Drop s bytes from the front of the stream, pushing the positions of the
   /// remaining bytes down by s. This is used to skip past the bitcode header,
@@ -50,18 +135,18 @@ class ThreadedStreamingCache : public llvm::StreamingMemoryObject {
   /// starts (although it can be called anytime).
   void setKnownObjectSize(size_t Size) override;
  private:
-  const static uint64_t kCacheSize = 4 * 4096;
+  const static uint64_t kCacheSize = ThreadedStreamingPages::kPageSize;
   const static uint64_t kCacheSizeMask = ~(kCacheSize - 1);
-  static llvm::sys::SmartMutex<false> StreamerLock;
 
-  // Fetch up to kCacheSize worth of data starting from Address, into the
-  // CacheBase, and set MinObjectSize to the new known edge.
+  // Point the cache at the shared page containing Address, and set
+  // MinObjectSize to the new known edge.
   // If at EOF, MinObjectSize reflects the final size.
   void fetchCacheLine(uint64_t Address) const;
 
-  llvm::StreamingMemoryObject *Streamer;
-  // Cached data for addresses [CacheBase, CacheBase + kCacheSize)
-  mutable std::vector<unsigned char> Cache;
+  ThreadedStreamingPages *Pages;
+  // The page holding addresses [CacheBase, CacheBase + kCacheSize), owned by
+  // Pages.
+  mutable const ThreadedStreamingPages::Page *CachePage;
   // The MemoryObject is at least this size. Used as a cache for isValidAddress.
   mutable uint64_t MinObjectSize;
   // Current base address for the cache.
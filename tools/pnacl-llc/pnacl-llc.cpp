@@ -14,6 +14,7 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/Triple.h"
 #include "llvm/Analysis/NaCl.h"
+#include "llvm/Bitcode/NaCl/NaClModuleSnapshot.h"
 #include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
 #include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/CodeGen/CommandFlags.h"
@@ -104,6 +105,14 @@ LazyBitcode("streaming-bitcode",
   cl::desc("Use lazy bitcode streaming for file inputs"),
   cl::init(false));
 
+#if !defined(PNACL_BROWSER_TRANSLATOR)
+static cl::opt<bool>
+MmapBitcode("mmap-bitcode",
+  cl::desc("With -streaming-bitcode, map the input file into memory instead "
+           "of copying it (stdin and other non-regular files are copied)"),
+  cl::init(true));
+#endif
+
 static cl::opt<bool>
 PNaClABIVerify("pnaclabi-verify",
   cl::desc("Verify PNaCl bitcode ABI before translating"),
@@ -154,7 +163,8 @@ SplitModuleCount("split-module",
 
 enum SplitModuleSchedulerKind {
   SplitModuleDynamic,
-  SplitModuleStatic
+  SplitModuleStatic,
+  SplitModuleCost
 };
 
 static cl::opt<SplitModuleSchedulerKind>
@@ -166,9 +176,19 @@ SplitModuleSched(
                    "Dynamic thread scheduling (default)"),
         clEnumValN(SplitModuleStatic, "static",
                    "Static thread scheduling"),
+        clEnumValN(SplitModuleCost, "cost",
+                   "Deterministic scheduling by function size, with work "
+                   "stealing (reads the whole stream first)"),
         clEnumValEnd),
     cl::init(SplitModuleDynamic));
 
+static cl::opt<bool>
+SplitModuleSnapshot(
+    "split-module-snapshot",
+    cl::desc("Parse the module-level records of a streamed PNaCl module once, "
+             "and instantiate the modules of the other threads from them"),
+    cl::init(false));
+
 /// Compile the module provided to pnacl-llc. The file name for reading the
 /// module and other options are taken from globals populated by command-line
 /// option parsing.
@@ -356,7 +376,8 @@ static std::unique_ptr<Module> parseBitcodeRecordsAsText(
 
 static std::unique_ptr<Module> getModule(
     StringRef ProgramName, LLVMContext &Context,
-    StreamingMemoryObject *StreamingObject) {
+    ThreadedStreamingPages *StreamingPages,
+    NaClModuleSnapshot *Snapshot = nullptr) {
   std::unique_ptr<Module> M;
   SMDiagnostic Err;
   std::string VerboseBuffer;
@@ -366,14 +387,18 @@ static std::unique_ptr<Module> getModule(
     switch (InputFileFormat) {
     case PNaClFormat: {
       std::unique_ptr<StreamingMemoryObject> Cache(
-          new ThreadedStreamingCache(StreamingObject));
-      M.reset(getNaClStreamedBitcodeModule(
-          InputFilename, Cache.release(), Context, &VerboseStrm, &StrError));
+          new ThreadedStreamingCache(StreamingPages));
+      if (Snapshot)
+        M.reset(getNaClSnapshotModule(InputFilename, *Snapshot, Cache.release(),
+                                      Context, &VerboseStrm, &StrError));
+      else
+        M.reset(getNaClStreamedBitcodeModule(
+            InputFilename, Cache.release(), Context, &VerboseStrm, &StrError));
       break;
     }
     case LLVMFormat: {
       std::unique_ptr<StreamingMemoryObject> Cache(
-          new ThreadedStreamingCache(StreamingObject));
+          new ThreadedStreamingCache(StreamingPages));
       ErrorOr<std::unique_ptr<Module>> MOrErr =
           getStreamedBitcodeModule(
           InputFilename, Cache.release(), Context);
@@ -446,11 +471,12 @@ static int runCompilePasses(Module *ModuleRef,
     }
     if (ModuleIndex > 0) {
       // Remove the initializers for all global variables, turning them into
-      // declarations.
+      // declarations. Modules instantiated from a snapshot have none.
       for (Module::global_iterator GI = ModuleRef->global_begin(),
           GE = ModuleRef->global_end();
           GI != GE; ++GI) {
-        assert(GI->hasInitializer() && "Global variable missing initializer");
+        if (!GI->hasInitializer())
+          continue;
         Constant *Init = GI->getInitializer();
         GI->setInitializer(nullptr);
         if (Init->getNumUses() == 0)
@@ -531,6 +557,18 @@ static int runCompilePasses(Module *ModuleRef,
       ++FuncIndex;
     }
     break;
+  case SplitModuleCost:
+    for (Function &F : *ModuleRef) {
+      if (!F.isMaterializable() && F.isDeclaration())
+        continue;
+      if (FuncQueue->GrabFunctionByCost(FuncIndex, ModuleIndex)) {
+        PM->run(F);
+        CheckABIVerifyErrors(ABIErrorReporter, "Function " + F.getName());
+        F.Dematerialize();
+      }
+      ++FuncIndex;
+    }
+    break;
   case SplitModuleDynamic:
     unsigned ChunkSize = 0;
     unsigned NumFunctions = FuncQueue->Size();
@@ -569,6 +607,27 @@ static int runCompilePasses(Module *ModuleRef,
   return 0;
 }
 
+// Estimates the cost of compiling each function with a body in M, in module
+// order, for -split-module-sched=cost. Bodies that are still in the PNaCl
+// bitcode are measured by their size in bits, and bodies that have been read
+// by their number of instructions.
+static void getFunctionCosts(Module *M, std::vector<uint64_t> &Costs) {
+  if (LazyBitcode && InputFileFormat == PNaClFormat) {
+    if (std::error_code EC = getNaClFunctionBodyBitSizes(M, Costs))
+      report_fatal_error("Unable to find function bodies: " + EC.message());
+    return;
+  }
+  Costs.clear();
+  for (Function &F : *M) {
+    if (!F.isMaterializable() && F.isDeclaration())
+      continue;
+    uint64_t NumInsts = 0;
+    for (BasicBlock &BB : F)
+      NumInsts += BB.size();
+    Costs.push_back(NumInsts);
+  }
+}
+
 static int compileSplitModule(const TargetOptions &Options,
                               const Triple &TheTriple,
                               const Target *TheTarget,
@@ -576,7 +635,8 @@ static int compileSplitModule(const TargetOptions &Options,
                               CodeGenOpt::Level OLvl,
                               const StringRef &ProgramName,
                               Module *GlobalModuleRef,
-                              StreamingMemoryObject *StreamingObject,
+                              ThreadedStreamingPages *StreamingPages,
+                              NaClModuleSnapshot *Snapshot,
                               unsigned ModuleIndex,
                               ThreadedFunctionQueue *FuncQueue) {
   std::auto_ptr<TargetMachine>
@@ -598,7 +658,7 @@ static int compileSplitModule(const TargetOptions &Options,
     ModuleRef = GlobalModuleRef;
   } else {
     C.reset(new LLVMContext());
-    M = getModule(ProgramName, *C, StreamingObject);
+    M = getModule(ProgramName, *C, StreamingPages, Snapshot);
     if (!M)
       return 1;
     // M owns the temporary module, but use a reference through ModuleRef
@@ -662,7 +722,8 @@ struct ThreadData {
   CodeGenOpt::Level OLvl;
   std::string ProgramName;
   Module *GlobalModuleRef;
-  StreamingMemoryObject *StreamingObject;
+  ThreadedStreamingPages *StreamingPages;
+  NaClModuleSnapshot *Snapshot;
   unsigned ModuleIndex;
   ThreadedFunctionQueue *FuncQueue;
 };
@@ -677,7 +738,8 @@ static void *runCompileThread(void *arg) {
                                Data->OLvl,
                                Data->ProgramName,
                                Data->GlobalModuleRef,
-                               Data->StreamingObject,
+                               Data->StreamingPages,
+                               Data->Snapshot,
                                Data->ModuleIndex,
                                Data->FuncQueue);
   return reinterpret_cast<void *>(static_cast<intptr_t>(ret));
@@ -695,6 +757,11 @@ static int compileModule(StringRef ProgramName) {
   Triple TheTriple;
   PNaClABIErrorReporter ABIErrorReporter;
   std::unique_ptr<StreamingMemoryObject> StreamingObject;
+  // The pages of StreamingObject, shared by the translation threads.
+  std::unique_ptr<ThreadedStreamingPages> StreamingPages;
+  // The module-level records of MainMod, shared by the translation threads
+  // with -split-module-snapshot.
+  std::unique_ptr<NaClModuleSnapshot> Snapshot;
 
   if (!MainContext) return 1;
 
@@ -702,7 +769,9 @@ static int compileModule(StringRef ProgramName) {
   StreamingObject.reset(
       new StreamingMemoryObjectImpl(getNaClBitcodeStreamer()));
 #else
-  if (LazyBitcode) {
+  if (LazyBitcode && MmapBitcode && InputFilename != "-")
+    StreamingObject.reset(getMappedFileMemoryObject(InputFilename, nullptr));
+  if (LazyBitcode && !StreamingObject) {
     std::string StrError;
     DataStreamer* FileStreamer(getDataFileStreamer(InputFilename, &StrError));
     if (!StrError.empty()) {
@@ -714,10 +783,18 @@ static int compileModule(StringRef ProgramName) {
     StreamingObject.reset(new StreamingMemoryObjectImpl(FileStreamer));
   }
 #endif
-  MainMod = getModule(ProgramName, *MainContext.get(), StreamingObject.get());
+  if (StreamingObject)
+    StreamingPages.reset(new ThreadedStreamingPages(StreamingObject.get()));
+  MainMod = getModule(ProgramName, *MainContext.get(), StreamingPages.get());
 
   if (!MainMod) return 1;
 
+  // Take the snapshot before any pass changes MainMod.
+  if (SplitModuleSnapshot && SplitModuleCount > 1 && LazyBitcode &&
+      InputFileFormat == PNaClFormat)
+    Snapshot = getNaClModuleSnapshot(
+        MainMod.get(), new ThreadedStreamingCache(StreamingPages.get()));
+
   if (PNaClABIVerify) {
     // Verify the module (but not the functions yet)
     std::unique_ptr<ModulePass> VerifyPass(
@@ -794,8 +871,14 @@ static int compileModule(StringRef ProgramName) {
     // No need for dynamic scheduling with one thread.
     SplitModuleSched = SplitModuleStatic;
     return compileSplitModule(Options, TheTriple, TheTarget, FeaturesStr,
-                              OLvl, ProgramName, MainMod.get(), nullptr, 0,
-                              &FuncQueue);
+                              OLvl, ProgramName, MainMod.get(), nullptr,
+                              nullptr, 0, &FuncQueue);
+  }
+
+  if (SplitModuleSched == SplitModuleCost) {
+    std::vector<uint64_t> Costs;
+    getFunctionCosts(MainMod.get(), Costs);
+    FuncQueue.ScheduleByCost(Costs);
   }
 
   for(unsigned ModuleIndex = 0; ModuleIndex < SplitModuleCount; ++ModuleIndex) {
@@ -806,7 +889,8 @@ static int compileModule(StringRef ProgramName) {
     ThreadDatas[ModuleIndex].OLvl = OLvl;
     ThreadDatas[ModuleIndex].ProgramName = ProgramName.str();
     ThreadDatas[ModuleIndex].GlobalModuleRef = MainMod.get();
-    ThreadDatas[ModuleIndex].StreamingObject = StreamingObject.get();
+    ThreadDatas[ModuleIndex].StreamingPages = StreamingPages.get();
+    ThreadDatas[ModuleIndex].Snapshot = Snapshot.get();
     ThreadDatas[ModuleIndex].ModuleIndex = ModuleIndex;
     ThreadDatas[ModuleIndex].FuncQueue = &FuncQueue;
     if (pthread_create(&Pthreads[ModuleIndex], nullptr, runCompileThread,
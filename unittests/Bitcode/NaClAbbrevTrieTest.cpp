@@ -10,9 +10,14 @@
 // Tests if we properly sort abbreviations when building an
 // abbreviation trie.
 
+#include "NaClTestModules.h"
+
+#include "llvm/ADT/SmallString.h"
 #include "llvm/Bitcode/NaCl/AbbrevTrieNode.h"
 #include "llvm/Bitcode/NaCl/NaClBitCodes.h"
+#include "llvm/Bitcode/NaCl/NaClBitcodeHeader.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeValueDist.h"
+#include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
 #include "gtest/gtest.h"
 
 #include <iostream>
@@ -969,4 +974,142 @@ TEST(NaClAbbrevTrieTest, NonsimpleArray) {
   Clear(LookupMap);
 }
 
+// Collects the records of the function blocks of a bitcode file.
+class FunctionRecordCollector : public NaClBitcodeParser {
+public:
+  FunctionRecordCollector(NaClBitstreamCursor &Cursor,
+                          std::vector<NaClBitcodeRecordData> &Records)
+      : NaClBitcodeParser(Cursor), Records(Records) {}
+
+  FunctionRecordCollector(unsigned BlockID,
+                          FunctionRecordCollector *EnclosingParser)
+      : NaClBitcodeParser(BlockID, EnclosingParser),
+        Records(EnclosingParser->Records) {}
+
+  bool ParseBlock(unsigned BlockID) override {
+    FunctionRecordCollector Parser(BlockID, this);
+    return Parser.ParseThisBlock();
+  }
+
+  void ProcessRecord() override {
+    if (GetBlockID() == naclbitc::FUNCTION_BLOCK_ID)
+      Records.push_back(Record.GetRecordData());
+  }
+
+private:
+  std::vector<NaClBitcodeRecordData> &Records;
+};
+
+// Writes a module with NumFunctions functions, with a mix of
+// instructions, and puts the records of its function blocks in
+// Records.
+static void collectFunctionRecords(
+    unsigned NumFunctions, std::vector<NaClBitcodeRecordData> &Records) {
+  SmallString<1024> Mem;
+  nacltestmodules::writeArithmeticModule(Mem, NumFunctions, 20,
+                                         nacltestmodules::MixedOps);
+
+  const unsigned char *BufPtr =
+      reinterpret_cast<const unsigned char *>(Mem.data());
+  const unsigned char *EndBufPtr = BufPtr + Mem.size();
+  NaClBitcodeHeader Header;
+  ASSERT_FALSE(Header.Read(BufPtr, EndBufPtr));
+  NaClBitstreamReader Reader(BufPtr, EndBufPtr, Header);
+  NaClBitstreamCursor Cursor(Reader);
+  FunctionRecordCollector Parser(Cursor, Records);
+  while (!Cursor.AtEndOfStream())
+    ASSERT_FALSE(Parser.Parse());
+}
+
+// Builds abbreviations for Records, the way the analysis of
+// pnacl-bccompress does: one per record code, one per record code and
+// size, and one per record code and first value, for the first
+// MaxLiteralAbbrevs pairs seen.
+static void buildRecordAbbrevs(
+    const std::vector<NaClBitcodeRecordData> &Records,
+    size_t MaxLiteralAbbrevs, AbbrevVector &Abbrevs) {
+  std::set<unsigned> Codes;
+  std::set<std::pair<unsigned, size_t>> CodeSizes;
+  std::set<std::pair<unsigned, uint64_t>> CodeValues;
+  for (const NaClBitcodeRecordData &Record : Records) {
+    if (Codes.insert(Record.Code).second) {
+      NaClBitCodeAbbrev *Abbrev = new NaClBitCodeAbbrev();
+      Abbrev->Add(NaClBitCodeAbbrevOp(Record.Code));
+      Abbrev->Add(NaClBitCodeAbbrevOp(NaClBitCodeAbbrevOp::Array));
+      Abbrev->Add(NaClBitCodeAbbrevOp(NaClBitCodeAbbrevOp::VBR, 6));
+      Abbrevs.push_back(Abbrev);
+    }
+    size_t Size = Record.Values.size();
+    if (Size < NaClValueIndexCutoff &&
+        CodeSizes.insert(std::make_pair(Record.Code, Size)).second) {
+      NaClBitCodeAbbrev *Abbrev = new NaClBitCodeAbbrev();
+      Abbrev->Add(NaClBitCodeAbbrevOp(Record.Code));
+      for (size_t i = 0; i < Size; ++i)
+        Abbrev->Add(NaClBitCodeAbbrevOp(NaClBitCodeAbbrevOp::VBR, 6));
+      Abbrevs.push_back(Abbrev);
+    }
+    if (Size > 0 && CodeValues.size() < MaxLiteralAbbrevs &&
+        CodeValues.insert(
+            std::make_pair(Record.Code, Record.Values[0])).second) {
+      NaClBitCodeAbbrev *Abbrev = new NaClBitCodeAbbrev();
+      Abbrev->Add(NaClBitCodeAbbrevOp(Record.Code));
+      Abbrev->Add(NaClBitCodeAbbrevOp(Record.Values[0]));
+      Abbrev->Add(NaClBitCodeAbbrevOp(NaClBitCodeAbbrevOp::Array));
+      Abbrev->Add(NaClBitCodeAbbrevOp(NaClBitCodeAbbrevOp::VBR, 6));
+      Abbrevs.push_back(Abbrev);
+    }
+  }
+}
+
+// Returns the abbreviations the trie finds for Record.
+static const std::set<AbbrevIndexPair> *
+trieAbbreviations(const AbbrevLookupSizeMap &LookupMap,
+                  const NaClBitcodeRecordData &Record) {
+  size_t Size = Record.Values.size() + 1;
+  if (Size > NaClValueIndexCutoff) Size = NaClValueIndexCutoff + 1;
+  AbbrevLookupSizeMap::const_iterator Pos = LookupMap.find(Size);
+  if (Pos == LookupMap.end() || Pos->second == 0)
+    return 0;
+  return &Pos->second->MatchRecord(Record)->GetAbbreviations();
+}
+
+// Test that the flat lookup table finds the same abbreviations, in the
+// same order, as the tries it was built from, for the records of
+// function blocks.
+TEST(NaClAbbrevTrieTest, LookupTableMatchesTrie) {
+  std::vector<NaClBitcodeRecordData> Records;
+  collectFunctionRecords(50, Records);
+  ASSERT_FALSE(Records.empty());
+  AbbrevVector Abbrevs;
+  buildRecordAbbrevs(Records, 200, Abbrevs);
+  AbbrevLookupSizeMap LookupMap;
+  NaClBuildAbbrevLookupMap(LookupMap, Abbrevs);
+  AbbrevLookupTable LookupTable;
+  LookupTable.Build(LookupMap);
+
+  // Also try records that no trie node refines.
+  NaClBitcodeRecordData Unmatched;
+  Unmatched.Code = 1000;
+  Records.push_back(Unmatched);
+  Unmatched.Values.assign(10, 1);
+  Records.push_back(Unmatched);
+
+  for (const NaClBitcodeRecordData &Record : Records) {
+    const std::set<AbbrevIndexPair> *Expected =
+        trieAbbreviations(LookupMap, Record);
+    ArrayRef<AbbrevIndexPair> Found = LookupTable.MatchRecord(Record);
+    if (Expected == 0) {
+      EXPECT_TRUE(Found.empty()) << DescribeRecord(Record);
+      continue;
+    }
+    EXPECT_EQ(std::vector<AbbrevIndexPair>(Expected->begin(),
+                                           Expected->end()),
+              Found.vec())
+        << DescribeRecord(Record);
+  }
+
+  Clear(Abbrevs);
+  Clear(LookupMap);
+}
+
 }
@@ -7,16 +7,25 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "NaClTestModules.h"
+
 #include "llvm/ADT/SmallString.h"
 #include "llvm/Bitcode/BitstreamWriter.h"
+#include "llvm/Bitcode/NaCl/NaClBitcodeHeader.h"
+#include "llvm/Bitcode/NaCl/NaClBitstreamReader.h"
+#include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
+#include "llvm/Bitcode/NaCl/NaClModuleSnapshot.h"
 #include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/DataStream.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/StreamingMemoryObject.h"
 #include "gtest/gtest.h"
 
 namespace llvm {
@@ -60,6 +69,505 @@ TEST(NaClBitReaderTest, MaterializeSimpleModule) {
   EXPECT_FALSE(verifyModule(*M, &dbgs()));
 }
 
+// Check that the sizes of lazily read function bodies are found, in module
+// order, skipping declarations.
+TEST(NaClBitReaderTest, FunctionBodyBitSizes) {
+  std::unique_ptr<Module> Mod = makeLLVMModule();
+  FunctionType* FuncTy =
+    FunctionType::get(Type::getVoidTy(Mod->getContext()), false);
+  Function::Create(FuncTy, GlobalValue::ExternalLinkage, "decl", Mod.get());
+  Function* Small = Function::Create(FuncTy, GlobalValue::ExternalLinkage,
+                                     "small", Mod.get());
+  new UnreachableInst(Mod->getContext(),
+                      BasicBlock::Create(Mod->getContext(), "entry", Small));
+  SmallString<1024> Mem;
+  raw_svector_ostream OS(Mem);
+  NaClWriteBitcodeToFile(Mod.get(), OS);
+  OS.flush();
+
+  std::unique_ptr<MemoryBuffer> Buffer = MemoryBuffer::getMemBuffer(Mem.str(), "test", false);
+  ErrorOr<Module *> ModuleOrErr =
+      getNaClLazyBitcodeModule(std::move(Buffer), getGlobalContext());
+  ASSERT_EQ(true, bool(ModuleOrErr));
+  std::unique_ptr<Module> M(ModuleOrErr.get());
+  std::vector<uint64_t> BitSizes;
+  EXPECT_FALSE(getNaClFunctionBodyBitSizes(M.get(), BitSizes));
+  ASSERT_EQ(2u, BitSizes.size());
+  EXPECT_GT(BitSizes[1], 0u);
+  EXPECT_GT(BitSizes[0], BitSizes[1]);
+}
+
+// Streams the contents of a buffer, filling every request.
+class BufferDataStreamer : public DataStreamer {
+public:
+  explicit BufferDataStreamer(StringRef Data) : Data(Data), Pos(0) {}
+
+  size_t GetBytes(unsigned char *Buf, size_t Len) override {
+    Len = std::min(Len, Data.size() - Pos);
+    memcpy(Buf, Data.data() + Pos, Len);
+    Pos += Len;
+    return Len;
+  }
+
+  size_t getNumBytesRead() const { return Pos; }
+
+private:
+  StringRef Data;
+  size_t Pos;
+};
+
+static StreamingMemoryObject *makeStreamer(StringRef Data) {
+  return new StreamingMemoryObjectImpl(new BufferDataStreamer(Data));
+}
+
+static std::string printFunction(const Function &F) {
+  std::string Str;
+  raw_string_ostream OS(Str);
+  F.print(OS);
+  return OS.str();
+}
+
+// Test that a module instantiated from a snapshot of a streamed module has
+// the same declarations, in the same order, and the same function bodies.
+TEST(NaClBitReaderTest, ModuleSnapshot) {
+  std::unique_ptr<Module> Mod = makeLLVMModule();
+  LLVMContext &Context = Mod->getContext();
+  Type *I8 = Type::getInt8Ty(Context);
+  Type *I32 = Type::getInt32Ty(Context);
+  Function *Func = Mod->getFunction("func");
+  new GlobalVariable(*Mod, ArrayType::get(I8, 8), false,
+                     GlobalValue::InternalLinkage,
+                     ConstantAggregateZero::get(ArrayType::get(I8, 8)), "zero");
+  Constant *Fields[] = {
+    ConstantDataArray::getString(Context, "abc"),
+    ConstantExpr::getPtrToInt(Func, I32)
+  };
+  Constant *Reloc = ConstantStruct::getAnon(Context, Fields, true);
+  new GlobalVariable(*Mod, Reloc->getType(), true,
+                     GlobalValue::InternalLinkage, Reloc, "reloc");
+  FunctionType *AddTy = FunctionType::get(I32, I32, false);
+  Function::Create(AddTy, GlobalValue::ExternalLinkage, "decl", Mod.get());
+  for (unsigned i = 0; i < 3; ++i) {
+    Function *Add = Function::Create(AddTy, GlobalValue::InternalLinkage,
+                                     "add" + std::to_string(i), Mod.get());
+    BasicBlock *Entry = BasicBlock::Create(Context, "entry", Add);
+    CallInst::Create(Func, "", Entry);
+    Value *Sum = BinaryOperator::CreateAdd(
+        Add->arg_begin(), ConstantInt::get(I32, i), "", Entry);
+    ReturnInst::Create(Context, Sum, Entry);
+  }
+  SmallString<1024> Mem;
+  raw_svector_ostream OS(Mem);
+  NaClWriteBitcodeToFile(Mod.get(), OS);
+  OS.flush();
+
+  LLVMContext MainContext;
+  std::unique_ptr<Module> Main(getNaClStreamedBitcodeModule(
+      "main", makeStreamer(Mem.str()), MainContext));
+  ASSERT_TRUE(Main.get() != nullptr);
+  std::unique_ptr<NaClModuleSnapshot> Snapshot =
+      getNaClModuleSnapshot(Main.get(), makeStreamer(Mem.str()));
+  ASSERT_TRUE(Snapshot.get() != nullptr);
+  EXPECT_EQ(4u, Snapshot->getNumFunctionBodies());
+
+  // Instantiate twice, into contexts of their own, as pnacl-llc threads do.
+  for (unsigned Copy = 0; Copy < 2; ++Copy) {
+    LLVMContext CopyContext;
+    std::unique_ptr<Module> M(getNaClSnapshotModule(
+        "copy", *Snapshot, makeStreamer(Mem.str()), CopyContext));
+    ASSERT_TRUE(M.get() != nullptr);
+
+    ASSERT_EQ(Main->size(), M->size());
+    for (Module::iterator F = Main->begin(), G = M->begin(), E = Main->end();
+         F != E; ++F, ++G) {
+      EXPECT_EQ(F->getName(), G->getName());
+      EXPECT_EQ(F->getLinkage(), G->getLinkage());
+      EXPECT_EQ(F->isMaterializable(), G->isMaterializable());
+    }
+    ASSERT_EQ(Main->getGlobalList().size(), M->getGlobalList().size());
+    for (Module::global_iterator GV = Main->global_begin(),
+             GW = M->global_begin(), E = Main->global_end();
+         GV != E; ++GV, ++GW) {
+      EXPECT_EQ(GV->getName(), GW->getName());
+      EXPECT_EQ(GV->getAlignment(), GW->getAlignment());
+      EXPECT_EQ(GV->isConstant(), GW->isConstant());
+      EXPECT_TRUE(GW->isDeclaration());
+      ASSERT_TRUE(GV->hasInitializer());
+      std::string Expected, Actual;
+      raw_string_ostream ExpectedOS(Expected), ActualOS(Actual);
+      GV->getType()->print(ExpectedOS);
+      GW->getType()->print(ActualOS);
+      EXPECT_EQ(ExpectedOS.str(), ActualOS.str());
+    }
+
+    // Materialize the bodies in reverse, so that the bodies after the first
+    // are found by the snapshot.
+    for (Module::reverse_iterator G = M->rbegin(), E = M->rend(); G != E; ++G)
+      EXPECT_FALSE(G->materialize());
+    EXPECT_FALSE(verifyModule(*M, &errs()));
+  }
+
+  EXPECT_FALSE(Main->materializeAll());
+  LLVMContext CopyContext;
+  std::unique_ptr<Module> M(getNaClSnapshotModule(
+      "copy", *Snapshot, makeStreamer(Mem.str()), CopyContext));
+  ASSERT_TRUE(M.get() != nullptr);
+  EXPECT_FALSE(M->materializeAll());
+  for (Module::iterator F = Main->begin(), G = M->begin(), E = Main->end();
+       F != E; ++F, ++G)
+    EXPECT_EQ(printFunction(*F), printFunction(*G));
+}
+
+// Writes Mod to Buffer, with a function index if WithIndex.
+static void writeModuleWithIndex(const Module *Mod, bool WithIndex,
+                                 SmallVectorImpl<char> &Buffer) {
+  cl::opt<bool> *FunctionIndex = static_cast<cl::opt<bool> *>(
+      cl::getRegisteredOptions()["function-index"]);
+  ASSERT_TRUE(FunctionIndex != nullptr);
+  *FunctionIndex = WithIndex;
+  raw_svector_ostream OS(Buffer);
+  NaClWriteBitcodeToFile(Mod, OS);
+  OS.flush();
+  *FunctionIndex = false;
+}
+
+// Test that a streamed module with a function index finds the sizes of its
+// bodies without reading them, and reads its bodies in any order.
+TEST(NaClBitReaderTest, FunctionIndex) {
+  std::unique_ptr<Module> Mod = makeLLVMModule();
+  LLVMContext &Context = Mod->getContext();
+  Type *I32 = Type::getInt32Ty(Context);
+  FunctionType *FuncTy = FunctionType::get(I32, I32, false);
+  Function::Create(FuncTy, GlobalValue::ExternalLinkage, "decl", Mod.get());
+  // Enough bodies that they do not fit in the first chunk of the stream.
+  for (unsigned i = 0; i < 100; ++i) {
+    Function *Func = Function::Create(FuncTy, GlobalValue::InternalLinkage,
+                                      "f" + std::to_string(i), Mod.get());
+    BasicBlock *Entry = BasicBlock::Create(Context, "entry", Func);
+    Value *Sum = Func->arg_begin();
+    for (unsigned j = 0; j <= i * 2; ++j)
+      Sum = BinaryOperator::CreateAdd(Sum, ConstantInt::get(I32, j), "",
+                                      Entry);
+    ReturnInst::Create(Context, Sum, Entry);
+  }
+  SmallString<1024> Plain, Indexed;
+  writeModuleWithIndex(Mod.get(), false, Plain);
+  writeModuleWithIndex(Mod.get(), true, Indexed);
+  EXPECT_GT(Indexed.size(), Plain.size());
+
+  LLVMContext PlainContext;
+  std::unique_ptr<Module> PlainM(getNaClStreamedBitcodeModule(
+      "plain", makeStreamer(Plain.str()), PlainContext));
+  ASSERT_TRUE(PlainM.get() != nullptr);
+  std::vector<uint64_t> PlainSizes;
+  EXPECT_FALSE(getNaClFunctionBodyBitSizes(PlainM.get(), PlainSizes));
+
+  LLVMContext IndexedContext;
+  BufferDataStreamer *Streamer = new BufferDataStreamer(Indexed.str());
+  std::unique_ptr<Module> IndexedM(getNaClStreamedBitcodeModule(
+      "indexed", new StreamingMemoryObjectImpl(Streamer), IndexedContext));
+  ASSERT_TRUE(IndexedM.get() != nullptr);
+  std::vector<uint64_t> IndexedSizes;
+  EXPECT_FALSE(getNaClFunctionBodyBitSizes(IndexedM.get(), IndexedSizes));
+  EXPECT_EQ(PlainSizes, IndexedSizes);
+  EXPECT_LT(Streamer->getNumBytesRead(), Indexed.size());
+
+  for (Module::reverse_iterator F = IndexedM->rbegin(), E = IndexedM->rend();
+       F != E; ++F)
+    EXPECT_FALSE(F->materialize());
+  EXPECT_FALSE(verifyModule(*IndexedM, &errs()));
+  EXPECT_FALSE(PlainM->materializeAll());
+  EXPECT_FALSE(IndexedM->materializeAll());
+  for (Module::iterator F = PlainM->begin(), G = IndexedM->begin(),
+           E = PlainM->end(); F != E; ++F, ++G)
+    EXPECT_EQ(printFunction(*F), printFunction(*G));
+}
+
+// Returns the bit position of each entry of the function index in Mem. The
+// startword and numwords of an entry are the two 32-bit fields there.
+static std::vector<uint64_t> findIndexEntryBits(StringRef Mem) {
+  std::vector<uint64_t> EntryBits;
+  const unsigned char *Start =
+      reinterpret_cast<const unsigned char *>(Mem.data());
+  const unsigned char *End = Start + Mem.size();
+  NaClBitcodeHeader Header;
+  if (Header.Read(Start, End))
+    return EntryBits;
+  NaClBitstreamReader Reader(Start, End, Header);
+  NaClBitstreamCursor Cursor(Reader);
+  NaClBitstreamEntry Entry = Cursor.advance(0, nullptr);
+  if (Entry.Kind != NaClBitstreamEntry::SubBlock ||
+      Entry.ID != naclbitc::MODULE_BLOCK_ID ||
+      Cursor.EnterSubBlock(naclbitc::MODULE_BLOCK_ID))
+    return EntryBits;
+  bool InIndex = false;
+  SmallVector<uint64_t, 8> Record;
+  while (1) {
+    Entry = Cursor.advance(0, nullptr);
+    switch (Entry.Kind) {
+    case NaClBitstreamEntry::Error:
+    case NaClBitstreamEntry::EndBlock:
+      return EntryBits;
+    case NaClBitstreamEntry::SubBlock:
+      if (Entry.ID == naclbitc::BLOCKINFO_BLOCK_ID) {
+        if (Cursor.ReadBlockInfoBlock(nullptr))
+          return EntryBits;
+      } else if (Entry.ID == naclbitc::FUNCTION_INDEX_BLOCK_ID) {
+        if (Cursor.EnterSubBlock(naclbitc::FUNCTION_INDEX_BLOCK_ID))
+          return EntryBits;
+        InIndex = true;
+      } else if (Cursor.SkipBlock()) {
+        return EntryBits;
+      }
+      break;
+    case NaClBitstreamEntry::Record:
+      Record.clear();
+      Cursor.readRecord(Entry.ID, Record);
+      if (InIndex)
+        EntryBits.push_back(Cursor.GetCurrentBitNo() - 64);
+      break;
+    }
+  }
+}
+
+// Returns the 32-bit field of Mem at Bit.
+static uint32_t getFieldAt(StringRef Mem, uint64_t Bit) {
+  uint32_t Value = 0;
+  for (unsigned i = 0; i < 32; ++i, ++Bit)
+    Value |= uint32_t((Mem[Bit / CHAR_BIT] >> (Bit % CHAR_BIT)) & 1) << i;
+  return Value;
+}
+
+// Sets the 32-bit field of Mem at Bit to Value.
+static void setFieldAt(SmallVectorImpl<char> &Mem, uint64_t Bit,
+                       uint32_t Value) {
+  for (unsigned i = 0; i < 32; ++i, ++Bit) {
+    char Mask = char(1 << (Bit % CHAR_BIT));
+    if ((Value >> i) & 1)
+      Mem[Bit / CHAR_BIT] |= Mask;
+    else
+      Mem[Bit / CHAR_BIT] &= ~Mask;
+  }
+}
+
+// Test that a streamed module whose function index does not describe its
+// function blocks finds the bodies by skipping over the blocks instead, in
+// the module and in modules instantiated from its snapshot.
+TEST(NaClBitReaderTest, BadFunctionIndex) {
+  std::unique_ptr<Module> Mod = makeLLVMModule();
+  nacltestmodules::addArithmeticFunctions(Mod.get(), 20, 30);
+  SmallString<1024> Plain, Indexed;
+  writeModuleWithIndex(Mod.get(), false, Plain);
+  writeModuleWithIndex(Mod.get(), true, Indexed);
+  std::vector<uint64_t> EntryBits = findIndexEntryBits(Indexed.str());
+  ASSERT_EQ(21u, EntryBits.size());
+
+  LLVMContext PlainContext;
+  std::unique_ptr<Module> PlainM(getNaClStreamedBitcodeModule(
+      "plain", makeStreamer(Plain.str()), PlainContext));
+  ASSERT_TRUE(PlainM.get() != nullptr);
+  EXPECT_FALSE(PlainM->materializeAll());
+
+  // Moving the boundary between bodies 5 and 6 keeps the entries one after
+  // the other, but body 6 no longer starts at a function block, which is
+  // only found when it is read. Moving the start of body 6 alone leaves a
+  // gap between the entries, so the index is not used at all.
+  for (bool MoveBoundary : {true, false}) {
+    SmallString<1024> Bad(Indexed);
+    uint64_t Entry5 = EntryBits[5], Entry6 = EntryBits[6];
+    setFieldAt(Bad, Entry6, getFieldAt(Bad, Entry6) + 1);
+    if (MoveBoundary) {
+      setFieldAt(Bad, Entry5 + 32, getFieldAt(Bad, Entry5 + 32) + 1);
+      setFieldAt(Bad, Entry6 + 32, getFieldAt(Bad, Entry6 + 32) - 1);
+    }
+
+    LLVMContext BadContext;
+    std::unique_ptr<Module> BadM(getNaClStreamedBitcodeModule(
+        "bad", makeStreamer(Bad.str()), BadContext));
+    ASSERT_TRUE(BadM.get() != nullptr);
+    std::unique_ptr<NaClModuleSnapshot> Snapshot =
+        getNaClModuleSnapshot(BadM.get(), makeStreamer(Bad.str()));
+    ASSERT_TRUE(Snapshot.get() != nullptr);
+    LLVMContext CopyContext;
+    std::unique_ptr<Module> CopyM(getNaClSnapshotModule(
+        "copy", *Snapshot, makeStreamer(Bad.str()), CopyContext));
+    ASSERT_TRUE(CopyM.get() != nullptr);
+
+    // Read the bodies last to first, so that their positions come from the
+    // index if it is used.
+    for (Module *M : {BadM.get(), CopyM.get()}) {
+      for (Module::reverse_iterator F = M->rbegin(), E = M->rend(); F != E;
+           ++F)
+        EXPECT_FALSE(F->materialize());
+      EXPECT_FALSE(verifyModule(*M, &errs()));
+      for (Module::iterator F = PlainM->begin(), G = M->begin(),
+               E = PlainM->end(); F != E; ++F, ++G)
+        EXPECT_EQ(printFunction(*F), printFunction(*G));
+    }
+  }
+}
+
+// Test that forward references, whose placeholders are reused from one
+// function body to the next, are resolved in each body.
+TEST(NaClBitReaderTest, ForwardReferences) {
+  std::unique_ptr<Module> Mod(new Module("test-mem", getGlobalContext()));
+  LLVMContext &Context = Mod->getContext();
+  Type *I32 = Type::getInt32Ty(Context);
+  FunctionType *FuncTy = FunctionType::get(I32, I32, false);
+  for (unsigned i = 0; i < 3; ++i) {
+    // A loop whose phi uses the value computed at the end of the loop.
+    Function *Func = Function::Create(FuncTy, GlobalValue::ExternalLinkage,
+                                      "loop" + std::to_string(i), Mod.get());
+    BasicBlock *Entry = BasicBlock::Create(Context, "", Func);
+    BasicBlock *Loop = BasicBlock::Create(Context, "", Func);
+    BasicBlock *Exit = BasicBlock::Create(Context, "", Func);
+    BranchInst::Create(Loop, Entry);
+    PHINode *Phi = PHINode::Create(I32, 2, "", Loop);
+    Value *Next = BinaryOperator::CreateAdd(Phi, ConstantInt::get(I32, i + 1),
+                                            "", Loop);
+    Value *Done = new ICmpInst(*Loop, ICmpInst::ICMP_EQ, Next,
+                               Func->arg_begin());
+    BranchInst::Create(Exit, Loop, Done, Loop);
+    Phi->addIncoming(ConstantInt::get(I32, 0), Entry);
+    Phi->addIncoming(Next, Loop);
+    ReturnInst::Create(Context, Next, Exit);
+  }
+  SmallString<1024> Mem;
+  raw_svector_ostream OS(Mem);
+  NaClWriteBitcodeToFile(Mod.get(), OS);
+  OS.flush();
+
+  LLVMContext ReadContext;
+  ErrorOr<Module *> ModuleOrErr =
+      NaClParseBitcodeFile(MemoryBufferRef(Mem.str(), "test"), ReadContext);
+  ASSERT_TRUE(bool(ModuleOrErr));
+  std::unique_ptr<Module> M(ModuleOrErr.get());
+  EXPECT_FALSE(verifyModule(*M, &errs()));
+  for (Module::iterator F = Mod->begin(), G = M->begin(), E = Mod->end();
+       F != E; ++F, ++G)
+    EXPECT_EQ(printFunction(*F), printFunction(*G));
+}
+
+// Reads Mem with NaClParseBitcodeFile, decoding function blocks on
+// NumThreads threads.
+static ErrorOr<Module *> parseWithDecodeThreads(StringRef Mem,
+                                                LLVMContext &Context,
+                                                unsigned NumThreads) {
+  cl::opt<unsigned> *DecodeThreads = static_cast<cl::opt<unsigned> *>(
+      cl::getRegisteredOptions()["bitcode-decode-threads"]);
+  if (DecodeThreads == nullptr) {
+    ADD_FAILURE() << "Option -bitcode-decode-threads is not registered";
+    return std::make_error_code(std::errc::invalid_argument);
+  }
+  unsigned OldNumThreads = *DecodeThreads;
+  *DecodeThreads = NumThreads;
+  ErrorOr<Module *> ModuleOrErr =
+      NaClParseBitcodeFile(MemoryBufferRef(Mem, "test"), Context);
+  *DecodeThreads = OldNumThreads;
+  return ModuleOrErr;
+}
+
+// Test that decoding function blocks on several threads reads the same
+// module.
+TEST(NaClBitReaderTest, ParallelDecode) {
+  std::unique_ptr<Module> Mod = makeLLVMModule();
+  nacltestmodules::addArithmeticFunctions(Mod.get(), 200, 50);
+  SmallString<1024> Mem;
+  raw_svector_ostream OS(Mem);
+  NaClWriteBitcodeToFile(Mod.get(), OS);
+  OS.flush();
+
+  LLVMContext SeqContext, ParContext;
+  ErrorOr<Module *> SeqOrErr = parseWithDecodeThreads(Mem, SeqContext, 1);
+  ErrorOr<Module *> ParOrErr = parseWithDecodeThreads(Mem, ParContext, 4);
+  ASSERT_TRUE(bool(SeqOrErr));
+  ASSERT_TRUE(bool(ParOrErr));
+  std::unique_ptr<Module> Seq(SeqOrErr.get()), Par(ParOrErr.get());
+  EXPECT_FALSE(verifyModule(*Par, &errs()));
+  ASSERT_EQ(Seq->size(), Par->size());
+  for (Module::iterator F = Seq->begin(), G = Par->begin(), E = Seq->end();
+       F != E; ++F, ++G)
+    EXPECT_EQ(printFunction(*F), printFunction(*G));
+}
+
+// Collects the output written to it, and records the size of the largest
+// write.
+class RecordingStream : public raw_pwrite_stream {
+public:
+  RecordingStream() : raw_pwrite_stream(/* Unbuffered = */ true) {}
+
+  std::string Data;
+  size_t MaxWriteSize = 0;
+
+  void pwrite(const char *Ptr, size_t Size, uint64_t Offset) override {
+    ASSERT_LE(Offset + Size, Data.size());
+    Data.replace(Offset, Size, Ptr, Size);
+  }
+
+private:
+  void write_impl(const char *Ptr, size_t Size) override {
+    Data.append(Ptr, Size);
+    MaxWriteSize = std::max(MaxWriteSize, Size);
+  }
+  uint64_t current_pos() const override { return Data.size(); }
+};
+
+// Test that writing a module a block at a time produces the same bitcode as
+// writing it all at once, while holding only one function block at a time.
+TEST(NaClBitReaderTest, StreamedWrite) {
+  LLVMContext Context;
+  std::unique_ptr<Module> Mod(new Module("test", Context));
+  nacltestmodules::addArithmeticFunctions(Mod.get(), 200, 50);
+  cl::opt<bool> *FunctionIndex = static_cast<cl::opt<bool> *>(
+      cl::getRegisteredOptions()["function-index"]);
+  ASSERT_TRUE(FunctionIndex != nullptr);
+  for (bool WithIndex : {false, true}) {
+    SmallString<1024> Expected;
+    writeModuleWithIndex(Mod.get(), WithIndex, Expected);
+
+    RecordingStream OS;
+    // Output need not start at the beginning of the stream.
+    OS << "prefix";
+    *FunctionIndex = WithIndex;
+    NaClWriteBitcodeToStream(Mod.get(), OS);
+    *FunctionIndex = false;
+    EXPECT_EQ("prefix" + Expected.str().str(), OS.Data);
+    EXPECT_LT(OS.MaxWriteSize * 20, Expected.size());
+  }
+}
+
+// Test that writing function blocks on several threads produces the same
+// bitcode as writing them on one, with and without a function index, and
+// when streaming.
+TEST(NaClBitReaderTest, ParallelWrite) {
+  cl::opt<unsigned> *WriteThreads = static_cast<cl::opt<unsigned> *>(
+      cl::getRegisteredOptions()["bitcode-write-threads"]);
+  cl::opt<bool> *FunctionIndex = static_cast<cl::opt<bool> *>(
+      cl::getRegisteredOptions()["function-index"]);
+  ASSERT_TRUE(WriteThreads != nullptr);
+  ASSERT_TRUE(FunctionIndex != nullptr);
+  unsigned OldNumThreads = *WriteThreads;
+  std::unique_ptr<Module> Mod = makeLLVMModule();
+  nacltestmodules::addArithmeticFunctions(Mod.get(), 300, 20);
+  for (bool WithIndex : {false, true}) {
+    SmallString<1024> Expected;
+    writeModuleWithIndex(Mod.get(), WithIndex, Expected);
+    for (unsigned NumThreads = 2; NumThreads <= 8; NumThreads *= 4) {
+      *WriteThreads = NumThreads;
+      SmallString<1024> Written;
+      writeModuleWithIndex(Mod.get(), WithIndex, Written);
+      EXPECT_EQ(Expected.str(), Written.str());
+
+      RecordingStream OS;
+      *FunctionIndex = WithIndex;
+      NaClWriteBitcodeToStream(Mod.get(), OS);
+      *FunctionIndex = false;
+      *WriteThreads = OldNumThreads;
+      EXPECT_EQ(Expected.str(), OS.Data);
+    }
+  }
+}
+
 // Test that we catch bad stuff at the end of a bitcode file.
 TEST(NaClBitReaderTest, BadDataAfterModule) {
   SmallString<1024> Mem;
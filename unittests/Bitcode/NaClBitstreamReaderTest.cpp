@@ -13,6 +13,7 @@
 // TODO(kschimpf) Add more Tests.
 
 #include "llvm/Bitcode/NaCl/NaClBitstreamReader.h"
+#include "llvm/Bitcode/NaCl/NaClBitstreamWriter.h"
 
 #include "gtest/gtest.h"
 
@@ -66,4 +67,262 @@ TEST(NaClBitstreamTest, CursorAtReaderInitialAddress) {
   EXPECT_EQ(InitialAddress * CHAR_BIT, Cursor->GetCurrentBitNo());
 }
 
+// A field of the test bitstream: a fixed-width value, or a VBR with the
+// given chunk size.
+struct TestField {
+  uint64_t Value;
+  unsigned NumBits;
+  bool IsVBR;
+};
+
+// Returns fields like those of function blocks: mostly small VBR6 operands,
+// with some large values, fixed-width fields, and other chunk sizes.
+static std::vector<TestField> makeTestFields(size_t NumFields) {
+  std::vector<TestField> Fields(NumFields);
+  uint64_t Seed = 12345;
+  for (size_t i = 0; i < NumFields; ++i) {
+    Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint64_t R = Seed >> 16;
+    TestField &Field = Fields[i];
+    Field.IsVBR = R % 8 != 0;
+    if (!Field.IsVBR) {
+      Field.NumBits = 1 + R % 32;
+      Field.Value = (R >> 8) & (~uint64_t(0) >> (64 - Field.NumBits));
+      continue;
+    }
+    Field.NumBits = R % 4 == 0 ? 2 + (R >> 4) % 31 : 6;
+    switch ((R >> 12) % 16) {
+    default:
+      Field.Value = (R >> 20) % 32;
+      break;
+    case 0: case 1: case 2:
+      Field.Value = (R >> 20) % 4096;
+      break;
+    case 3:
+      Field.Value = Seed;
+      break;
+    }
+  }
+  return Fields;
+}
+
+static void writeTestFields(const std::vector<TestField> &Fields,
+                            SmallVectorImpl<char> &Buffer) {
+  NaClBitstreamWriter Writer(Buffer);
+  for (const TestField &Field : Fields) {
+    if (Field.IsVBR)
+      Writer.EmitVBR64(Field.Value, Field.NumBits);
+    else
+      Writer.Emit(static_cast<uint32_t>(Field.Value), Field.NumBits);
+  }
+  Writer.FlushToWord();
+}
+
+// Reads the fields back, and returns the number of fields that match.
+static size_t readTestFields(NaClBitstreamReader &Reader,
+                             const std::vector<TestField> &Fields) {
+  NaClBitstreamCursor Cursor(Reader);
+  size_t NumMatches = 0;
+  for (const TestField &Field : Fields) {
+    uint64_t Value;
+    if (!Field.IsVBR)
+      Value = Cursor.Read(Field.NumBits);
+    else if (Field.NumBits % 2)
+      Value = Cursor.ReadVBR64(Field.NumBits);
+    else
+      Value = Cursor.ReadVBR(Field.NumBits);
+    uint64_t Expected = Field.Value;
+    if (Field.IsVBR && Field.NumBits % 2 == 0)
+      Expected = static_cast<uint32_t>(Expected);
+    NumMatches += Value == Expected;
+  }
+  return NumMatches;
+}
+
+// Tests that contiguous and streamed bytes decode to the same values.
+TEST(NaClBitstreamTest, DirectAndStreamedReadsMatch) {
+  std::vector<TestField> Fields = makeTestFields(100000);
+  SmallVector<char, 1024> Buffer;
+  writeTestFields(Fields, Buffer);
+  // End the stream with a partial word, which is read a byte at a time.
+  if (Buffer.size() % sizeof(size_t) == 0)
+    Buffer.append(4, char(0));
+  const unsigned char *Start =
+      reinterpret_cast<const unsigned char *>(Buffer.data());
+  const unsigned char *End = Start + Buffer.size();
+
+  NaClBitcodeHeader Header;
+  NaClBitstreamReader DirectReader(Start, End, Header);
+  EXPECT_EQ(Fields.size(), readTestFields(DirectReader, Fields));
+  NaClBitstreamReader StreamedReader(getNonStreamedMemoryObject(Start, End),
+                                     0);
+  EXPECT_EQ(Fields.size(), readTestFields(StreamedReader, Fields));
+
+  // The cursor reaches the end of the stream after the partial word.
+  NaClBitstreamCursor Cursor(DirectReader);
+  Cursor.JumpToBit((Buffer.size() - 4) * CHAR_BIT);
+  EXPECT_FALSE(Cursor.AtEndOfStream());
+  Cursor.Read(32);
+  EXPECT_TRUE(Cursor.AtEndOfStream());
+}
+
+// Returns abbreviations of the shapes readRecord has fast paths for (fixed
+// width operands, and fixed, char6, VBR and literal arrays), and of shapes
+// it does not.
+static std::vector<NaClBitCodeAbbrev *> makeTestAbbrevs() {
+  typedef NaClBitCodeAbbrevOp Op;
+  static const std::vector<std::vector<Op>> Shapes = {
+    {Op(5), Op(Op::Fixed, 3), Op(Op::VBR, 6), Op(Op::Char6)},
+    {Op(7), Op(Op::Fixed, 4), Op(Op::Char6), Op(Op::Fixed, 32),
+     Op(Op::Fixed, 32)},
+    {Op(Op::Fixed, 3), Op(Op::Fixed, 5), Op(Op::Array), Op(Op::Fixed, 8)},
+    {Op(1), Op(Op::Array), Op(Op::Char6)},
+    {Op(Op::Array), Op(Op::VBR, 6)},
+    {Op(Op::Array), Op(Op::Fixed, 7)},
+    {Op(2), Op(Op::Array), Op(9)},
+    {Op(3), Op(Op::VBR, 8), Op(Op::Array), Op(Op::Fixed, 32)},
+    {Op(Op::Fixed, 4), Op(Op::Array), Op(Op::VBR, 4)},
+  };
+  std::vector<NaClBitCodeAbbrev *> Abbrevs;
+  for (const std::vector<Op> &Shape : Shapes) {
+    NaClBitCodeAbbrev *Abbrev = new NaClBitCodeAbbrev();
+    for (const Op &Operand : Shape)
+      Abbrev->Add(Operand);
+    Abbrevs.push_back(Abbrev);
+  }
+  return Abbrevs;
+}
+
+// A record of the test block. Abbrev is the index of its abbreviation in
+// makeTestAbbrevs(), or the number of abbreviations if it is unabbreviated.
+struct TestRecord {
+  unsigned Abbrev;
+  unsigned Code;
+  SmallVector<uint64_t, 16> Values;
+};
+
+// Returns a value for an operand encoded as Operand. Values that may be the
+// record code fit in 32 bits.
+static uint64_t makeTestValue(const NaClBitCodeAbbrevOp &Operand,
+                              uint64_t R, bool IsCode) {
+  switch (Operand.getEncoding()) {
+  case NaClBitCodeAbbrevOp::Literal:
+    return Operand.getValue();
+  case NaClBitCodeAbbrevOp::Fixed:
+    return R & (~uint64_t(0) >> (64 - Operand.getValue()));
+  case NaClBitCodeAbbrevOp::Char6:
+    return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._"
+        [R % 64];
+  default:
+    if (R % 16 == 0)
+      return IsCode ? static_cast<uint32_t>(R) : R;
+    return R % 64;
+  }
+}
+
+// Returns records written with each of the test abbreviations, and some
+// unabbreviated ones.
+static std::vector<TestRecord> makeTestRecords(size_t NumRecords) {
+  std::vector<NaClBitCodeAbbrev *> Abbrevs = makeTestAbbrevs();
+  std::vector<TestRecord> Records(NumRecords);
+  uint64_t Seed = 12345;
+  auto Next = [&Seed]() {
+    Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return Seed >> 16;
+  };
+  for (TestRecord &Record : Records) {
+    Record.Abbrev = Next() % (Abbrevs.size() + 1);
+    SmallVector<uint64_t, 16> Values;
+    if (Record.Abbrev == Abbrevs.size()) {
+      for (size_t i = 0, e = 1 + Next() % 8; i < e; ++i)
+        Values.push_back(Next() % 1000);
+    } else {
+      const NaClBitCodeAbbrev *Abbrev = Abbrevs[Record.Abbrev];
+      for (unsigned i = 0; i < Abbrev->getNumOperandInfos(); ++i) {
+        const NaClBitCodeAbbrevOp &Operand = Abbrev->getOperandInfo(i);
+        if (!Operand.isArrayOp()) {
+          Values.push_back(makeTestValue(Operand, Next(), Values.empty()));
+          continue;
+        }
+        // Sizes span several words of fixed width elements, and the code
+        // must be there if it is the first element.
+        const NaClBitCodeAbbrevOp &Element = Abbrev->getOperandInfo(++i);
+        for (size_t j = 0, e = (Values.empty() ? 1 : 0) + Next() % 40; j < e;
+             ++j)
+          Values.push_back(makeTestValue(Element, Next(), Values.empty()));
+      }
+    }
+    Record.Code = Values[0];
+    Record.Values.append(Values.begin() + 1, Values.end());
+  }
+  for (NaClBitCodeAbbrev *Abbrev : Abbrevs)
+    Abbrev->dropRef();
+  return Records;
+}
+
+const unsigned TestBlockID = 20;
+
+static void writeTestRecords(const std::vector<TestRecord> &Records,
+                             SmallVectorImpl<char> &Buffer) {
+  NaClBitstreamWriter Writer(Buffer);
+  std::vector<NaClBitCodeAbbrev *> Abbrevs = makeTestAbbrevs();
+  Writer.EnterSubblock(TestBlockID,
+                       naclbitc::FIRST_APPLICATION_ABBREV + Abbrevs.size());
+  std::vector<unsigned> AbbrevIDs;
+  for (NaClBitCodeAbbrev *Abbrev : Abbrevs)
+    AbbrevIDs.push_back(Writer.EmitAbbrev(Abbrev));
+  AbbrevIDs.push_back(0);
+  for (const TestRecord &Record : Records)
+    Writer.EmitRecord(Record.Code, Record.Values, AbbrevIDs[Record.Abbrev]);
+  Writer.ExitBlock();
+}
+
+// Reads the records back with readRecord, or skips them if Skip, and
+// returns the number of records that match.
+static size_t readTestRecords(NaClBitstreamReader &Reader,
+                              const std::vector<TestRecord> &Records,
+                              bool Skip) {
+  NaClBitstreamCursor Cursor(Reader);
+  NaClBitstreamEntry Entry = Cursor.advance(0, nullptr);
+  if (Entry.Kind != NaClBitstreamEntry::SubBlock ||
+      Cursor.EnterSubBlock(TestBlockID))
+    return 0;
+  size_t NumMatches = 0;
+  SmallVector<uint64_t, 16> Values;
+  for (const TestRecord &Record : Records) {
+    Entry = Cursor.advance(0, nullptr);
+    if (Entry.Kind != NaClBitstreamEntry::Record)
+      return NumMatches;
+    if (Skip) {
+      Cursor.skipRecord(Entry.ID);
+      ++NumMatches;
+      continue;
+    }
+    Values.clear();
+    unsigned Code = Cursor.readRecord(Entry.ID, Values);
+    NumMatches += Code == Record.Code && Values == Record.Values;
+  }
+  // All records must have been read exactly.
+  Entry = Cursor.advance(0, nullptr);
+  if (Entry.Kind != NaClBitstreamEntry::EndBlock)
+    return 0;
+  return NumMatches;
+}
+
+// Tests that records read and skipped with each shape of abbreviation are
+// decoded as written.
+TEST(NaClBitstreamTest, AbbreviatedRecordsMatch) {
+  std::vector<TestRecord> Records = makeTestRecords(20000);
+  SmallVector<char, 1024> Buffer;
+  writeTestRecords(Records, Buffer);
+  const unsigned char *Start =
+      reinterpret_cast<const unsigned char *>(Buffer.data());
+  const unsigned char *End = Start + Buffer.size();
+
+  NaClBitcodeHeader Header;
+  NaClBitstreamReader Reader(Start, End, Header);
+  EXPECT_EQ(Records.size(), readTestRecords(Reader, Records, false));
+  EXPECT_EQ(Records.size(), readTestRecords(Reader, Records, true));
+}
+
 } // end of anonymous namespace
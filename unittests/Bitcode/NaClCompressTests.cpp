@@ -9,13 +9,176 @@
 //===----------------------------------------------------------------------===//
 
 #include "NaClMungeTest.h"
+#include "NaClTestModules.h"
 
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/NaCl/NaClCompress.h"
 #include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
 
 using namespace llvm;
+using namespace nacltestmodules;
 
 namespace naclmungetest {
 
+// Compresses Input into Output, using Flags. Returns true if
+// successful.
+static bool compressWithFlags(
+    StringRef Input, SmallVectorImpl<char> &Output,
+    const NaClBitcodeCompressor::CompressFlags &Flags) {
+  std::unique_ptr<MemoryBuffer> Buffer =
+      MemoryBuffer::getMemBuffer(Input, "test", false);
+  NaClBitcodeCompressor Compressor;
+  Compressor.Flags = Flags;
+  raw_svector_ostream OS(Output);
+  std::string ShowBuffer;
+  raw_string_ostream ShowOutput(ShowBuffer);
+  bool Result = Compressor.compress(Buffer.get(), OS, ShowOutput);
+  OS.flush();
+  return Result;
+}
+
+// Compresses Input into Output, with NumThreads threads. Returns true
+// if successful.
+static bool compressWithThreads(StringRef Input, SmallVectorImpl<char> &Output,
+                                unsigned NumThreads) {
+  NaClBitcodeCompressor::CompressFlags Flags;
+  Flags.NumThreads = NumThreads;
+  return compressWithFlags(Input, Output, Flags);
+}
+
+// Test that compressing function blocks on several threads gives the
+// same bitcode as compressing on one thread, both for bitcode without
+// blockinfo abbreviations, and for the compressed bitcode, which has
+// them.
+TEST(NaClCompressTests, ParallelCompress) {
+  SmallString<1024> Input;
+  writeArithmeticModule(Input, 100, 30);
+  for (unsigned Round = 0; Round < 2; ++Round) {
+    SmallString<1024> Expected;
+    ASSERT_TRUE(compressWithThreads(Input, Expected, 1));
+    for (unsigned NumThreads = 2; NumThreads <= 5; ++NumThreads) {
+      SmallString<1024> Output;
+      ASSERT_TRUE(compressWithThreads(Input, Output, NumThreads));
+      EXPECT_EQ(Expected.str(), Output.str());
+    }
+    Input = Expected;
+  }
+}
+
+// Test that function blocks defining (local) abbreviations, which are
+// analyzed in order, also compress the same on several threads.
+TEST(NaClCompressTests, ParallelCompressLocalAbbrevs) {
+  const uint64_t BitcodeRecords[] = {
+    1, naclbitc::BLK_CODE_ENTER, naclbitc::MODULE_BLOCK_ID, 2, Terminator,
+    3, naclbitc::MODULE_CODE_VERSION, 1, Terminator,
+    1, naclbitc::BLK_CODE_ENTER, naclbitc::FUNCTION_BLOCK_ID, 2, Terminator,
+    3, naclbitc::FUNC_CODE_DECLAREBLOCKS, 1, Terminator,
+    3, naclbitc::FUNC_CODE_INST_RET, Terminator,
+    0, naclbitc::BLK_CODE_EXIT, Terminator,
+    1, naclbitc::BLK_CODE_ENTER, naclbitc::FUNCTION_BLOCK_ID, 3, Terminator,
+    2, naclbitc::BLK_CODE_DEFINE_ABBREV, 3,
+       1, naclbitc::FUNC_CODE_INST_BINOP,
+       0, NaClBitCodeAbbrevOp::Array,
+       0, NaClBitCodeAbbrevOp::VBR, 6,
+       Terminator,
+    3, naclbitc::FUNC_CODE_DECLAREBLOCKS, 1, Terminator,
+    4, naclbitc::FUNC_CODE_INST_BINOP, 1, 1, 0, Terminator,
+    4, naclbitc::FUNC_CODE_INST_BINOP, 2, 1, 0, Terminator,
+    3, naclbitc::FUNC_CODE_INST_RET, 1, Terminator,
+    0, naclbitc::BLK_CODE_EXIT, Terminator,
+    1, naclbitc::BLK_CODE_ENTER, naclbitc::FUNCTION_BLOCK_ID, 2, Terminator,
+    3, naclbitc::FUNC_CODE_DECLAREBLOCKS, 1, Terminator,
+    3, naclbitc::FUNC_CODE_INST_BINOP, 1, 1, 0, Terminator,
+    3, naclbitc::FUNC_CODE_INST_RET, 1, Terminator,
+    0, naclbitc::BLK_CODE_EXIT, Terminator,
+    0, naclbitc::BLK_CODE_EXIT, Terminator,
+  };
+  NaClMungedBitcode Bitcode(ARRAY_TERM(BitcodeRecords));
+  SmallString<1024> Input;
+  ASSERT_TRUE(Bitcode.write(Input, /* AddHeader = */ true));
+  SmallString<1024> Expected;
+  ASSERT_TRUE(compressWithThreads(Input, Expected, 1));
+  for (unsigned NumThreads = 2; NumThreads <= 3; ++NumThreads) {
+    SmallString<1024> Output;
+    ASSERT_TRUE(compressWithThreads(Input, Output, NumThreads));
+    EXPECT_EQ(Expected.str(), Output.str());
+  }
+}
+
+// Test that synthesized abbreviations make the compressed bitcode
+// smaller, without changing its records, and that the result does not
+// depend on the number of threads.
+TEST(NaClCompressTests, SynthesizeAbbreviations) {
+  SmallString<1024> Input;
+  writeArithmeticModule(Input, 100, 30);
+  NaClBitcodeCompressor::CompressFlags Flags;
+  SmallString<1024> Compressed;
+  ASSERT_TRUE(compressWithFlags(Input, Compressed, Flags));
+  Flags.SynthesizeAbbreviations = true;
+  SmallString<1024> Synthesized;
+  ASSERT_TRUE(compressWithFlags(Input, Synthesized, Flags));
+  EXPECT_LT(Synthesized.size(), Compressed.size());
+  Flags.NumThreads = 3;
+  SmallString<1024> Output;
+  ASSERT_TRUE(compressWithFlags(Input, Output, Flags));
+  EXPECT_EQ(Synthesized.str(), Output.str());
+
+  // Both hold the same records.
+  NaClBitcodeCompressor::CompressFlags RemoveFlags;
+  RemoveFlags.RemoveAbbreviations = true;
+  SmallString<1024> Expected;
+  ASSERT_TRUE(compressWithFlags(Compressed, Expected, RemoveFlags));
+  Output.clear();
+  ASSERT_TRUE(compressWithFlags(Synthesized, Output, RemoveFlags));
+  EXPECT_EQ(Expected.str(), Output.str());
+}
+
+// Test that the size of a value in a VBR field is computed from all
+// of its bits. The value 64 needs two chunks of VBR(6), so a record
+// holding it is smaller with abbreviation <1, fixed(7)> than with
+// abbreviation <1, vbr(6)>.
+TEST(NaClCompressTests, VBRSizeOfValue) {
+  const uint64_t BitcodeRecords[] = {
+    1, naclbitc::BLK_CODE_ENTER, naclbitc::MODULE_BLOCK_ID, 3, Terminator,
+    2, naclbitc::BLK_CODE_DEFINE_ABBREV, 2,
+       1, naclbitc::MODULE_CODE_VERSION,
+       0, NaClBitCodeAbbrevOp::VBR, 6,
+       Terminator,
+    2, naclbitc::BLK_CODE_DEFINE_ABBREV, 2,
+       1, naclbitc::MODULE_CODE_VERSION,
+       0, NaClBitCodeAbbrevOp::Fixed, 7,
+       Terminator,
+    4, naclbitc::MODULE_CODE_VERSION, 64, Terminator,
+    4, naclbitc::MODULE_CODE_VERSION, 64, Terminator,
+    4, naclbitc::MODULE_CODE_VERSION, 64, Terminator,
+    4, naclbitc::MODULE_CODE_VERSION, 64, Terminator,
+    4, naclbitc::MODULE_CODE_VERSION, 64, Terminator,
+    0, naclbitc::BLK_CODE_EXIT, Terminator,
+  };
+  NaClMungedBitcode Bitcode(ARRAY_TERM(BitcodeRecords));
+  SmallString<1024> Input;
+  ASSERT_TRUE(Bitcode.write(Input, /* AddHeader = */ true));
+  SmallString<1024> Output;
+  ASSERT_TRUE(compressWithThreads(Input, Output, 1));
+  NaClMungedBitcode Compressed(
+      MemoryBuffer::getMemBufferCopy(Output.str(), "compressed"));
+  std::string Records;
+  raw_string_ostream RecordsStream(Records);
+  Compressed.print(RecordsStream);
+  EXPECT_EQ(
+      "       1: [65535, 8, 3]\n"
+      "         2: [65533, 2, 1, 1, 0, 1, 7]\n"
+      "         1: [65535, 0, 2]\n"
+      "         0: [65534]\n"
+      "         4: [1, 64]\n"
+      "         4: [1, 64]\n"
+      "         4: [1, 64]\n"
+      "         4: [1, 64]\n"
+      "         4: [1, 64]\n"
+      "       0: [65534]\n",
+      RecordsStream.str());
+}
+
 // Note: Tests fix for bug in
 // https://code.google.com/p/nativeclient/issues/detail?id=4104
 TEST(NaClCompressTests, FixedModuleAbbrevIdBug) {
@@ -0,0 +1,67 @@
+//===- llvm/unittest/Bitcode/NaClObjDumpThreadsTest.cpp -------------------===//
+//     Tests disassembling function blocks of PNaCl bitcode on threads.
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "NaClTestModules.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "gtest/gtest.h"
+
+using namespace llvm;
+using namespace nacltestmodules;
+
+namespace {
+
+// Disassembles Input into Output, with NumThreads threads. Returns
+// true if errors were found.
+static bool objDump(StringRef Input, std::string &Output,
+                    unsigned NumThreads) {
+  std::unique_ptr<MemoryBuffer> Buffer =
+      MemoryBuffer::getMemBuffer(Input, "test", false);
+  raw_string_ostream OS(Output);
+  bool Result = NaClObjDump(Buffer->getMemBufferRef(), OS, false, false,
+                            NumThreads);
+  OS.flush();
+  return Result;
+}
+
+// Test that disassembling function blocks on several threads gives
+// the same text as disassembling on one thread.
+TEST(NaClObjDumpThreadsTest, ParallelObjDump) {
+  SmallString<1024> Input;
+  writeArithmeticModule(Input, 100, 20);
+  std::string Expected;
+  EXPECT_FALSE(objDump(Input, Expected, 1));
+  for (unsigned NumThreads = 2; NumThreads <= 5; ++NumThreads) {
+    std::string Output;
+    EXPECT_FALSE(objDump(Input, Output, NumThreads));
+    EXPECT_EQ(Expected, Output);
+  }
+}
+
+// Test that function blocks with errors, which are disassembled again
+// in order, give the same text and errors on several threads.
+TEST(NaClObjDumpThreadsTest, ParallelObjDumpErrors) {
+  SmallString<1024> Input;
+  writeArithmeticModule(Input, 60, 10, AddOps, 15);
+  std::string Expected;
+  EXPECT_TRUE(objDump(Input, Expected, 1));
+  EXPECT_NE(std::string::npos, Expected.find("Invalid type signature"));
+  for (unsigned NumThreads = 2; NumThreads <= 5; ++NumThreads) {
+    std::string Output;
+    EXPECT_TRUE(objDump(Input, Output, NumThreads));
+    EXPECT_EQ(Expected, Output);
+  }
+}
+
+} // end of anonymous namespace
@@ -0,0 +1,100 @@
+//===- llvm/unittest/Bitcode/NaClTestModules.h - Test modules -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Contains generators of modules with many function blocks, used to
+// test reading, writing, and analyzing PNaCl bitcode.
+
+#ifndef LLVM_UNITTEST_BITCODE_NACLTESTMODULES_H
+#define LLVM_UNITTEST_BITCODE_NACLTESTMODULES_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+
+namespace nacltestmodules {
+
+/// The instructions in the functions built by addArithmeticFunctions.
+enum ArithmeticOps {
+  /// Only adds.
+  AddOps,
+  /// Adds, xors, compares with selects, and shifts, in turn.
+  MixedOps
+};
+
+/// Adds NumFunctions functions to Mod, each with a body of about
+/// InstsPerFunction instructions that use function-level constants.
+/// If BadFunction is nonzero, every BadFunction-th function takes an
+/// i1 argument, whose type signature PNaCl bitcode doesn't allow.
+inline void addArithmeticFunctions(llvm::Module *Mod, unsigned NumFunctions,
+                                   unsigned InstsPerFunction,
+                                   ArithmeticOps Ops = AddOps,
+                                   unsigned BadFunction = 0) {
+  using namespace llvm;
+  LLVMContext &Context = Mod->getContext();
+  Type *I32 = Type::getInt32Ty(Context);
+  FunctionType *FuncTy = FunctionType::get(I32, I32, false);
+  FunctionType *BadFuncTy =
+      FunctionType::get(I32, Type::getInt1Ty(Context), false);
+  for (unsigned i = 0; i < NumFunctions; ++i) {
+    bool IsBad = BadFunction && i % BadFunction == BadFunction - 1;
+    Function *Func = Function::Create(IsBad ? BadFuncTy : FuncTy,
+                                      GlobalValue::InternalLinkage,
+                                      "f" + std::to_string(i), Mod);
+    BasicBlock *Entry = BasicBlock::Create(Context, "entry", Func);
+    Value *Sum = Func->arg_begin();
+    if (IsBad)
+      Sum = ConstantInt::get(I32, i);
+    for (unsigned j = 0; j < InstsPerFunction; ++j) {
+      Value *Const = ConstantInt::get(I32, i + j);
+      switch (Ops == AddOps ? 0 : j % 4) {
+      case 0:
+        Sum = BinaryOperator::CreateAdd(Sum, Const, "", Entry);
+        break;
+      case 1:
+        Sum = BinaryOperator::CreateXor(Sum, Const, "", Entry);
+        break;
+      case 2:
+        Sum = SelectInst::Create(
+            new ICmpInst(*Entry, ICmpInst::ICMP_ULT, Sum, Const), Sum,
+            Const, "", Entry);
+        break;
+      case 3:
+        Sum = BinaryOperator::CreateShl(Sum, Const, "", Entry);
+        break;
+      }
+    }
+    ReturnInst::Create(Context, Sum, Entry);
+  }
+}
+
+/// Writes a module with the functions added by addArithmeticFunctions
+/// to Mem, as PNaCl bitcode.
+inline void writeArithmeticModule(llvm::SmallVectorImpl<char> &Mem,
+                                  unsigned NumFunctions,
+                                  unsigned InstsPerFunction,
+                                  ArithmeticOps Ops = AddOps,
+                                  unsigned BadFunction = 0) {
+  llvm::LLVMContext Context;
+  llvm::Module Mod("arithmetic", Context);
+  addArithmeticFunctions(&Mod, NumFunctions, InstsPerFunction, Ops,
+                         BadFunction);
+  llvm::raw_svector_ostream OS(Mem);
+  llvm::NaClWriteBitcodeToFile(&Mod, OS);
+  OS.flush();
+}
+
+} // end of namespace nacltestmodules
+
+#endif // end LLVM_UNITTEST_BITCODE_NACLTESTMODULES_H
@@ -0,0 +1,118 @@
+//===- llvm/unittest/Bitcode/NaClWindowedStreamingMemoryObjectTest.cpp ----===//
+//     Tests reading a stream through a window of its most recent bytes.
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Bitcode/NaCl/NaClWindowedStreamingMemoryObject.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+// Returns the byte at Address of the streams below.
+static uint8_t byteAt(uint64_t Address) {
+  return static_cast<uint8_t>(Address % 251);
+}
+
+// Streams Size bytes, byteAt(0), byteAt(1), ..., returning at most
+// MaxRead bytes per call.
+class PatternDataStreamer : public DataStreamer {
+public:
+  PatternDataStreamer(uint64_t Size, size_t MaxRead)
+      : Size(Size), MaxRead(MaxRead), Pos(0) {}
+
+  size_t GetBytes(unsigned char *Buf, size_t Len) override {
+    size_t Count = std::min<uint64_t>(std::min(Len, MaxRead), Size - Pos);
+    for (size_t i = 0; i < Count; ++i)
+      Buf[i] = byteAt(Pos++);
+    return Count;
+  }
+
+private:
+  uint64_t Size;
+  size_t MaxRead;
+  uint64_t Pos;
+};
+
+// Reads all Size bytes of Bytes, in order, Step bytes at a time, and checks
+// that the window never holds more than WindowSize + ChunkSize bytes.
+static void readInOrder(NaClWindowedStreamingMemoryObject &Bytes,
+                        uint64_t Size, size_t Step, size_t WindowSize,
+                        size_t ChunkSize) {
+  std::vector<uint8_t> Buf(Step);
+  for (uint64_t Address = 0; Address < Size; Address += Step) {
+    uint64_t Expected = std::min<uint64_t>(Step, Size - Address);
+    ASSERT_EQ(Expected, Bytes.readBytes(Buf.data(), Step, Address));
+    for (size_t i = 0; i < Expected; ++i)
+      ASSERT_EQ(byteAt(Address + i), Buf[i]) << "at " << (Address + i);
+    ASSERT_LE(Bytes.getNumBytesRead() - Bytes.getWindowStart(),
+              WindowSize + ChunkSize);
+  }
+}
+
+// Tests reading a stream much bigger than the window, with reads from the
+// streamer that end in the middle of chunks, so that the bytes kept are
+// moved to the front of the window at unaligned offsets.
+TEST(NaClWindowedStreamingMemoryObjectTest, SmallWindow) {
+  const uint64_t Size = 1001;
+  const size_t WindowSize = 64;
+  const size_t ChunkSize = 16;
+  NaClWindowedStreamingMemoryObject Bytes(
+      new PatternDataStreamer(Size, 7), WindowSize, ChunkSize);
+  readInOrder(Bytes, Size, 4, WindowSize, ChunkSize);
+  EXPECT_LT(Size - WindowSize - ChunkSize, Bytes.getWindowStart());
+
+  // The last WindowSize bytes read can still be read again.
+  uint64_t Oldest = Bytes.getNumBytesRead() - WindowSize;
+  uint8_t Buf[4];
+  ASSERT_EQ(4u, Bytes.readBytes(Buf, 4, Oldest));
+  EXPECT_EQ(byteAt(Oldest), Buf[0]);
+  EXPECT_EQ(byteAt(Oldest + 3), Buf[3]);
+
+  EXPECT_EQ(Size, Bytes.getExtent());
+  EXPECT_EQ(0u, Bytes.readBytes(Buf, 4, Size));
+  EXPECT_TRUE(Bytes.isValidAddress(Size - 1));
+  EXPECT_FALSE(Bytes.isValidAddress(Size));
+}
+
+// Tests reading a stream bigger than the default window, as
+// pnacl-bcanalyzer -stream does.
+TEST(NaClWindowedStreamingMemoryObjectTest, DefaultWindow) {
+  const size_t WindowSize =
+      NaClWindowedStreamingMemoryObject::DefaultWindowSize;
+  const size_t ChunkSize =
+      NaClWindowedStreamingMemoryObject::DefaultChunkSize;
+  const uint64_t Size = 3 * WindowSize + 5;
+  NaClWindowedStreamingMemoryObject Bytes(
+      new PatternDataStreamer(Size, ChunkSize - 3));
+  readInOrder(Bytes, Size, 64, WindowSize, ChunkSize);
+  EXPECT_LT(Size - WindowSize - ChunkSize, Bytes.getWindowStart());
+  EXPECT_EQ(Size, Bytes.getExtent());
+}
+
+#ifdef GTEST_HAS_DEATH_TEST
+// Tests that reading a byte that has been dropped from the window is a
+// fatal error, rather than reading stale bytes.
+TEST(NaClWindowedStreamingMemoryObjectTest, DieOnReadBeforeWindow) {
+  const uint64_t Size = 1001;
+  NaClWindowedStreamingMemoryObject Bytes(
+      new PatternDataStreamer(Size, 7), 64, 16);
+  uint8_t Buf[4];
+  ASSERT_EQ(4u, Bytes.readBytes(Buf, 4, 500));
+  ASSERT_LT(0u, Bytes.getWindowStart());
+  EXPECT_DEATH(Bytes.readBytes(Buf, 4, Bytes.getWindowStart() - 1),
+               "Bitcode read before the streamed window");
+}
+#endif // GTEST_HAS_DEATH_TEST
+
+} // end of anonymous namespace
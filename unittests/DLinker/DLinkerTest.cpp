@@ -0,0 +1,359 @@
+//===- llvm/unittest/DLinker/DLinkerTest.cpp - DLinker tests --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/DLinker/DLinker.h"
+#include "llvm/DLinker/ExportIndex.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "gtest/gtest.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+// Builds modules in the flattened form that DLinker reads: the PSO root is a
+// packed struct of i32 ptrtoint fields pointing at the import table, the
+// import function table, and the export table. With Pooled set, the names
+// are packed into one string table, as PNaClPsoRoot emits them.
+class PsoBuilder {
+public:
+  explicit PsoBuilder(LLVMContext &Ctx, bool Pooled = false)
+      : Ctx(Ctx), I32(Type::getInt32Ty(Ctx)), Pooled(Pooled) {}
+
+  Constant *getString(Module &M, StringRef Str) {
+    Constant *Init = ConstantDataArray::getString(Ctx, Str, true);
+    GlobalVariable *GV =
+        new GlobalVariable(M, Init->getType(), true,
+                           GlobalValue::InternalLinkage, Init, "");
+    return ConstantExpr::getPtrToInt(GV, I32);
+  }
+
+  std::vector<Constant *> getStrings(Module &M, ArrayRef<std::string> Strs) {
+    std::vector<Constant *> Ptrs;
+    if (!Pooled) {
+      for (const std::string &Str : Strs)
+        Ptrs.push_back(getString(M, Str));
+      return Ptrs;
+    }
+    std::string Pool;
+    std::vector<unsigned> Offsets;
+    for (const std::string &Str : Strs) {
+      Offsets.push_back(Pool.size());
+      Pool += Str;
+      Pool.push_back('\0');
+    }
+    Constant *Base = getString(M, StringRef(Pool.data(), Pool.size() - 1));
+    for (unsigned Offset : Offsets)
+      Ptrs.push_back(Offset ? ConstantExpr::getAdd(
+                                  Base, ConstantInt::get(I32, Offset))
+                            : Base);
+    return Ptrs;
+  }
+
+  Constant *getTable(Module &M, ArrayRef<Constant *> Fields) {
+    Constant *Init = ConstantStruct::getAnon(Ctx, Fields, true);
+    GlobalVariable *GV =
+        new GlobalVariable(M, Init->getType(), true,
+                           GlobalValue::InternalLinkage, Init, "");
+    return ConstantExpr::getPtrToInt(GV, I32);
+  }
+
+  void addPsoRoot(Module &M, Constant *Imports, Constant *Exports) {
+    Constant *Fields[] = {Imports, ConstantInt::get(I32, 0), Exports};
+    Constant *Init = ConstantStruct::getAnon(Ctx, Fields, true);
+    new GlobalVariable(M, Init->getType(), false, GlobalValue::ExternalLinkage,
+                       Init, "__pnacl_pso_root");
+  }
+
+  // A root that imports every name in Names.
+  std::unique_ptr<Module> createRoot(ArrayRef<std::string> Names) {
+    std::unique_ptr<Module> M(new Module("root", Ctx));
+    FunctionType *FTy = FunctionType::get(Type::getVoidTy(Ctx), false);
+    Type *LibTy = ArrayType::get(Type::getInt8Ty(Ctx), 1);
+    GlobalVariable *Lib =
+        new GlobalVariable(*M, LibTy, false, GlobalValue::InternalLinkage,
+                           ConstantAggregateZero::get(LibTy), "");
+    Constant *LibPtr = ConstantExpr::getPtrToInt(Lib, I32);
+    std::vector<Constant *> NamePtrs = getStrings(*M, Names);
+    std::vector<Constant *> Imports;
+    for (unsigned i = 0; i < Names.size(); ++i) {
+      Function::Create(FTy, GlobalValue::ExternalLinkage, Names[i], M.get());
+      Imports.push_back(NamePtrs[i]);
+      Imports.push_back(LibPtr);
+    }
+    addPsoRoot(*M, getTable(*M, Imports), ConstantInt::get(I32, 0));
+    return M;
+  }
+
+  // A PSO that defines and exports every name in Names.
+  std::unique_ptr<Module> createPso(StringRef ID, ArrayRef<std::string> Names) {
+    std::unique_ptr<Module> M(new Module(ID, Ctx));
+    FunctionType *FTy = FunctionType::get(Type::getVoidTy(Ctx), false);
+    std::vector<Constant *> NamePtrs = getStrings(*M, Names);
+    std::vector<Constant *> Exports;
+    for (unsigned i = 0; i < Names.size(); ++i) {
+      Function *F = Function::Create(FTy, GlobalValue::ExternalLinkage,
+                                     Names[i], M.get());
+      ReturnInst::Create(Ctx, BasicBlock::Create(Ctx, "entry", F));
+      Exports.push_back(NamePtrs[i]);
+      Exports.push_back(ConstantExpr::getPtrToInt(F, I32));
+    }
+    addPsoRoot(*M, ConstantInt::get(I32, 0), getTable(*M, Exports));
+    return M;
+  }
+
+private:
+  LLVMContext &Ctx;
+  IntegerType *I32;
+  bool Pooled;
+};
+
+void ignoreDiagnostics(const DiagnosticInfo &) {}
+
+// Returns the global that the library field Field points into, and the
+// offset of the library name in it.
+GlobalVariable *getLibraryGlobal(Constant *Field, uint64_t &Offset) {
+  ConstantExpr *CE = cast<ConstantExpr>(Field);
+  Offset = 0;
+  if (CE->getOpcode() == Instruction::Add) {
+    Offset = cast<ConstantInt>(CE->getOperand(1))->getZExtValue();
+    CE = cast<ConstantExpr>(CE->getOperand(0));
+  }
+  return cast<GlobalVariable>(CE->getOperand(0));
+}
+
+// Returns the library field of each import of Root.
+std::vector<Constant *> getImportLibraryFields(Module &Root) {
+  std::vector<Constant *> Fields;
+  GlobalVariable *PsoRoot = Root.getNamedGlobal("__pnacl_pso_root");
+  ConstantStruct *RootCS = cast<ConstantStruct>(PsoRoot->getInitializer());
+  ConstantExpr *ImportsCE = cast<ConstantExpr>(RootCS->getOperand(0));
+  GlobalVariable *ImportsGV = cast<GlobalVariable>(ImportsCE->getOperand(0));
+  ConstantStruct *Imports = cast<ConstantStruct>(ImportsGV->getInitializer());
+  for (unsigned i = 1; i < Imports->getNumOperands(); i += 2)
+    Fields.push_back(Imports->getOperand(i));
+  return Fields;
+}
+
+// Returns the name of the library that resolved each import of Root.
+std::vector<std::string> getImportLibraries(Module &Root) {
+  std::vector<std::string> Libraries;
+  for (Constant *Field : getImportLibraryFields(Root)) {
+    uint64_t Offset;
+    GlobalVariable *LibGV = getLibraryGlobal(Field, Offset);
+    ConstantDataArray *Lib =
+        dyn_cast<ConstantDataArray>(LibGV->getInitializer());
+    if (!Lib || !Lib->isString()) {
+      Libraries.push_back("");
+      continue;
+    }
+    StringRef Data = Lib->getAsString().substr(Offset);
+    Libraries.push_back(Data.substr(0, Data.find('\0')));
+  }
+  return Libraries;
+}
+
+TEST(DLinkerTest, ResolvesImportsAcrossPsos) {
+  LLVMContext Ctx;
+  PsoBuilder Builder(Ctx);
+  std::vector<std::string> Imports = {"foo", "bar", "baz"};
+  std::unique_ptr<Module> Root = Builder.createRoot(Imports);
+  DLinker Linker(Root.get(), Ctx, ignoreDiagnostics);
+
+  std::vector<std::string> Pso1Exports = {"baz", "unused", "foo"};
+  std::vector<std::string> Pso2Exports = {"bar"};
+  std::unique_ptr<Module> Pso1 = Builder.createPso("libone.pso", Pso1Exports);
+  std::unique_ptr<Module> Pso2 = Builder.createPso("libtwo.pso", Pso2Exports);
+  Linker.linkPsoRoot(Pso1.get());
+  Linker.linkPsoRoot(Pso2.get());
+
+  std::vector<std::string> Libraries = getImportLibraries(*Root);
+  ASSERT_EQ(3u, Libraries.size());
+  EXPECT_EQ("libone.pso", Libraries[0]);
+  EXPECT_EQ("libtwo.pso", Libraries[1]);
+  EXPECT_EQ("libone.pso", Libraries[2]);
+}
+
+// Links a root with many imports against dozens of PSOs. Resolution is a hash
+// lookup per export, so this stays fast as the symbol count grows.
+TEST(DLinkerTest, ManyImportsAcrossManyPsos) {
+  const unsigned NumPsos = 40;
+  const unsigned NumPerPso = 256;
+
+  LLVMContext Ctx;
+  PsoBuilder Builder(Ctx);
+  std::vector<std::string> Imports;
+  std::vector<std::unique_ptr<Module>> Psos;
+  for (unsigned P = 0; P < NumPsos; ++P) {
+    std::vector<std::string> Exports;
+    for (unsigned i = 0; i < NumPerPso; ++i) {
+      std::string Name = "f" + std::to_string(P) + "_" + std::to_string(i);
+      Exports.push_back(Name);
+      Imports.push_back(Name);
+    }
+    Psos.push_back(Builder.createPso("lib" + std::to_string(P), Exports));
+  }
+
+  std::unique_ptr<Module> Root = Builder.createRoot(Imports);
+  DLinker Linker(Root.get(), Ctx, ignoreDiagnostics);
+  for (auto &Pso : Psos)
+    Linker.linkPsoRoot(Pso.get());
+
+  std::vector<std::string> Libraries = getImportLibraries(*Root);
+  ASSERT_EQ(NumPsos * NumPerPso, Libraries.size());
+  for (unsigned i = 0; i < Libraries.size(); ++i)
+    EXPECT_EQ("lib" + std::to_string(i / NumPerPso), Libraries[i]);
+}
+
+// With lazy binding, the declaration of an import that is only called
+// through its __import_funcs slot can be dropped from the module.
+TEST(DLinkerTest, ResolvesImportsWithoutDeclaration) {
+  LLVMContext Ctx;
+  PsoBuilder Builder(Ctx);
+  std::vector<std::string> Imports = {"foo", "bar"};
+  std::unique_ptr<Module> Root = Builder.createRoot(Imports);
+  Root->getFunction("bar")->eraseFromParent();
+  DLinker Linker(Root.get(), Ctx, ignoreDiagnostics);
+
+  std::vector<std::string> PsoExports = {"foo", "bar"};
+  std::unique_ptr<Module> Pso = Builder.createPso("libpso", PsoExports);
+  Linker.linkPsoRoot(Pso.get());
+
+  std::vector<std::string> Libraries = getImportLibraries(*Root);
+  ASSERT_EQ(2u, Libraries.size());
+  EXPECT_EQ("libpso", Libraries[0]);
+  EXPECT_EQ("libpso", Libraries[1]);
+}
+
+// Names read from pooled string tables, and the library names of the
+// composite are emitted as a single deduplicated table as well.
+TEST(DLinkerTest, PooledStringTables) {
+  LLVMContext Ctx;
+  PsoBuilder Builder(Ctx, /*Pooled=*/true);
+  std::vector<std::string> Imports = {"foo", "bar", "baz", "qux"};
+  std::unique_ptr<Module> Root = Builder.createRoot(Imports);
+  DLinker Linker(Root.get(), Ctx, ignoreDiagnostics);
+
+  std::vector<std::string> Pso1Exports = {"baz", "foo"};
+  std::vector<std::string> Pso2Exports = {"qux", "bar"};
+  std::unique_ptr<Module> Pso1 = Builder.createPso("libone.pso", Pso1Exports);
+  std::unique_ptr<Module> Pso2 = Builder.createPso("libtwo.pso", Pso2Exports);
+  unsigned NumGlobals = Root->getGlobalList().size();
+  Linker.linkPsoRoot(Pso1.get());
+  Linker.linkPsoRoot(Pso2.get());
+  // Only the library name table has been added to the composite.
+  EXPECT_EQ(NumGlobals + 1, Root->getGlobalList().size());
+
+  std::vector<std::string> Libraries = getImportLibraries(*Root);
+  ASSERT_EQ(4u, Libraries.size());
+  EXPECT_EQ("libone.pso", Libraries[0]);
+  EXPECT_EQ("libtwo.pso", Libraries[1]);
+  EXPECT_EQ("libone.pso", Libraries[2]);
+  EXPECT_EQ("libtwo.pso", Libraries[3]);
+
+  uint64_t Offset;
+  std::vector<Constant *> Fields = getImportLibraryFields(*Root);
+  GlobalVariable *Pool = getLibraryGlobal(Fields[0], Offset);
+  for (Constant *Field : Fields)
+    EXPECT_EQ(Pool, getLibraryGlobal(Field, Offset));
+  EXPECT_EQ(StringRef("libone.pso\0libtwo.pso\0", 22),
+            cast<ConstantDataArray>(Pool->getInitializer())->getAsString());
+}
+
+// Linking the imports that findImports returned for a module's exports is the
+// same as linking the module, which is how pnacl-dlink replays the inputs
+// that did not change since the last link.
+TEST(DLinkerTest, ReplaysRecordedImports) {
+  LLVMContext Ctx;
+  PsoBuilder Builder(Ctx);
+  std::vector<std::string> Imports = {"foo", "bar", "baz", "foo"};
+  std::vector<std::string> Pso1Exports = {"foo", "baz"};
+  std::vector<std::string> Pso2Exports = {"baz", "bar"};
+  std::unique_ptr<Module> Pso1 = Builder.createPso("libone.pso", Pso1Exports);
+  std::unique_ptr<Module> Pso2 = Builder.createPso("libtwo.pso", Pso2Exports);
+
+  std::unique_ptr<Module> Linked = Builder.createRoot(Imports);
+  DLinker Linker(Linked.get(), Ctx, ignoreDiagnostics);
+  std::vector<std::vector<unsigned>> Recorded;
+  for (Module *Pso : {Pso1.get(), Pso2.get()}) {
+    std::vector<StringRef> ExportNames;
+    DLinker::getExports(Pso, ExportNames);
+    Recorded.emplace_back();
+    Linker.findImports(ExportNames, Recorded.back());
+    Linker.linkImports(Pso->getDataLayout(), Pso->getModuleIdentifier(),
+                       Recorded.back());
+  }
+  EXPECT_EQ(std::vector<unsigned>({0, 3, 2}), Recorded[0]);
+  EXPECT_EQ(std::vector<unsigned>({2, 1}), Recorded[1]);
+
+  std::unique_ptr<Module> Replayed = Builder.createRoot(Imports);
+  DLinker Replayer(Replayed.get(), Ctx, ignoreDiagnostics);
+  EXPECT_EQ(4u, Replayer.getNumImports());
+  Replayer.linkImports(Pso1->getDataLayout(), "libone.pso", Recorded[0]);
+  Replayer.linkImports(Pso2->getDataLayout(), "libtwo.pso", Recorded[1]);
+
+  std::vector<std::string> Libraries = getImportLibraries(*Replayed);
+  EXPECT_EQ(getImportLibraries(*Linked), Libraries);
+  ASSERT_EQ(4u, Libraries.size());
+  EXPECT_EQ("libone.pso", Libraries[0]);
+  EXPECT_EQ("libtwo.pso", Libraries[1]);
+  EXPECT_EQ("libtwo.pso", Libraries[2]);
+  EXPECT_EQ("libone.pso", Libraries[3]);
+}
+
+TEST(DLinkerTest, LinksCachedExportIndex) {
+  LLVMContext Ctx;
+  PsoBuilder Builder(Ctx);
+  std::vector<std::string> Imports = {"foo", "bar"};
+  std::vector<std::string> PsoExports = {"bar", "foo"};
+  std::unique_ptr<Module> Pso = Builder.createPso("libpso", PsoExports);
+  Pso->setDataLayout("e-p:32:32");
+
+  SmallString<128> Dir;
+  ASSERT_FALSE(sys::fs::createUniqueDirectory("dlinker-test", Dir));
+  std::vector<StringRef> ExportNames;
+  DLinker::getExports(Pso.get(), ExportNames);
+  ASSERT_EQ(2u, ExportNames.size());
+  ASSERT_FALSE(
+      ExportIndex::write(Dir, "key", Pso->getDataLayoutStr(), ExportNames));
+  EXPECT_EQ(nullptr, ExportIndex::read(Dir, "missing"));
+  std::unique_ptr<ExportIndex> Index = ExportIndex::read(Dir, "key");
+  ASSERT_NE(nullptr, Index);
+  EXPECT_EQ("e-p:32:32", Index->getDataLayout());
+  ASSERT_EQ(2u, Index->size());
+  EXPECT_EQ("bar", Index->getExport(0));
+  EXPECT_EQ("foo", Index->getExport(1));
+
+  std::unique_ptr<Module> Root = Builder.createRoot(Imports);
+  DLinker Linker(Root.get(), Ctx, ignoreDiagnostics);
+  Linker.linkExportIndex(*Index, "libpso");
+  std::vector<std::string> Libraries = getImportLibraries(*Root);
+  ASSERT_EQ(2u, Libraries.size());
+  EXPECT_EQ("libpso", Libraries[0]);
+  EXPECT_EQ("libpso", Libraries[1]);
+  EXPECT_EQ("e-p:32:32", Root->getDataLayoutStr());
+
+  Index.reset();
+  sys::fs::remove(Dir + "/key.exports");
+  sys::fs::remove(Dir);
+}
+
+} // end anonymous namespace
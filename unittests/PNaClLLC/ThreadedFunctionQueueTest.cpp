@@ -0,0 +1,156 @@
+//===- ThreadedFunctionQueueTest.cpp - Tests for ThreadedFunctionQueue ----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ThreadedFunctionQueue.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+// A module with NumFunctions function bodies, and a declaration in between
+// each, which the queue should not count.
+std::unique_ptr<Module> makeModule(LLVMContext &Context,
+                                   unsigned NumFunctions) {
+  std::unique_ptr<Module> M(new Module("test", Context));
+  FunctionType *FTy = FunctionType::get(Type::getVoidTy(Context), false);
+  for (unsigned i = 0; i < NumFunctions; ++i) {
+    Function *F =
+        Function::Create(FTy, GlobalValue::ExternalLinkage, "", M.get());
+    ReturnInst::Create(Context, BasicBlock::Create(Context, "", F));
+    Function::Create(FTy, GlobalValue::ExternalLinkage, "", M.get());
+  }
+  return M;
+}
+
+// Function body sizes in bits: mostly small functions, some medium ones,
+// and a few huge ones, like the functions of a large pexe.
+std::vector<uint64_t> makeMixedCosts(unsigned NumFunctions) {
+  std::vector<uint64_t> Costs(NumFunctions);
+  uint32_t Seed = 12345;
+  for (unsigned i = 0; i < NumFunctions; ++i) {
+    Seed = Seed * 1103515245 + 12345;
+    uint32_t R = Seed >> 8;
+    if (R % 100 == 0)
+      Costs[i] = 200000 + R % 2000000;
+    else if (R % 10 == 0)
+      Costs[i] = 10000 + R % 40000;
+    else
+      Costs[i] = 100 + R % 2000;
+  }
+  return Costs;
+}
+
+// The largest total cost of the functions assigned to any thread, which is
+// the translation time if time is proportional to cost.
+template <typename AssignFn>
+uint64_t getMakespan(ArrayRef<uint64_t> Costs, unsigned NumThreads,
+                     AssignFn IsAssigned) {
+  uint64_t Makespan = 0;
+  for (unsigned t = 0; t < NumThreads; ++t) {
+    uint64_t Load = 0;
+    for (unsigned i = 0; i < Costs.size(); ++i)
+      if (IsAssigned(i, t))
+        Load += Costs[i];
+    Makespan = std::max(Makespan, Load);
+  }
+  return Makespan;
+}
+
+// Replays GrabFunctionDynamic() with the costs as the clock: the thread that
+// is next out of work grabs the next chunk.
+uint64_t getDynamicMakespan(Module *M, ArrayRef<uint64_t> Costs,
+                            unsigned NumThreads) {
+  ThreadedFunctionQueue Queue(M, NumThreads);
+  std::vector<uint64_t> Clock(NumThreads, 0);
+  unsigned FuncIndex = 0;
+  while (FuncIndex < Queue.Size()) {
+    unsigned Thread =
+        std::min_element(Clock.begin(), Clock.end()) - Clock.begin();
+    unsigned NextIndex;
+    bool Grabbed = Queue.GrabFunctionDynamic(
+        FuncIndex, Queue.RecommendedChunkSize(), NextIndex);
+    EXPECT_TRUE(Grabbed);
+    for (; FuncIndex < NextIndex && FuncIndex < Queue.Size(); ++FuncIndex)
+      Clock[Thread] += Costs[FuncIndex];
+  }
+  return *std::max_element(Clock.begin(), Clock.end());
+}
+
+TEST(ThreadedFunctionQueueTest, CostScheduleAssignsEachFunctionOnce) {
+  LLVMContext Context;
+  std::unique_ptr<Module> M = makeModule(Context, 500);
+  std::vector<uint64_t> Costs = makeMixedCosts(500);
+  ThreadedFunctionQueue Queue(M.get(), 4);
+  ASSERT_EQ(500u, Queue.Size());
+  Queue.ScheduleByCost(Costs);
+
+  // A second schedule of the same input is the same.
+  ThreadedFunctionQueue Other(M.get(), 4);
+  Other.ScheduleByCost(Costs);
+  for (unsigned i = 0; i < Queue.Size(); ++i) {
+    unsigned NumOwners = 0;
+    for (unsigned t = 0; t < 4; ++t) {
+      NumOwners += Queue.GrabFunctionByCost(i, t);
+      EXPECT_EQ(Queue.GrabFunctionByCost(i, t), Other.GrabFunctionByCost(i, t));
+    }
+    EXPECT_EQ(1u, NumOwners);
+  }
+}
+
+TEST(ThreadedFunctionQueueTest, CostScheduleSpreadsUnknownCosts) {
+  LLVMContext Context;
+  std::unique_ptr<Module> M = makeModule(Context, 12);
+  ThreadedFunctionQueue Queue(M.get(), 3);
+  Queue.ScheduleByCost(std::vector<uint64_t>(12, 0));
+  for (unsigned t = 0; t < 3; ++t) {
+    unsigned NumFunctions = 0;
+    for (unsigned i = 0; i < 12; ++i)
+      NumFunctions += Queue.GrabFunctionByCost(i, t);
+    EXPECT_EQ(4u, NumFunctions);
+  }
+}
+
+TEST(ThreadedFunctionQueueTest, CostScheduleBalancesMixedSizes) {
+  LLVMContext Context;
+  const unsigned NumFunctions = 5000;
+  std::unique_ptr<Module> M = makeModule(Context, NumFunctions);
+  std::vector<uint64_t> Costs = makeMixedCosts(NumFunctions);
+  uint64_t Total = 0;
+  for (uint64_t Cost : Costs)
+    Total += Cost;
+  uint64_t MaxCost = *std::max_element(Costs.begin(), Costs.end());
+
+  for (unsigned NumThreads = 2; NumThreads <= 16; NumThreads *= 2) {
+    ThreadedFunctionQueue Queue(M.get(), NumThreads);
+    Queue.ScheduleByCost(Costs);
+    uint64_t Makespan = getMakespan(
+        Costs, NumThreads, [&Queue](unsigned i, unsigned t) {
+          return Queue.GrabFunctionByCost(i, t);
+        });
+    EXPECT_LE(Makespan, Total / NumThreads + MaxCost);
+    // The cost schedule is no worse than the static and the dynamic ones.
+    uint64_t Static = getMakespan(
+        Costs, NumThreads, [&Queue](unsigned i, unsigned t) {
+          return Queue.GrabFunctionStatic(i, t);
+        });
+    EXPECT_LE(Makespan, Static);
+    EXPECT_LE(Makespan, getDynamicMakespan(M.get(), Costs, NumThreads));
+  }
+}
+
+} // end anonymous namespace
@@ -0,0 +1,184 @@
+//===- ThreadedStreamingCacheTest.cpp - Tests for ThreadedStreamingCache --===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ThreadedStreamingCache.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/DataStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <pthread.h>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+// Streams the contents of a buffer. StreamingMemoryObjectImpl treats a short
+// read as the end of the stream, so every request is filled.
+class BufferDataStreamer : public DataStreamer {
+public:
+  explicit BufferDataStreamer(const std::vector<uint8_t> &Data)
+      : Data(Data), Pos(0) {}
+
+  size_t GetBytes(unsigned char *Buf, size_t Len) override {
+    Len = std::min<size_t>(Len, Data.size() - Pos);
+    memcpy(Buf, &Data[Pos], Len);
+    Pos += Len;
+    return Len;
+  }
+
+private:
+  const std::vector<uint8_t> &Data;
+  size_t Pos;
+};
+
+std::vector<uint8_t> makeStream(size_t Size) {
+  std::vector<uint8_t> Data(Size);
+  for (size_t i = 0; i < Size; ++i)
+    Data[i] = static_cast<uint8_t>(i * 2654435761u >> 24);
+  return Data;
+}
+
+// Writes Data to a temporary file, whose name is put in Path.
+void writeTempFile(const std::vector<uint8_t> &Data,
+                   SmallVectorImpl<char> &Path) {
+  int FD;
+  ASSERT_FALSE(sys::fs::createTemporaryFile("ThreadedStreamingCacheTest",
+                                            "pexe", FD, Path));
+  raw_fd_ostream OF(FD, true);
+  OF.write(reinterpret_cast<const char *>(Data.data()), Data.size());
+}
+
+struct ReaderData {
+  ThreadedStreamingPages *Pages;
+  const std::vector<uint8_t> *Expected;
+  uint64_t Start;
+  bool Matches;
+};
+
+// Reads the whole stream a word at a time through a thread's own cache, the
+// way the bitstream reader does, starting at Start and wrapping around.
+void *runReader(void *Arg) {
+  ReaderData *Data = static_cast<ReaderData *>(Arg);
+  ThreadedStreamingCache Cache(Data->Pages);
+  const std::vector<uint8_t> &Expected = *Data->Expected;
+  uint64_t Size = Expected.size();
+  Data->Matches = true;
+  for (uint64_t Offset = 0; Offset < Size; Offset += sizeof(uint32_t)) {
+    uint64_t Address = (Data->Start + Offset) % Size;
+    if (!Cache.isValidAddress(Address)) {
+      Data->Matches = false;
+      break;
+    }
+    uint8_t Word[sizeof(uint32_t)];
+    uint64_t Read = Cache.readBytes(Word, sizeof(Word), Address);
+    if (Read != std::min<uint64_t>(sizeof(Word), Size - Address) ||
+        memcmp(Word, &Expected[Address], Read) != 0) {
+      Data->Matches = false;
+      break;
+    }
+  }
+  return nullptr;
+}
+
+// Runs NumThreads readers over Streamer, which holds Data, and sets AllMatch
+// if they all read Data.
+void readConcurrently(StreamingMemoryObject &Streamer,
+                      const std::vector<uint8_t> &Data, unsigned NumThreads,
+                      bool &AllMatch) {
+  ThreadedStreamingPages Pages(&Streamer);
+  std::vector<pthread_t> Threads(NumThreads);
+  std::vector<ReaderData> Readers(NumThreads);
+  for (unsigned i = 0; i < NumThreads; ++i) {
+    // Spread the starting points so that threads miss on different pages,
+    // like threads translating different functions.
+    Readers[i].Pages = &Pages;
+    Readers[i].Expected = &Data;
+    Readers[i].Start = (Data.size() / NumThreads * i) & ~uint64_t(3);
+    Readers[i].Matches = false;
+    EXPECT_EQ(0, pthread_create(&Threads[i], nullptr, runReader, &Readers[i]));
+  }
+  AllMatch = true;
+  for (unsigned i = 0; i < NumThreads; ++i) {
+    EXPECT_EQ(0, pthread_join(Threads[i], nullptr));
+    AllMatch &= Readers[i].Matches;
+  }
+}
+
+TEST(ThreadedStreamingCacheTest, ReadsPartialLastPage) {
+  std::vector<uint8_t> Data = makeStream(3 * ThreadedStreamingPages::kPageSize +
+                                         10);
+  StreamingMemoryObjectImpl Streamer(new BufferDataStreamer(Data));
+  ThreadedStreamingPages Pages(&Streamer);
+  ThreadedStreamingCache Cache(&Pages);
+
+  uint64_t End = Data.size();
+  EXPECT_TRUE(Cache.isValidAddress(End - 1));
+  EXPECT_FALSE(Cache.isValidAddress(End));
+  uint8_t Buf[8];
+  EXPECT_EQ(2u, Cache.readBytes(Buf, sizeof(Buf), End - 2));
+  EXPECT_EQ(0, memcmp(Buf, &Data[End - 2], 2));
+  EXPECT_EQ(8u, Cache.readBytes(Buf, sizeof(Buf), 16));
+  EXPECT_EQ(0, memcmp(Buf, &Data[16], 8));
+
+  // A second cache sees the pages fetched through the first.
+  ThreadedStreamingCache Other(&Pages);
+  EXPECT_EQ(Pages.getPage(0), Pages.getPage(ThreadedStreamingPages::kPageSize -
+                                            1));
+  EXPECT_EQ(4u, Other.readBytes(Buf, 4, End - 8));
+  EXPECT_EQ(0, memcmp(Buf, &Data[End - 8], 4));
+}
+
+TEST(ThreadedStreamingCacheTest, ConcurrentReaders) {
+  std::vector<uint8_t> Data = makeStream(40 * ThreadedStreamingPages::kPageSize +
+                                         100);
+  StreamingMemoryObjectImpl Streamer(new BufferDataStreamer(Data));
+  bool AllMatch;
+  readConcurrently(Streamer, Data, 8, AllMatch);
+  EXPECT_TRUE(AllMatch);
+}
+
+TEST(ThreadedStreamingCacheTest, ReadsMappedFileInPlace) {
+  std::vector<uint8_t> Data = makeStream(3 * ThreadedStreamingPages::kPageSize +
+                                         10);
+  SmallString<64> Path;
+  writeTempFile(Data, Path);
+  std::unique_ptr<StreamingMemoryObject> Streamer(
+      getMappedFileMemoryObject(Path.str(), nullptr));
+  ASSERT_TRUE(Streamer != nullptr);
+  ThreadedStreamingPages Pages(Streamer.get());
+  ThreadedStreamingCache Cache(&Pages);
+
+  // The whole file is known at once, and read from the mapping.
+  uint64_t End = Data.size();
+  EXPECT_EQ(End, Pages.getKnownSize());
+  EXPECT_EQ(Streamer->getStablePointer(), Cache.getStablePointer());
+  EXPECT_EQ(End, Cache.getExtent());
+  EXPECT_TRUE(Cache.isValidAddress(End - 1));
+  EXPECT_FALSE(Cache.isValidAddress(End));
+  // Reads may span pages.
+  uint8_t Buf[8];
+  uint64_t Address = ThreadedStreamingPages::kPageSize - 4;
+  EXPECT_EQ(8u, Cache.readBytes(Buf, sizeof(Buf), Address));
+  EXPECT_EQ(0, memcmp(Buf, &Data[Address], 8));
+  EXPECT_EQ(2u, Cache.readBytes(Buf, sizeof(Buf), End - 2));
+  EXPECT_EQ(0, memcmp(Buf, &Data[End - 2], 2));
+
+  bool AllMatch;
+  readConcurrently(*Streamer, Data, 8, AllMatch);
+  EXPECT_TRUE(AllMatch);
+  sys::fs::remove(Path.str());
+}
+
+} // end anonymous namespace
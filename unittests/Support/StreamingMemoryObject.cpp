@@ -7,8 +7,12 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/StreamingMemoryObject.h"
+#include "llvm/Support/raw_ostream.h"
 #include "gtest/gtest.h"
+#include <memory>
 #include <string.h>
 
 using namespace llvm;
@@ -28,3 +32,39 @@ TEST(StreamingMemoryObject, Test) {
   StreamingMemoryObjectImpl O(DS);
   EXPECT_TRUE(O.isValidAddress(32 * 1024));
 }
+
+// @LOCALMOD-BEGIN
+TEST(StreamingMemoryObject, MappedFile) {
+  int FD;
+  SmallString<64> Path;
+  ASSERT_FALSE(sys::fs::createTemporaryFile("StreamingMemoryObject", "temp",
+                                            FD, Path));
+  {
+    raw_fd_ostream OF(FD, true);
+    OF << "0123456789abcdef";
+  }
+  std::string Err;
+  std::unique_ptr<StreamingMemoryObject> O(
+      getMappedFileMemoryObject(Path.str(), &Err));
+  ASSERT_TRUE(O != nullptr) << Err;
+  EXPECT_EQ(16u, O->getExtent());
+  EXPECT_TRUE(O->isValidAddress(15));
+  EXPECT_FALSE(O->isValidAddress(16));
+  ASSERT_TRUE(O->getStablePointer() != nullptr);
+  EXPECT_EQ(0, memcmp(O->getStablePointer(), "0123456789abcdef", 16));
+
+  uint8_t Buf[8];
+  EXPECT_EQ(4u, O->readBytes(Buf, sizeof(Buf), 12));
+  EXPECT_EQ(0, memcmp(Buf, "cdef", 4));
+
+  // Dropping a header moves the addresses of the remaining bytes down.
+  EXPECT_FALSE(O->dropLeadingBytes(4));
+  EXPECT_EQ(12u, O->getExtent());
+  EXPECT_EQ('4', O->getStablePointer()[0]);
+  EXPECT_TRUE(O->dropLeadingBytes(13));
+  sys::fs::remove(Path.str());
+
+  EXPECT_EQ(nullptr, getMappedFileMemoryObject(Path.str(), &Err));
+  EXPECT_FALSE(Err.empty());
+}
+// @LOCALMOD-END
@@ -0,0 +1,67 @@
+//===- PsoExportHashTest.cpp - Tests for PSO export hash lookup -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/NaCl/PsoExportHash.h"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+// Sorted export names, as emitted by PNaClPsoRoot with -pnacl-pso-export-hash.
+class PsoExportHashTest : public ::testing::Test {
+protected:
+  void makeExports(unsigned Count) {
+    for (unsigned i = 0; i < Count; ++i)
+      Storage.push_back("export_function_" + std::to_string(i * 7919 % Count));
+    std::sort(Storage.begin(), Storage.end());
+    Names.assign(Storage.begin(), Storage.end());
+    PsoExportHash::build(Names, Table);
+  }
+
+  uint32_t lookupHashed(const char *Name) const {
+    return PsoExportHash::lookup(
+        Table.data(), Names.size(), Name,
+        [this](uint32_t i) { return Storage[i].c_str(); });
+  }
+
+  uint32_t lookupSorted(const char *Name) const {
+    std::vector<StringRef>::const_iterator I =
+        std::lower_bound(Names.begin(), Names.end(), StringRef(Name));
+    if (I == Names.end() || *I != Name)
+      return Names.size();
+    return I - Names.begin();
+  }
+
+  std::vector<std::string> Storage;
+  std::vector<StringRef> Names;
+  std::vector<uint32_t> Table;
+};
+
+TEST_F(PsoExportHashTest, Empty) {
+  makeExports(0);
+  EXPECT_EQ(0u, lookupHashed("missing"));
+}
+
+TEST_F(PsoExportHashTest, FindsEveryExport) {
+  makeExports(1000);
+  for (uint32_t i = 0; i < Names.size(); ++i) {
+    EXPECT_EQ(i, lookupHashed(Storage[i].c_str()));
+    EXPECT_EQ(i, lookupSorted(Storage[i].c_str()));
+  }
+  EXPECT_EQ(Names.size(), lookupHashed("missing"));
+  EXPECT_EQ(Names.size(), lookupHashed("export_function_1000"));
+  EXPECT_EQ(Names.size(), lookupHashed(""));
+}
+
+} // end anonymous namespace